@@ -24,17 +24,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
-/* Use 6 if you're on 64 bit, or 5 if you're on 32 bit. */
-#ifndef ANTIREPLAY_BITS_PER_SEQNUM
+/* The number of sequence numbers per bucket is 2^6, one 64-bit word. */
 #define ANTIREPLAY_BITS_PER_SEQNUM	6
-#endif
 
-/* must be a power of two */
+/*
+ * The number of buckets, must be a power of two. The window holds one bucket
+ * less than the bitmap, so the default of 64 buckets accepts packets that are
+ * reordered by up to 4032 sequence numbers.
+ */
 #ifndef ANTIREPLAY_NRBUCKETS
-#define ANTIREPLAY_NRBUCKETS	8
+#define ANTIREPLAY_NRBUCKETS	64
 #endif
 
-/* The number of numbers a bucket can hold. Ideally the result should be word sized. */
 #define MAXBUCKETITEMS	(1 << ANTIREPLAY_BITS_PER_SEQNUM)
 #define TOTALBITS	(ANTIREPLAY_NRBUCKETS * MAXBUCKETITEMS)
 #define SEQBUCKMASK	(ANTIREPLAY_NRBUCKETS - 1)
@@ -43,7 +44,7 @@
 
 struct antireplay {
 	uint64_t maxseqnum;
-	int bitmap[TOTALBITS / 8];
+	uint64_t bitmap[ANTIREPLAY_NRBUCKETS];
 };
 
 /*
@@ -55,22 +56,18 @@ struct antireplay {
 int
 antireplay_isnew(const struct antireplay *ar, uint64_t seqnum)
 {
-	int bit, bucket;
+	uint64_t word;
 
 	/* Check if in current window. */
 	if (seqnum > ar->maxseqnum) {
 		return 1; /* beyond window */
-	} else if ((seqnum + MAXTOTALITEMS) < ar->maxseqnum) {
+	} else if (ar->maxseqnum - seqnum > MAXTOTALITEMS) {
 		return 0; /* behind window */
 	}
 
-	bucket = (seqnum >> ANTIREPLAY_BITS_PER_SEQNUM) & SEQBUCKMASK;
-	bit = seqnum & SEQBITMASK;
+	word = ar->bitmap[(seqnum >> ANTIREPLAY_BITS_PER_SEQNUM) & SEQBUCKMASK];
 
-	if (ar->bitmap[bucket] & (1 << bit))
-		return 0;	/* replayed */
-
-	return 1;
+	return ((word >> (seqnum & SEQBITMASK)) & 1) ^ 1;
 }
 
 /*
@@ -81,41 +78,32 @@ antireplay_isnew(const struct antireplay *ar, uint64_t seqnum)
 int
 antireplay_update(struct antireplay *ar, uint64_t seqnum)
 {
-	int bit, bucket;
-	size_t n, slide;
+	uint64_t bucket, slide, n;
 
 	if (!antireplay_isnew(ar, seqnum))
 		return -1;
 
 	/* slide the window if needed */
 	if (seqnum > ar->maxseqnum) {
-		/* current bucket */
-		bucket = ar->maxseqnum >> ANTIREPLAY_BITS_PER_SEQNUM &
-		    SEQBUCKMASK;
 		/*
-		 * Determine the number of buckets to slide. Start counting the
-		 * number of items from the start of the bucket that currently
-		 * holds maxseqnum and divide by the number of items per bucket.
+		 * Clear each bucket between the one that currently holds
+		 * maxseqnum and the one of seqnum, at most all of them.
 		 */
-		slide = (seqnum - (ar->maxseqnum -
-		    (ar->maxseqnum & ANTIREPLAY_BITS_PER_SEQNUM)))
-		    / MAXBUCKETITEMS;
+		bucket = ar->maxseqnum >> ANTIREPLAY_BITS_PER_SEQNUM;
+		slide = (seqnum >> ANTIREPLAY_BITS_PER_SEQNUM) - bucket;
 
 		if (slide > ANTIREPLAY_NRBUCKETS)	/* big jump */
 			slide = ANTIREPLAY_NRBUCKETS;
 
-		/* erase next buckets */
-		for (n = 0; n < slide; n++)
-			ar->bitmap[(bucket + n + 1) & SEQBUCKMASK] = 0;
+		for (n = 1; n <= slide; n++)
+			ar->bitmap[(bucket + n) & SEQBUCKMASK] = 0;
 
 		ar->maxseqnum = seqnum;
 	}
 
 	/* update the bit for this seqnum */
-	bucket = (seqnum >> ANTIREPLAY_BITS_PER_SEQNUM) & SEQBUCKMASK;
-	bit = seqnum & SEQBITMASK;
-
-	ar->bitmap[bucket] |= (1 << bit);
+	ar->bitmap[(seqnum >> ANTIREPLAY_BITS_PER_SEQNUM) & SEQBUCKMASK] |=
+	    (uint64_t)1 << (seqnum & SEQBITMASK);
 
 	return 0;
 }
@@ -19,6 +19,7 @@
 
 #include "blake2.h"
 #include "blake2-impl.h"
+#include "blake2s-simd.h"
 
 static const uint32_t blake2s_IV[8] =
 {
@@ -169,7 +170,8 @@ int blake2s_init_key( blake2s_state *S, size_t outlen, const void *key, size_t k
     G(r,7,v[ 3],v[ 4],v[ 9],v[14]); \
   } while(0)
 
-static void blake2s_compress( blake2s_state *S, const uint8_t in[BLAKE2S_BLOCKBYTES] )
+/* used as fallback and as the oracle of the vectorized versions */
+void blake2s_compress_ref( blake2s_state *S, const uint8_t in[BLAKE2S_BLOCKBYTES] )
 {
   uint32_t m[16];
   uint32_t v[16];
@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Vectorized BLAKE2s compression functions.
+ *
+ * The sixteen words of the working state are kept in four vectors, one per
+ * row. A round first mixes the four columns in parallel, then rotates the
+ * second, third and fourth row by one, two and three lanes so that the
+ * diagonals line up as columns, mixes those and rotates the rows back.
+ *
+ * Only one block is compressed at a time, so wider vectors than 128 bits do not
+ * help. A round is bound by the latency of the add, xor and rotate chain, so the
+ * gain is in cheap rotations: byte shuffles for 16 and 8 bits on SSSE3 and a
+ * rotate instruction for all of them on AVX-512VL. The x86 versions are
+ * compiled with a target attribute and only used if the CPU supports the
+ * instructions, NEON is always available on arm64.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SSE
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#include "blake2.h"
+#include "blake2-impl.h"
+#include "blake2s-simd.h"
+
+#if defined(HAVE_SSE) || defined(HAVE_NEON)
+static const uint32_t iv[8] = {
+	0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+	0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+};
+
+static const uint8_t sigma[10][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 },
+};
+
+/*
+ * Load the message words of block "in" in host order.
+ */
+static void
+loadmsg(uint32_t m[16], const uint8_t in[BLAKE2S_BLOCKBYTES])
+{
+	size_t i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = load32(in + i * sizeof(m[i]));
+}
+#endif /* HAVE_SSE || HAVE_NEON */
+
+#ifdef HAVE_SSE
+
+/* message words "a", "b", "c" and "d" of round "r" in lane 0, 1, 2 and 3 */
+#define SSE_MSG(m, r, a, b, c, d) \
+    _mm_set_epi32((int)(m)[sigma[r][d]], (int)(m)[sigma[r][c]], \
+    (int)(m)[sigma[r][b]], (int)(m)[sigma[r][a]])
+
+/*
+ * One round on rows "r1" to "r4", "b0" up to and including "b3" are the
+ * message vectors and ROTR rotates each word in the way that is fastest for
+ * the instruction set.
+ */
+#define SSE_ROUND(r1, r2, r3, r4, b0, b1, b2, b3, ROTR)		\
+    do {								\
+	r1 = _mm_add_epi32(_mm_add_epi32(r1, b0), r2);			\
+	r4 = ROTR(_mm_xor_si128(r4, r1), 16);				\
+	r3 = _mm_add_epi32(r3, r4);					\
+	r2 = ROTR(_mm_xor_si128(r2, r3), 12);				\
+	r1 = _mm_add_epi32(_mm_add_epi32(r1, b1), r2);			\
+	r4 = ROTR(_mm_xor_si128(r4, r1), 8);				\
+	r3 = _mm_add_epi32(r3, r4);					\
+	r2 = ROTR(_mm_xor_si128(r2, r3), 7);				\
+									\
+	r2 = _mm_shuffle_epi32(r2, _MM_SHUFFLE(0, 3, 2, 1));		\
+	r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(1, 0, 3, 2));		\
+	r4 = _mm_shuffle_epi32(r4, _MM_SHUFFLE(2, 1, 0, 3));		\
+									\
+	r1 = _mm_add_epi32(_mm_add_epi32(r1, b2), r2);			\
+	r4 = ROTR(_mm_xor_si128(r4, r1), 16);				\
+	r3 = _mm_add_epi32(r3, r4);					\
+	r2 = ROTR(_mm_xor_si128(r2, r3), 12);				\
+	r1 = _mm_add_epi32(_mm_add_epi32(r1, b3), r2);			\
+	r4 = ROTR(_mm_xor_si128(r4, r1), 8);				\
+	r3 = _mm_add_epi32(r3, r4);					\
+	r2 = ROTR(_mm_xor_si128(r2, r3), 7);				\
+									\
+	r2 = _mm_shuffle_epi32(r2, _MM_SHUFFLE(2, 1, 0, 3));		\
+	r3 = _mm_shuffle_epi32(r3, _MM_SHUFFLE(1, 0, 3, 2));		\
+	r4 = _mm_shuffle_epi32(r4, _MM_SHUFFLE(0, 3, 2, 1));		\
+    } while (0)
+
+/*
+ * Round "r" on the rows and message of SSE_COMPRESS. Rounds are unrolled so
+ * that the message schedule is known at compile time.
+ */
+#define SSE_ROUNDN(r, ROTR)						\
+    do {								\
+	b0 = SSE_MSG(m, r, 0, 2, 4, 6);					\
+	b1 = SSE_MSG(m, r, 1, 3, 5, 7);					\
+	b2 = SSE_MSG(m, r, 8, 10, 12, 14);				\
+	b3 = SSE_MSG(m, r, 9, 11, 13, 15);				\
+	SSE_ROUND(r1, r2, r3, r4, b0, b1, b2, b3, ROTR);		\
+    } while (0)
+
+#define SSE_COMPRESS(S, in, ROTR)					\
+    do {								\
+	__m128i r1, r2, r3, r4, b0, b1, b2, b3, h1, h2;			\
+	uint32_t m[16];							\
+									\
+	loadmsg(m, in);							\
+									\
+	h1 = _mm_loadu_si128((const __m128i *)&(S)->h[0]);		\
+	h2 = _mm_loadu_si128((const __m128i *)&(S)->h[4]);		\
+	r1 = h1;							\
+	r2 = h2;							\
+	r3 = _mm_loadu_si128((const __m128i *)&iv[0]);			\
+	r4 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&iv[4]),	\
+	    _mm_set_epi32((int)(S)->f[1], (int)(S)->f[0],		\
+	    (int)(S)->t[1], (int)(S)->t[0]));				\
+									\
+	SSE_ROUNDN(0, ROTR);						\
+	SSE_ROUNDN(1, ROTR);						\
+	SSE_ROUNDN(2, ROTR);						\
+	SSE_ROUNDN(3, ROTR);						\
+	SSE_ROUNDN(4, ROTR);						\
+	SSE_ROUNDN(5, ROTR);						\
+	SSE_ROUNDN(6, ROTR);						\
+	SSE_ROUNDN(7, ROTR);						\
+	SSE_ROUNDN(8, ROTR);						\
+	SSE_ROUNDN(9, ROTR);						\
+									\
+	_mm_storeu_si128((__m128i *)&(S)->h[0],				\
+	    _mm_xor_si128(h1, _mm_xor_si128(r1, r3)));			\
+	_mm_storeu_si128((__m128i *)&(S)->h[4],				\
+	    _mm_xor_si128(h2, _mm_xor_si128(r2, r4)));			\
+    } while (0)
+
+/*
+ * SSSE3 rotates by 16 and 8 bits by shuffling the bytes of each word, the other
+ * rotations need two shifts.
+ */
+#define SSSE3_ROTR(x, n) ((n) == 16 ?					\
+    _mm_shuffle_epi8((x), _mm_set_epi8(13, 12, 15, 14, 9, 8, 11, 10,	\
+    5, 4, 7, 6, 1, 0, 3, 2)) : (n) == 8 ?				\
+    _mm_shuffle_epi8((x), _mm_set_epi8(12, 15, 14, 13, 8, 11, 10, 9,	\
+    4, 7, 6, 5, 0, 3, 2, 1)) :						\
+    _mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n))))
+
+__attribute__((target("ssse3")))
+static void
+compress_ssse3(blake2s_state *S, const uint8_t in[BLAKE2S_BLOCKBYTES])
+{
+	SSE_COMPRESS(S, in, SSSE3_ROTR);
+}
+
+/* AVX-512VL has a rotate instruction for 128 bit vectors */
+#define AVX512_ROTR(x, n) _mm_ror_epi32((x), (n))
+
+__attribute__((target("avx512f,avx512vl")))
+static void
+compress_avx512(blake2s_state *S, const uint8_t in[BLAKE2S_BLOCKBYTES])
+{
+	SSE_COMPRESS(S, in, AVX512_ROTR);
+}
+
+static int
+supported_ssse3(void)
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int
+supported_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512vl");
+}
+
+#endif /* HAVE_SSE */
+
+#ifdef HAVE_NEON
+
+#define NEON_ROTR(x, n) vorrq_u32(vshrq_n_u32((x), (n)), vshlq_n_u32((x), \
+    32 - (n)))
+#define NEON_ROTR16(x) vreinterpretq_u32_u16(vrev32q_u16( \
+    vreinterpretq_u16_u32(x)))
+
+/*
+ * Return message words "a", "b", "c" and "d" of round "r" in lane 0, 1, 2 and
+ * 3.
+ */
+static uint32x4_t
+neon_msg(const uint32_t m[16], size_t r, size_t a, size_t b, size_t c,
+    size_t d)
+{
+	uint32_t v[4];
+
+	v[0] = m[sigma[r][a]];
+	v[1] = m[sigma[r][b]];
+	v[2] = m[sigma[r][c]];
+	v[3] = m[sigma[r][d]];
+
+	return vld1q_u32(v);
+}
+
+static void
+compress_neon(blake2s_state *S, const uint8_t in[BLAKE2S_BLOCKBYTES])
+{
+	uint32x4_t r1, r2, r3, r4, b, h1, h2;
+	uint32_t m[16], tf[4];
+	size_t r;
+
+	loadmsg(m, in);
+
+	tf[0] = S->t[0];
+	tf[1] = S->t[1];
+	tf[2] = S->f[0];
+	tf[3] = S->f[1];
+
+	h1 = vld1q_u32(&S->h[0]);
+	h2 = vld1q_u32(&S->h[4]);
+	r1 = h1;
+	r2 = h2;
+	r3 = vld1q_u32(&iv[0]);
+	r4 = veorq_u32(vld1q_u32(&iv[4]), vld1q_u32(tf));
+
+	for (r = 0; r < 10; r++) {
+		b = neon_msg(m, r, 0, 2, 4, 6);
+		r1 = vaddq_u32(vaddq_u32(r1, b), r2);
+		r4 = NEON_ROTR16(veorq_u32(r4, r1));
+		r3 = vaddq_u32(r3, r4);
+		r2 = NEON_ROTR(veorq_u32(r2, r3), 12);
+		b = neon_msg(m, r, 1, 3, 5, 7);
+		r1 = vaddq_u32(vaddq_u32(r1, b), r2);
+		r4 = NEON_ROTR(veorq_u32(r4, r1), 8);
+		r3 = vaddq_u32(r3, r4);
+		r2 = NEON_ROTR(veorq_u32(r2, r3), 7);
+
+		r2 = vextq_u32(r2, r2, 1);
+		r3 = vextq_u32(r3, r3, 2);
+		r4 = vextq_u32(r4, r4, 3);
+
+		b = neon_msg(m, r, 8, 10, 12, 14);
+		r1 = vaddq_u32(vaddq_u32(r1, b), r2);
+		r4 = NEON_ROTR16(veorq_u32(r4, r1));
+		r3 = vaddq_u32(r3, r4);
+		r2 = NEON_ROTR(veorq_u32(r2, r3), 12);
+		b = neon_msg(m, r, 9, 11, 13, 15);
+		r1 = vaddq_u32(vaddq_u32(r1, b), r2);
+		r4 = NEON_ROTR(veorq_u32(r4, r1), 8);
+		r3 = vaddq_u32(r3, r4);
+		r2 = NEON_ROTR(veorq_u32(r2, r3), 7);
+
+		r2 = vextq_u32(r2, r2, 3);
+		r3 = vextq_u32(r3, r3, 2);
+		r4 = vextq_u32(r4, r4, 1);
+	}
+
+	vst1q_u32(&S->h[0], veorq_u32(h1, veorq_u32(r1, r3)));
+	vst1q_u32(&S->h[4], veorq_u32(h2, veorq_u32(r2, r4)));
+}
+
+#endif /* HAVE_NEON */
+
+const struct blake2s_impl blake2s_implv[] = {
+	{ "ref", NULL, blake2s_compress_ref },
+#ifdef HAVE_SSE
+	{ "ssse3", supported_ssse3, compress_ssse3 },
+	{ "avx512", supported_avx512, compress_avx512 },
+#endif
+#ifdef HAVE_NEON
+	{ "neon", NULL, compress_neon },
+#endif
+};
+
+const size_t blake2s_implvsize = sizeof(blake2s_implv) /
+    sizeof(blake2s_implv[0]);
+
+static const struct blake2s_impl *current;
+
+/*
+ * Return 1 if "impl" can be used on this CPU, 0 otherwise.
+ */
+int
+blake2s_implsupported(const struct blake2s_impl *impl)
+{
+	if (impl->supported == NULL)
+		return 1;
+
+	return impl->supported();
+}
+
+/*
+ * Use "impl" for all following compressions. If "impl" is NULL the fastest
+ * supported implementation is selected.
+ *
+ * Return 0 on success, -1 if "impl" is not supported on this CPU.
+ */
+int
+blake2s_useimpl(const struct blake2s_impl *impl)
+{
+	size_t n;
+
+	if (impl == NULL) {
+		for (n = blake2s_implvsize; n > 0; n--) {
+			if (blake2s_implsupported(&blake2s_implv[n - 1])) {
+				current = &blake2s_implv[n - 1];
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	if (!blake2s_implsupported(impl))
+		return -1;
+
+	current = impl;
+	return 0;
+}
+
+/*
+ * Return the implementation that is in use, select one first if needed.
+ */
+const struct blake2s_impl *
+blake2s_currentimpl(void)
+{
+	if (current == NULL)
+		blake2s_useimpl(NULL);
+
+	return current;
+}
+
+void
+blake2s_compress(blake2s_state *S, const uint8_t in[BLAKE2S_BLOCKBYTES])
+{
+	if (current == NULL)
+		blake2s_useimpl(NULL);
+
+	current->compress(S, in);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef BLAKE2S_SIMD_H
+#define BLAKE2S_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "blake2.h"
+
+/*
+ * The BLAKE2s compression function is selected at runtime. The reference
+ * implementation is always available, vectorized implementations are used if
+ * the CPU supports them. The first call to blake2s_compress selects the fastest
+ * supported implementation unless one is set by blake2s_useimpl.
+ */
+
+typedef void blake2s_compressfn(blake2s_state *S,
+    const uint8_t in[BLAKE2S_BLOCKBYTES]);
+
+struct blake2s_impl {
+	const char *name;
+	int (*supported)(void);	/* NULL if always supported */
+	blake2s_compressfn *compress;
+};
+
+/* ordered from slowest to fastest, the first is the reference */
+extern const struct blake2s_impl blake2s_implv[];
+extern const size_t blake2s_implvsize;
+
+blake2s_compressfn blake2s_compress_ref;
+blake2s_compressfn blake2s_compress;
+
+int blake2s_implsupported(const struct blake2s_impl *impl);
+int blake2s_useimpl(const struct blake2s_impl *impl);
+const struct blake2s_impl *blake2s_currentimpl(void);
+
+#endif /* BLAKE2S_SIMD_H */
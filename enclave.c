@@ -16,7 +16,9 @@
 
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <ctype.h>
@@ -27,10 +29,12 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "base64.h"
 #include "blake2.h"
+#include "stats.h"
 #include "tai64n.h"
 #include "util.h"
 #include "wireprot.h"
@@ -39,6 +43,7 @@
 #define TAGLEN 16
 #define MINDATA  (1 << 21) /* malloc(3) and mmap(2) without ifn or peers */
 #define MAXSTACK (1 << 15) /* 32 KB should be enough */
+#define EPHPOOLSIZE 64 /* pre-generated ephemeral keypairs */
 
 #ifdef DEBUG
 #define MAXCORE (1024 * 1024 * 10)
@@ -70,6 +75,7 @@ struct hs {
  * pubkey	= Spubm'
  * pubkeyhash	= Hash(Hash(Hash(Construction) || Identifier) || Spubm')
  * mac1key	= Hash(Label-Mac1 || Spubm')
+ * cookiekey	= Hash(Label-Cookie || Spubm')
  * dhsecret	= DH(Sprivm, Spubm')
  */
 struct peer {
@@ -77,11 +83,37 @@ struct peer {
 	wskey pubkey;
 	wshash pubkeyhash;
 	wskey mac1key;
+	wskey cookiekey;
 	wskey dhsecret;
 	wskey psk;
 	struct ifn *ifn;
 	struct hs *hs;
 	uint8_t recvts[12]; /* last received authenticated timestamp */
+	uint8_t lastmac1[16]; /* mac1 of the last handshake message sent */
+	uint8_t cookie[COOKIELEN]; /* last cookie received from the peer */
+	time_t cookiets; /* uptime when the cookie was received, -1 if none */
+	int unused;	/* slot without a peer, a spare or removed by a reload */
+};
+
+/*
+ * Session id index entry. Maps the session id of a pending handshake to the
+ * peer that uses it.
+ */
+struct sessidmap {
+	struct peer *peer;	/* NULL if the entry is not in use */
+	uint32_t id;		/* wire format, little-endian */
+};
+
+/*
+ * Token bucket that limits the rate at which messages from one source, the
+ * proxy or an ifn, are handled. If a source runs out of tokens its read event
+ * is disabled until a timer signals that a new token is available.
+ */
+struct tbucket {
+	int port;
+	void *udata;	/* udata of the read event on port */
+	size_t tokens;
+	uint64_t lastfill;	/* microseconds */
 };
 
 /*
@@ -94,6 +126,8 @@ struct peer {
 struct ifn {
 	uint32_t id;
 	int port;
+	size_t workers;
+	int workerports[MAXWORKERS];	/* port of each worker, port is first */
 	char *ifname; /* null terminated name of the interface */
 	size_t ifnamesize;
 	wskey privkey;
@@ -103,12 +137,62 @@ struct ifn {
 	wskey cookiekey;
 	struct peer **peers;
 	size_t peerssize;
+	struct peer **pubkeymapv;	/* open addressing, keyed on pubkey */
+	size_t pubkeymapvsize;		/* power of two */
+	struct sessidmap *sessidmapv;
+	size_t sessidmapvsize;		/* power of two */
+	struct tbucket tbv[MAXWORKERS];	/* one per worker port */
+};
+
+/*
+ * Ephemeral keypair that is generated while idle. Each keypair is handed out
+ * only once and wiped from the pool when it is taken.
+ */
+struct ephkey {
+	wskey pub;
+	wskey priv;
+};
+
+/*
+ * Header of a message that the front passes on to the enclave worker that
+ * serves the peer, the message itself follows the header. Messages from the
+ * proxy are identified again by the worker, messages from an ifn carry the id
+ * of the peer.
+ */
+struct fwdhdr {
+	uint32_t ifnid;
+	uint32_t peerid;	/* only if not from the proxy */
+	int fromproxy;
+	union sockaddr_inet fsn;
+	union sockaddr_inet lsn;
+	unsigned char mtcode;
 };
 
 static uid_t uid;
 static gid_t gid;
 
-static int kq, pport, doterm, logstats;
+static int kq, pport, mport, doterm, logstats;
+
+/* counters, in the shared memory stats page if there is one */
+static struct statspage *statspage;
+static struct enclavestats *stats;
+static int sharedstats;
+
+static struct tbucket proxytb;
+static size_t hsrate, hsburst;
+
+/* the first "ephpoolcount" entries are unused keypairs */
+static struct ephkey ephpool[EPHPOOLSIZE];
+static size_t ephpoolcount;
+
+/*
+ * Enclave workers, each peer is served by exactly one of them. Worker 0 is the
+ * front that reads from the proxy and all ifn ports and passes the messages of
+ * other peers on.
+ */
+static size_t worker, workers;
+static int frontport;			/* worker > 0 */
+static int fwdports[MAXENCLWORKERS];	/* worker 0, index 0 is unused */
 
 static uint8_t msg[MAXSCRATCH];
 
@@ -297,6 +381,46 @@ dh(wskey sharedsecret, const wskey privkey, const wskey peerkey)
 	return 0;
 }
 
+/*
+ * Get a new ephemeral keypair, from the pool if possible or else generate one.
+ */
+static void
+ephtake(wskey pub, wskey priv)
+{
+	struct ephkey *ek;
+
+	if (ephpoolcount == 0) {
+		stats->ephinline++;
+		X25519_keypair(pub, priv);
+		return;
+	}
+
+	ek = &ephpool[--ephpoolcount];
+	memcpy(pub, ek->pub, KEYLEN);
+	memcpy(priv, ek->priv, KEYLEN);
+	explicit_bzero(ek, sizeof(*ek));
+	stats->ephpooled++;
+}
+
+/*
+ * Add one new ephemeral keypair to the pool.
+ *
+ * Return 0 on success, -1 if the pool is full.
+ */
+static int
+ephrefill(void)
+{
+	struct ephkey *ek;
+
+	if (ephpoolcount >= EPHPOOLSIZE)
+		return -1;
+
+	ek = &ephpool[ephpoolcount++];
+	X25519_keypair(ek->pub, ek->priv);
+
+	return 0;
+}
+
 static void
 inithash2(wshash out, const void *in1, size_t in1size, const void *in2,
     size_t in2size)
@@ -318,11 +442,78 @@ appendhash(wshash h, const uint8_t *in, size_t insize)
 	ws_hash(h, iov, 2);
 }
 
+/*
+ * Return the home index of "pubkey" in the public key index of "ifn". Public
+ * keys are uniformly distributed so the first bytes are a good enough hash.
+ */
+static size_t
+pubkeymaphome(const struct ifn *ifn, const wskey pubkey)
+{
+	uint32_t h;
+
+	memcpy(&h, pubkey, sizeof(h));
+
+	return h & (ifn->pubkeymapvsize - 1);
+}
+
+/*
+ * Add "p" to the public key index of its interface. The index is sized in
+ * recvconfig so that it never fills up.
+ */
+static void
+pubkeymapput(struct peer *p)
+{
+	struct ifn *ifn;
+	size_t n;
+
+	ifn = p->ifn;
+
+	n = pubkeymaphome(ifn, p->pubkey);
+	while (ifn->pubkeymapv[n] != NULL)
+		n = (n + 1) & (ifn->pubkeymapvsize - 1);
+
+	ifn->pubkeymapv[n] = p;
+}
+
+/*
+ * Remove "p" from the public key index of its interface, if it is in there.
+ */
+static void
+pubkeymapdel(const struct peer *p)
+{
+	struct ifn *ifn;
+	size_t n, m, home;
+
+	ifn = p->ifn;
+
+	n = pubkeymaphome(ifn, p->pubkey);
+	while (ifn->pubkeymapv[n] != NULL && ifn->pubkeymapv[n] != p)
+		n = (n + 1) & (ifn->pubkeymapvsize - 1);
+
+	if (ifn->pubkeymapv[n] == NULL)
+		return;
+
+	/* shift back following entries, like sessidmapdel */
+	m = n;
+	for (;;) {
+		ifn->pubkeymapv[n] = NULL;
+
+		do {
+			m = (m + 1) & (ifn->pubkeymapvsize - 1);
+			if (ifn->pubkeymapv[m] == NULL)
+				return;
+			home = pubkeymaphome(ifn, ifn->pubkeymapv[m]->pubkey);
+		} while (n <= m ? (n < home && home <= m) :
+		    (n < home || home <= m));
+
+		ifn->pubkeymapv[n] = ifn->pubkeymapv[m];
+		n = m;
+	}
+}
+
 /*
  * Find a peer by public key and interface. Return 1 if found and updates "p" to
  * point to it. 0 if not found and updates "p" to NULL.
- *
- * XXX log(n)
  */
 static int
 findifnpeerbypubkey(struct peer **p, const struct ifn *ifn, wskey pubkey)
@@ -331,21 +522,68 @@ findifnpeerbypubkey(struct peer **p, const struct ifn *ifn, wskey pubkey)
 
 	*p = NULL;
 
-	for (n = 0; n < ifn->peerssize; n++) {
-		if (memcmp(ifn->peers[n]->pubkey, pubkey, sizeof(wskey)) == 0) {
-			*p = ifn->peers[n];
+	n = pubkeymaphome(ifn, pubkey);
+	while (ifn->pubkeymapv[n] != NULL) {
+		if (memcmp(ifn->pubkeymapv[n]->pubkey, pubkey,
+		    sizeof(wskey)) == 0) {
+			*p = ifn->pubkeymapv[n];
 			return 1;
 		}
+		n = (n + 1) & (ifn->pubkeymapvsize - 1);
 	}
 
 	return 0;
 }
 
+/*
+ * Return the home index of session id "id" in the session id index of "ifn".
+ */
+static size_t
+sessidmaphome(const struct ifn *ifn, uint32_t id)
+{
+	return (id * 2654435761U) & (ifn->sessidmapvsize - 1);
+}
+
+/*
+ * Remove the mapping of session id "id" if it belongs to "peer". Session ids of
+ * other peers are left alone.
+ */
+static void
+sessidmapdel(struct ifn *ifn, uint32_t id, const struct peer *peer)
+{
+	size_t n, m, home;
+
+	n = sessidmaphome(ifn, id);
+	while (ifn->sessidmapv[n].peer != NULL && ifn->sessidmapv[n].id != id)
+		n = (n + 1) & (ifn->sessidmapvsize - 1);
+
+	if (ifn->sessidmapv[n].peer != peer)
+		return;
+
+	/*
+	 * Shift back any following entries that would otherwise become
+	 * unreachable so that lookups can stop at the first empty entry.
+	 */
+	m = n;
+	for (;;) {
+		ifn->sessidmapv[n].peer = NULL;
+
+		do {
+			m = (m + 1) & (ifn->sessidmapvsize - 1);
+			if (ifn->sessidmapv[m].peer == NULL)
+				return;
+			home = sessidmaphome(ifn, ifn->sessidmapv[m].id);
+		} while (n <= m ? (n < home && home <= m) :
+		    (n < home || home <= m));
+
+		ifn->sessidmapv[n] = ifn->sessidmapv[m];
+		n = m;
+	}
+}
+
 /*
  * Find a peer by session id and interface. Return 1 if found and updates "p" to
  * point to it. 0 if not found and updates "p" to NULL.
- *
- * XXX log(n)
  */
 static int
 findifnpeerbysessid(struct peer **p, const struct ifn *ifn, uint32_t sessid)
@@ -354,19 +592,56 @@ findifnpeerbysessid(struct peer **p, const struct ifn *ifn, uint32_t sessid)
 
 	*p = NULL;
 
-	for (n = 0; n < ifn->peerssize; n++) {
-		if (ifn->peers[n]->hs->sessid == sessid) {
-			*p = ifn->peers[n];
+	n = sessidmaphome(ifn, sessid);
+	while (ifn->sessidmapv[n].peer != NULL) {
+		if (ifn->sessidmapv[n].id == sessid) {
+			*p = ifn->sessidmapv[n].peer;
 			return 1;
 		}
+		n = (n + 1) & (ifn->sessidmapvsize - 1);
 	}
 
 	return 0;
 }
 
+/*
+ * Give the handshake of "peer" a new random session id that is not in use by
+ * any other peer on the same interface and update the session id index. Each
+ * peer has at most one entry in the index so it never fills up.
+ *
+ * The session id modulo the number of workers is the worker that created it so
+ * that the front can pass response messages from the proxy on by receiver.
+ */
+static void
+newsessid(struct peer *peer)
+{
+	struct ifn *ifn;
+	struct peer *p;
+	size_t n;
+	uint32_t id;
+
+	ifn = peer->ifn;
+
+	sessidmapdel(ifn, peer->hs->sessid, peer);
+
+	do {
+		id = htole32(arc4random_uniform(UINT32_MAX / workers) *
+		    workers + worker);
+	} while (findifnpeerbysessid(&p, ifn, id));
+
+	n = sessidmaphome(ifn, id);
+	while (ifn->sessidmapv[n].peer != NULL)
+		n = (n + 1) & (ifn->sessidmapvsize - 1);
+
+	ifn->sessidmapv[n].peer = peer;
+	ifn->sessidmapv[n].id = id;
+
+	peer->hs->sessid = id;
+}
+
 /*
  * Find a peer by id and interface. Return 1 if found and updates "p" to point
- * to it. 0 if not found and updates "p" to NULL.
+ * to it. 0 if not found or if the slot is unused and updates "p" to NULL.
  */
 static int
 findifnpeerbyid(struct peer **p, const struct ifn *ifn, uint32_t peerid)
@@ -376,10 +651,32 @@ findifnpeerbyid(struct peer **p, const struct ifn *ifn, uint32_t peerid)
 	if (peerid >= ifn->peerssize)
 		return 0;
 
+	if (ifn->peers[peerid]->unused)
+		return 0;
+
 	*p = ifn->peers[peerid];
 	return 1;
 }
 
+/*
+ * Return the port of the ifn worker that serves "peer".
+ */
+static int
+peerport(const struct peer *peer)
+{
+	return peer->ifn->workerports[peer->id % peer->ifn->workers];
+}
+
+/*
+ * Return the enclave worker that serves "peer". Peers are spread over the
+ * workers across interfaces.
+ */
+static size_t
+peerworker(const struct peer *peer)
+{
+	return (peer->ifn->id + peer->id) % workers;
+}
+
 static void
 prinths(FILE *fp, const struct hs *hs)
 {
@@ -446,6 +743,41 @@ err:
 	return -1;
 }
 
+/*
+ * Start the responder side of init message "mwi" that is received on "ifn" and
+ * decrypt the static key of the initiator into "tmpstat". Updates tmph, tmpc
+ * and k.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int
+openinitstat(const struct ifn *ifn, const struct msgwginit *mwi)
+{
+	size_t n;
+
+	memcpy(tmph, ifn->pubkeyhash, HASHLEN);
+	appendhash(tmph, mwi->ephemeral, sizeof(mwi->ephemeral));
+
+	if (kdf1(tmpc, mwi->ephemeral, conshash) == -1)
+		return -1;
+
+	if (dh(k, ifn->privkey, mwi->ephemeral) == -1)
+		return -1;
+
+	iov[0].iov_base = tmpc;
+	iov[0].iov_len = KEYLEN;
+	iov[1].iov_base = k;
+	iov[1].iov_len = KEYLEN;
+	if (kdfn(iov, 2, k, tmpc) == -1)
+		return -1;
+
+	n = sizeof(tmpstat);
+	if (aead(tmpstat, &n, mwi->stat, sizeof(mwi->stat), k, tmph, 1) == -1)
+		return -1;
+
+	return 0;
+}
+
 /*
  * Upgrade handshake initialization state.
  *
@@ -476,35 +808,7 @@ upgradehsinit(struct ifn *ifn, struct msgwginit *mwi, struct peer **peer,
 		return -1;
 
 	if (responder) {
-		memcpy(tmph, ifn->pubkeyhash, HASHLEN);
-	} else {
-		memcpy(tmph, (*peer)->pubkeyhash, HASHLEN);
-	}
-
-	appendhash(tmph, mwi->ephemeral, sizeof(mwi->ephemeral));
-
-	if (kdf1(tmpc, mwi->ephemeral, conshash) == -1)
-		return -1;
-
-	if (responder) {
-		if (dh(k, ifn->privkey, mwi->ephemeral) == -1)
-			return -1;
-	} else {
-		if (dh(k, (*peer)->hs->epriv, (*peer)->pubkey) == -1)
-			return -1;
-	}
-
-	iov[0].iov_base = tmpc;
-	iov[0].iov_len = KEYLEN;
-	iov[1].iov_base = k;
-	iov[1].iov_len = KEYLEN;
-	if (kdfn(iov, 2, k, tmpc) == -1)
-		return -1;
-
-	if (responder) {
-		n = sizeof(tmpstat);
-		if (aead(tmpstat, &n, mwi->stat, sizeof(mwi->stat), k, tmph, 1)
-		    == -1)
+		if (openinitstat(ifn, mwi) == -1)
 			return -1;
 
 		if (!findifnpeerbypubkey(&p, ifn, tmpstat))
@@ -514,6 +818,22 @@ upgradehsinit(struct ifn *ifn, struct msgwginit *mwi, struct peer **peer,
 			return -1;
 		*peer = p;
 	} else {
+		memcpy(tmph, (*peer)->pubkeyhash, HASHLEN);
+		appendhash(tmph, mwi->ephemeral, sizeof(mwi->ephemeral));
+
+		if (kdf1(tmpc, mwi->ephemeral, conshash) == -1)
+			return -1;
+
+		if (dh(k, (*peer)->hs->epriv, (*peer)->pubkey) == -1)
+			return -1;
+
+		iov[0].iov_base = tmpc;
+		iov[0].iov_len = KEYLEN;
+		iov[1].iov_base = k;
+		iov[1].iov_len = KEYLEN;
+		if (kdfn(iov, 2, k, tmpc) == -1)
+			return -1;
+
 		n = sizeof(mwi->stat);
 		if (aead(mwi->stat, &n, ifn->pubkey, sizeof(ifn->pubkey), k,
 		    tmph, 0) == -1)
@@ -562,6 +882,19 @@ upgradehsinit(struct ifn *ifn, struct msgwginit *mwi, struct peer **peer,
 	return 0;
 }
 
+/*
+ * Return 1 if a cookie was received from "peer" that can still be used to
+ * calculate mac2, 0 otherwise.
+ */
+static int
+hasfreshcookie(const struct peer *peer)
+{
+	if (peer->cookiets == -1)
+		return 0;
+
+	return getuptime() - peer->cookiets < COOKIEMAXAGE - COOKIELATENCY;
+}
+
 /*
  * Create new handshake initialization state and a message.
  *
@@ -577,12 +910,12 @@ createhsinit(struct peer *peer, struct msgwginit *mwi)
 
 	hs = peer->hs;
 
-	hs->sessid = arc4random();
+	newsessid(peer);
 
 	mwi->type = htole32(1);
 	mwi->sender = hs->sessid;
 
-	X25519_keypair(mwi->ephemeral, hs->epriv);
+	ephtake(mwi->ephemeral, hs->epriv);
 
 	if (externaltai64n(mwi->timestamp, sizeof(mwi->timestamp) - TAGLEN,
 	    nowtai64n(&ts)) == -1)
@@ -609,10 +942,24 @@ createhsinit(struct peer *peer, struct msgwginit *mwi)
 		return -1;
 
 	/*
-	 * Cookies are handled outside the enclave.
+	 * Remember mac1 to authenticate a cookie reply.
+	 *
+	 * msgb = everything up to mac2 field.
+	 *
+	 * Mac2:
+	 * msg.mac2 := Mac(Lm, msgb) if cookie Lm is less than 120 seconds
+	 * old, otherwise 0^16
 	 */
 
-	memset(mwi->mac2, 0, sizeof(mwi->mac2));
+	memcpy(peer->lastmac1, mwi->mac1, sizeof(peer->lastmac1));
+
+	if (hasfreshcookie(peer)) {
+		if (ws_mac2(mwi->mac2, sizeof(mwi->mac2), mwi, MAC2OFFSETINIT,
+		    peer->cookie) == -1)
+			return -1;
+	} else {
+		memset(mwi->mac2, 0, sizeof(mwi->mac2));
+	}
 
 	return 0;
 }
@@ -710,14 +1057,14 @@ createhsresp(struct peer *peer, struct msgwgresp *mwr,
 	 * might point to the same memory.
 	 */
 
-	hs->sessid = arc4random();
+	newsessid(peer);
 	hs->peersessid = mwi->sender;
 
 	mwr->type = htole32(2);
 	mwr->sender = hs->sessid;
 	mwr->receiver = hs->peersessid;
 
-	X25519_keypair(mwr->ephemeral, hs->epriv);
+	ephtake(mwr->ephemeral, hs->epriv);
 
 	if (upgradehsresp(hs, mwr, 1) == -1) {
 		logwarnx("enclave %s %x could not upgrade response message",
@@ -729,7 +1076,15 @@ createhsresp(struct peer *peer, struct msgwgresp *mwr,
 	    hs->peer->mac1key) == -1)
 		return -1;
 
-	memset(mwr->mac2, 0, sizeof(mwr->mac2));
+	memcpy(peer->lastmac1, mwr->mac1, sizeof(peer->lastmac1));
+
+	if (hasfreshcookie(peer)) {
+		if (ws_mac2(mwr->mac2, sizeof(mwr->mac2), mwr, MAC2OFFSETRESP,
+		    peer->cookie) == -1)
+			return -1;
+	} else {
+		memset(mwr->mac2, 0, sizeof(mwr->mac2));
+	}
 
 	return 0;
 }
@@ -803,7 +1158,7 @@ handlewginit(struct ifn *ifn, struct peer *peer,
 			    peer->id);
 			exit(1);
 		}
-		if (wire_sendpeeridmsg(ifn->port, peer->id, MSGCONNREQ, &mcr,
+		if (wire_sendpeeridmsg(peerport(peer), peer->id, MSGCONNREQ, &mcr,
 		    sizeof(mcr)) == -1) {
 			logwarnx("enclave %s (%x) I:%x error sending connect "
 			    "request for peer %u to ifn", ifn->ifname,
@@ -818,7 +1173,7 @@ handlewginit(struct ifn *ifn, struct peer *peer,
 		exit(1);
 	}
 
-	if (wire_sendpeeridmsg(ifn->port, peer->id, MSGSESSKEYS, &msk,
+	if (wire_sendpeeridmsg(peerport(peer), peer->id, MSGSESSKEYS, &msk,
 	    sizeof(msk)) == -1) {
 		logwarnx("enclave %s (%x) I:%x error sending keys for peer %u "
 		    "to ifn", ifn->ifname, respsess, initsess, peer->id);
@@ -827,7 +1182,7 @@ handlewginit(struct ifn *ifn, struct peer *peer,
 
 	explicit_bzero(&msk, sizeof(msk));
 
-	if (wire_sendpeeridmsg(ifn->port, peer->id, MSGWGRESP, mwr,
+	if (wire_sendpeeridmsg(peerport(peer), peer->id, MSGWGRESP, mwr,
 	    sizeof(*mwr)) == -1) {
 		logwarnx("enclave %s (%x) I:%x error sending response message "
 		    "for peer %u to ifn", ifn->ifname, respsess, initsess,
@@ -924,7 +1279,7 @@ handlewgresp(struct ifn *ifn, struct peer *peer,
 			    peer->id);
 			exit(1);
 		}
-		if (wire_sendpeeridmsg(ifn->port, peer->id, MSGCONNREQ, &mcr,
+		if (wire_sendpeeridmsg(peerport(peer), peer->id, MSGCONNREQ, &mcr,
 		    sizeof(mcr)) == -1) {
 			logwarnx("enclave %s %x R:%x error sending connect "
 			    "request for peer %u to ifn", ifn->ifname, initsess,
@@ -939,7 +1294,7 @@ handlewgresp(struct ifn *ifn, struct peer *peer,
 		exit(1);
 	}
 
-	if (wire_sendpeeridmsg(ifn->port, peer->id, MSGSESSKEYS, &msk,
+	if (wire_sendpeeridmsg(peerport(peer), peer->id, MSGSESSKEYS, &msk,
 	    sizeof(msk)) == -1) {
 		logwarnx("enclave %s %x R:%x error sending keys for peer %u to "
 		    "ifn", ifn->ifname, initsess, respsess, peer->id);
@@ -956,7 +1311,55 @@ handlewgresp(struct ifn *ifn, struct peer *peer,
 }
 
 /*
- * Receive and handle a message from an IFN.
+ * Handle an incoming MSGWGCOOKIE from "peer". The cookie must be a reply to the
+ * last init or response message we created for this peer. Reads from "msg".
+ *
+ * MSGWGCOOKIE
+ *   if the cookie authenticates, use it for the mac2 of following handshake
+ *   messages
+ *
+ * Return 0 on success, -1 if the cookie did not authenticate.
+ */
+static int
+handlewgcookie(struct peer *peer)
+{
+	struct msgwgcook *mwc;
+	uint8_t cookie[COOKIELEN];
+	size_t n;
+
+	mwc = (struct msgwgcook *)msg;
+
+	if (mwc->receiver != peer->hs->sessid) {
+		logwarnx("enclave %s %x cookie reply from peer %u for unknown "
+		    "session %x", peer->ifn->ifname, le32toh(peer->hs->sessid),
+		    peer->id, le32toh(mwc->receiver));
+		return -1;
+	}
+
+	n = sizeof(cookie);
+	if (ws_xaead(cookie, &n, mwc->cookie, sizeof(mwc->cookie),
+	    peer->cookiekey, mwc->nonce, peer->lastmac1,
+	    sizeof(peer->lastmac1), 1) == -1 || n != sizeof(cookie)) {
+		logwarnx("enclave %s %x cookie reply from peer %u could not be "
+		    "authenticated", peer->ifn->ifname,
+		    le32toh(peer->hs->sessid), peer->id);
+		return -1;
+	}
+
+	memcpy(peer->cookie, cookie, sizeof(peer->cookie));
+	peer->cookiets = getuptime();
+	explicit_bzero(cookie, sizeof(cookie));
+
+	if (verbose > 1)
+		loginfox("enclave %s %x received cookie from peer %u",
+		    peer->ifn->ifname, le32toh(peer->hs->sessid), peer->id);
+
+	return 0;
+}
+
+/*
+ * Handle a message for "peer" that is received from the ifn that serves it.
+ * Reads and writes to "msg".
  *
  * MSGWGINIT
  *   if data authenticates:
@@ -965,60 +1368,74 @@ handlewgresp(struct ifn *ifn, struct peer *peer,
  * MSGWGRESP
  *   if data authenticates:
  *      send MSGSESSKEYS
+ * MSGWGCOOKIE
+ *   if the cookie authenticates:
+ *      store it for the next handshake message
  * MSGREQWGINIT
  *      create and send MSGWGINIT
  *
  * Return 0 on success, -1 on error.
  */
 static int
-handleifnmsg(const struct ifn *ifn)
+handlepeermsg(struct peer *peer, unsigned char mtcode)
 {
 	struct msgwginit *mwi;
-	struct peer *peer;
-	size_t msgsize;
-	uint32_t peerid;
-	unsigned char mtcode;
-
-	msgsize = sizeof(msg);
-	if (wire_recvpeeridmsg(ifn->port, &peerid, &mtcode, msg, &msgsize)
-	    == -1) {
-		logwarnx("enclave %s read error", ifn->ifname);
-		return -1;
-	}
-
-	if (!findifnpeerbyid(&peer, ifn, peerid)) {
-		logwarnx("enclave %s unknown peer id %u", ifn->ifname, peerid);
-		return -1;
-	}
+	int rc;
 
 	switch (mtcode) {
 	case MSGWGINIT:
-		return handlewginit(peer->ifn, peer, NULL, NULL);
+		stats->initin++;
+		HISTSTART(statspage, HISTWGINIT);
+		rc = handlewginit(peer->ifn, peer, NULL, NULL);
+		HISTSTOP(statspage, HISTWGINIT);
+		if (rc == -1) {
+			stats->initinerr++;
+			return -1;
+		}
+		break;
 	case MSGWGRESP:
-		return handlewgresp(peer->ifn, peer, NULL, NULL);
+		stats->respin++;
+		HISTSTART(statspage, HISTWGRESP);
+		rc = handlewgresp(peer->ifn, peer, NULL, NULL);
+		HISTSTOP(statspage, HISTWGRESP);
+		if (rc == -1) {
+			stats->respinerr++;
+			return -1;
+		}
+		break;
+	case MSGWGCOOKIE:
+		stats->cookiein++;
+		if (handlewgcookie(peer) == -1) {
+			stats->cookieinerr++;
+			return -1;
+		}
+		break;
 	case MSGREQWGINIT:
 		mwi = (struct msgwginit *)msg;
 		if (createhsinit(peer, mwi) == -1) {
 			logwarnx("enclave %s unable to create a new init "
-			    "message for peer %u", ifn->ifname, peer->id);
+			    "message for peer %u", peer->ifn->ifname, peer->id);
+			stats->initouterr++;
 			return -1;
 		}
 
-		if (wire_sendpeeridmsg(ifn->port, peerid, MSGWGINIT, msg,
+		if (wire_sendpeeridmsg(peerport(peer), peer->id, MSGWGINIT, msg,
 		    sizeof(struct msgwginit)) == -1) {
 			logwarnx("enclave %s [%x] error sending init message "
-			    "for peer %u to ifn", ifn->ifname,
+			    "for peer %u to ifn", peer->ifn->ifname,
 			    le32toh(mwi->sender), peer->id);
+			stats->initouterr++;
 			return -1;
 		}
+		stats->initout++;
 		if (verbose > 1)
 			loginfox("enclave %s [%x] sent init message for peer %u"
-			    " to ifn", ifn->ifname, le32toh(mwi->sender),
+			    " to ifn", peer->ifn->ifname, le32toh(mwi->sender),
 			    peer->id);
 		break;
 	default:
 		logwarnx("enclave %s message from ifn of unknown type %d",
-		    ifn->ifname, mtcode);
+		    peer->ifn->ifname, mtcode);
 		return -1;
 	}
 
@@ -1026,26 +1443,170 @@ handleifnmsg(const struct ifn *ifn)
 }
 
 /*
- * Receive and handle one of the messages from the proxy.
+ * Handle a message that is received from the network by the proxy for "ifn".
+ * "fsn" and "lsn" are the foreign and local address of the message. Reads and
+ * writes to "msg".
  *
  * MSGWGINIT
- *   if data authenticates, determine the appropriate interface:
+ *   if data authenticates:
  *      send MSGCONNREQ
  *      send MSGSESSKEYS
  *      create and send MSGWGRESP
  * MSGWGRESP
- *   if data authenticates, determine the appropriate interface:
+ *   if data authenticates:
  *      send MSGCONNREQ
  *      send MSGSESSKEYS
  *
  * Return 0 on success, -1 on error.
  */
 static int
-handleproxymsg(void)
+handlenetmsg(struct ifn *ifn, unsigned char mtcode, union sockaddr_inet *fsn,
+    union sockaddr_inet *lsn)
 {
-	union sockaddr_inet fsn, lsn;
+	int rc;
+
+	switch (mtcode) {
+	case MSGWGINIT:
+		stats->initin++;
+		HISTSTART(statspage, HISTWGINIT);
+		rc = handlewginit(ifn, NULL, fsn, lsn);
+		HISTSTOP(statspage, HISTWGINIT);
+		if (rc == -1) {
+			stats->initinerr++;
+			return -1;
+		}
+		break;
+	case MSGWGRESP:
+		stats->respin++;
+		HISTSTART(statspage, HISTWGRESP);
+		rc = handlewgresp(ifn, NULL, fsn, lsn);
+		HISTSTOP(statspage, HISTWGRESP);
+		if (rc == -1) {
+			stats->respinerr++;
+			return -1;
+		}
+		break;
+	default:
+		logwarnx("enclave %s message from proxy of unknown type %d",
+		    ifn->ifname, mtcode);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Determine the peer of the init message in "msg" that is received from the
+ * proxy for "ifn", without changing any handshake state. The worker that serves
+ * the peer authenticates the complete message again.
+ *
+ * Return 0 and update "peer" on success, -1 if the message could not be
+ * authenticated.
+ */
+static int
+identifyinit(const struct ifn *ifn, struct peer **peer)
+{
+	struct msgwginit *mwi;
+
+	mwi = (struct msgwginit *)msg;
+
+	if (!ws_validmac(mwi->mac1, sizeof(mwi->mac1), mwi, MAC1OFFSETINIT,
+	    ifn->mac1key)) {
+		logwarnx("enclave %s I:%x init message with invalid mac "
+		    "received from peer", ifn->ifname, le32toh(mwi->sender));
+		return -1;
+	}
+
+	if (openinitstat(ifn, mwi) == -1 ||
+	    !findifnpeerbypubkey(peer, ifn, tmpstat)) {
+		logwarnx("enclave %s I:%x could not authenticate init message "
+		    "from peer", ifn->ifname, le32toh(mwi->sender));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pass the message in "msg" of "msgsize" bytes on to enclave worker "w" with
+ * header "fh".
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+forwardmsg(size_t w, const struct fwdhdr *fh, size_t msgsize)
+{
+	struct iovec fiov[2];
+
+	fiov[0].iov_base = (void *)fh;
+	fiov[0].iov_len = sizeof(*fh);
+	fiov[1].iov_base = msg;
+	fiov[1].iov_len = msgsize;
+
+	if (writev(fwdports[w], fiov, 2) == -1) {
+		logwarn("enclave error passing message on to worker %zu", w);
+		return -1;
+	}
+
+	stats->forwarded++;
+
+	return 0;
+}
+
+/*
+ * Receive a message from an IFN and handle it if the peer is served by this
+ * worker, otherwise pass it on to the worker that serves the peer.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handleifnmsg(const struct ifn *ifn, int port)
+{
+	struct fwdhdr fh;
+	struct peer *peer;
+	size_t msgsize, w;
+	uint32_t peerid;
+	unsigned char mtcode;
+
+	msgsize = sizeof(msg);
+	if (wire_recvpeeridmsg(port, &peerid, &mtcode, msg, &msgsize)
+	    == -1) {
+		logwarnx("enclave %s read error", ifn->ifname);
+		return -1;
+	}
+
+	if (!findifnpeerbyid(&peer, ifn, peerid)) {
+		logwarnx("enclave %s unknown peer id %u", ifn->ifname, peerid);
+		return -1;
+	}
+
+	if ((w = peerworker(peer)) != worker) {
+		memset(&fh, 0, sizeof(fh));
+		fh.ifnid = ifn->id;
+		fh.peerid = peerid;
+		fh.mtcode = mtcode;
+		return forwardmsg(w, &fh, msgsize);
+	}
+
+	return handlepeermsg(peer, mtcode);
+}
+
+/*
+ * Receive one of the messages from the proxy and handle it if the peer is
+ * served by this worker, otherwise pass it on to the worker that serves the
+ * peer. Init messages are identified by the initiator's static key, response
+ * messages by the worker that created the receiver session id.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handleproxymsg(void)
+{
+	union sockaddr_inet fsn, lsn;
+	struct fwdhdr fh;
 	struct ifn *ifn;
-	size_t msgsize;
+	struct peer *peer;
+	size_t msgsize, w;
 	uint32_t ifnid;
 	unsigned char mtcode;
 
@@ -1056,65 +1617,509 @@ handleproxymsg(void)
 		return -1;
 	}
 
-	if (ifnid > ifnvsize) {
+	if (ifnid >= ifnvsize) {
 		logwarnx("enclave unknown interface id from proxy: %d", ifnid);
 		return -1;
 	}
 	ifn = ifnv[ifnid];
 
-	switch (mtcode) {
-	case MSGWGINIT:
-		return handlewginit(ifn, NULL, &fsn, &lsn);
-	case MSGWGRESP:
-		return handlewgresp(ifn, NULL, &fsn, &lsn);
-	default:
-		logwarnx("enclave %s message from proxy of unknown type %d",
-		    ifn->ifname, mtcode);
+	w = worker;
+	if (workers > 1 && mtcode == MSGWGINIT) {
+		if (identifyinit(ifn, &peer) == -1) {
+			stats->initin++;
+			stats->initinerr++;
+			return -1;
+		}
+		w = peerworker(peer);
+	} else if (workers > 1 && mtcode == MSGWGRESP) {
+		w = le32toh(((struct msgwgresp *)msg)->receiver) % workers;
+	}
+
+	if (w != worker) {
+		memset(&fh, 0, sizeof(fh));
+		fh.ifnid = ifnid;
+		fh.fromproxy = 1;
+		fh.fsn = fsn;
+		fh.lsn = lsn;
+		fh.mtcode = mtcode;
+		return forwardmsg(w, &fh, msgsize);
+	}
+
+	return handlenetmsg(ifn, mtcode, &fsn, &lsn);
+}
+
+/*
+ * Apply peer slot "speer" that is changed by a reload of the configuration. A
+ * slot that is no longer used loses its keys so that a handshake with the
+ * public key of the removed peer fails. A pending handshake of the slot is
+ * dropped and the state that protects against replays is only kept if the
+ * public key stays the same.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+reloadpeer(const struct speer *speer)
+{
+	struct ifn *ifn;
+	struct peer *p, *q;
+	struct hs *hs;
+	int samekey;
+
+	if (speer->ifnid >= ifnvsize || ifnv[speer->ifnid]->id != speer->ifnid) {
+		logwarnx("enclave reload of unknown interface id %u",
+		    speer->ifnid);
 		return -1;
 	}
+	ifn = ifnv[speer->ifnid];
+
+	if (speer->peerid >= ifn->peerssize) {
+		logwarnx("enclave %s reload of unknown peer id %u", ifn->ifname,
+		    speer->peerid);
+		return -1;
+	}
+	p = ifn->peers[speer->peerid];
+
+	samekey = !p->unused && !speer->unused &&
+	    memcmp(p->pubkey, speer->peerkey, sizeof(p->pubkey)) == 0;
+
+	if (!p->unused)
+		pubkeymapdel(p);
+
+	hs = p->hs;
+	sessidmapdel(ifn, hs->sessid, p);
+	explicit_bzero(hs, sizeof(*hs));
+	hs->peer = p;
+
+	p->unused = speer->unused;
+	if (p->unused) {
+		explicit_bzero(p->psk, sizeof(p->psk));
+		explicit_bzero(p->pubkey, sizeof(p->pubkey));
+		explicit_bzero(p->pubkeyhash, sizeof(p->pubkeyhash));
+		explicit_bzero(p->mac1key, sizeof(p->mac1key));
+		explicit_bzero(p->cookiekey, sizeof(p->cookiekey));
+		explicit_bzero(p->dhsecret, sizeof(p->dhsecret));
+	} else {
+		memcpy(p->psk, speer->psk,
+		    MIN(sizeof p->psk, sizeof speer->psk));
+		memcpy(p->pubkey, speer->peerkey,
+		    MIN(sizeof p->pubkey, sizeof speer->peerkey));
+		memcpy(p->mac1key, speer->mac1key,
+		    MIN(sizeof p->mac1key, sizeof speer->mac1key));
+		memcpy(p->cookiekey, speer->cookiekey,
+		    MIN(sizeof p->cookiekey, sizeof speer->cookiekey));
+
+		memcpy(p->pubkeyhash, considhash, HASHLEN);
+		appendhash(p->pubkeyhash, speer->peerkey, KEYLEN);
+
+		dh(p->dhsecret, ifn->privkey, p->pubkey);
+	}
+
+	if (!samekey) {
+		memset(p->recvts, 0, sizeof(p->recvts));
+		memset(p->lastmac1, 0, sizeof(p->lastmac1));
+		memset(p->cookie, 0, sizeof(p->cookie));
+		p->cookiets = -1;
+	}
+
+	if (p->unused)
+		return 0;
+
+	if (findifnpeerbypubkey(&q, ifn, p->pubkey)) {
+		logwarnx("enclave %s peer %u has the same public key as peer "
+		    "%u", ifn->ifname, p->id, q->id);
+	} else {
+		pubkeymapput(p);
+	}
 
 	return 0;
 }
 
+/*
+ * Receive a peer slot that is changed by a reload from the master and apply
+ * it. Each other worker has a copy of all peers so pass it on to all of them.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handlemastermsg(void)
+{
+	struct fwdhdr fh;
+	struct speer *speer;
+	size_t msgsize, w;
+	unsigned char mtcode;
+	int rc;
+
+	msgsize = sizeof(msg);
+	if (wire_recvmsg(mport, &mtcode, msg, &msgsize) == -1) {
+		logwarnx("enclave read master message error");
+		return -1;
+	}
+
+	if (mtcode != SPEER || msgsize != sizeof(*speer)) {
+		logwarnx("enclave unexpected message from master %d", mtcode);
+		return -1;
+	}
+	speer = (struct speer *)msg;
+
+	if ((rc = reloadpeer(speer)) == 0) {
+		memset(&fh, 0, sizeof(fh));
+		fh.ifnid = speer->ifnid;
+		fh.peerid = speer->peerid;
+		fh.mtcode = SPEER;
+
+		for (w = 1; w < workers; w++)
+			if (forwardmsg(w, &fh, msgsize) == -1)
+				rc = -1;
+	}
+
+	explicit_bzero(msg, msgsize);
+
+	return rc;
+}
+
+/*
+ * Receive and handle a message that is passed on by the front.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handlefwdmsg(void)
+{
+	struct fwdhdr fh;
+	struct iovec fiov[2];
+	struct ifn *ifn;
+	struct peer *peer;
+	ssize_t rc;
+
+	fiov[0].iov_base = &fh;
+	fiov[0].iov_len = sizeof(fh);
+	fiov[1].iov_base = msg;
+	fiov[1].iov_len = sizeof(msg);
+
+	if ((rc = readv(frontport, fiov, 2)) == -1) {
+		logwarn("enclave worker %zu read error", worker);
+		return -1;
+	}
+
+	if ((size_t)rc < sizeof(fh) || fh.ifnid >= ifnvsize) {
+		logwarnx("enclave worker %zu invalid message from front",
+		    worker);
+		return -1;
+	}
+	ifn = ifnv[fh.ifnid];
+
+	if (fh.fromproxy)
+		return handlenetmsg(ifn, fh.mtcode, &fh.fsn, &fh.lsn);
+
+	if (fh.mtcode == SPEER) {
+		if ((size_t)rc != sizeof(fh) + sizeof(struct speer)) {
+			logwarnx("enclave worker %zu invalid reload from front",
+			    worker);
+			return -1;
+		}
+		rc = reloadpeer((struct speer *)msg);
+		explicit_bzero(msg, sizeof(struct speer));
+		return rc;
+	}
+
+	if (!findifnpeerbyid(&peer, ifn, fh.peerid)) {
+		logwarnx("enclave worker %zu %s unknown peer id %u", worker,
+		    ifn->ifname, fh.peerid);
+		return -1;
+	}
+
+	return handlepeermsg(peer, fh.mtcode);
+}
+
+/*
+ * Return the time of the monotonic clock in microseconds.
+ *
+ * Exit on error.
+ */
+static uint64_t
+nowus(void)
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1) {
+		logwarn("enclave clock_gettime error");
+		exit(1);
+	}
+
+	return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/*
+ * Initialize a full token bucket for the messages on "port". "udata" must be
+ * the udata that is used for the read event of "port".
+ */
+static void
+tbinit(struct tbucket *tb, int port, void *udata)
+{
+	tb->port = port;
+	tb->udata = udata;
+	tb->tokens = hsburst;
+	tb->lastfill = nowus();
+}
+
+/*
+ * Take one token from "tb". If no token is available, stop reading from the
+ * port of "tb" and set a one-shot timer that fires as soon as a new token is
+ * available. If the source is the proxy, signal it that the enclave is under
+ * load so that it starts answering handshakes with cookie replies.
+ *
+ * Return 0 if a token was taken, -1 if the read is deferred.
+ */
+static int
+tbtake(struct tbucket *tb)
+{
+	struct msgoverload mol;
+	struct kevent ev[2];
+	uint64_t now, idle, n;
+	int64_t wait;
+
+	/*
+	 * Refilling the whole bucket takes no longer than this, clamp so that a
+	 * long idle period can not overflow.
+	 */
+	now = nowus();
+	idle = MIN(now - tb->lastfill,
+	    ((uint64_t)hsburst * 1000000 + hsrate - 1) / hsrate);
+	n = idle * hsrate / 1000000;
+	if (n > 0) {
+		if (tb->tokens + n >= hsburst) {
+			tb->tokens = hsburst;
+			tb->lastfill = now;
+		} else {
+			tb->tokens += n;
+			tb->lastfill += n * 1000000 / hsrate;
+		}
+	}
+
+	if (tb->tokens > 0) {
+		tb->tokens--;
+		return 0;
+	}
+
+	/* milliseconds until the next token, rounded up */
+	wait = (tb->lastfill + 1000000 / hsrate - now + 999) / 1000;
+	if (wait < 1)
+		wait = 1;
+
+	EV_SET(&ev[0], tb->port, EVFILT_READ, EV_DISABLE, 0, 0, tb->udata);
+	EV_SET(&ev[1], tb->port, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, wait,
+	    tb);
+	if (kevent(kq, ev, 2, NULL, 0, NULL) == -1) {
+		logwarn("enclave kevent defer error");
+		exit(1);
+	}
+
+	stats->deferred++;
+
+	if (tb == &proxytb) {
+		memset(&mol, 0, sizeof(mol));
+		if (wire_sendmsg(pport, MSGOVERLOAD, &mol, sizeof(mol)) == -1)
+			logwarnx("enclave send overload to proxy error");
+	}
+
+	if (verbose > 1)
+		loginfox("enclave rate limit reached, deferring reads for "
+		    "%lldms", (long long)wait);
+
+	return -1;
+}
+
+/*
+ * Resume reading from the port of "tb" after a deferral.
+ *
+ * Exit on error.
+ */
+static void
+tbresume(struct tbucket *tb)
+{
+	struct kevent ev;
+
+	EV_SET(&ev, tb->port, EVFILT_READ, EV_ENABLE, 0, 0, tb->udata);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) == -1) {
+		logwarn("enclave kevent resume error");
+		exit(1);
+	}
+}
+
+static void
+enclave_loginfo(void)
+{
+	logwarnx("enclave init in %zu (%zu errors) out %zu (%zu errors)",
+	    stats->initin, stats->initinerr, stats->initout,
+	    stats->initouterr);
+	logwarnx("enclave resp in %zu (%zu errors)", stats->respin,
+	    stats->respinerr);
+	logwarnx("enclave cookie in %zu (%zu errors)", stats->cookiein,
+	    stats->cookieinerr);
+	logwarnx("enclave deferred reads %zu", stats->deferred);
+	logwarnx("enclave ephemeral keys pooled %zu, inline %zu",
+	    stats->ephpooled, stats->ephinline);
+	logwarnx("enclave messages passed on to other workers %zu",
+	    stats->forwarded);
+}
+
+/*
+ * Serve the peers of an enclave worker other than the front. Only messages that
+ * are passed on by the front are read, responses are sent to the ifn that
+ * serves the peer directly.
+ *
+ * Exit on error.
+ */
+static void
+workerserv(void)
+{
+	static const struct timespec nowait = { 0, 0 };
+	static const struct timespec logwait = { 1, 0 };
+	const struct timespec *timeout;
+	struct kevent ev;
+	int nev;
+
+	if ((kq = kqueue()) == -1) {
+		logwarn("enclave worker %zu kqueue error", worker);
+		exit(1);
+	}
+
+	EV_SET(&ev, frontport, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) == -1) {
+		logwarn("enclave worker %zu kevent error", worker);
+		exit(1);
+	}
+
+	logdefer(1);
+
+	for (;;) {
+		if (logstats) {
+			logdefer(0);
+			enclave_loginfo();
+			logdefer(1);
+			logstats = 0;
+		}
+
+		if (doterm) {
+			if (verbose > 1)
+				loginfox("enclave worker %zu received "
+				    "termination signal, shutting down",
+				    worker);
+			exit(1);
+		}
+
+		/*
+		 * Only poll if there are keypairs to generate while idle, wake up
+		 * in time to report suppressed log messages.
+		 */
+		if (ephpoolcount < EPHPOOLSIZE)
+			timeout = &nowait;
+		else if (logflush())
+			timeout = &logwait;
+		else
+			timeout = NULL;
+
+		if ((nev = kevent(kq, NULL, 0, &ev, 1, timeout)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else {
+				logwarn("enclave worker %zu kevent error",
+				    worker);
+				exit(1);
+			}
+		}
+
+		if (nev == 0) {
+			ephrefill();
+			continue;
+		}
+
+		if (ev.flags & EV_EOF) {
+			if (verbose > 1)
+				loginfox("enclave worker %zu front EOF, "
+				    "shutting down", worker);
+			exit(1);
+		}
+
+		handlefwdmsg();
+	}
+}
+
 /*
  * Setup read listeners for:
  *    proxy port
  *    each IFN port
+ *    each enclave worker, for EOF
  *
- * Handle events.
+ * Each port is rate limited by a token bucket so that a flood of handshakes
+ * from one source can not starve the others.
+ *
+ * Handle events. Enclave workers other than the front only serve the messages
+ * that are passed on to them.
  *
  * Exit on error.
  */
 void
 enclave_serv(void)
 {
+	static const struct timespec nowait = { 0, 0 };
+	static const struct timespec logwait = { 1, 0 };
+	const struct timespec *timeout;
 	struct kevent *ev;
-	size_t evsize, n;
-	int nev, i;
+	struct ifn *ifn;
+	size_t evsize, n, w;
+	int nev, i, port;
+
+	if (worker > 0)
+		workerserv();
 
 	if ((kq = kqueue()) == -1) {
 		logwarn("enclave kqueue error");
 		exit(1);
 	}
 
-	evsize = ifnvsize + 1;
+	/*
+	 * Room for a read and a deferral timer per port, one per worker and one
+	 * for the master.
+	 */
+	evsize = (ifnvsize + 1) * 2 + workers + 1;
 	if ((ev = calloc(evsize, sizeof(*ev))) == NULL) {
 		logwarn("enclave calloc ev error");
 		exit(1);
 	}
 
-	for (n = 0; n < ifnvsize; n++)
-		EV_SET(&ev[n], ifnv[n]->port, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	/* register each ifn worker port with its interface */
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		w = n - ifn->id;
+		port = ifn->workerports[w];
+		EV_SET(&ev[n], port, EVFILT_READ, EV_ADD, 0, 0, ifn);
+		tbinit(&ifn->tbv[w], port, ifn);
+	}
 
 	EV_SET(&ev[ifnvsize], pport, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	tbinit(&proxytb, pport, NULL);
+
+	/* workers never write to the front, only watch for them to exit */
+	for (w = 1; w < workers; w++)
+		EV_SET(&ev[ifnvsize + w], fwdports[w], EVFILT_READ, EV_ADD, 0,
+		    0, NULL);
+
+	/* the master sends the peers that change on a reload */
+	EV_SET(&ev[ifnvsize + workers], mport, EVFILT_READ, EV_ADD, 0, 0, NULL);
 
-	if (kevent(kq, ev, evsize, NULL, 0, NULL) == -1) {
+	if (kevent(kq, ev, ifnvsize + workers + 1, NULL, 0, NULL) == -1) {
 		logwarn("enclave kevent error");
 		exit(1);
 	}
 
+	logdefer(1);
+
 	for (;;) {
 		if (logstats) {
+			logdefer(0);
+			enclave_loginfo();
+			logdefer(1);
 			logstats = 0;
 		}
 
@@ -1125,7 +2130,18 @@ enclave_serv(void)
 			exit(1);
 		}
 
-		if ((nev = kevent(kq, NULL, 0, ev, evsize, NULL)) == -1) {
+		/*
+		 * Only poll if there are keypairs to generate while idle, wake up
+		 * in time to report suppressed log messages.
+		 */
+		if (ephpoolcount < EPHPOOLSIZE)
+			timeout = &nowait;
+		else if (logflush())
+			timeout = &logwait;
+		else
+			timeout = NULL;
+
+		if ((nev = kevent(kq, NULL, 0, ev, evsize, timeout)) == -1) {
 			if (errno == EINTR) {
 				continue;
 			} else {
@@ -1134,10 +2150,20 @@ enclave_serv(void)
 			}
 		}
 
+		if (nev == 0) {
+			ephrefill();
+			continue;
+		}
+
 		if (verbose > 2)
 			logdebugx("enclave %d events", nev);
 
 		for (i = 0; i < nev; i++) {
+			if (ev[i].filter == EVFILT_TIMER) {
+				tbresume(ev[i].udata);
+				continue;
+			}
+
 			if ((int)ev[i].ident == pport) {
 				if (ev[i].flags & EV_EOF) {
 					if (verbose > -1)
@@ -1146,30 +2172,50 @@ enclave_serv(void)
 						logwarn("enclave close error");
 						exit(1);
 					}
-					break;
+					continue;
 				}
-				handleproxymsg();
-				break;
+				if (tbtake(&proxytb) == 0)
+					handleproxymsg();
+				continue;
 			}
 
-			/* XXX log(n) */
-			for (n = 0; n < ifnvsize; n++) {
-				if ((int)ev[i].ident == ifnv[n]->port) {
-					if (ev[i].flags & EV_EOF) {
-						if (verbose > -1)
-							logwarnx("enclave %s "
-							    "EOF",
-							    ifnv[n]->ifname);
-						if (close(ifnv[n]->port) == -1) {
-							logwarn("enclave close error");
-							exit(1);
-						}
-						break;
-					}
-					handleifnmsg(ifnv[n]);
-					break;
+			if ((int)ev[i].ident == mport) {
+				if (ev[i].flags & EV_EOF) {
+					logwarnx("enclave master went away");
+					exit(1);
+				}
+				if (handlemastermsg() == -1)
+					logwarnx("enclave reload error");
+				continue;
+			}
+
+			/* the peers of an exited worker can not be served */
+			if (ev[i].udata == NULL) {
+				logwarnx("enclave worker on port %d exited",
+				    (int)ev[i].ident);
+				exit(1);
+			}
+
+			ifn = ev[i].udata;
+			port = ev[i].ident;
+
+			if (ev[i].flags & EV_EOF) {
+				if (verbose > -1)
+					logwarnx("enclave %s EOF", ifn->ifname);
+				if (close(port) == -1) {
+					logwarn("enclave close error");
+					exit(1);
 				}
+				continue;
 			}
+
+			for (w = 0; w < ifn->workers; w++)
+				if (ifn->workerports[w] == port)
+					break;
+			assert(w < ifn->workers);
+
+			if (tbtake(&ifn->tbv[w]) == 0)
+				handleifnmsg(ifn, port);
 		}
 	}
 }
@@ -1192,10 +2238,13 @@ recvconfig(int masterport)
 		struct speer peer;
 		struct seos eos;
 	} smsg;
-	struct peer *p;
+	struct wire_bulk bulk;
+	struct peer *p, *q, *peerv;
+	struct hs *hsv;
 	struct ifn *ifn;
 	size_t n, m, msgsize;
 	unsigned char mtcode;
+	int bulkfd;
 
 	if (readhexnomem(conshash, HASHLEN, CONSHASH, strlen(CONSHASH)) == -1)
 		abort();
@@ -1204,7 +2253,8 @@ recvconfig(int masterport)
 		abort();
 
 	msgsize = sizeof(smsg);
-	if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
+	if (wire_recvmsgfd(masterport, &mtcode, &smsg, &msgsize, &bulkfd)
+	    == -1) {
 		logwarnx("enclave receive SINIT error %d", masterport);
 		exit(1);
 	}
@@ -1219,6 +2269,46 @@ recvconfig(int masterport)
 	gid = smsg.init.gid;
 	pport = smsg.init.proxport;
 	ifnvsize = smsg.init.nifns;
+	hsrate = smsg.init.hsrate;
+	hsburst = smsg.init.hsburst;
+	if (hsrate == 0)
+		hsrate = HSRATE;
+	if (hsburst == 0)
+		hsburst = hsrate;
+	workers = smsg.init.enclworkers;
+	if (workers == 0 || workers > MAXENCLWORKERS)
+		workers = 1;
+
+	/* map the stats page, the descriptor is not needed after */
+	if (smsg.init.statsfd != -1 && !isopenfd(smsg.init.statsfd)) {
+		logwarnx("enclave stats page %d not open", smsg.init.statsfd);
+		exit(1);
+	}
+	statspage = stats_map(smsg.init.statsfd, 0, STATSENCLAVE, "enclave");
+	if (statspage == NULL) {
+		logwarn("enclave map stats page error");
+		exit(1);
+	}
+	if (smsg.init.statsfd != -1 && close(smsg.init.statsfd) == -1) {
+		logwarn("enclave close stats page error");
+		exit(1);
+	}
+	stats = &statspage->u.enclave;
+	sharedstats = smsg.init.statsfd != -1;
+
+	/* map the bulk configuration, the descriptor is not needed after */
+	if (bulkfd == -1) {
+		logwarnx("enclave no bulk configuration");
+		exit(1);
+	}
+	if (wire_bulkmap(&bulk, bulkfd, smsg.init.bulksize) == -1) {
+		logwarn("enclave map bulk configuration error");
+		exit(1);
+	}
+	if (close(bulkfd) == -1) {
+		logwarn("enclave close bulk configuration error");
+		exit(1);
+	}
 
 	if ((ifnv = calloc(ifnvsize, sizeof(*ifnv))) == NULL) {
 		logwarn("enclave calloc ifnv error");
@@ -1236,17 +2326,35 @@ recvconfig(int masterport)
 			exit(1);
 		}
 
+		assert(n == smsg.ifn.ifnid);
+
+		/* additional workers follow their first worker */
+		if (smsg.ifn.worker > 0) {
+			if (smsg.ifn.worker > n ||
+			    smsg.ifn.worker >= ifnv[n - smsg.ifn.worker]->workers) {
+				logwarnx("enclave invalid worker %zu",
+				    smsg.ifn.worker);
+				exit(1);
+			}
+			ifn = ifnv[n - smsg.ifn.worker];
+			ifn->workerports[smsg.ifn.worker] = smsg.ifn.ifnport;
+			ifnv[n] = ifn;
+			continue;
+		}
+
 		if ((ifn = malloc(sizeof(*ifn))) == NULL) {
 			logwarn("enclave malloc ifn error");
 			exit(1);
 		}
 		ifnv[n] = ifn;
 
-		assert(n == smsg.ifn.ifnid);
-
 		ifn->id = smsg.ifn.ifnid;
 		ifn->ifname = strdup(smsg.ifn.ifname);
 		ifn->port = smsg.ifn.ifnport;
+		ifn->workers = smsg.ifn.workers;
+		if (ifn->workers == 0 || ifn->workers > MAXWORKERS)
+			ifn->workers = 1;
+		ifn->workerports[0] = ifn->port;
 		ifn->peerssize = smsg.ifn.npeers;
 
 		if ((ifn->peers = calloc(ifn->peerssize,
@@ -1266,16 +2374,38 @@ recvconfig(int masterport)
 		memcpy(ifn->cookiekey, smsg.ifn.cookiekey,
 		    MIN(sizeof ifn->cookiekey, sizeof smsg.ifn.cookiekey));
 
+		/* keep both indices at most half full */
+		for (ifn->pubkeymapvsize = 8;
+		    ifn->pubkeymapvsize < ifn->peerssize * 2;)
+			ifn->pubkeymapvsize *= 2;
+		ifn->sessidmapvsize = ifn->pubkeymapvsize;
+
+		if ((ifn->pubkeymapv = calloc(ifn->pubkeymapvsize,
+		    sizeof(*ifn->pubkeymapv))) == NULL) {
+			logwarn("enclave calloc pubkeymapv error");
+			exit(1);
+		}
+		if ((ifn->sessidmapv = calloc(ifn->sessidmapvsize,
+		    sizeof(*ifn->sessidmapv))) == NULL) {
+			logwarn("enclave calloc sessidmapv error");
+			exit(1);
+		}
+
+		/* allocate all peers and their handshakes at once */
+		peerv = calloc(ifn->peerssize, sizeof(*peerv));
+		hsv = calloc(ifn->peerssize, sizeof(*hsv));
+		if ((peerv == NULL || hsv == NULL) && ifn->peerssize > 0) {
+			logwarn("enclave calloc peers error");
+			exit(1);
+		}
+
 		for (m = 0; m < ifn->peerssize; m++) {
-			if ((p = malloc(sizeof(*p))) == NULL) {
-				logwarn("enclave malloc peer error");
-				exit(1);
-			}
+			p = &peerv[m];
 
 			msgsize = sizeof(smsg);
-			if (wire_recvmsg(masterport, &mtcode, &smsg,
-			    &msgsize) == -1) {
-				logwarnx("enclave receive SPEER error");
+			if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize)
+			    == -1) {
+				logwarnx("enclave bulk SPEER error");
 				exit(1);
 			}
 			if (mtcode != SPEER) {
@@ -1289,6 +2419,14 @@ recvconfig(int masterport)
 
 			p->ifn = ifn;
 			p->id = m;
+			p->hs = &hsv[m];
+			p->hs->peer = p;
+			p->cookiets = -1;
+			ifn->peers[m] = p;
+
+			/* a spare slot has no keys until a reload uses it */
+			if ((p->unused = smsg.peer.unused))
+				continue;
 
 			memcpy(p->psk, smsg.peer.psk,
 			    MIN(sizeof p->psk, sizeof smsg.peer.psk));
@@ -1296,23 +2434,34 @@ recvconfig(int masterport)
 			    MIN(sizeof p->pubkey, sizeof smsg.peer.peerkey));
 			memcpy(p->mac1key, smsg.peer.mac1key,
 			    MIN(sizeof p->mac1key, sizeof smsg.peer.mac1key));
+			memcpy(p->cookiekey, smsg.peer.cookiekey,
+			    MIN(sizeof p->cookiekey, sizeof smsg.peer.cookiekey));
 
 			memcpy(p->pubkeyhash, considhash, HASHLEN);
 			appendhash(p->pubkeyhash, smsg.peer.peerkey, KEYLEN);
 
 			dh(p->dhsecret, ifn->privkey, p->pubkey);
 
-			if ((p->hs = malloc(sizeof(*p->hs))) == NULL) {
-				logwarn("enclave malloc p->hs error");
-				exit(1);
+			/* only the first peer with a given key is reachable */
+			if (findifnpeerbypubkey(&q, ifn, p->pubkey)) {
+				logwarnx("enclave %s peer %zu has the same "
+				    "public key as peer %u", ifn->ifname, m,
+				    q->id);
+			} else {
+				pubkeymapput(p);
 			}
-
-			memset(p->recvts, 0, sizeof(p->recvts));
-			p->hs->peer = p;
-			ifn->peers[m] = p;
 		}
 	}
 
+	if (bulk.off != bulk.size) {
+		logwarnx("enclave trailing bulk configuration");
+		exit(1);
+	}
+	if (wire_bulkunmap(&bulk, 1) == -1) {
+		logwarn("enclave unmap bulk configuration error");
+		exit(1);
+	}
+
 	/* expect end of startup signal */
 	msgsize = sizeof(smsg);
 	if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
@@ -1330,6 +2479,101 @@ recvconfig(int masterport)
 		logdebugx("enclave config received from master");
 }
 
+/*
+ * Turn a forked process into enclave worker "w" that receives messages from the
+ * front on "port". Descriptors that are only used by the front are closed and
+ * if the front has a shared stats page the worker gets a page of its own,
+ * following the pages of the ifn processes.
+ *
+ * Exit on error.
+ */
+static void
+initworker(size_t w, int port, int masterport)
+{
+	char name[sizeof(statspage->name)];
+	size_t n;
+	int fd;
+
+	worker = w;
+	frontport = port;
+
+	for (n = 1; n < w; n++) {
+		if (close(fwdports[n]) == -1) {
+			logwarn("enclave worker %zu close error", w);
+			exit(1);
+		}
+	}
+
+	if (close(pport) == -1 || close(masterport) == -1) {
+		logwarn("enclave worker %zu close error", w);
+		exit(1);
+	}
+
+	setproctitle("enclave worker %zu", w);
+
+	if (!sharedstats)
+		return;
+
+	if ((fd = stats_create(1 + ifnvsize + w, 0)) == -1) {
+		logwarn("enclave worker %zu stats page error", w);
+		exit(1);
+	}
+	snprintf(name, sizeof(name), "enclave.%zu", w);
+	statspage = stats_map(fd, 0, STATSENCLAVE, name);
+	if (statspage == NULL) {
+		logwarn("enclave worker %zu map stats page error", w);
+		exit(1);
+	}
+	if (close(fd) == -1) {
+		logwarn("enclave worker %zu close stats page error", w);
+		exit(1);
+	}
+	stats = &statspage->u.enclave;
+}
+
+/*
+ * Fork the other enclave workers, each with a channel to the front. Returns in
+ * the front and in each worker.
+ *
+ * Exit on error.
+ */
+static void
+forkworkers(int masterport)
+{
+	size_t w;
+	int tmpchan[2];
+
+	for (w = 1; w < workers; w++) {
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tmpchan) == -1) {
+			logwarn("enclave socketpair error worker %zu", w);
+			exit(1);
+		}
+
+		switch (fork()) {
+		case -1:
+			logwarn("enclave fork error worker %zu", w);
+			exit(1);
+		case 0:
+			if (close(tmpchan[0]) == -1) {
+				logwarn("enclave worker %zu close error", w);
+				exit(1);
+			}
+			initworker(w, tmpchan[1], masterport);
+			break;
+		default:
+			if (close(tmpchan[1]) == -1) {
+				logwarn("enclave close error worker %zu", w);
+				exit(1);
+			}
+			fwdports[w] = tmpchan[0];
+			break;
+		}
+
+		if (worker > 0)
+			break;
+	}
+}
+
 /*
  * "masterport" descriptor to communicate with the master process and receive
  * the configuration.
@@ -1338,10 +2582,11 @@ void
 enclave_init(int masterport)
 {
 	struct sigaction sa;
-	size_t heapneeded, n, nrpeers;
-	int stdopen;
+	size_t heapneeded, n, nrpeers, nrmap;
+	int stdopen, port;
 
 	recvconfig(masterport);
+	mport = masterport;
 
 	/*
 	 * Make sure we are not missing any communication channels and that
@@ -1361,9 +2606,10 @@ enclave_init(int masterport)
 	}
 
 	for (n = 0; n < ifnvsize; n++) {
-		if (!isopenfd(ifnv[n]->port)) {
+		port = ifnv[n]->workerports[n - ifnv[n]->id];
+		if (!isopenfd(port)) {
 			logwarnx("enclave %s port %d not open",
-			    ifnv[n]->ifname, ifnv[n]->port);
+			    ifnv[n]->ifname, port);
 			exit(1);
 		}
 	}
@@ -1374,6 +2620,8 @@ enclave_init(int masterport)
 		exit(1);
 	}
 
+	forkworkers(masterport);
+
 	/*
 	 * Calculate the amount of dynamic memory we need.
 	 *
@@ -1382,8 +2630,13 @@ enclave_init(int masterport)
 	 */
 
 	nrpeers = 0;
-	for (n = 0; n < ifnvsize; n++)
+	nrmap = 0;
+	for (n = 0; n < ifnvsize; n++) {
+		if (ifnv[n]->id != n)
+			continue;
 		nrpeers += ifnv[n]->peerssize;
+		nrmap += ifnv[n]->pubkeymapvsize;
+	}
 
 	if (nrpeers > MAXPEERS) {
 		logwarn("enclave number of peers exceeds maximum %zu %d",
@@ -1395,7 +2648,9 @@ enclave_init(int masterport)
 	heapneeded += nrpeers * sizeof(struct peer);
 	heapneeded += nrpeers * 8;
 	heapneeded += ifnvsize * sizeof(struct ifn);
-	heapneeded += (ifnvsize + 1) * sizeof(struct kevent);
+	heapneeded += nrmap * (sizeof(struct peer *) + sizeof(struct sessidmap));
+	heapneeded += ((ifnvsize + 1) * 2 + workers + 1) *
+	    sizeof(struct kevent);
 
 	xensurelimit(RLIMIT_DATA, heapneeded);
 	xensurelimit(RLIMIT_FSIZE, MAXCORE);
@@ -1456,6 +2711,8 @@ enclave_printinfo(FILE *fp)
 
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
+		if (ifn->id != n)
+			continue;
 		fprintf(fp, "ifn %zu\n", n);
 		fprintf(fp, "id %u\n", ifn->id);
 		fprintf(fp, "port %d\n", ifn->port);
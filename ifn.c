@@ -42,6 +42,7 @@
 #include <unistd.h>
 
 #include "antireplay.h"
+#include "stats.h"
 #include "util.h"
 #include "wiresep.h"
 #include "wireprot.h"
@@ -55,6 +56,8 @@
 #define REKEY_AFTER_TIME 120000000
 #define REKEY_ATTEMPT_TIME 90000000
 #define REKEY_TIMEOUT 5000000
+#define REKEYJITTER 10000000 /* start rekeys up to 10 s before the limit */
+#define MAXHSREQS 16 /* max early rekey requests outstanding at the enclave */
 #define KEEPALIVE_TIMEOUT 10000000
 
 #define MINIP6HDR 40
@@ -65,8 +68,15 @@
 #define WSTUNMTU 1408
 #define TAGLEN 16
 #define DATAHEADERLEN 16
+#define TUNHEADROOM (DATAHEADERLEN - TUNHDRSIZ) /* wg header before tun frame */
+#define TUNTAILROOM (15 + TAGLEN)	/* padding and tag after the packet */
 
 #define MAXQUEUEPACKETS 50
+#define PEERTIMERS 5	/* four sessions and the rekey timer */
+#define TIMERBITS 6
+#define TIMERSLOTS (1 << TIMERBITS)	/* slots per timer wheel level */
+#define TIMERLEVELS 4	/* covers 2^24 ms, about four and a half hours */
+#define SENDBATCH 32 /* max datagrams written at once */
 #define MAXQUEUEPACKETSDATASZ ((size_t)(MAXSCRATCH * MAXQUEUEPACKETS))
 #define MINDATA  (1 << 21) /* minimum dynamic memory without peers / packets */
 #define MAXSTACK (1 << 15) /* 32 KB should be enough */
@@ -112,11 +122,11 @@ struct sesstent {
  * Used when a peer started negotiating a new session.
  */
 struct sessnext {
+	int64_t id;			/* host byte order */
+	int64_t peerid;			/* host byte order */
 	enum { SNINACTIVE, GOTKEYS, RESPSENT } state;
 	utime_t lastvrfyinit;
 	utime_t start;
-	int64_t id;			/* host byte order */
-	int64_t peerid;			/* host byte order */
 	EVP_AEAD_CTX sendctx;
 	EVP_AEAD_CTX recvctx;
 };
@@ -126,25 +136,46 @@ struct sessnext {
  * completes. While the handshake is still in progress it signifies the moment
  * the first handshake init was sent.
  * Note: an "id" of 0 is a valid, although unlikely, session id.
+ *
+ * Sessions live in slots of "sessarena" that start on a cache line. The fields
+ * used for each packet come first, the receive counter bitmap last.
  */
 struct session {
-	struct antireplay arrecv;	/* receive counter bitmap */
 	EVP_AEAD_CTX sendctx;
 	EVP_AEAD_CTX recvctx;
-	struct peer *peer;
-	utime_t start;			/* whenever handshake completes (or
-					 * first hs while still tentative) */
-	utime_t expack;			/* time before either data or a
-					 * keepalive is expected from the peer
-					 */
 	uint64_t nextnonce;		/* next number for the next packet to
 					 * send */
 	uint32_t id;			/* wire format, little-endian */
 	uint32_t peerid;		/* wire format, little-endian */
+	utime_t expack;			/* time before either data or a
+					 * keepalive is expected from the peer
+					 */
+	utime_t start;			/* whenever handshake completes (or
+					 * first hs while still tentative) */
+	utime_t rekeyat;		/* start of an early rekey if the
+					 * initiator */
+	struct peer *peer;
 	char initiator;
 	char kaset;			/* is the keepalive timer set? */
+	struct antireplay arrecv;	/* receive counter bitmap */
+} __attribute__((aligned(CACHELINESIZE)));
+
+/*
+ * Session timer in the timer wheel. "id" is the session id of the rekey or
+ * keepalive timer in host byte order. The peer is stored instead of the session
+ * since session slots are reused while their timers might still be pending and
+ * peers are never freed.
+ */
+struct timer {
+	LIST_ENTRY(timer) entry;
+	struct peer *peer;
+	uint64_t expires;		/* milliseconds */
+	uint32_t id;			/* host byte order */
+	int pending;
 };
 
+LIST_HEAD(timerlist, timer);
+
 struct cidraddr {
 	union sockaddr_inet addr;
 	struct in6_addr v6addrmasked;
@@ -154,11 +185,50 @@ struct cidraddr {
 	size_t prefixlen;
 };
 
-/* queued packet */
+/*
+ * Node in a path-compressed binary trie used for longest-prefix matching of
+ * allowedips. "key" is the masked network address in network byte order and
+ * "prefixlen" is the number of significant bits in "key". Nodes that only exist
+ * to branch have "cidraddr" and "peer" set to NULL.
+ */
+struct rtnode {
+	struct rtnode *child[2];
+	struct cidraddr *cidraddr;
+	struct peer *peer;
+	uint8_t key[16];
+	size_t prefixlen;
+};
+
+/*
+ * Session id index entry. Maps a live session id to the peer that uses it.
+ */
+struct sessidmap {
+	struct peer *peer;	/* NULL if the entry is not in use */
+	uint32_t id;		/* host byte order */
+};
+
+/*
+ * A datagram in the receive or send ring, "data" is suitably aligned for the
+ * WireGuard message structures.
+ */
+struct dgram {
+	size_t len;
+	uint8_t data[MAXBATCHMSG];
+};
+
+/* a transport data message of the receive ring that is being handled */
+struct rxdata {
+	struct msgwgdatahdr *mwdhdr;
+	size_t mwdsize;
+	struct session *sess;
+	uint64_t counter;
+	ssize_t payloadsize;	/* -1 if not authenticated */
+};
+
+/* queued packet, one slot in the pre-handshake ring of a peer */
 struct qpacket {
-	uint8_t *data;
 	size_t datasize;
-	SIMPLEQ_ENTRY(qpacket) qpackets;
+	uint8_t data[WSTUNMTU];
 };
 
 /*
@@ -169,26 +239,50 @@ struct portsock {
 	in_port_t p;	/* transport layer port in network byte order */
 };
 
+/*
+ * Peers are stored in "ifn->peers" by id, each one starts on a cache line. The
+ * fields used for each transport data message come first, including the id of
+ * the next session at the start of "sessnext", handshakes and configuration
+ * follow.
+ */
 struct peer {
-	char *name;
+	struct session *scurr;
+	struct session *sprev;
+	struct peerstats *stats;	/* counters in the stats page */
 	uint32_t id; /* peer id */
 	int sock; /* active socket */
+	struct sessnext sessnext;
 	int sockisv6;
-	size_t prefixlen;
-	union sockaddr_inet fsa;
+	int removed;	/* slot not in use, a spare or removed by a reload */
 	struct sesstent sesstent;
-	struct sessnext sessnext;
-	struct session *scurr;
-	struct session *sprev;
-	SIMPLEQ_HEAD(, qpacket) qpacketlist;
+	struct session *sessv;	/* two slots for the current and previous */
+	struct qpacket *qpacketv; /* ring of MAXQUEUEPACKETS slots */
+	size_t qpackethead;
 	size_t qpackets;
 	size_t qpacketsdatasz;
-	struct cidraddr **allowedips;
+	struct peer *fqnext;	/* next peer in the egress scheduler */
+	size_t fqdeficit;	/* bytes that may be sent in this round */
+	int fqactive;		/* in the egress scheduler */
+	struct peer *rknext;	/* next peer that waits for an early rekey */
+	int rkqueued;		/* waits for an early rekey */
+	struct timer timers[PEERTIMERS];
+	char *name;
+	union sockaddr_inet fsa;
+	struct cidraddr *allowedips;	/* consecutive in "allowedipsarena" */
 	size_t allowedipssize;
 	struct portsock *portsock6;
 	size_t portsock6count;
 	struct portsock *portsock4;
 	size_t portsock4count;
+} __attribute__((aligned(CACHELINESIZE)));
+
+/* new settings of a peer while a reload is in progress */
+struct peerreload {
+	struct cidraddr *allowedips;
+	size_t allowedipssize;
+	union sockaddr_inet fsa;
+	char name[sizeof(((struct speer *)0)->name)];
+	int found;
 };
 
 struct ifn {
@@ -203,39 +297,95 @@ struct ifn {
 	size_t laddr4count;
 	wskey mac1key;
 	wskey cookiekey;
-	struct peer **peers;
+	struct peer *peers;	/* indexed by peer id */
 	size_t peerssize;
+	struct rtnode *rt6;	/* allowedips routing tables */
+	struct rtnode *rt4;
+	size_t tunbudget;	/* max packets read from tund per event */
+	size_t fqquantum;	/* 0 if packets are sent in arrival order */
+	socklen_t sndbuf;	/* send buffer of peer sockets, 0 if default */
+	socklen_t rcvbuf;	/* receive buffer of peer sockets */
+	size_t worker;		/* index of this process, 0 owns the device */
+	size_t workers;		/* number of processes for this interface */
+	int workerports[MAXWORKERS]; /* worker 0: channel with each worker,
+				      * others: channel with worker 0 */
 };
 
 static uid_t uid;
 static gid_t gid;
 
-/* stats */
-static struct {
-	size_t devin; size_t devinerr; size_t devout; size_t devouterr;
-	    size_t devinsz; size_t devoutsz;
-	size_t queuein; size_t queueinerr; size_t queueout; size_t queueouterr;
-	    size_t queueinsz; size_t queueoutsz;
-	size_t sockin; size_t sockinerr; size_t sockout; size_t sockouterr;
-	    size_t sockinsz; size_t sockoutsz;
-	size_t initin; size_t initinerr; size_t initout; size_t initouterr;
-	size_t respin; size_t respinerr; size_t respout; size_t respouterr;
-	size_t proxin; size_t proxinerr; size_t proxout; size_t proxouterr;
-	size_t enclin; size_t enclinerr; size_t enclout; size_t enclouterr;
-	size_t corrupted;
-	size_t invalidmac;
-	size_t invalidpeer;
-} stats;
-
-static int kq, tund, pport, eport, doterm, logstats;
+/* counters, in the shared memory stats page if there is one */
+static struct statspage *statspage;
+static struct ifnstats *stats;
+
+static int kq, tund, pport, eport, mport, doterm, logstats;
 static struct ifn *ifn;
+static struct sessidmap *sessidmapv;
+static size_t sessidmapvsize;	/* power of two */
+static struct qpacket *qpacketarena; /* queue slots of all peers */
+static struct session *sessarena; /* two session slots per peer */
+static struct cidraddr *allowedipsarena; /* allowed ips of all peers */
 static uint8_t msg[MAXSCRATCH];
 static utime_t now;
+static struct wire_ring pring;	/* ring from the proxy, shm is NULL if none */
+static int pringpending;	/* ring not empty after a round */
+
+/*
+ * Hierarchical timer wheel with a resolution of one millisecond. Level "n"
+ * holds the timers that expire within TIMERSLOTS^(n + 1) ticks. Only the
+ * nearest deadline is armed as a kernel timer.
+ */
+static struct {
+	struct timerlist slots[TIMERLEVELS][TIMERSLOTS];
+	uint64_t curtick;	/* next tick to process in milliseconds */
+	uint64_t armed;		/* deadline of the kernel timer, 0 if none */
+	size_t pending;
+} wheel;
 static uint8_t nonce[16] = { 0 };
 static size_t sesscounter;
 
+/*
+ * Egress scheduler, only used if the fair queue quantum of the interface is
+ * set. Packets for peers with an active session are queued in the same ring
+ * that holds the packets of peers that wait for a handshake and are sent with
+ * deficit round-robin. The scheduler is run once after each drain of the tunnel
+ * descriptor so that every peer gets its whole turn in one batch, and early
+ * only if the queue of a peer is full.
+ */
+static struct peer *fqhead, *fqtail;
+
+/*
+ * Early rekeys of busy sessions are started at a random moment before
+ * REKEY_AFTER_TIME so that peers that came up together don't rekey together.
+ * At most MAXHSREQS handshake init requests may be outstanding at the enclave,
+ * "hsreqs" counts the tentative sessions in the INITREQ state. Early rekeys in
+ * excess of that wait in order in the list at "rkhead".
+ */
+static struct peer *rkhead, *rktail;
+static size_t hsreqs;
+
 static const EVP_AEAD *aead;
 
+/*
+ * Datagrams received from a peer socket are read into "rxring" at once and are
+ * handled in order, transport data goes through "rxdatav" in stages. Encrypted
+ * transport data messages are collected in "txring" and written to "txsock" at
+ * once as soon as the ring is full, another socket is used or after all events
+ * of a kevent call are handled.
+ */
+static struct dgram rxring[RECVBATCH];
+static struct rxdata rxdatav[RECVBATCH];
+static struct dgram txring[SENDBATCH];
+static size_t txcount;
+static int txsock = -1;
+
+#ifdef MSG_WAITFORONE /* recvmmsg(2) and sendmmsg(2) */
+static struct mmsghdr rxmsgv[RECVBATCH];
+static struct mmsghdr txmsgv[SENDBATCH];
+static struct iovec rxiov[RECVBATCH];
+static struct iovec txiov[SENDBATCH];
+#endif
+
 static void
 handlesig(int signo)
 {
@@ -292,9 +442,9 @@ logpeerinfo(const struct peer *peer)
 	logwarnx("%s   allowed ips %zu", ifn->ifname, peer->allowedipssize);
 	for (n = 0; n < peer->allowedipssize; n++) {
 		if (addrtostr(addrstr, sizeof(addrstr),
-		    (struct sockaddr *)&peer->allowedips[n]->addr, 1) != -1) {
+		    (struct sockaddr *)&peer->allowedips[n].addr, 1) != -1) {
 			logwarnx("%s   %s/%zu", ifn->ifname, addrstr,
-			    peer->allowedips[n]->prefixlen);
+			    peer->allowedips[n].prefixlen);
 		}
 	}
 
@@ -334,27 +484,27 @@ ifn_loginfo(void)
 	}
 
 	for (n = 0; n < ifn->peerssize; n++)
-		logpeerinfo(ifn->peers[n]);
+		logpeerinfo(&ifn->peers[n]);
 
 	logwarnx("%s stats packets in/out (errors in/out) [bytes in/out]", ifn->ifname);
-	logwarnx("%s   dev   %zu/%zu (%zu/%zu) %zu/%zu", ifn->ifname, stats.devin, stats.devout,
-	    stats.devinerr, stats.devouterr, stats.devinsz, stats.devoutsz);
-	logwarnx("%s   queue %zu/%zu (%zu/%zu) %zu/%zu", ifn->ifname, stats.queuein,
-	    stats.queueout, stats.queueinerr, stats.queueouterr,
-	    stats.queueinsz, stats.queueoutsz);
-	logwarnx("%s   sock  %zu/%zu (%zu/%zu) %zu/%zu", ifn->ifname, stats.sockin,
-	    stats.sockout, stats.sockinerr, stats.sockouterr, stats.sockinsz,
-	    stats.sockoutsz);
-	logwarnx("%s   init  %zu/%zu (%zu/%zu)", ifn->ifname, stats.initin, stats.initout,
-	    stats.initinerr, stats.initouterr);
-	logwarnx("%s   resp  %zu/%zu (%zu/%zu)", ifn->ifname, stats.respin, stats.respout,
-	    stats.respinerr, stats.respouterr);
-	logwarnx("%s   encl  %zu/%zu (%zu/%zu)", ifn->ifname, stats.enclin, stats.enclout,
-	    stats.enclinerr, stats.enclouterr);
-	logwarnx("%s   prox  %zu/%zu (%zu/%zu)", ifn->ifname, stats.proxin, stats.proxout,
-	    stats.proxinerr, stats.proxouterr);
+	logwarnx("%s   dev   %zu/%zu (%zu/%zu) %zu/%zu", ifn->ifname, stats->devin, stats->devout,
+	    stats->devinerr, stats->devouterr, stats->devinsz, stats->devoutsz);
+	logwarnx("%s   queue %zu/%zu (%zu/%zu) %zu/%zu", ifn->ifname, stats->queuein,
+	    stats->queueout, stats->queueinerr, stats->queueouterr,
+	    stats->queueinsz, stats->queueoutsz);
+	logwarnx("%s   sock  %zu/%zu (%zu/%zu) %zu/%zu", ifn->ifname, stats->sockin,
+	    stats->sockout, stats->sockinerr, stats->sockouterr, stats->sockinsz,
+	    stats->sockoutsz);
+	logwarnx("%s   init  %zu/%zu (%zu/%zu)", ifn->ifname, stats->initin, stats->initout,
+	    stats->initinerr, stats->initouterr);
+	logwarnx("%s   resp  %zu/%zu (%zu/%zu)", ifn->ifname, stats->respin, stats->respout,
+	    stats->respinerr, stats->respouterr);
+	logwarnx("%s   encl  %zu/%zu (%zu/%zu)", ifn->ifname, stats->enclin, stats->enclout,
+	    stats->enclinerr, stats->enclouterr);
+	logwarnx("%s   prox  %zu/%zu (%zu/%zu)", ifn->ifname, stats->proxin, stats->proxout,
+	    stats->proxinerr, stats->proxouterr);
 	logwarnx("%s   total corrupted/invalid mac/invalid peer %zu/%zu/%zu", ifn->ifname,
-	    stats.corrupted, stats.invalidmac, stats.invalidpeer);
+	    stats->corrupted, stats->invalidmac, stats->invalidpeer);
 }
 
 /*
@@ -486,35 +636,101 @@ assignaddr(const char *ifname, const struct cidraddr *ca)
 }
 
 /*
- * Find a peer by "sessid". Return 1 if found and updates "peer" to point to it.
- * 0 if not found.
+ * Return 1 if "peer" is served by this worker, 0 if it is served by another
+ * worker of the same interface.
+ */
+static int
+peerowned(const struct peer *peer)
+{
+	return peer->id % ifn->workers == ifn->worker;
+}
+
+/*
+ * Return the home index of session id "id" in the session id index. Session ids
+ * are random but spread them with a multiplicative hash anyway.
+ */
+static size_t
+sessidmaphome(uint32_t id)
+{
+	return (id * 2654435761U) & (sessidmapvsize - 1);
+}
+
+/*
+ * Map session id "id" in host byte order to "peer". If "id" is already mapped,
+ * the mapping is updated.
  *
- * XXX log(n)
+ * There are at most four live session ids per peer and the index is sized
+ * accordingly in recvconfig, so it never fills up.
+ */
+static void
+sessidmapput(uint32_t id, struct peer *peer)
+{
+	size_t n;
+
+	n = sessidmaphome(id);
+	while (sessidmapv[n].peer != NULL && sessidmapv[n].id != id)
+		n = (n + 1) & (sessidmapvsize - 1);
+
+	sessidmapv[n].peer = peer;
+	sessidmapv[n].id = id;
+}
+
+/*
+ * Remove the mapping of session id "id" in host byte order if it belongs to
+ * "peer". Session ids of other peers are left alone.
+ */
+static void
+sessidmapdel(uint32_t id, const struct peer *peer)
+{
+	size_t n, m, home;
+
+	n = sessidmaphome(id);
+	while (sessidmapv[n].peer != NULL && sessidmapv[n].id != id)
+		n = (n + 1) & (sessidmapvsize - 1);
+
+	if (sessidmapv[n].peer != peer)
+		return;
+
+	/*
+	 * Shift back any following entries that would otherwise become
+	 * unreachable so that lookups can stop at the first empty entry.
+	 */
+	m = n;
+	for (;;) {
+		sessidmapv[n].peer = NULL;
+
+		do {
+			m = (m + 1) & (sessidmapvsize - 1);
+			if (sessidmapv[m].peer == NULL)
+				return;
+			home = sessidmaphome(sessidmapv[m].id);
+		} while (n <= m ? (n < home && home <= m) :
+		    (n < home || home <= m));
+
+		sessidmapv[n] = sessidmapv[m];
+		n = m;
+	}
+}
+
+/*
+ * Find a peer by "sessid" in wire format. Return 1 if found and updates "peer"
+ * to point to it. 0 if not found.
  */
 static int
 findpeerbysessid(uint32_t sessid, struct peer **peer)
 {
-	struct peer *p;
 	size_t n;
+	uint32_t id;
 
-	for (n = 0; n < ifn->peerssize; n++) {
-		p = ifn->peers[n];
-		if (p->sesstent.id >= 0 && le32toh(sessid) == p->sesstent.id) {
-			*peer = p;
-			return 1;
-		}
-		if (p->sessnext.id >= 0 && le32toh(sessid) == p->sessnext.id) {
-			*peer = p;
-			return 1;
-		}
-		if (p->scurr && sessid == p->scurr->id) {
-			*peer = p;
-			return 1;
-		}
-		if (p->sprev && sessid == p->sprev->id) {
-			*peer = p;
+	id = le32toh(sessid);
+
+	n = sessidmaphome(id);
+	while (sessidmapv[n].peer != NULL) {
+		if (sessidmapv[n].id == id) {
+			*peer = sessidmapv[n].peer;
 			return 1;
 		}
+		n = (n + 1) & (sessidmapvsize - 1);
 	}
 
 	return 0;
@@ -598,7 +814,7 @@ findpeer(uint32_t peerid, struct peer **p)
 	if (peerid >= ifn->peerssize)
 		return 0;
 
-	*p = ifn->peers[peerid];
+	*p = &ifn->peers[peerid];
 	return 1;
 }
 
@@ -633,107 +849,301 @@ maskip6(struct in6_addr *out, const struct in6_addr *in, size_t prefixlen,
 }
 
 /*
- * Find a peer with most specific "allowedips" by a remote address. "fa" must
- * be a pointer to the foreign address. If multiple allowedips match the same
- * mask or prefix length, the last one is choosen.
+ * Return bit "n" of "key", counting from the most significant bit of the first
+ * byte.
+ */
+static int
+rtbit(const uint8_t *key, size_t n)
+{
+	return (key[n / 8] >> (7 - n % 8)) & 1;
+}
+
+/*
+ * Return the number of leading bits "a" and "b" have in common, with a maximum
+ * of "maxbits".
+ */
+static size_t
+rtcommonbits(const uint8_t *a, const uint8_t *b, size_t maxbits)
+{
+	size_t n;
+	uint8_t x;
+
+	for (n = 0; n < maxbits / 8; n++) {
+		if (a[n] != b[n])
+			break;
+	}
+
+	n *= 8;
+	if (n >= maxbits)
+		return maxbits;
+
+	x = a[n / 8] ^ b[n / 8];
+	while (n < maxbits && (x & (0x80 >> n % 8)) == 0)
+		n++;
+
+	return n;
+}
+
+/*
+ * Allocate a new trie node with the first "prefixlen" bits of "key". Any
+ * trailing bits are zeroed.
  *
- * Return 1 if a peer with a matching route is found and updates "peer" to point
- * to it as well as "addr" to the addr that matched. Returns 0 if no peer is
- * found and updates "peer" and "addr" to NULL.
+ * Exit on failure.
+ */
+static struct rtnode *
+xrtnodenew(const uint8_t *key, size_t prefixlen, struct peer *peer,
+    struct cidraddr *cidraddr)
+{
+	struct rtnode *node;
+
+	assert(prefixlen <= 128);
+
+	if ((node = calloc(1, sizeof(*node))) == NULL) {
+		logwarn("%s calloc rtnode", ifn->ifname);
+		exit(1);
+	}
+
+	memcpy(node->key, key, (prefixlen + 7) / 8);
+	if (prefixlen % 8)
+		node->key[prefixlen / 8] &= 0xff << (8 - prefixlen % 8);
+
+	node->prefixlen = prefixlen;
+	node->peer = peer;
+	node->cidraddr = cidraddr;
+
+	return node;
+}
+
+/*
+ * Add route "cidraddr" of "peer" to the trie at "root". "key" must be the
+ * masked network address with a length of at least "prefixlen" bits.
  *
- * XXX log(n)
+ * Return 0 on success, -1 if another peer already has a route with exactly the
+ * same address and prefixlen. If the same peer has a duplicate route, the last
+ * one is used.
+ *
+ * Exit on failure.
  */
 static int
-peerbyroute6(struct peer **peer, struct cidraddr **addr,
-    const struct in6_addr *fa)
+rtinsert(struct rtnode **root, const uint8_t *key, size_t prefixlen,
+    struct peer *peer, struct cidraddr *cidraddr)
 {
-	struct cidraddr *allowedip;
-	struct in6_addr famasked;
-	struct peer *p;
-	size_t maxprefixlen;
+	struct rtnode *node, *newnode, *branch;
+	size_t cb;
 
-	size_t n, o;
+	while (*root != NULL) {
+		node = *root;
 
-	maxprefixlen = 0;
-	*peer = NULL;
-	*addr = NULL;
+		cb = rtcommonbits(node->key, key,
+		    MIN(node->prefixlen, prefixlen));
 
-	for (n = 0; n < ifn->peerssize; n++) {
-		p = ifn->peers[n];
+		if (cb == node->prefixlen && cb == prefixlen) {
+			if (node->cidraddr != NULL && node->peer != peer)
+				return -1;
 
-		for (o = 0; o < p->allowedipssize; o++) {
-			allowedip = p->allowedips[o];
+			node->peer = peer;
+			node->cidraddr = cidraddr;
+			return 0;
+		}
 
-			if (allowedip->addr.h.family != AF_INET6)
-				continue;
+		if (cb == node->prefixlen) {
+			/* node is a less specific prefix, descend */
+			root = &node->child[rtbit(key, cb)];
+			continue;
+		}
 
-			/* XXX once it works, don't zero out postfix */
-			maskip6(&famasked, fa, allowedip->prefixlen, 1);
+		newnode = xrtnodenew(key, prefixlen, peer, cidraddr);
 
-			if (memcmp(&famasked, &allowedip->v6addrmasked, 16) == 0
-			    && allowedip->prefixlen >= maxprefixlen) {
-				*peer = p;
-				*addr = allowedip;
-				maxprefixlen = allowedip->prefixlen;
-			}
+		if (cb == prefixlen) {
+			/* the new route is a less specific prefix of node */
+			newnode->child[rtbit(node->key, cb)] = node;
+			*root = newnode;
+			return 0;
 		}
-	}
 
-	if (*peer != NULL)
-		return 1;
+		/* node and the new route diverge at bit cb */
+		branch = xrtnodenew(key, cb, NULL, NULL);
+		branch->child[rtbit(key, cb)] = newnode;
+		branch->child[rtbit(node->key, cb)] = node;
+		*root = branch;
+		return 0;
+	}
 
+	*root = xrtnodenew(key, prefixlen, peer, cidraddr);
 	return 0;
 }
 
 /*
- * Find a peer based on its allowed ips and the address "fa". "fa" must be in
- * network byte order. The first most-specific match is returned.
+ * Free all nodes of the trie at "root".
+ */
+static void
+rtfree(struct rtnode *root)
+{
+	if (root == NULL)
+		return;
+
+	rtfree(root->child[0]);
+	rtfree(root->child[1]);
+	free(root);
+}
+
+/*
+ * Pre-calculate the masks of "allowedip" and add it as a route of "peer" to
+ * the trie at "rt6" or "rt4", depending on the address family.
  *
- * Return 1 if a peer with a matching route is found and updates "peer" to point
- * to it as well as "addr" to the addr that matched. Returns 0 if no peer is
- * found and updates "peer" and "addr" to NULL.
+ * Return 0 on success, -1 if the address family is unknown or if another peer
+ * already has a route with exactly the same address and prefixlen.
  *
- * XXX log(n)
+ * Exit on failure.
  */
 static int
-peerbyroute4(struct peer **peer, struct cidraddr **addr,
-    const struct in_addr *fa)
+routeadd(struct rtnode **rt6, struct rtnode **rt4, struct peer *peer,
+    struct cidraddr *allowedip)
 {
-	struct cidraddr *allowedip;
-	struct peer *p;
-	size_t maxprefixlen;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	char addrp[INET6_ADDRSTRLEN];
 
-	size_t n, o;
+	if (allowedip->addr.h.family == AF_INET6) {
+		sin6 = (struct sockaddr_in6 *)&allowedip->addr;
+		maskip6(&allowedip->v6addrmasked, &sin6->sin6_addr,
+		    allowedip->prefixlen, 1);
 
-	maxprefixlen = 0;
-	*peer = NULL;
-	*addr = NULL;
+		if (inet_ntop(AF_INET6, &sin6->sin6_addr, addrp, sizeof(addrp))
+		    == NULL) {
+			logwarn("%s inet_ntop on v6 allowedip failed",
+			    ifn->ifname);
+			exit(1);
+		}
 
-	for (n = 0; n < ifn->peerssize; n++) {
-		p = ifn->peers[n];
+		if (rtinsert(rt6, (uint8_t *)&allowedip->v6addrmasked,
+		    allowedip->prefixlen, peer, allowedip) == -1) {
+			logwarnx("%s multiple allowedips with the same address "
+			    "and prefixlen: %s/%zu", ifn->ifname, addrp,
+			    allowedip->prefixlen);
+			return -1;
+		}
+	} else if (allowedip->addr.h.family == AF_INET) {
+		assert(allowedip->prefixlen <= 32);
 
-		for (o = 0; o < p->allowedipssize; o++) {
-			allowedip = p->allowedips[o];
+		allowedip->v4mask.s_addr = htonl(((1ULL << 32) - 1) <<
+		    (32 - allowedip->prefixlen));
 
-			if (allowedip->addr.h.family != AF_INET)
-				continue;
+		sin = (struct sockaddr_in *)&allowedip->addr;
+		allowedip->v4addrmasked.s_addr = sin->sin_addr.s_addr &
+		    allowedip->v4mask.s_addr;
 
-			if ((fa->s_addr & allowedip->v4mask.s_addr) ==
-			    allowedip->v4addrmasked.s_addr &&
-			    allowedip->prefixlen >= maxprefixlen) {
-				*peer = p;
-				*addr = allowedip;
-				maxprefixlen = allowedip->prefixlen;
-			}
+		if (inet_ntop(AF_INET, &sin->sin_addr, addrp, sizeof(addrp))
+		    == NULL) {
+			logwarn("%s inet_ntop on v4 allowedip failed",
+			    ifn->ifname);
+			exit(1);
+		}
+
+		if (rtinsert(rt4, (uint8_t *)&allowedip->v4addrmasked,
+		    allowedip->prefixlen, peer, allowedip) == -1) {
+			logwarnx("%s multiple allowedips with the same address "
+			    "and prefixlen: %s/%zu", ifn->ifname, addrp,
+			    allowedip->prefixlen);
+			return -1;
 		}
+	} else {
+		logwarnx("%s %s allowedip unknown address family",
+		    ifn->ifname, peer->name);
+		return -1;
 	}
 
-	if (*peer != NULL)
-		return 1;
+	if (verbose > 1)
+		loginfox("%s %s allowedip %s/%zu", ifn->ifname, peer->name,
+		    addrp, allowedip->prefixlen);
 
 	return 0;
 }
 
+/*
+ * Find the most specific route for "key" in the trie at "root". "maxbits" is
+ * the length of "key" in bits.
+ *
+ * Return the node with the matching route or NULL if no route matches.
+ */
+static const struct rtnode *
+rtlookup(const struct rtnode *root, const uint8_t *key, size_t maxbits)
+{
+	const struct rtnode *node, *match;
+
+	match = NULL;
+	node = root;
+
+	while (node != NULL && node->prefixlen <= maxbits && rtcommonbits(
+	    node->key, key, node->prefixlen) == node->prefixlen) {
+		if (node->cidraddr != NULL)
+			match = node;
+
+		if (node->prefixlen == maxbits)
+			break;
+
+		node = node->child[rtbit(key, node->prefixlen)];
+	}
+
+	return match;
+}
+
+/*
+ * Find a peer with most specific "allowedips" by a remote address. "fa" must
+ * be a pointer to the foreign address.
+ *
+ * Return 1 if a peer with a matching route is found and updates "peer" to point
+ * to it as well as "addr" to the addr that matched. Returns 0 if no peer is
+ * found and updates "peer" and "addr" to NULL.
+ */
+static int
+peerbyroute6(struct peer **peer, struct cidraddr **addr,
+    const struct in6_addr *fa)
+{
+	const struct rtnode *node;
+
+	HISTSTART(statspage, HISTROUTE);
+	node = rtlookup(ifn->rt6, (const uint8_t *)fa, 128);
+	HISTSTOP(statspage, HISTROUTE);
+	if (node == NULL) {
+		*peer = NULL;
+		*addr = NULL;
+		return 0;
+	}
+
+	*peer = node->peer;
+	*addr = node->cidraddr;
+	return 1;
+}
+
+/*
+ * Find a peer based on its allowed ips and the address "fa". "fa" must be in
+ * network byte order. The most-specific match is returned.
+ *
+ * Return 1 if a peer with a matching route is found and updates "peer" to point
+ * to it as well as "addr" to the addr that matched. Returns 0 if no peer is
+ * found and updates "peer" and "addr" to NULL.
+ */
+static int
+peerbyroute4(struct peer **peer, struct cidraddr **addr,
+    const struct in_addr *fa)
+{
+	const struct rtnode *node;
+
+	HISTSTART(statspage, HISTROUTE);
+	node = rtlookup(ifn->rt4, (const uint8_t *)fa, 32);
+	HISTSTOP(statspage, HISTROUTE);
+	if (node == NULL) {
+		*peer = NULL;
+		*addr = NULL;
+		return 0;
+	}
+
+	*peer = node->peer;
+	*addr = node->cidraddr;
+	return 1;
+}
+
 /*
  * Fill in an IPv6 socket addresss structure.
  *
@@ -900,7 +1310,132 @@ addrtoport(const struct sockaddr *addr, int isv6, in_port_t porthint)
 }
 
 /*
- * Disconnect and deregister the active socket of a peer by connecting it to a
+ * Prepare the message headers used for batched receiving and sending.
+ */
+static void
+batchinit(void)
+{
+#ifdef MSG_WAITFORONE
+	size_t n;
+
+	for (n = 0; n < RECVBATCH; n++) {
+		rxiov[n].iov_base = rxring[n].data;
+		rxiov[n].iov_len = sizeof(rxring[n].data);
+		rxmsgv[n].msg_hdr.msg_iov = &rxiov[n];
+		rxmsgv[n].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (n = 0; n < SENDBATCH; n++) {
+		txiov[n].iov_base = txring[n].data;
+		txmsgv[n].msg_hdr.msg_iov = &txiov[n];
+		txmsgv[n].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+}
+
+/*
+ * Read up to RECVBATCH datagrams from socket "s" into "rxring" without
+ * blocking. Datagrams that do not fit in a ring slot are discarded by the
+ * kernel and have their length set to 0.
+ *
+ * Return the number of datagrams read, or -1 on error with errno set.
+ */
+static int
+recvbatch(int s)
+{
+#ifdef MSG_WAITFORONE
+	int i, n;
+
+	n = recvmmsg(s, rxmsgv, RECVBATCH, MSG_DONTWAIT, NULL);
+	if (n == -1)
+		return errno == EAGAIN ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		if (rxmsgv[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			rxring[i].len = 0;
+		} else {
+			rxring[i].len = rxmsgv[i].msg_len;
+		}
+	}
+#else
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t rc;
+	int n;
+
+	for (n = 0; n < RECVBATCH; n++) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = rxring[n].data;
+		iov.iov_len = sizeof(rxring[n].data);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+
+		rc = recvmsg(s, &mh, MSG_DONTWAIT);
+		if (rc == -1) {
+			if (n == 0 && errno != EAGAIN)
+				return -1;
+			break;
+		}
+
+		if (mh.msg_flags & MSG_TRUNC) {
+			rxring[n].len = 0;
+		} else {
+			rxring[n].len = rc;
+		}
+	}
+#endif
+
+	return n;
+}
+
+/*
+ * Write all datagrams in "txring" to "txsock" and empty the ring. A datagram
+ * that can not be sent is counted and skipped so that the rest of the ring is
+ * still sent.
+ */
+static void
+txflush(void)
+{
+	size_t n, sent, errs;
+	int rc, saved_errno;
+
+	errs = 0;
+	saved_errno = 0;
+
+	HISTSTART(statspage, HISTSOCKWRITE);
+	for (sent = 0; sent < txcount; sent += rc) {
+#ifdef MSG_WAITFORONE
+		rc = sendmmsg(txsock, &txmsgv[sent], txcount - sent, 0);
+#else
+		rc = write(txsock, txring[sent].data, txring[sent].len) == -1 ?
+		    -1 : 1;
+#endif
+		if (rc <= 0) {
+			saved_errno = errno;
+			errs++;
+			rc = 1;
+			continue;
+		}
+
+		for (n = sent; n < sent + rc; n++) {
+			stats->sockout++;
+			stats->sockoutsz += txring[n].len - DATAHEADERLEN;
+		}
+	}
+	HISTSTOP(statspage, HISTSOCKWRITE);
+
+	if (errs > 0) {
+		errno = saved_errno;
+		logwarn("%s error sending %zu data messages", ifn->ifname,
+		    errs);
+		stats->sockouterr += errs;
+	}
+
+	txcount = 0;
+}
+
+/*
+ * Disconnect and deregister the active socket of a peer by connecting it to a
  * reserved port on the localhost so that it can be used later to connect to a
  * new address, and stop listening for any events that might happen (triggered
  * by a /rogue/ local process).
@@ -923,6 +1458,10 @@ peerpark(struct peer *peer)
 		return -1;
 	}
 
+	/* don't send pending data to the parking address */
+	if (txcount > 0 && txsock == peer->sock)
+		txflush();
+
 	/*
 	 * Stop listening for anything that might be sent to this
 	 * socket. If no read filter was set (yet) on a descriptor EBADF is
@@ -1118,7 +1657,7 @@ peerconnect(struct peer *peer, const struct sockaddr *faddr)
 		loginfox("%s %s socket connected %s -> %s", ifn->ifname,
 		    peer->name, addrstr1, addrstr2);
 
-	EV_SET(&ev, peer->sock, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	EV_SET(&ev, peer->sock, EVFILT_READ, EV_ADD, 0, 0, peer);
 	if (kevent(kq, &ev, 1, NULL, 0, NULL) == -1) {
 		logwarn("%s %s %s kevent error", ifn->ifname, peer->name,
 		    __func__);
@@ -1129,39 +1668,96 @@ peerconnect(struct peer *peer, const struct sockaddr *faddr)
 }
 
 /*
- * Schedule a one-shot timer.
+ * Put timer "t" in the slot of the timer wheel that corresponds with its
+ * expiry. Timers beyond the range of the wheel are put in the last slot of the
+ * highest level and are redistributed when that slot is cascaded.
+ */
+static void
+wheeladd(struct timer *t)
+{
+	uint64_t delta, expires;
+	int level;
+
+	expires = t->expires;
+	if (expires < wheel.curtick)
+		expires = wheel.curtick;
+
+	delta = expires - wheel.curtick;
+	if (delta >= (uint64_t)1 << (TIMERBITS * TIMERLEVELS)) {
+		delta = ((uint64_t)1 << (TIMERBITS * TIMERLEVELS)) - 1;
+		expires = wheel.curtick + delta;
+	}
+
+	for (level = 0; level < TIMERLEVELS - 1; level++)
+		if (delta < (uint64_t)1 << (TIMERBITS * (level + 1)))
+			break;
+
+	LIST_INSERT_HEAD(&wheel.slots[level][(expires >> (TIMERBITS * level)) &
+	    (TIMERSLOTS - 1)], t, entry);
+}
+
+/*
+ * Schedule a one-shot timer for a session of "peer".
+ *
+ * The timer is only added to the timer wheel. If it expires before the kernel
+ * timer that is currently armed, the kernel timer is rearmed on the next
+ * iteration of the event loop.
  *
  * Note that if a timer with the same id is already set, this call has no
  * effect. The existing timer will *not* be updated and a new timer will not be
  * added.
  */
 static void
-settimer(unsigned int id, utime_t usec)
+settimer(unsigned int id, utime_t usec, struct peer *peer)
 {
-	struct kevent ev;
+	struct timer *t;
+	size_t n;
+
+	t = NULL;
+	for (n = 0; n < PEERTIMERS; n++) {
+		if (peer->timers[n].pending) {
+			if (peer->timers[n].id == id)
+				return;
+		} else if (t == NULL) {
+			t = &peer->timers[n];
+		}
+	}
+
+	if (t == NULL) {
+		logwarnx("%s %s %x no free timer", ifn->ifname, peer->name, id);
+		return;
+	}
 
-	EV_SET(&ev, id, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, usec / 1000,
-	    NULL);
+	t->peer = peer;
+	t->id = id;
+	t->expires = (now + usec + 999) / 1000;
+	t->pending = 1;
+	wheel.pending++;
 
-	assert(kevent(kq, &ev, 1, NULL, 0, NULL) != -1);
+	wheeladd(t);
+
+	if (wheel.armed > t->expires)
+		wheel.armed = 0;
 }
 
 /*
- * Clear a rekey or keepalive timer.
- *
- * Return 0 on success, -1 on error with errno set.
+ * Clear a rekey or keepalive timer of "peer", if set.
  */
-static int
-cleartimer(unsigned int id)
+static void
+cleartimer(unsigned int id, struct peer *peer)
 {
-	struct kevent ev;
-
-	EV_SET(&ev, id, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
-
-	if (kevent(kq, &ev, 1, NULL, 0, NULL) == -1 && errno != ENOENT)
-		return -1;
+	struct timer *t;
+	size_t n;
 
-	return 0;
+	for (n = 0; n < PEERTIMERS; n++) {
+		t = &peer->timers[n];
+		if (t->pending && t->id == id) {
+			LIST_REMOVE(t, entry);
+			t->pending = 0;
+			wheel.pending--;
+			return;
+		}
+	}
 }
 
 /*
@@ -1179,17 +1775,17 @@ notifyproxy(uint32_t peerid, uint32_t sessid, enum sessidtype type)
 
 	if (wire_sendpeeridmsg(pport, peerid, MSGSESSID, &msi, sizeof(msi))
 	    == -1) {
-		stats.proxouterr++;
+		stats->proxouterr++;
 		return -1;
 	}
 
-	stats.proxout++;
+	stats->proxout++;
 	return 0;
 }
 
 /*
- * Wipe and securely free a current or previous session. Destroys keys, timers
- * and notifies the proxy of the invalidated session id.
+ * Wipe a current or previous session so that its slot can be reused. Destroys
+ * keys, timers and notifies the proxy of the invalidated session id.
  *
  * Call this function whenever a session reaches the time or number of messages
  * limit.
@@ -1211,17 +1807,17 @@ sessdestroy(struct session *sess)
 	 * calling of this function.
 	 */
 	if (sess->kaset) {
-		if (cleartimer(le32toh(sess->id)) == -1) {
-			logwarn("%s %s %x cleartimer error", ifn->ifname,
-			    peer->name, le32toh(sess->id));
-		} else if (verbose > 2) {
+		cleartimer(le32toh(sess->id), peer);
+
+		if (verbose > 2)
 			logdebugx("%s %s %x keepalive timeout cleared %zu",
 			    ifn->ifname, peer->name, le32toh(sess->id),
 			    sesscounter);
-		}
 	}
 
-	freezero(sess, sizeof(struct session));
+	sessidmapdel(le32toh(sessid), peer);
+
+	explicit_bzero(sess, sizeof(struct session));
 	sesscounter--;
 
 	if (notifyproxy(peer->id, sessid, SESSIDDESTROY) == -1)
@@ -1229,6 +1825,23 @@ sessdestroy(struct session *sess)
 		    "failed", ifn->ifname, peer->name, le32toh(sessid));
 }
 
+/*
+ * Set the state of the tentative session of "peer" and keep count of the
+ * number of outstanding handshake init requests.
+ */
+static void
+sesstentsetstate(struct peer *peer, int state)
+{
+	if (peer->sesstent.state == INITREQ && state != INITREQ) {
+		assert(hsreqs > 0);
+		hsreqs--;
+	} else if (peer->sesstent.state != INITREQ && state == INITREQ) {
+		hsreqs++;
+	}
+
+	peer->sesstent.state = state;
+}
+
 /*
  * Request a new handshake init message from the enclave.
  */
@@ -1254,14 +1867,23 @@ sendreqhsinit(struct peer *peer)
 	 * Since the rekey timer is set by session id, we need one even though
 	 * the session id will be overwritten by one from the enclave later on.
 	 */
+	if (peer->sesstent.id >= 0) {
+		sessidmapdel(peer->sesstent.id, peer);
+		cleartimer(peer->sesstent.id, peer);
+	}
+
 	peer->sesstent.id = arc4random();
-	settimer(peer->sesstent.id, REKEY_TIMEOUT);
+	sessidmapput(peer->sesstent.id, peer);
+	settimer(peer->sesstent.id, REKEY_TIMEOUT, peer);
+
+	peer->stats->hsinit++;
+	peer->stats->hsstart = now;
 
 	if (verbose > 1)
 		loginfox("%s %s %x rekey timeout set to %d ms", ifn->ifname,
 		    peer->name, peer->sesstent.id, REKEY_TIMEOUT / 1000);
 
-	peer->sesstent.state = INITREQ;
+	sesstentsetstate(peer, INITREQ);
 }
 
 /*
@@ -1277,6 +1899,61 @@ ensurehs(struct peer *peer)
 	peer->sesstent.lastreq = now;
 }
 
+/*
+ * Start an early rekey of "peer" if not too many handshake init requests are
+ * outstanding, otherwise wait for a turn in rekeyrun. Only peers that send
+ * data get here, so handshakes are spent on peers that actively carry traffic.
+ */
+static void
+rekeyrequest(struct peer *peer)
+{
+	if (peer->sesstent.state != STINACTIVE || peer->rkqueued)
+		return;
+
+	if (hsreqs < MAXHSREQS && rkhead == NULL) {
+		ensurehs(peer);
+		return;
+	}
+
+	if (verbose > 1)
+		loginfox("%s %s early rekey deferred, %zu requests outstanding",
+		    ifn->ifname, peer->name, hsreqs);
+
+	peer->rkqueued = 1;
+	peer->rknext = NULL;
+	if (rktail == NULL) {
+		rkhead = peer;
+	} else {
+		rktail->rknext = peer;
+	}
+	rktail = peer;
+}
+
+/*
+ * Start the early rekeys that are waiting for their turn, as long as not too
+ * many handshake init requests are outstanding. Skip peers that started a
+ * handshake in the mean time or that no longer have a current session.
+ */
+static void
+rekeyrun(void)
+{
+	struct peer *peer;
+
+	while (hsreqs < MAXHSREQS && (peer = rkhead) != NULL) {
+		rkhead = peer->rknext;
+		if (rkhead == NULL)
+			rktail = NULL;
+		peer->rknext = NULL;
+		peer->rkqueued = 0;
+
+		if (peer->removed || peer->sesstent.state != STINACTIVE ||
+		    peer->scurr == NULL)
+			continue;
+
+		ensurehs(peer);
+	}
+}
+
 /*
  * Determine if a current or previous session can be used for sending or
  * receiving data. There are time based and message based limits, as well as
@@ -1334,16 +2011,17 @@ static void
 sesstentclear(struct peer *peer, int timerset)
 {
 	if (timerset) {
-		if (cleartimer(peer->sesstent.id) == -1) {
-			logwarn("%s %s [%x] %s cleartimer error", ifn->ifname,
-			    peer->name, peer->sesstent.id, __func__);
-		} else if (verbose > 1) {
+		cleartimer(peer->sesstent.id, peer);
+
+		if (verbose > 1)
 			loginfox("%s %s [%x] rekey timeout cleared",
 			    ifn->ifname, peer->name, peer->sesstent.id);
-		}
 	}
 
-	peer->sesstent.state = STINACTIVE;
+	if (peer->sesstent.id >= 0)
+		sessidmapdel(peer->sesstent.id, peer);
+
+	sesstentsetstate(peer, STINACTIVE);
 	peer->sesstent.id = -1;
 	peer->sesstent.lastreq = 0;
 }
@@ -1356,6 +2034,9 @@ sessnextclear(struct peer *peer, int keysset)
 		EVP_AEAD_CTX_cleanup(&peer->sessnext.recvctx);
 	}
 
+	if (peer->sessnext.id >= 0)
+		sessidmapdel(peer->sessnext.id, peer);
+
 	peer->sessnext.state = SNINACTIVE;
 	peer->sessnext.id = -1;
 	peer->sessnext.peerid = -1;
@@ -1364,15 +2045,12 @@ sessnextclear(struct peer *peer, int keysset)
 }
 
 /*
- * Initialize a newly allocated current slot based on the "peer"s next session.
- * If a current session already exists, roll it into prev, if a previous session
- * exists, destroy and free it.
- *
- * Allocate new memory to randomize the position on the heap.
- *
- * Return 0 on success and -1 on error with errno set.
+ * Make room for a new current session of "peer". If a current session already
+ * exists, roll it into prev, if a previous session exists, destroy it. The
+ * current session takes the slot that is not in use by prev, the caller must
+ * initialize it.
  */
-static int
+static void
 rollcurrsess(struct peer *peer)
 {
 	if (peer->sprev) {
@@ -1382,30 +2060,30 @@ rollcurrsess(struct peer *peer)
 
 	peer->sprev = peer->scurr;
 
-	if ((peer->scurr = malloc(sizeof(struct session))) == NULL)
-		return -1;
-
-	return 0;
+	if (peer->sprev == &peer->sessv[0])
+		peer->scurr = &peer->sessv[1];
+	else
+		peer->scurr = &peer->sessv[0];
 }
 
 /*
- * Initialize a newly allocated current slot based on the "peer"s tent session.
- * If a current session already exists, roll it into prev, if a previous session
- * exists, destroy and free it. Also notify the proxy of the new current
- * session.
+ * Initialize a new current slot based on the "peer"s tent session. If a current
+ * session already exists, roll it into prev, if a previous session exists,
+ * destroy it. Also notify the proxy of the new current session.
  *
  * Return 0 on success, -1 on failure.
  */
 static int
 maketentcurr(struct peer *peer, const struct msgsesskeys *msk)
 {
-	if (rollcurrsess(peer) == -1)
-		return -1;
+	rollcurrsess(peer);
 
 	peer->scurr->initiator = 1;
 	peer->scurr->id = htole32(peer->sesstent.id);
 	peer->scurr->peerid = msk->peersessid;
 	peer->scurr->start = now;
+	peer->scurr->rekeyat = now + REKEY_AFTER_TIME -
+	    arc4random_uniform(REKEYJITTER);
 	peer->scurr->peer = peer;
 	peer->scurr->kaset = 0;
 	peer->scurr->expack = 0;
@@ -1421,23 +2099,22 @@ maketentcurr(struct peer *peer, const struct msgsesskeys *msk)
 		return -1;
 
 	sesstentclear(peer, 1);
+	sessidmapput(le32toh(peer->scurr->id), peer);
 
 	return 0;
 }
 
 /*
- * Initialize a newly allocated current slot based on the "peer"s next session.
- * If a current session already exists, roll it into prev, if a previous session
- * exists, destroy and free it. Also notify the proxy of the new current
- * session.
+ * Initialize a new current slot based on the "peer"s next session. If a current
+ * session already exists, roll it into prev, if a previous session exists,
+ * destroy it. Also notify the proxy of the new current session.
  *
  * Return 0 on success, -1 on failure.
  */
 static int
 makenextcurr(struct peer *peer)
 {
-	if (rollcurrsess(peer) == -1)
-		return -1;
+	rollcurrsess(peer);
 
 	peer->scurr->initiator = 0;
 	peer->scurr->id = htole32(peer->sessnext.id);
@@ -1457,52 +2134,7 @@ makenextcurr(struct peer *peer)
 	peer->sessnext.id = -1;
 	peer->sessnext.peerid = -1;
 
-	return 0;
-}
-
-/*
- * Send a MSGWGDATA message. The caller is responsible for encrypting "packet".
- *
- * Output format: WireGuard Transport Data Message
- *
- * Return 0 on success, -1 on error.
- */
-static int
-sendwgdatamsg(int s, uint32_t receiver, uint64_t counter, const uint8_t *packet,
-    size_t packetsize)
-{
-	static struct iovec iov[4];
-	static uint64_t lecounter;
-	static uint32_t mtcode;
-	ssize_t rc;
-
-	lecounter = htole64(counter);
-	mtcode = htole32(4);
-
-	/* empty data packets still have a 16 byte authentication tag */
-	if (packetsize < 16)
-		return -1;
-
-	iov[0].iov_base = &mtcode;
-	iov[0].iov_len = sizeof(mtcode);
-
-	iov[1].iov_base = &receiver;
-	iov[1].iov_len = sizeof(receiver);
-
-	iov[2].iov_base = &lecounter;
-	iov[2].iov_len = sizeof(lecounter);
-
-	iov[3].iov_base = (uint8_t *)packet;
-	iov[3].iov_len = packetsize;
-
-	rc = writev(s, iov, 4);
-	if (rc < DATAHEADERLEN) {
-		logwarn("%s %x error sending data", ifn->ifname, receiver);
-		return -1;
-	}
-
-	if ((size_t)rc - DATAHEADERLEN != packetsize)
-		return -1;
+	sessidmapput(le32toh(peer->scurr->id), peer);
 
 	return 0;
 }
@@ -1510,13 +2142,26 @@ sendwgdatamsg(int s, uint32_t receiver, uint64_t counter, const uint8_t *packet,
 /*
  * Encrypt data, send on connected socket and update session.
  *
+ * "buf" starts with DATAHEADERLEN bytes of headroom for the transport data
+ * header, followed by "insize" bytes of plaintext. "bufsize" is the size of
+ * the whole buffer, it must leave room for the padding and the tag.
+ *
+ * Messages that fit in a slot of the send ring are encrypted into that slot and
+ * sent by txflush, others are encrypted in place and sent right away as one
+ * datagram.
+ *
  * Return 0 on success, -1 on failure.
  */
 static int
-encryptandsend(void *out, size_t outsize, const void *in, size_t insize,
+encryptandsend(uint8_t *buf, size_t bufsize, size_t insize,
     struct session *sess)
 {
-	size_t padlen;
+	struct msgwgdatahdr *mwdhdr;
+	struct dgram *dgram;
+	size_t padlen, outsize;
+	uint8_t *in;
+	ssize_t written;
+	int rc;
 
 	if (insize == 0) {
 		/* keepalive */
@@ -1529,36 +2174,88 @@ encryptandsend(void *out, size_t outsize, const void *in, size_t insize,
 		logdebugx("%s %s %x packet size %zu padded %zu", ifn->ifname,
 		    sess->peer->name, le32toh(sess->id), insize, padlen);
 
+	assert(bufsize >= DATAHEADERLEN + TAGLEN);
+	outsize = bufsize - DATAHEADERLEN - TAGLEN;
 	if (padlen > outsize) {
 		logwarnx("%s %s %x truncating padded %zu to %zu", ifn->ifname,
 		    sess->peer->name, le32toh(sess->id), padlen, outsize);
 		padlen = outsize;
+		insize = MIN(insize, padlen);
 	}
 
 	/* TODO cap padding to at most the MTU size */
 
+	in = &buf[DATAHEADERLEN];
+	memset(&in[insize], 0, padlen - insize);
+
 	*(uint64_t *)&nonce[8] = htole64(sess->nextnonce);
-	if (EVP_AEAD_CTX_seal(&sess->sendctx, out, &outsize, outsize, &nonce[4],
-	    (sizeof nonce) - 4, in, padlen, NULL, 0) == 0) {
-		stats.sockouterr++;
-		return -1;
-	}
 
-	if (sendwgdatamsg(sess->peer->sock, sess->peerid, sess->nextnonce, out,
-	    outsize) == -1) {
-		logwarnx("%s %s %x error sending %zu bytes", ifn->ifname,
-		    sess->peer->name, le32toh(sess->id), outsize);
-		return -1;
-	}
+	if (DATAHEADERLEN + padlen + TAGLEN <= MAXBATCHMSG) {
+		if (txcount == SENDBATCH ||
+		    (txcount > 0 && txsock != sess->peer->sock))
+			txflush();
+
+		dgram = &txring[txcount];
+		outsize = sizeof(dgram->data) - DATAHEADERLEN;
+		HISTSTART(statspage, HISTENCRYPT);
+		rc = EVP_AEAD_CTX_seal(&sess->sendctx,
+		    &dgram->data[DATAHEADERLEN], &outsize, outsize, &nonce[4],
+		    (sizeof nonce) - 4, in, padlen, NULL, 0);
+		HISTSTOP(statspage, HISTENCRYPT);
+		if (rc == 0) {
+			stats->sockouterr++;
+			return -1;
+		}
+
+		mwdhdr = (struct msgwgdatahdr *)dgram->data;
+		mwdhdr->type = htole32(4);
+		mwdhdr->receiver = sess->peerid;
+		mwdhdr->counter = htole64(sess->nextnonce);
+		dgram->len = DATAHEADERLEN + outsize;
+#ifdef MSG_WAITFORONE
+		txiov[txcount].iov_len = dgram->len;
+#endif
+		txsock = sess->peer->sock;
+		txcount++;
+	} else {
+		/* keep messages in order */
+		txflush();
+
+		outsize = bufsize - DATAHEADERLEN;
+		HISTSTART(statspage, HISTENCRYPT);
+		rc = EVP_AEAD_CTX_seal(&sess->sendctx, in, &outsize, outsize,
+		    &nonce[4], (sizeof nonce) - 4, in, padlen, NULL, 0);
+		HISTSTOP(statspage, HISTENCRYPT);
+		if (rc == 0) {
+			stats->sockouterr++;
+			return -1;
+		}
+
+		mwdhdr = (struct msgwgdatahdr *)buf;
+		mwdhdr->type = htole32(4);
+		mwdhdr->receiver = sess->peerid;
+		mwdhdr->counter = htole64(sess->nextnonce);
+
+		HISTSTART(statspage, HISTSOCKWRITE);
+		written = write(sess->peer->sock, buf, DATAHEADERLEN + outsize);
+		HISTSTOP(statspage, HISTSOCKWRITE);
+		if (written != (ssize_t)(DATAHEADERLEN + outsize)) {
+			logwarn("%s %s %x error sending %zu bytes",
+			    ifn->ifname, sess->peer->name, le32toh(sess->id),
+			    outsize);
+			return -1;
+		}
 
-	stats.sockout++;
-	stats.sockoutsz += outsize;
+		stats->sockout++;
+		stats->sockoutsz += outsize;
+	}
 
 	sess->nextnonce++;
+	sess->peer->stats->tx++;
+	sess->peer->stats->txsz += insize;
 
 	if (sess->kaset) {
-		if (cleartimer(le32toh(sess->id)) == -1)
-			return -1;
+		cleartimer(le32toh(sess->id), sess->peer);
 
 		sess->kaset = 0;
 
@@ -1594,38 +2291,46 @@ encryptandsend(void *out, size_t outsize, const void *in, size_t insize,
 		return 0;
 	}
 
+	if (sess->initiator && sess->rekeyat <= now &&
+	    sess == sess->peer->scurr) {
+		rekeyrequest(sess->peer);
+		return 0;
+	}
+
 	return 0;
 }
 
 /*
- * Decrypt a WGDATA message into "out".
+ * Decrypt a WGDATA message in place. The plaintext starts right after the
+ * header, so the last TUNHDRSIZ bytes of the header can be reused for a tunnel
+ * header.
  *
  * Returns the payload size of the packet on success, -1 otherwise.
  */
 static ssize_t
-decryptpacket(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
-    size_t mwdsize, EVP_AEAD_CTX *key, uint32_t sessid)
+decryptpacket(struct msgwgdatahdr *mwdhdr, size_t mwdsize, EVP_AEAD_CTX *key,
+    uint32_t sessid)
 {
 	uint8_t *payload;
-	size_t payloadsize;
-
-	if (outsize < mwdsize)
-		return -1;
+	size_t payloadsize, outsize;
+	int rc;
 
 	if (payloadoffset(&payload, &payloadsize, mwdhdr, mwdsize) == -1) {
-		stats.corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
-	/* prepend a tunnel header */
 	*(uint64_t *)&nonce[8] = mwdhdr->counter;
-	if (EVP_AEAD_CTX_open(key, out, &outsize, outsize, &nonce[4],
-	    (sizeof nonce) - 4, payload, payloadsize, NULL, 0) == 0) {
+	HISTSTART(statspage, HISTDECRYPT);
+	rc = EVP_AEAD_CTX_open(key, payload, &outsize, payloadsize, &nonce[4],
+	    (sizeof nonce) - 4, payload, payloadsize, NULL, 0);
+	HISTSTOP(statspage, HISTDECRYPT);
+	if (rc == 0) {
 		logwarnx("%s %x unauthenticated data received, udp data: %zu, "
 		    "wg payload: %zu, counter: %llu", ifn->ifname,
 		    le32toh(sessid), mwdsize, payloadsize,
 		    le64toh(mwdhdr->counter));
-		stats.corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
@@ -1682,7 +2387,7 @@ forward2tun(uint8_t *frame, size_t framesize, const struct peer *peer)
 	int rc;
 
 	if (framesize < TUNHDRSIZ + MINIPHDR) {
-		stats.corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
@@ -1694,7 +2399,7 @@ forward2tun(uint8_t *frame, size_t framesize, const struct peer *peer)
 		logwarnx("%s %s decrypted packet contains invalid ip packet",
 		    ifn->ifname, peer->name);
 
-		stats.corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
@@ -1702,7 +2407,7 @@ forward2tun(uint8_t *frame, size_t framesize, const struct peer *peer)
 		logwarnx("%s %s ip packet could not be routed", ifn->ifname,
 		    peer->name);
 
-		stats.invalidpeer++;
+		stats->invalidpeer++;
 		return -1;
 	}
 
@@ -1710,20 +2415,23 @@ forward2tun(uint8_t *frame, size_t framesize, const struct peer *peer)
 		logwarnx("%s %s ip packet with a source address from %s "
 		    "received", ifn->ifname, peer->name, routedpeer->name);
 
-		stats.invalidpeer++;
+		stats->invalidpeer++;
 		return -1;
 	}
 
 	*(uint32_t *)frame = htonl(addr->addr.h.family);
 
-	if (writen(tund, frame, framesize) != 0) {
+	HISTSTART(statspage, HISTTUNWRITE);
+	rc = writen(tund, frame, framesize);
+	HISTSTOP(statspage, HISTTUNWRITE);
+	if (rc != 0) {
 		logwarn("%s %s tunnel write error", ifn->ifname, peer->name);
-		stats.devouterr++;
+		stats->devouterr++;
 		return -1;
 	}
 
-	stats.devout++;
-	stats.devoutsz += ippacketsize;
+	stats->devout++;
+	stats->devoutsz += ippacketsize;
 
 	return 0;
 }
@@ -1735,10 +2443,10 @@ forward2tun(uint8_t *frame, size_t framesize, const struct peer *peer)
  * Return 0 on success, -1 on failure.
  */
 static int
-handlenextdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
-    size_t mwdsize, struct peer *peer)
+handlenextdata(struct msgwgdatahdr *mwdhdr, size_t mwdsize, struct peer *peer)
 {
 	ssize_t payloadsize;
+	uint8_t *frame;
 
 	if (peer->sessnext.start < now - REJECT_AFTER_TIME) {
 		if (verbose > -1)
@@ -1754,24 +2462,30 @@ handlenextdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 
 		sessnextclear(peer, 1);
 
-		stats.sockinerr++;
+		stats->sockinerr++;
 		return -1;
 	}
 
-	/* leave room in "out" for the tunnel header */
-	payloadsize = decryptpacket(&out[TUNHDRSIZ], outsize - TUNHDRSIZ,
-	    mwdhdr, mwdsize, &peer->sessnext.recvctx,
+	payloadsize = decryptpacket(mwdhdr, mwdsize, &peer->sessnext.recvctx,
 	    htole32(peer->sessnext.id));
 
-	if (payloadsize < 0)
+	if (payloadsize < 0) {
+		peer->stats->unauthenticated++;
 		return -1;
+	}
+
+	peer->stats->rx++;
+	peer->stats->rxsz += payloadsize;
+
+	/* the tunnel header overwrites the end of the counter */
+	frame = (uint8_t *)mwdhdr + TUNHEADROOM;
 
 	/*
 	 * Write authenticated and decrypted packet to the tunnel device if it's
 	 * an ip4 or ip6 packet. Otherwise treat it as a keepalive.
 	 */
 	if (payloadsize >= MINIPHDR) {
-		if (forward2tun(out, TUNHDRSIZ + payloadsize, peer) == -1)
+		if (forward2tun(frame, TUNHDRSIZ + payloadsize, peer) == -1)
 			return -1;
 	} else if (verbose > 1) {
 		loginfox("%s %s (%x) received %zd byte message at start of next"
@@ -1786,7 +2500,7 @@ handlenextdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 			    "current", ifn->ifname, peer->name,
 			    peer->sessnext.id);
 
-		stats.invalidpeer++;
+		stats->invalidpeer++;
 		return -1;
 	}
 
@@ -1804,44 +2518,53 @@ handlenextdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 }
 
 /*
- * Handle data of an established session (either curr or prev).
- * Decrypt data, forward to tunnel and update session.
+ * Check if data for an established session (either curr or prev) can be
+ * accepted before it is authenticated. The anti-replay state is not changed.
  *
- * Return 0 on success, -1 on failure.
+ * Return 0 on success and updates "counter", -1 on failure.
  */
 static int
-handlesessdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
-    size_t mwdsize, struct session *sess)
+sessdatacheck(const struct msgwgdatahdr *mwdhdr, struct session *sess,
+    uint64_t *counter)
 {
-	uint64_t counter;
-	ssize_t payloadsize;
-
 	if (!sessactive(sess)) {
 		logwarnx("%s /%x/ data for unusable session received",
 		    ifn->ifname, le32toh(mwdhdr->receiver));
-		stats.sockinerr++;
+		stats->sockinerr++;
 		return -1;
 	}
 
-	counter = le64toh(mwdhdr->counter);
+	*counter = le64toh(mwdhdr->counter);
 
-	if (!antireplay_isnew(&sess->arrecv, counter)) {
+	if (!antireplay_isnew(&sess->arrecv, *counter)) {
 		if (verbose > -1)
 			logwarnx("%s %s /%x/ data replayed %llu %llu",
 			    ifn->ifname, sess->peer->name,
-			    le32toh(mwdhdr->receiver), counter,
+			    le32toh(mwdhdr->receiver), *counter,
 			    sess->arrecv.maxseqnum);
 
-		stats.corrupted++;
+		stats->corrupted++;
+		sess->peer->stats->replayed++;
 		return -1;
 	}
 
-	/* leave room in "out" for the tunnel header */
-	payloadsize = decryptpacket(&out[TUNHDRSIZ], outsize - TUNHDRSIZ,
-	    mwdhdr, mwdsize, &sess->recvctx, sess->id);
+	return 0;
+}
 
-	if (payloadsize < 0)
-		return -1;
+/*
+ * Handle authenticated and decrypted data of an established session. Commit
+ * "counter" to the anti-replay state, forward to tunnel and update session.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int
+sessdatacommit(struct msgwgdatahdr *mwdhdr, struct session *sess,
+    uint64_t counter, ssize_t payloadsize)
+{
+	uint8_t *frame;
+
+	/* the tunnel header overwrites the end of the counter */
+	frame = (uint8_t *)mwdhdr + TUNHEADROOM;
 
 	sess->expack = 0;
 
@@ -1851,12 +2574,15 @@ handlesessdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 		return -1;
 	}
 
+	sess->peer->stats->rx++;
+	sess->peer->stats->rxsz += payloadsize;
+
 	/*
 	 * Write authenticated and decrypted packet to the tunnel device if it's
 	 * an ip4 or ip6 packet. Otherwise treat it as a keepalive.
 	 */
 	if (payloadsize >= MINIPHDR) {
-		if (forward2tun(out, TUNHDRSIZ + payloadsize, sess->peer) == -1)
+		if (forward2tun(frame, TUNHDRSIZ + payloadsize, sess->peer) == -1)
 			return -1;
 
 		/*
@@ -1866,7 +2592,8 @@ handlesessdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 		if (sess->kaset == 0 &&
 		    now - sess->start < REJECT_AFTER_TIME - KEEPALIVE_TIMEOUT &&
 		    sess->nextnonce < REJECT_AFTER_MESSAGES) {
-			settimer(le32toh(sess->id), KEEPALIVE_TIMEOUT);
+			settimer(le32toh(sess->id), KEEPALIVE_TIMEOUT,
+			    sess->peer);
 			sess->kaset = 1;
 
 			if (verbose > 2)
@@ -1892,6 +2619,58 @@ handlesessdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 	return 0;
 }
 
+/*
+ * Handle data of an established session (either curr or prev).
+ * Decrypt data, forward to tunnel and update session.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int
+handlesessdata(struct msgwgdatahdr *mwdhdr, size_t mwdsize,
+    struct session *sess)
+{
+	uint64_t counter;
+	ssize_t payloadsize;
+
+	if (sessdatacheck(mwdhdr, sess, &counter) == -1)
+		return -1;
+
+	payloadsize = decryptpacket(mwdhdr, mwdsize, &sess->recvctx, sess->id);
+	if (payloadsize < 0) {
+		sess->peer->stats->unauthenticated++;
+		return -1;
+	}
+
+	return sessdatacommit(mwdhdr, sess, counter, payloadsize);
+}
+
+/*
+ * Encrypt the first queued packet of peer "p" with the current session, send it
+ * and remove it from the queue. "p" must have an active current session and at
+ * least one queued packet.
+ *
+ * Return 0 on success, -1 if the packet could not be sent.
+ */
+static int
+sendqueued(struct peer *p)
+{
+	struct qpacket *qp;
+	int rc;
+
+	assert(p->qpackets > 0);
+
+	qp = &p->qpacketv[p->qpackethead];
+	memcpy(&msg[DATAHEADERLEN], qp->data, qp->datasize);
+	rc = encryptandsend(msg, sizeof(msg), qp->datasize, p->scurr);
+
+	p->qpackethead = (p->qpackethead + 1) % MAXQUEUEPACKETS;
+	p->qpackets--;
+	p->qpacketsdatasz -= qp->datasize;
+	qp->datasize = 0;
+
+	return rc;
+}
+
 /*
  * Receive and handle one of the messages from the enclave.
  *
@@ -1910,14 +2689,13 @@ handlesessdata(uint8_t *out, size_t outsize, struct msgwgdatahdr *mwdhdr,
 static int
 handleenclavemsg(void)
 {
-	struct qpacket *qp;
 	struct msgconnreq *mcr;
 	struct msgwginit *mwi;
 	struct msgwgresp *mwr;
 	struct msgsesskeys *msk;
 	struct peer *p;
 	uint32_t peerid;
-	size_t msgsize;
+	size_t msgsize, datasize;
 	ssize_t rc;
 	unsigned char mtcode;
 
@@ -1928,7 +2706,7 @@ handleenclavemsg(void)
 		exit(1);
 	}
 
-	stats.enclin++;
+	stats->enclin++;
 
 	if (!findpeer(peerid, &p)) {
 		logwarn("%s unknown peer id from enclave %u", ifn->ifname,
@@ -1936,6 +2714,14 @@ handleenclavemsg(void)
 		exit(1);
 	}
 
+	/* messages for a peer that is removed by a reload may be underway */
+	if (p->removed) {
+		if (verbose > 1)
+			loginfox("%s %s removed peer, ignoring message %d from "
+			    "enclave", ifn->ifname, p->name, mtcode);
+		return 0;
+	}
+
 	switch (mtcode) {
 	case MSGWGINIT:
 		/* 1. handlewginitfromenclave */
@@ -1947,10 +2733,7 @@ handleenclavemsg(void)
 			 * enclave, send the message to the peer and if this
 			 * succeeds schedule a new timer.
 			 */
-			if (cleartimer(p->sesstent.id) == -1)
-				logwarn("%s %s [%x] could not clear rekey "
-				    "timer", ifn->ifname, p->name,
-				    p->sesstent.id);
+			cleartimer(p->sesstent.id, p);
 
 			if (verbose > 1)
 				loginfox("%s %s [%x] tentative session replaced"
@@ -1958,15 +2741,17 @@ handleenclavemsg(void)
 				    p->name, p->sesstent.id,
 				    le32toh(mwi->sender));
 
+			sessidmapdel(p->sesstent.id, p);
 			p->sesstent.id = le32toh(mwi->sender);
+			sessidmapput(p->sesstent.id, p);
 
 			rc = write(p->sock, msg, msgsize);
 			if (rc < 0) {
 				logwarn("%s %s [%x] error when trying to send "
 				    "init message to peer", ifn->ifname,
 				    p->name, p->sesstent.id);
-				stats.sockouterr++;
-				stats.initouterr++;
+				stats->sockouterr++;
+				stats->initouterr++;
 				return -1;
 			}
 			if ((size_t)rc != msgsize) {
@@ -1974,22 +2759,22 @@ handleenclavemsg(void)
 				    "init message to peer, written %zd bytes "
 				    "instead of %zu", ifn->ifname,
 				    p->name, p->sesstent.id, rc, msgsize);
-				stats.sockouterr++;
-				stats.initouterr++;
+				stats->sockouterr++;
+				stats->initouterr++;
 				return -1;
 			}
-			stats.initout++;
-			stats.sockout++;
-			stats.sockoutsz += msgsize;
+			stats->initout++;
+			stats->sockout++;
+			stats->sockoutsz += msgsize;
 
-			p->sesstent.state = INITSENT;
+			sesstentsetstate(p, INITSENT);
 
 			if (verbose > 0)
 				lognoticex("%s %s [%x] got init message from "
 				    "enclave, forwarded to peer", ifn->ifname,
 				    p->name, p->sesstent.id);
 
-			settimer(p->sesstent.id, REKEY_TIMEOUT);
+			settimer(p->sesstent.id, REKEY_TIMEOUT, p);
 
 			if (verbose > 1)
 				loginfox("%s %s [%x] rekey timeout set to %d "
@@ -2021,8 +2806,8 @@ handleenclavemsg(void)
 				    ifn->ifname, p->name, p->sessnext.id,
 				    p->sessnext.state);
 
-			stats.sockouterr++;
-			stats.respouterr++;
+			stats->sockouterr++;
+			stats->respouterr++;
 			return -1;
 		}
 
@@ -2034,8 +2819,8 @@ handleenclavemsg(void)
 				    ifn->ifname, p->name, p->sessnext.id,
 				    p->sessnext.peerid, le32toh(mwr->receiver));
 
-			stats.sockouterr++;
-			stats.respouterr++;
+			stats->sockouterr++;
+			stats->respouterr++;
 			return -1;
 		}
 
@@ -2047,21 +2832,22 @@ handleenclavemsg(void)
 			logwarn("%s %s (%x) error when trying to send "
 			    "response message to peer", ifn->ifname,
 			    p->name, p->sessnext.id);
-			stats.sockouterr++;
-			stats.respouterr++;
+			stats->sockouterr++;
+			stats->respouterr++;
 			return -1;
 		}
 		if ((size_t)rc != msgsize) {
 			logwarn("%s %s (%x) error when trying to send response "
 			    "message to peer, written %zd bytes instead of %zu",
 			    ifn->ifname, p->name, p->sessnext.id, rc, msgsize);
-			stats.sockouterr++;
-			stats.respouterr++;
+			stats->sockouterr++;
+			stats->respouterr++;
 			return -1;
 		}
-		stats.respout++;
-		stats.sockout++;
-		stats.sockoutsz += msgsize;
+		stats->respout++;
+		stats->sockout++;
+		stats->sockoutsz += msgsize;
+		p->stats->hsresp++;
 
 		if (verbose > 0)
 			lognoticex("%s %s (%x) got response message from "
@@ -2071,7 +2857,7 @@ handleenclavemsg(void)
 	case MSGCONNREQ:
 		mcr = (struct msgconnreq *)msg;
 		if (peerconnect(p, (struct sockaddr *)&mcr->fsa) == -1) {
-			stats.sockouterr++;
+			stats->sockouterr++;
 			return -1;
 		}
 		break;
@@ -2083,7 +2869,7 @@ handleenclavemsg(void)
 				logwarnx("%s %s [%x] new session keys from "
 				    "enclave for initiator role unexpected",
 				    ifn->ifname, p->name, p->sesstent.id);
-				stats.enclinerr++;
+				stats->enclinerr++;
 				return -1;
 			}
 
@@ -2091,7 +2877,7 @@ handleenclavemsg(void)
 				logwarnx("%s %s [%x] failed to make tentative "
 				    "session the current session", ifn->ifname,
 				    p->name, p->sesstent.id);
-				stats.sockouterr++;
+				stats->sockouterr++;
 				return -1;
 			}
 
@@ -2101,35 +2887,29 @@ handleenclavemsg(void)
 				    "session failed", ifn->ifname, p->name,
 				    le32toh(p->scurr->id));
 
+			p->stats->hsdone++;
+			p->stats->hslatency = now - p->stats->hsstart;
+			p->stats->hslatencysum += p->stats->hslatency;
+			HISTADD(statspage, HISTHANDSHAKE,
+			    p->stats->hslatency * 1000);
+
 			if (verbose > 0)
 				lognoticex("%s %s %x R:%x new session "
 				    "established", ifn->ifname, p->name,
 				    le32toh(p->scurr->id),
 				    le32toh(p->scurr->peerid));
 
-			if (p->qpackets > 0) {
-				while (!SIMPLEQ_EMPTY(&p->qpacketlist)) {
-					qp = SIMPLEQ_FIRST(&p->qpacketlist);
-					rc = encryptandsend(msg, sizeof(msg), qp->data,
-					    qp->datasize, p->scurr);
-
-					if (rc == -1) {
-						stats.sockouterr++;
-						stats.queueouterr++;
-					} else {
-						stats.queueout++;
-						stats.queueoutsz += qp->datasize;
-					}
-					SIMPLEQ_REMOVE_HEAD(&p->qpacketlist,
-					    qpackets);
-					p->qpackets--;
-					p->qpacketsdatasz -= qp->datasize;
-					free(qp->data);
-					qp->data = NULL;
-					qp->datasize = 0;
-					free(qp);
+			while (p->qpackets > 0) {
+				datasize = p->qpacketv[p->qpackethead].datasize;
+				if (sendqueued(p) == -1) {
+					stats->sockouterr++;
+					stats->queueouterr++;
+				} else {
+					stats->queueout++;
+					stats->queueoutsz += datasize;
 				}
 			}
+			p->stats->queued = 0;
 		} else {
 			/* 2. handlekeysfromenclave */
 			if (p->sessnext.state != SNINACTIVE &&
@@ -2137,7 +2917,7 @@ handleenclavemsg(void)
 				logwarnx("%s %s (%x) new session keys from "
 				    "enclave for responder role unexpected",
 				    ifn->ifname, p->name, p->sessnext.id);
-				stats.enclinerr++;
+				stats->enclinerr++;
 				return -1;
 			}
 
@@ -2147,19 +2927,22 @@ handleenclavemsg(void)
 			 * of a hardcoded value of 2.
 			 */
 			p->sessnext.lastvrfyinit = now - 2;
+			if (p->sessnext.id >= 0)
+				sessidmapdel(p->sessnext.id, p);
 			p->sessnext.id = le32toh(msk->sessid);
+			sessidmapput(p->sessnext.id, p);
 			p->sessnext.peerid = le32toh(msk->peersessid);
 			p->sessnext.state = GOTKEYS;
 
 			if (EVP_AEAD_CTX_init(&p->sessnext.sendctx, aead,
 			    msk->sendkey, KEYLEN, TAGLEN, NULL) == 0) {
-				stats.enclinerr++;
+				stats->enclinerr++;
 				return -1;
 			}
 
 			if (EVP_AEAD_CTX_init(&p->sessnext.recvctx, aead,
 			    msk->recvkey, KEYLEN, TAGLEN, NULL) == 0) {
-				stats.enclinerr++;
+				stats->enclinerr++;
 				return -1;
 			}
 
@@ -2195,70 +2978,140 @@ handleenclavemsg(void)
 }
 
 /*
- * Receive and handle incoming data from the tunnel descriptor.
+ * Send the packets of all peers in the egress scheduler with deficit
+ * round-robin. Each round every peer may send up to the quantum of the
+ * interface plus whatever it did not use in the previous round. Peers that
+ * lost their session keep their packets queued until the next handshake.
+ */
+static void
+fqrun(void)
+{
+	struct peer *p;
+
+	while ((p = fqhead) != NULL) {
+		fqhead = p->fqnext;
+		p->fqnext = NULL;
+		if (fqhead == NULL)
+			fqtail = NULL;
+
+		p->fqdeficit += ifn->fqquantum;
+
+		while (p->qpackets > 0 && sessactive(p->scurr)) {
+			if (p->qpacketv[p->qpackethead].datasize > p->fqdeficit)
+				break;
+
+			p->fqdeficit -= p->qpacketv[p->qpackethead].datasize;
+			if (sendqueued(p) == -1)
+				stats->sockouterr++;
+		}
+
+		p->stats->queued = p->qpackets;
+
+		if (p->qpackets > 0 && sessactive(p->scurr)) {
+			if (fqtail == NULL) {
+				fqhead = p;
+			} else {
+				fqtail->fqnext = p;
+			}
+			fqtail = p;
+			continue;
+		}
+
+		/* don't schedule the peer again until it has new packets */
+		if (p->qpackets > 0) {
+			stats->queuein += p->qpackets;
+			stats->queueinsz += p->qpacketsdatasz;
+			ensurehs(p);
+		}
+
+		p->fqactive = 0;
+		p->fqdeficit = 0;
+	}
+}
+
+/*
+ * Add the last queued packet of peer "p" to the egress scheduler.
+ */
+static void
+fqenqueue(struct peer *p)
+{
+	if (!p->fqactive) {
+		p->fqactive = 1;
+		p->fqdeficit = 0;
+		p->fqnext = NULL;
+		if (fqtail == NULL) {
+			fqhead = p;
+		} else {
+			fqtail->fqnext = p;
+		}
+		fqtail = p;
+	}
+
+	/* don't drop the next packet of the peer for want of a turn */
+	if (p->qpackets >= MAXQUEUEPACKETS)
+		fqrun();
+}
+
+/*
+ * Handle a packet of "msgsize" bytes read from the tunnel descriptor into msg
+ * at TUNHEADROOM.
  *
  * 1. Decide to which peer.
  * 2. See if the peer is connected
  * 3. See if the peer has a current session that is alive
  *      If not, queue packet and ensure handshake
  * Otherwise write a MSGWGDATA to the connected socket using the current
- * session.
+ * session, or queue it for the egress scheduler if the interface has a fair
+ * queue quantum.
  *
  * Return 0 on success, -1 on error.
  */
 static int
-handletundmsg(void)
+handletundmsg(size_t msgsize)
 {
 	struct cidraddr *addr;
 	struct qpacket *qp;
 	struct peer *p;
 	struct ip6_hdr *ip6hdr;
 	struct ip *ip4;
-	ssize_t rc;
-	size_t msgsize;
+	uint8_t *frame;
+	char addrstr[INET6_ADDRSTRLEN];
 
-	/* Cryptokey Routing */
-
-	msgsize = sizeof(msg);
-	rc = read(tund, msg, msgsize);
-	if (rc < 0) {
-		logwarnx("%s device read error", ifn->ifname);
-		exit(1);
-	}
+	frame = &msg[TUNHEADROOM];
 
-	msgsize = rc;
+	/* Cryptokey Routing */
 
-	stats.devin++;
-	stats.devinsz += msgsize - TUNHDRSIZ;
+	stats->devin++;
+	stats->devinsz += msgsize - TUNHDRSIZ;
 
 	/* expect at least a tunnel and ip header */
-	if (rc < TUNHDRSIZ + MINIPHDR) {
+	if (msgsize < TUNHDRSIZ + MINIPHDR) {
 		if (verbose > 1)
 			loginfox("%s %s empty message from device received", ifn->ifname,
 			    ifn->ifname);
-		stats.devinerr++;
+		stats->devinerr++;
 		return -1;
 	}
 
 	p = NULL;
 	/* expect 4 byte tunnel header */
-	switch(ntohl(*(uint32_t *)msg)) {
+	switch(ntohl(*(uint32_t *)frame)) {
 	case AF_INET6:
 		if (msgsize < TUNHDRSIZ + MINIP6HDR)
 			logwarnx("%s %s invalid ipv6 packet from device", ifn->ifname,
 			    ifn->ifname);
-		ip6hdr = (struct ip6_hdr *)&msg[TUNHDRSIZ];
+		ip6hdr = (struct ip6_hdr *)&frame[TUNHDRSIZ];
 		if (!peerbyroute6(&p, &addr, &ip6hdr->ip6_dst)) {
-			if (inet_ntop(AF_INET6, &ip6hdr->ip6_dst, (char *)msg,
-			    sizeof msg) == NULL)
+			if (inet_ntop(AF_INET6, &ip6hdr->ip6_dst, addrstr,
+			    sizeof addrstr) == NULL)
 				logwarn("%s inet_ntop error", ifn->ifname);
 
 			if (verbose > 0)
 				lognoticex("%s no route to %s", ifn->ifname,
-				    msg);
+				    addrstr);
 
 			errno = EHOSTUNREACH;
-			stats.devinerr++;
+			stats->devinerr++;
 			return -1;
 		}
 		break;
@@ -2266,23 +3119,23 @@ handletundmsg(void)
 		if (msgsize < TUNHDRSIZ + MINIP4HDR)
 			logwarnx("%s %s invalid ipv4 packet from device", ifn->ifname,
 			    ifn->ifname);
-		ip4 = (struct ip *)&msg[TUNHDRSIZ];
+		ip4 = (struct ip *)&frame[TUNHDRSIZ];
 		if (!peerbyroute4(&p, &addr, &ip4->ip_dst)) {
 			if (verbose > 0)
 				lognoticex("%s no route to %s", ifn->ifname,
 				    inet_ntoa(ip4->ip_dst));
 
 			errno = EHOSTUNREACH;
-			stats.devinerr++;
+			stats->devinerr++;
 			return -1;
 		}
 		break;
 	default:
 		if (verbose > -1)
 			logwarnx("%s invalid message from device %d %zu bytes",
-			    ifn->ifname, ntohl(*(uint32_t *)msg),
+			    ifn->ifname, ntohl(*(uint32_t *)frame),
 			    msgsize - TUNHDRSIZ);
-		stats.devinerr++;
+		stats->devinerr++;
 		return -1;
 	}
 
@@ -2290,10 +3143,30 @@ handletundmsg(void)
 		if (verbose > -1)
 			logwarnx("%s %zu bytes for unknown peer", ifn->ifname,
 			    msgsize - TUNHDRSIZ);
-		stats.devinerr++;
+		stats->devinerr++;
 		return -1;
 	}
 
+	/* hand the packet to the worker that serves the peer */
+	if (!peerowned(p)) {
+		if (ifn->worker > 0) {
+			logwarnx("%s %s packet for a peer of another worker",
+			    ifn->ifname, p->name);
+			stats->devinerr++;
+			return -1;
+		}
+		if (write(ifn->workerports[p->id % ifn->workers], frame,
+		    msgsize) == -1) {
+			if (verbose > 1)
+				logwarn("%s %s error forwarding packet to "
+				    "worker %u", ifn->ifname, p->name,
+				    p->id % (uint32_t)ifn->workers);
+			stats->devinerr++;
+			return -1;
+		}
+		return 0;
+	}
+
 	if (verbose > 2)
 		logdebugx("%s %s %x %zu bytes for peer", ifn->ifname,
 		    p->name, p->scurr == NULL ? 0x0 : le32toh(p->scurr->id),
@@ -2303,62 +3176,131 @@ handletundmsg(void)
 		errno = EDESTADDRREQ;
 		logwarn("%s %s %x peer not connected", ifn->ifname, p->name,
 		    p->scurr == NULL ? 0x0 : le32toh(p->scurr->id));
-		stats.sockouterr++;
+		stats->sockouterr++;
+		return -1;
+	}
+
+	if (sessactive(p->scurr) && ifn->fqquantum == 0)
+		return encryptandsend(msg, sizeof(msg), msgsize - TUNHDRSIZ,
+		    p->scurr);
+
+	/*
+	 * Packets that don't fit in a queue slot, only possible with a manually
+	 * configured MTU, are sent right away and may overtake queued ones.
+	 */
+	if (sessactive(p->scurr) && msgsize - TUNHDRSIZ > WSTUNMTU)
+		return encryptandsend(msg, sizeof(msg), msgsize - TUNHDRSIZ,
+		    p->scurr);
+
+	if (p->qpackets >= MAXQUEUEPACKETS) {
+		logwarnx("%s %s queue full %zu packets", ifn->ifname,
+		    p->name, p->qpackets);
+		stats->sockouterr++;
+		stats->queueinerr++;
+		p->stats->queuedrops++;
+		return -1;
+	}
+
+	qp = &p->qpacketv[(p->qpackethead + p->qpackets) % MAXQUEUEPACKETS];
+
+	if (msgsize - TUNHDRSIZ > sizeof(qp->data)) {
+		logwarnx("%s %s packet too big to queue %zu bytes",
+		    ifn->ifname, p->name, msgsize - TUNHDRSIZ);
+		stats->sockouterr++;
+		stats->queueinerr++;
+		p->stats->queuedrops++;
 		return -1;
 	}
 
+	qp->datasize = msgsize - TUNHDRSIZ;
+	memcpy(qp->data, &frame[TUNHDRSIZ], qp->datasize);
+
+	p->qpackets++;
+	p->qpacketsdatasz += qp->datasize;
+	p->stats->queued = p->qpackets;
+
+	/* packets of a peer with a session wait only for their turn */
 	if (sessactive(p->scurr)) {
-		return encryptandsend(msg, sizeof(msg), &msg[TUNHDRSIZ],
-		    msgsize - TUNHDRSIZ, p->scurr);
-	} else {
-		if (p->qpackets >= MAXQUEUEPACKETS) {
-			logwarnx("%s %s queue full %zu packets", ifn->ifname,
-			    p->name, p->qpackets);
-			stats.sockouterr++;
-			stats.queueinerr++;
-			return -1;
-		}
+		fqenqueue(p);
+		return 0;
+	}
 
-		if ((MAXQUEUEPACKETSDATASZ - (msgsize - TUNHDRSIZ)) <
-		    p->qpacketsdatasz) {
-			logwarnx("%s %s queue full %zu bytes", ifn->ifname,
-			    p->name, p->qpacketsdatasz);
-			stats.sockouterr++;
-			stats.queueinerr++;
-			return -1;
-		}
+	stats->queuein++;
+	stats->queueinsz += qp->datasize;
 
-		if ((qp = malloc(sizeof(*qp))) == NULL) {
-			logwarn("%s %s malloc failed %zu", ifn->ifname,
-			    p->name, sizeof *qp);
-			stats.sockouterr++;
-			stats.queueinerr++;
-			return -1;
-		}
+	ensurehs(p);
 
-		qp->datasize = msgsize - TUNHDRSIZ;
+	return -1;
+}
 
-		if ((qp->data = malloc(qp->datasize)) == NULL) {
-			logwarn("%s %s malloc failed %zu", ifn->ifname,
-			    p->name, qp->datasize);
-			free(qp);
-			stats.sockouterr++;
-			stats.queueinerr++;
-			return -1;
+/*
+ * Drain the tunnel descriptor. Read packets until the device is empty or the
+ * budget of the interface is exhausted so that a busy tunnel can not starve
+ * the peer sockets. Whatever is left is reported again by the next kevent(2).
+ *
+ * "data" of a read event on a tun(4) device holds the size of the first
+ * queued packet, not the number of packets, so it is only used to skip a
+ * wakeup without data.
+ */
+static void
+handletund(const struct kevent *ev)
+{
+	ssize_t rc;
+	size_t n;
+
+	if (ev->data <= 0)
+		return;
+
+	for (n = 0; n < ifn->tunbudget; n++) {
+		HISTSTART(statspage, HISTTUNREAD);
+		rc = read(tund, &msg[TUNHEADROOM],
+		    sizeof(msg) - TUNHEADROOM - TUNTAILROOM);
+		HISTSTOP(statspage, HISTTUNREAD);
+		if (rc == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			logwarn("%s device read error", ifn->ifname);
+			exit(1);
 		}
 
-		memcpy(qp->data, &msg[TUNHDRSIZ], qp->datasize);
-		SIMPLEQ_INSERT_TAIL(&p->qpacketlist, qp, qpackets);
+		handletundmsg(rc);
+	}
 
-		p->qpackets++;
-		p->qpacketsdatasz += qp->datasize;
+	fqrun();
+}
 
-		stats.queuein++;
-		stats.queueinsz += qp->datasize;
+/*
+ * Write the packets that another worker has decrypted to the tunnel device.
+ * Only used by worker 0. Read at most the budget of the interface, just like
+ * the device itself.
+ */
+static void
+handleworker(const struct kevent *ev)
+{
+	ssize_t rc;
+	size_t n;
+	int wrc;
+
+	for (n = 0; n < ifn->tunbudget; n++) {
+		rc = read((int)ev->ident, msg, sizeof(msg));
+		if (rc == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			logwarn("%s worker read error", ifn->ifname);
+			exit(1);
+		}
 
-		ensurehs(p);
+		HISTSTART(statspage, HISTTUNWRITE);
+		wrc = writen(tund, msg, rc);
+		HISTSTOP(statspage, HISTTUNWRITE);
+		if (wrc != 0) {
+			logwarn("%s tunnel write error", ifn->ifname);
+			stats->devouterr++;
+			continue;
+		}
 
-		return -1;
+		stats->devout++;
+		stats->devoutsz += rc - TUNHDRSIZ;
 	}
 }
 
@@ -2375,74 +3317,96 @@ handlewgdata(struct msgwgdatahdr *mwdhdr, size_t msgsize, struct peer *p)
 			    "while in unexpected state %x", ifn->ifname,
 			    p->name, le32toh(mwdhdr->receiver),
 			    p->sessnext.state);
-			stats.sockinerr++;
+			stats->sockinerr++;
 			return -1;
 		}
 
-		return handlenextdata(msg, sizeof(msg), mwdhdr, msgsize, p);
+		return handlenextdata(mwdhdr, msgsize, p);
 	} else if (p->scurr && mwdhdr->receiver == p->scurr->id) {
-		return handlesessdata(msg, sizeof(msg), mwdhdr, msgsize,
-		    p->scurr);
+		return handlesessdata(mwdhdr, msgsize, p->scurr);
 	} else if (p->sprev && mwdhdr->receiver == p->sprev->id) {
-		return handlesessdata(msg, sizeof(msg), mwdhdr, msgsize,
-		    p->sprev);
+		return handlesessdata(mwdhdr, msgsize, p->sprev);
 	}
 
 	logwarnx("%s %s /%x/ data with unknown session received",
 	    ifn->ifname, p->name, le32toh(mwdhdr->receiver));
-	stats.sockinerr++;
+	stats->sockinerr++;
 	return -1;
 }
 
 /*
- * Receive and handle a message from the Internet.
+ * Forward a cookie reply to the enclave if it answers a handshake message of
+ * the tentative or next session of peer "p".
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+forwardcookie(struct peer *p, const struct msgwgcook *mwc)
+{
+	int64_t receiver;
+
+	receiver = le32toh(mwc->receiver);
+
+	if (receiver != p->sesstent.id && receiver != p->sessnext.id) {
+		if (verbose > 0)
+			lognoticex("%s %s cookie reply for unknown tentative "
+			    "or next session %x", ifn->ifname, p->name,
+			    (uint32_t)receiver);
+		return -1;
+	}
+
+	if (wire_sendpeeridmsg(eport, p->id, MSGWGCOOKIE, mwc,
+	    sizeof(*mwc)) == -1) {
+		logwarnx("%s %s %x error forwarding cookie reply to enclave",
+		    ifn->ifname, p->name, (uint32_t)receiver);
+		exit(1);
+	}
+
+	if (verbose > 1)
+		loginfox("%s %s %x got cookie reply, forwarded to enclave",
+		    ifn->ifname, p->name, (uint32_t)receiver);
+
+	return 0;
+}
+
+/*
+ * Handle a message from the Internet that was received on the socket of peer
+ * "p". Transport data messages are decrypted in place in "buf".
  *
  * MSGWGINIT
  *   forward to enclave
  * MSGWGRESP
  *   forward to enclave
  * MSGWGCOOKIE
- *   TODO handle ourselves
+ *   forward to enclave
  * MSGWGDATA
  *   authenticate, decrypt and forward to tunnel
  *
  * Return 0 on success, -1 on error.
  */
 static int
-handlesocketmsg(struct peer *p)
+handlepeermsg(struct peer *p, uint8_t *buf, size_t msgsize)
 {
 	struct msgwginit *mwi;
 	struct msgwgresp *mwr;
-	ssize_t rc;
-	size_t msgsize;
 	unsigned char mtcode;
 
-	rc = read(p->sock, msg, sizeof(msg));
-	if (rc < 0) {
-		logwarn("%s %s read error when reading from peer socket",
-		    ifn->ifname, p->name);
-		stats.sockinerr++;
-		peerpark(p);
-		return -1;
-	}
-
-	msgsize = rc;
+	stats->sockin++;
+	stats->sockinsz += msgsize;
 
-	stats.sockin++;
-	stats.sockinsz += msgsize;
-
-	if (rc < 1) {
+	if (msgsize < 1) {
 		if (verbose > 1)
-			loginfox("%s %s peer socket EOF", ifn->ifname, p->name);
-		stats.sockinerr++;
+			loginfox("%s %s empty or oversized datagram from peer",
+			    ifn->ifname, p->name);
+		stats->sockinerr++;
 		return -1;
 	}
 
-	mtcode = msg[0];
+	mtcode = buf[0];
 	if (mtcode >= MTNCODES) {
 		logwarnx("%s %s peer sent unexpected message code %d",
 		    ifn->ifname, p->name, mtcode);
-		stats.sockinerr++;
+		stats->sockinerr++;
 		return -1;
 	}
 
@@ -2451,38 +3415,38 @@ handlesocketmsg(struct peer *p)
 			logwarnx("%s %s peer sent only %zu bytes instead of "
 			    "%zu", ifn->ifname, p->name, msgsize,
 			    msgtypes[mtcode].size);
-			stats.sockinerr++;
+			stats->sockinerr++;
 			return -1;
 		}
 	} else if (msgsize != msgtypes[mtcode].size) {
 		logwarnx("%s %s peer sent %zu bytes instead of %zu",
 		    ifn->ifname, p->name, msgsize, msgtypes[mtcode].size);
-		stats.sockinerr++;
+		stats->sockinerr++;
 		return -1;
 	}
 
-	switch (msg[0]) {
+	switch (mtcode) {
 	case MSGWGINIT:
 		/* 1. handlewginitfrompeer */
-		stats.initin++;
+		stats->initin++;
 
 		if (now - p->sessnext.lastvrfyinit < REKEY_TIMEOUT) {
 			logwarnx("%s %s is flooding us with wginit messages, "
 			    "previous init message only %llu ms ago", ifn->ifname,
 			    p->name, now - p->sessnext.lastvrfyinit);
-			stats.sockinerr++;
-			stats.initinerr++;
+			stats->sockinerr++;
+			stats->initinerr++;
 			return -1;
 		}
 
-		mwi = (struct msgwginit *)msg;
+		mwi = (struct msgwginit *)buf;
 		if (!ws_validmac(mwi->mac1, sizeof(mwi->mac1), mwi,
 		    MAC1OFFSETINIT, ifn->mac1key)) {
 			logwarnx("%s %s init message from peer has an invalid "
 			    "mac1", ifn->ifname, p->name);
-			stats.sockinerr++;
-			stats.initinerr++;
-			stats.invalidmac++;
+			stats->sockinerr++;
+			stats->initinerr++;
+			stats->invalidmac++;
 			return -1;
 		}
 
@@ -2503,9 +3467,9 @@ handlesocketmsg(struct peer *p)
 		break;
 	case MSGWGRESP:
 		/* 2. handlewgrespfrompeer */
-		stats.respin++;
+		stats->respin++;
 
-		mwr = (struct msgwgresp *)msg;
+		mwr = (struct msgwgresp *)buf;
 		if (p->sesstent.id == le32toh(mwr->receiver) &&
 		    (p->sesstent.state == INITSENT ||
 		     p->sesstent.state == RESPRECVD)) {
@@ -2514,9 +3478,9 @@ handlesocketmsg(struct peer *p)
 				logwarnx("%s %s [%x] response message from peer"
 				    " has an invalid mac1", ifn->ifname,
 				    p->name, p->sesstent.id);
-				stats.sockinerr++;
-				stats.respinerr++;
-				stats.invalidmac++;
+				stats->sockinerr++;
+				stats->respinerr++;
+				stats->invalidmac++;
 				return -1;
 			}
 
@@ -2528,7 +3492,7 @@ handlesocketmsg(struct peer *p)
 				exit(1);
 			}
 
-			p->sesstent.state = RESPRECVD;
+			sesstentsetstate(p, RESPRECVD);
 
 			if (verbose > 0)
 				lognoticex("%s %s [%x] got response message "
@@ -2543,23 +3507,26 @@ handlesocketmsg(struct peer *p)
 			    "late or unknown tentative session %x", ifn->ifname,
 			    p->name, p->sesstent.id, le32toh(mwr->receiver));
 
-		stats.sockinerr++;
-		stats.respinerr++;
+		stats->sockinerr++;
+		stats->respinerr++;
 		return -1;
 		break;
 	case MSGWGCOOKIE:
-		logwarnx("%s %s cookies are unsupported", ifn->ifname, p->name);
+		if (forwardcookie(p, (struct msgwgcook *)buf) == -1) {
+			stats->sockinerr++;
+			return -1;
+		}
 		break;
 	case MSGWGDATA:
 		/* 4. handlewgdatafrompeer part 1/2 */
-		if (handlewgdata((struct msgwgdatahdr *)msg, msgsize, p) == -1)
+		if (handlewgdata((struct msgwgdatahdr *)buf, msgsize, p) == -1)
 			return -1;
 
 		break;
 	default:
 		logwarnx("%s %s received unknown message type %d", ifn->ifname,
-		    p->name, msg[0]);
-		stats.sockinerr++;
+		    p->name, mtcode);
+		stats->sockinerr++;
 		return -1;
 	}
 
@@ -2567,36 +3534,153 @@ handlesocketmsg(struct peer *p)
 }
 
 /*
- * Receive and handle one of the messages from the proxy.
+ * Return the established session of "p" that the transport data message in
+ * "buf" of "msgsize" bytes is for, or NULL if "buf" is not a transport data
+ * message of the current or previous session.
+ */
+static struct session *
+datasess(const struct peer *p, const uint8_t *buf, size_t msgsize)
+{
+	const struct msgwgdatahdr *mwdhdr;
+
+	if (msgsize < msgtypes[MSGWGDATA].size || buf[0] != MSGWGDATA)
+		return NULL;
+
+	mwdhdr = (const struct msgwgdatahdr *)buf;
+	if (le32toh(mwdhdr->receiver) == p->sessnext.id)
+		return NULL;
+	if (p->scurr && mwdhdr->receiver == p->scurr->id)
+		return p->scurr;
+	if (p->sprev && mwdhdr->receiver == p->sprev->id)
+		return p->sprev;
+
+	return NULL;
+}
+
+/*
+ * Authenticate and decrypt the first "count" messages in "rxdatav" back to
+ * back and only then commit them and write them to the tunnel device.
+ *
+ * Return 0 on success, -1 if any message failed.
+ */
+static int
+rxdataflush(size_t count)
+{
+	struct rxdata *rd;
+	size_t n;
+	int rc;
+
+	for (n = 0; n < count; n++) {
+		rd = &rxdatav[n];
+		rd->payloadsize = decryptpacket(rd->mwdhdr, rd->mwdsize,
+		    &rd->sess->recvctx, rd->sess->id);
+	}
+
+	rc = 0;
+	for (n = 0; n < count; n++) {
+		rd = &rxdatav[n];
+		if (rd->payloadsize < 0) {
+			rd->sess->peer->stats->unauthenticated++;
+			rc = -1;
+			continue;
+		}
+		if (sessdatacommit(rd->mwdhdr, rd->sess, rd->counter,
+		    rd->payloadsize) == -1)
+			rc = -1;
+	}
+
+	return rc;
+}
+
+/*
+ * Receive and handle all pending messages from the Internet on the socket of
+ * peer "p", up to RECVBATCH at a time.
+ *
+ * Transport data of established sessions is handled in three stages over a
+ * run of consecutive messages: check the session and anti-replay state of each
+ * message, then decrypt all of them and finally commit and route them. Any
+ * other message ends the run so that the order of messages is kept.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handlesocketmsg(struct peer *p)
+{
+	struct session *sess;
+	struct rxdata *rd;
+	size_t staged;
+	int i, n, rc;
+
+	HISTSTART(statspage, HISTSOCKREAD);
+	n = recvbatch(p->sock);
+	HISTSTOP(statspage, HISTSOCKREAD);
+	if (n < 0) {
+		logwarn("%s %s read error when reading from peer socket",
+		    ifn->ifname, p->name);
+		stats->sockinerr++;
+		peerpark(p);
+		return -1;
+	}
+
+	rc = 0;
+	staged = 0;
+	for (i = 0; i < n; i++) {
+		sess = datasess(p, rxring[i].data, rxring[i].len);
+		if (sess == NULL) {
+			if (rxdataflush(staged) == -1)
+				rc = -1;
+			staged = 0;
+
+			if (handlepeermsg(p, rxring[i].data, rxring[i].len)
+			    == -1)
+				rc = -1;
+			continue;
+		}
+
+		stats->sockin++;
+		stats->sockinsz += rxring[i].len;
+
+		rd = &rxdatav[staged];
+		rd->mwdhdr = (struct msgwgdatahdr *)rxring[i].data;
+		rd->mwdsize = rxring[i].len;
+		rd->sess = sess;
+		if (sessdatacheck(rd->mwdhdr, sess, &rd->counter) == -1) {
+			rc = -1;
+			continue;
+		}
+		staged++;
+	}
+
+	if (rxdataflush(staged) == -1)
+		rc = -1;
+
+	return rc;
+}
+
+/*
+ * Handle a message of "msgsize" bytes from the proxy that is in "msg".
  *
  * MSGWGDATA
  *   if data authenticates, reconnect the peer and forward data to tund
+ * MSGWGCOOKIE
+ *   forward to enclave
  *
  * Return 0 on success, -1 on error.
  */
 static int
-handleproxymsg(void)
+handleproxydata(uint32_t ifnid, const union sockaddr_inet *fsa,
+    unsigned char mtcode, size_t msgsize)
 {
-	union sockaddr_inet fsa, lsa;
 	struct msgwgdatahdr *mwdhdr;
+	struct msgwgcook *mwc;
 	struct peer *p;
-	size_t msgsize;
-	uint32_t ifnid;
-	unsigned char mtcode;
-
-	msgsize = sizeof(msg);
-	if (wire_recvproxymsg(pport, &ifnid, &lsa, &fsa, &mtcode, msg,
-	    &msgsize) == -1) {
-		logwarnx("%s proxy read error", ifn->ifname);
-		exit(1);
-	}
 
-	stats.proxin++;
+	stats->proxin++;
 
 	if (ifnid != ifn->id) {
 		logwarnx("%s %s wrong interface id from proxy %d instead of %d", ifn->ifname,
 		    ifn->ifname, ifnid, ifn->id);
-		stats.proxinerr++;
+		stats->proxinerr++;
 		return -1;
 	}
 
@@ -2606,7 +3690,7 @@ handleproxymsg(void)
 		if (!findpeerbysessid(mwdhdr->receiver, &p)) {
 			logwarnx("%s %s invalid session id via proxy %x", ifn->ifname,
 			    ifn->ifname, le32toh(mwdhdr->receiver));
-			stats.proxinerr++;
+			stats->proxinerr++;
 			return -1;
 		}
 
@@ -2614,24 +3698,425 @@ handleproxymsg(void)
 			logwarnx("%s %s data for unusable session received via "
 			    "proxy %x", ifn->ifname, p->name,
 			    le32toh(mwdhdr->receiver));
-			stats.proxinerr++;
+			stats->proxinerr++;
+			return -1;
+		}
+
+		if (peerconnect(p, (struct sockaddr *)fsa) == -1) {
+			stats->sockouterr++;
+			return -1;
+		}
+
+		break;
+	case MSGWGCOOKIE:
+		mwc = (struct msgwgcook *)msg;
+		if (!findpeerbysessid(mwc->receiver, &p)) {
+			logwarnx("%s %s invalid session id via proxy %x", ifn->ifname,
+			    ifn->ifname, le32toh(mwc->receiver));
+			stats->proxinerr++;
+			return -1;
+		}
+
+		if (forwardcookie(p, mwc) == -1) {
+			stats->proxinerr++;
 			return -1;
 		}
 
-		if (peerconnect(p, (struct sockaddr *)&fsa) == -1) {
-			stats.sockouterr++;
-			return -1;
+		break;
+	default:
+		logwarnx("%s proxy sent unknown message %c", ifn->ifname,
+		    mtcode);
+		stats->proxinerr++;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Handle the messages in the ring from the proxy. Handle at most one round so
+ * that the proxy can not keep us busy. If the ring is not empty after that,
+ * "pringpending" is set and the event loop drains the ring again without
+ * waiting, since the proxy only rings the doorbell once the ring was empty.
+ *
+ * Return 0 on success, -1 if any message could not be handled.
+ */
+static int
+drainpring(void)
+{
+	union sockaddr_inet fsa, lsa;
+	size_t msgsize, n;
+	uint32_t ifnid;
+	unsigned char mtcode;
+	int rc;
+
+	pringpending = 0;
+
+	rc = 0;
+	for (n = 0; n < pring.nslots; n++) {
+		msgsize = sizeof(msg);
+		switch (wire_ringget(&pring, &ifnid, &lsa, &fsa, &mtcode, msg,
+		    &msgsize)) {
+		case 0:
+			return rc;
+		case -1:
+			logwarnx("%s invalid message in proxy ring",
+			    ifn->ifname);
+			stats->proxinerr++;
+			rc = -1;
+			break;
+		default:
+			if (handleproxydata(ifnid, &fsa, mtcode, msgsize) == -1)
+				rc = -1;
+		}
+	}
+
+	pringpending = 1;
+
+	return rc;
+}
+
+/*
+ * Receive and handle one of the messages from the proxy. If there is a ring
+ * with the proxy, handle everything in the ring as well. Besides on a
+ * MSGDOORBELL this is done on every message so that a ring that filled up
+ * while the doorbell was not rung is drained as soon as the proxy falls back
+ * to the port.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handleproxymsg(void)
+{
+	union sockaddr_inet fsa, lsa;
+	size_t msgsize;
+	uint32_t ifnid;
+	unsigned char mtcode;
+	int rc;
+
+	msgsize = sizeof(msg);
+	if (wire_recvproxymsg(pport, &ifnid, &lsa, &fsa, &mtcode, msg,
+	    &msgsize) == -1) {
+		logwarnx("%s proxy read error", ifn->ifname);
+		exit(1);
+	}
+
+	rc = 0;
+	if (mtcode != MSGDOORBELL)
+		rc = handleproxydata(ifnid, &fsa, mtcode, msgsize);
+
+	if (pring.shm == NULL)
+		return rc;
+
+	if (drainpring() == -1)
+		rc = -1;
+
+	return rc;
+}
+
+/*
+ * Stop using "peer" because it is no longer configured. All sessions are
+ * destroyed, queued packets are dropped and the socket is parked. The peer
+ * structure and its sockets are kept so that the slot can be used by a peer
+ * that is added by a later reload.
+ */
+static void
+peerremove(struct peer *peer)
+{
+	if (peer->sesstent.state >= INITSENT) {
+		if (notifyproxy(peer->id, htole32(peer->sesstent.id),
+		    SESSIDDESTROY) == -1)
+			logwarnx("%s %s [%x] proxy notification of destroyed "
+			    "tentative session id failed", ifn->ifname,
+			    peer->name, peer->sesstent.id);
+	}
+	if (peer->sesstent.state != STINACTIVE)
+		sesstentclear(peer, 1);
+
+	if (peer->sessnext.state != SNINACTIVE) {
+		if (notifyproxy(peer->id, htole32(peer->sessnext.id),
+		    SESSIDDESTROY) == -1)
+			logwarnx("%s %s (%x) proxy notification of destroyed "
+			    "next session id failed", ifn->ifname, peer->name,
+			    peer->sessnext.id);
+		sessnextclear(peer, 1);
+	}
+
+	if (peer->sprev) {
+		sessdestroy(peer->sprev);
+		peer->sprev = NULL;
+	}
+
+	if (peer->scurr) {
+		sessdestroy(peer->scurr);
+		peer->scurr = NULL;
+	}
+
+	peer->qpackethead = 0;
+	peer->qpackets = 0;
+	peer->qpacketsdatasz = 0;
+	peer->fqnext = NULL;
+	peer->fqdeficit = 0;
+	peer->fqactive = 0;
+
+	if (peer->sock != -1)
+		peerpark(peer);
+
+	peer->removed = 1;
+}
+
+/*
+ * Handle a reload of the configuration by the master. The master sends every
+ * peer slot in order of peer id. The allowed ips and endpoint of each peer are
+ * replaced, slots that are no longer used are removed and slots that are taken
+ * by a new peer are added. The sessions of all other peers are left alone.
+ * Other settings require a restart.
+ *
+ * The new routing tables are built before anything is changed so that an
+ * invalid configuration leaves the running one intact.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handlemastermsg(void)
+{
+	static union {
+		struct speer peer;
+		struct scidraddr cidraddr;
+	} smsg;
+	struct msgreload mrl;
+	struct wire_bulk bulk;
+	struct peerreload *prv, *pr;
+	struct rtnode *rt6, *rt4;
+	struct cidraddr *arena, *allowedip;
+	struct peer *peer;
+	size_t msgsize, m, n, i, nallowedips, peerips;
+	unsigned char mtcode;
+	char addrstr[MAXADDRSTR];
+	int added, bulkfd;
+
+	msgsize = sizeof(mrl);
+	if (wire_recvmsgfd(mport, &mtcode, &mrl, &msgsize, &bulkfd) == -1) {
+		logwarnx("%s master read error", ifn->ifname);
+		return -1;
+	}
+
+	if (mtcode != MSGRELOAD) {
+		logwarnx("%s master sent an unexpected message %d",
+		    ifn->ifname, mtcode);
+		if (bulkfd != -1)
+			close(bulkfd);
+		return -1;
+	}
+
+	if (bulkfd == -1) {
+		logwarnx("%s reload without peers", ifn->ifname);
+		return -1;
+	}
+
+	mrl.ifname[sizeof(mrl.ifname) - 1] = '\0';
+	if (strcmp(mrl.ifname, ifn->ifname) != 0 ||
+	    mrl.worker != ifn->worker || mrl.workers != ifn->workers) {
+		logwarnx("%s reload is for %s worker %zu of %zu, restart "
+		    "required", ifn->ifname, mrl.ifname, mrl.worker,
+		    mrl.workers);
+		close(bulkfd);
+		return -1;
+	}
+
+	if (wire_bulkmap(&bulk, bulkfd, mrl.bulksize) == -1) {
+		logwarn("%s map reload error", ifn->ifname);
+		close(bulkfd);
+		return -1;
+	}
+	if (close(bulkfd) == -1) {
+		logwarn("%s close reload error", ifn->ifname);
+		exit(1);
+	}
+
+	arena = NULL;
+	prv = NULL;
+	rt6 = NULL;
+	rt4 = NULL;
+
+	if (mrl.npeers != ifn->peerssize) {
+		logwarnx("%s reload has %zu peer slots instead of %zu, restart "
+		    "required", ifn->ifname, mrl.npeers, ifn->peerssize);
+		goto err;
+	}
+
+	arena = calloc(mrl.nallowedips, sizeof(*arena));
+	if (arena == NULL && mrl.nallowedips > 0) {
+		logwarn("%s calloc allowedips", ifn->ifname);
+		exit(1);
+	}
+
+	prv = calloc(ifn->peerssize, sizeof(*prv));
+	if (prv == NULL && ifn->peerssize > 0) {
+		logwarn("%s calloc peerreload", ifn->ifname);
+		exit(1);
+	}
+
+	nallowedips = 0;
+	for (m = 0; m < mrl.npeers; m++) {
+		msgsize = sizeof(smsg);
+		if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize) == -1 ||
+		    mtcode != SPEER) {
+			logwarnx("%s reload SPEER expected", ifn->ifname);
+			goto err;
+		}
+
+		if (smsg.peer.peerid != m) {
+			logwarnx("%s reload peer %u out of order", ifn->ifname,
+			    smsg.peer.peerid);
+			goto err;
+		}
+
+		smsg.peer.name[sizeof(smsg.peer.name) - 1] = '\0';
+
+		peer = NULL;
+		if (!smsg.peer.unused) {
+			peer = &ifn->peers[m];
+			pr = &prv[m];
+			pr->found = 1;
+			memcpy(&pr->fsa, &smsg.peer.fsa, sizeof(pr->fsa));
+			snprintf(pr->name, sizeof(pr->name), "%s",
+			    smsg.peer.name);
+			pr->allowedipssize = smsg.peer.nallowedips;
+			if (pr->allowedipssize > 0)
+				pr->allowedips = &arena[nallowedips];
+		}
+
+		peerips = smsg.peer.nallowedips;
+		for (i = 0; i < peerips; i++) {
+			if (nallowedips == mrl.nallowedips) {
+				logwarnx("%s more allowedips than announced",
+				    ifn->ifname);
+				goto err;
+			}
+			allowedip = &arena[nallowedips++];
+
+			msgsize = sizeof(smsg);
+			if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize)
+			    == -1 || mtcode != SCIDRADDR) {
+				logwarnx("%s reload SCIDRADDR expected",
+				    ifn->ifname);
+				goto err;
+			}
+
+			if (peer == NULL)
+				continue;
+
+			allowedip->prefixlen = smsg.cidraddr.prefixlen;
+			memcpy(&allowedip->addr, &smsg.cidraddr.addr,
+			    MIN(sizeof allowedip->addr,
+			    sizeof smsg.cidraddr.addr));
+
+			if (routeadd(&rt6, &rt4, peer, allowedip) == -1)
+				goto err;
+		}
+	}
+
+	if (bulk.off != bulk.size) {
+		logwarnx("%s trailing reload", ifn->ifname);
+		goto err;
+	}
+	if (wire_bulkunmap(&bulk, 1) == -1) {
+		logwarn("%s unmap reload", ifn->ifname);
+		exit(1);
+	}
+
+	/* the new configuration is valid, switch over */
+
+	for (n = 0; n < ifn->peerssize; n++) {
+		peer = &ifn->peers[n];
+		pr = &prv[n];
+
+		peer->allowedips = pr->allowedips;
+		peer->allowedipssize = pr->allowedipssize;
+
+		if (!pr->found) {
+			if (!peer->removed) {
+				peerremove(peer);
+				lognoticex("%s %s peer removed", ifn->ifname,
+				    peer->name);
+			}
+			continue;
+		}
+
+		if (strcmp(peer->name, pr->name) != 0) {
+			free(peer->name);
+			if ((peer->name = strdup(pr->name)) == NULL) {
+				logwarn("%s strdup peer name", ifn->ifname);
+				exit(1);
+			}
+			snprintf(peer->stats->name, sizeof(peer->stats->name),
+			    "%s", peer->name);
+		}
+
+		/* a new peer in a slot that was not in use */
+		added = peer->removed;
+		if (added) {
+			peer->removed = 0;
+			lognoticex("%s %s peer added", ifn->ifname,
+			    peer->name);
+		}
+
+		if (!added &&
+		    memcmp(&peer->fsa, &pr->fsa, sizeof(peer->fsa)) == 0)
+			continue;
+
+		memcpy(&peer->fsa, &pr->fsa, sizeof(peer->fsa));
+
+		if (peer->fsa.h.family != AF_INET6 &&
+		    peer->fsa.h.family != AF_INET)
+			continue;
+
+		if (verbose > 0) {
+			addrtostr(addrstr, sizeof(addrstr),
+			    (struct sockaddr *)&peer->fsa, 0);
+			lognoticex("%s %s endpoint changed to %s", ifn->ifname,
+			    peer->name, addrstr);
 		}
 
-		break;
-	default:
-		logwarnx("%s proxy sent unknown message %c", ifn->ifname,
-		    mtcode);
-		stats.proxinerr++;
-		return -1;
+		if (peerowned(peer) &&
+		    peerconnect(peer, (struct sockaddr *)&peer->fsa) == -1)
+			logwarnx("%s %s peerconnect error when connecting "
+			    "socket to new endpoint", ifn->ifname, peer->name);
 	}
 
+	rtfree(ifn->rt6);
+	rtfree(ifn->rt4);
+	ifn->rt6 = rt6;
+	ifn->rt4 = rt4;
+
+	free(allowedipsarena);
+	allowedipsarena = arena;
+
+	free(prv);
+
+	explicit_bzero(&smsg, sizeof(smsg));
+
+	if (verbose > 0)
+		lognoticex("%s configuration reloaded", ifn->ifname);
+
 	return 0;
+
+err:
+	rtfree(rt6);
+	rtfree(rt4);
+
+	free(prv);
+	free(arena);
+
+	if (wire_bulkunmap(&bulk, 1) == -1) {
+		logwarn("%s unmap reload", ifn->ifname);
+		exit(1);
+	}
+
+	explicit_bzero(&smsg, sizeof(smsg));
+
+	return -1;
 }
 
 /*
@@ -2652,22 +4137,14 @@ utime(const struct timespec *tp)
  * Handle rekey- and keepalive session timeout.
  */
 static void
-sesshandletimeout(struct kevent *ev)
+sesshandletimeout(uint32_t id, struct peer *peer)
 {
 	struct session *sess;
-	struct peer *peer;
 
 	if (verbose > 2)
-		logdebugx("%s handle timeout %lx", ifn->ifname, ev->ident);
-
-	if (!findpeerbysessid(htole32(ev->ident), &peer)) {
-		logwarnx("%s timer with unknown session id went off %lx",
-		    ifn->ifname, ev->ident);
-		return;
-	}
+		logdebugx("%s handle timeout %x", ifn->ifname, id);
 
-	if (peer->sesstent.id >= 0 &&
-	    ev->ident == (uint32_t)peer->sesstent.id) {
+	if (peer->sesstent.id >= 0 && id == (uint32_t)peer->sesstent.id) {
 		if (verbose > 1)
 			loginfox("%s %s [%x] rekey timer went off", ifn->ifname,
 			    peer->name, peer->sesstent.id);
@@ -2702,13 +4179,13 @@ sesshandletimeout(struct kevent *ev)
 	 * Must be a keepalive on either the current or the previous session.
 	 */
 
-	if (peer->scurr && ev->ident == le32toh(peer->scurr->id)) {
+	if (peer->scurr && id == le32toh(peer->scurr->id)) {
 		sess = peer->scurr;
-	} else if (peer->sprev && ev->ident == le32toh(peer->sprev->id)) {
+	} else if (peer->sprev && id == le32toh(peer->sprev->id)) {
 		sess = peer->sprev;
 	} else {
-		logwarnx("%s %s timer with unknown session id went off %lx",
-		    ifn->ifname, peer->name, ev->ident);
+		logwarnx("%s %s timer with unknown session id went off %x",
+		    ifn->ifname, peer->name, id);
 		return;
 	}
 
@@ -2718,45 +4195,190 @@ sesshandletimeout(struct kevent *ev)
 
 	sess->kaset = 0;
 
-	if (encryptandsend(msg, sizeof(msg), NULL, 0, sess) == -1)
+	if (encryptandsend(msg, sizeof(msg), 0, sess) == -1)
 		logwarn("%s %s %x encryptandsend error", ifn->ifname,
 		    peer->name, le32toh(sess->id));
 }
 
+/*
+ * Move all timers in slot "idx" of "level" to the lower levels of the wheel.
+ */
+static void
+wheelcascade(int level, size_t idx)
+{
+	struct timerlist *slot;
+	struct timer *t;
+
+	slot = &wheel.slots[level][idx];
+	while ((t = LIST_FIRST(slot)) != NULL) {
+		LIST_REMOVE(t, entry);
+		wheeladd(t);
+	}
+}
+
+/*
+ * Run all timers that expire at or before tick "to".
+ */
+static void
+wheeladvance(uint64_t to)
+{
+	struct timerlist *slot;
+	struct timer *t;
+	int level;
+
+	while (wheel.curtick <= to) {
+		if (wheel.pending == 0) {
+			wheel.curtick = to + 1;
+			return;
+		}
+
+		for (level = 1; level < TIMERLEVELS; level++) {
+			if ((wheel.curtick >> (TIMERBITS * (level - 1))) &
+			    (TIMERSLOTS - 1))
+				break;
+			wheelcascade(level, (wheel.curtick >>
+			    (TIMERBITS * level)) & (TIMERSLOTS - 1));
+		}
+
+		slot = &wheel.slots[0][wheel.curtick & (TIMERSLOTS - 1)];
+		while ((t = LIST_FIRST(slot)) != NULL) {
+			LIST_REMOVE(t, entry);
+			t->pending = 0;
+			wheel.pending--;
+			sesshandletimeout(t->id, t->peer);
+		}
+
+		wheel.curtick++;
+	}
+}
+
+/*
+ * Return the tick of the earliest pending timer. The slots of each level are
+ * ordered by time starting at the current position, so only the first
+ * non-empty slot of each level has to be inspected. Once the current slot of a
+ * higher level is cascaded it only holds timers a full revolution away and is
+ * checked last.
+ */
+static uint64_t
+wheelnext(void)
+{
+	struct timer *t;
+	uint64_t next;
+	size_t idx, n;
+	int level, found;
+
+	next = UINT64_MAX;
+	for (level = 0; level < TIMERLEVELS; level++) {
+		idx = (wheel.curtick >> (TIMERBITS * level)) & (TIMERSLOTS - 1);
+		if (wheel.curtick & (((uint64_t)1 << (TIMERBITS * level)) - 1))
+			idx++;
+
+		found = 0;
+		for (n = 0; n < TIMERSLOTS && !found; n++) {
+			LIST_FOREACH(t, &wheel.slots[level][(idx + n) &
+			    (TIMERSLOTS - 1)], entry) {
+				found = 1;
+				if (t->expires < next)
+					next = t->expires;
+			}
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Arm the kernel timer for the nearest deadline in the timer wheel, unless a
+ * kernel timer is already armed that does not go off later. A kernel timer
+ * that goes off early is harmless, it only advances the wheel.
+ *
+ * Return the number of changes written to "chg", either 0 or 1.
+ */
+static int
+wheelarm(struct kevent *chg)
+{
+	uint64_t next;
+	utime_t wait;
+
+	if (wheel.pending == 0 || wheel.armed != 0)
+		return 0;
+
+	next = wheelnext();
+	if (next * 1000 > now)
+		wait = (next * 1000 - now + 999) / 1000;
+	else
+		wait = 1;
+
+	EV_SET(chg, 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, wait, NULL);
+	wheel.armed = next;
+
+	return 1;
+}
+
+/*
+ * Size the buffers of a channel between two workers so that a burst of packets
+ * fits in.
+ *
+ * Exit on error.
+ */
+static void
+setworkerbuf(int s)
+{
+	socklen_t len;
+
+	len = MAXRECVBUF;
+	if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &len, sizeof len) == -1 ||
+	    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &len, sizeof len) == -1) {
+		logwarn("%s setsockopt worker buffer", ifn->ifname);
+		exit(1);
+	}
+}
+
 /*
  * Setup read listeners for:
  *    proxy port
  *    enclave port
- *    tunnel device
+ *    tunnel device, or the channel with worker 0
+ *    channels with the other workers
  *
  * Handle events.
  *
  * Exit on error.
- *
- * TODO
- *     MSGWGCOOKIE -> csock
  */
 void
 ifn_serv(void)
 {
+	static const struct timespec nowait = { 0, 0 };
+	static const struct timespec logwait = { 1, 0 };
+	const struct timespec *timeout;
 	struct peer *peer;
-	struct kevent *ev;
+	struct kevent *ev, chg;
 	struct timespec ts;
 	size_t evsize, maxevsize, n;
-	int nev, i;
+	int nev, nchg, i, flags;
 
 	if ((kq = kqueue()) == -1) {
 		logwarn("%s kqueue", ifn->ifname);
 		exit(1);
 	}
 
+	batchinit();
+
+	/* never block while draining the device */
+	if ((flags = fcntl(tund, F_GETFL)) == -1 ||
+	    fcntl(tund, F_SETFL, flags | O_NONBLOCK) == -1) {
+		logwarn("%s fcntl tund", ifn->ifname);
+		exit(1);
+	}
+
 	/*
-	 * Allocate space for events on eport, pport and tund and future
-	 * per-peer events. Each peer has:
-	 *    four sessions, one socket and two timers;
+	 * Allocate space for events on eport, pport, tund and the master, the
+	 * timer wheel, the other workers and future per-peer events. Each peer
+	 * has:
+	 *    four sessions and one socket;
 	 */
-	evsize = 3;
-	maxevsize = evsize + ifn->peerssize * (4 + 1 + 2);
+	evsize = 4;
+	maxevsize = evsize + 1 + ifn->workers + ifn->peerssize * (4 + 1);
 	if ((ev = calloc(maxevsize, sizeof(*ev))) == NULL) {
 		logwarn("%s calloc ev", ifn->ifname);
 		exit(1);
@@ -2765,21 +4387,51 @@ ifn_serv(void)
 	EV_SET(&ev[0], eport, EVFILT_READ, EV_ADD, 0, 0, NULL);
 	EV_SET(&ev[1], pport, EVFILT_READ, EV_ADD, 0, 0, NULL);
 	EV_SET(&ev[2], tund, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	EV_SET(&ev[3], mport, EVFILT_READ, EV_ADD, 0, 0, NULL);
 
 	if (kevent(kq, ev, evsize, NULL, 0, NULL) == -1) {
 		logwarn("%s kevent", ifn->ifname);
 		exit(1);
 	}
 
+	/*
+	 * Worker 0 reads decrypted packets from the other workers, registered
+	 * with the interface to tell them apart from peer sockets. For the
+	 * other workers the channel with worker 0 takes the place of the device.
+	 */
+	if (ifn->worker > 0)
+		setworkerbuf(tund);
+
+	for (n = 1; ifn->worker == 0 && n < ifn->workers; n++) {
+		setworkerbuf(ifn->workerports[n]);
+
+		if ((flags = fcntl(ifn->workerports[n], F_GETFL)) == -1 ||
+		    fcntl(ifn->workerports[n], F_SETFL, flags | O_NONBLOCK)
+		    == -1) {
+			logwarn("%s fcntl worker", ifn->ifname);
+			exit(1);
+		}
+
+		EV_SET(&ev[0], ifn->workerports[n], EVFILT_READ, EV_ADD, 0, 0,
+		    ifn);
+		if (kevent(kq, ev, 1, NULL, 0, NULL) == -1) {
+			logwarn("%s kevent worker", ifn->ifname);
+			exit(1);
+		}
+	}
+
 	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
 		logwarn("%s %s clock_gettime", ifn->ifname, __func__);
 		exit(1);
 	}
 	now = utime(&ts);
+	wheel.curtick = now / 1000;
 
 	/* Connect to peers with known end-points. */
 	for (n = 0; n < ifn->peerssize; n++) {
-		peer = ifn->peers[n];
+		peer = &ifn->peers[n];
+		if (!peerowned(peer))
+			continue;
 		if ((peer->fsa.h.family == AF_INET6 ||
 		    peer->fsa.h.family == AF_INET) &&
 		    peerconnect(peer, (struct sockaddr *)&peer->fsa) == -1)
@@ -2792,9 +4444,13 @@ ifn_serv(void)
 		lognoticex("%s ready, waiting for the first data to start a new"
 		    " WireGuard session", ifn->ifname);
 
+	logdefer(1);
+
 	for (;;) {
 		if (logstats) {
+			logdefer(0);
 			ifn_loginfo();
+			logdefer(1);
 			logstats = 0;
 		}
 
@@ -2805,8 +4461,24 @@ ifn_serv(void)
 			exit(1);
 		}
 
-		if ((nev = kevent(kq, NULL, 0, ev, maxevsize, NULL)) == -1) {
+		/* piggyback the kernel timer on the wait for events */
+		nchg = wheelarm(&chg);
+
+		/*
+		 * Wake up in time to report suppressed log messages, don't wait
+		 * at all if the ring from the proxy still holds messages.
+		 */
+		timeout = logflush() ? &logwait : NULL;
+		if (pringpending)
+			timeout = &nowait;
+
+		HISTSTART(statspage, HISTKEVENT);
+		nev = kevent(kq, &chg, nchg, ev, maxevsize, timeout);
+		HISTSTOP(statspage, HISTKEVENT);
+		if (nev == -1) {
 			if (errno == EINTR) {
+				/* make sure the kernel timer is set */
+				wheel.armed = 0;
 				continue;
 			} else {
 				logwarn("%s kevent", ifn->ifname);
@@ -2814,7 +4486,7 @@ ifn_serv(void)
 			}
 		}
 
-		if (nev == 0) {
+		if (nev == 0 && timeout == NULL) {
 			if (verbose > 0)
 				lognoticex("%s %s kevent but no events", ifn->ifname,
 				    ifn->ifname);
@@ -2827,30 +4499,44 @@ ifn_serv(void)
 		}
 		now = utime(&ts);
 
+		wheeladvance(now / 1000);
+
+		if (pringpending && drainpring() == -1)
+			logwarnx("%s proxy error", ifn->ifname);
+
 		for (i = 0; i < nev; i++) {
 			if (ev[i].filter == EVFILT_TIMER) {
-				/* session timer */
-				sesshandletimeout(&ev[i]);
+				/* timer wheel, already advanced */
+				wheel.armed = 0;
 			} else if ((int)ev[i].ident == eport) {
 				if (handleenclavemsg() == -1)
 					logwarnx("%s enclave error",
 					    ifn->ifname);
 			} else if ((int)ev[i].ident == tund) {
-				handletundmsg();
+				handletund(&ev[i]);
 			} else if ((int)ev[i].ident == pport) {
 				if (handleproxymsg() == -1)
 					logwarnx("%s proxy error", ifn->ifname);
-			} else {
-				/* find peer by socket */
-				/* XXX log(n) */
-				for (peer = NULL, n = 0; n < ifn->peerssize &&
-				    peer == NULL; n++) {
-					if ((int)ev[i].ident ==
-					    ifn->peers[n]->sock) {
-						peer = ifn->peers[n];
-					}
+			} else if ((int)ev[i].ident == mport) {
+				if (ev[i].flags & EV_EOF) {
+					logwarnx("%s master went away",
+					    ifn->ifname);
+					exit(1);
 				}
-				if (peer) {
+				if (handlemastermsg() == -1)
+					logwarnx("%s reload error",
+					    ifn->ifname);
+			} else if (ev[i].udata == ifn) {
+				handleworker(&ev[i]);
+			} else {
+				/*
+				 * Peer sockets are registered with their peer.
+				 * Skip the event if peerconnect switched the
+				 * peer to another socket while handling an
+				 * earlier event in this batch.
+				 */
+				peer = ev[i].udata;
+				if (peer && (int)ev[i].ident == peer->sock) {
 					/* INCOMING DATA */
 					handlesocketmsg(peer);
 				} else {
@@ -2859,6 +4545,9 @@ ifn_serv(void)
 				}
 			}
 		}
+
+		txflush();
+		rekeyrun();
 	}
 }
 
@@ -2929,21 +4618,50 @@ opentunnel(const char *ifname, const char *ifdesc, int setflags)
 }
 
 /*
- * Return a newly allocated peer on success, NULL on failure.
+ * Allocate a zeroed array of "nmemb" members of "size" bytes that starts on a
+ * cache line.
  *
- * The caller should never free the allocated structure.
+ * Return NULL if "nmemb" is 0. Exit on failure.
  */
-static struct peer *
-peernew(uint32_t id, const char *name, size_t nallowedips,
-    const union sockaddr_inet *faddr)
+static void *
+xcallocline(size_t nmemb, size_t size)
 {
-	struct peer *peer;
+	void *p;
+	int rc;
 
-	if ((peer = malloc(sizeof(*peer))) == NULL) {
-		logwarn("%s %s malloc peer", ifn->ifname, __func__);
+	if (nmemb == 0)
+		return NULL;
+
+	if (size == 0 || nmemb > SIZE_MAX / size) {
+		logwarnx("%s %s overflow", ifn->ifname, __func__);
+		exit(1);
+	}
+
+	if ((rc = posix_memalign(&p, CACHELINESIZE, nmemb * size)) != 0) {
+		errno = rc;
+		logwarn("%s %s", ifn->ifname, __func__);
 		exit(1);
 	}
 
+	memset(p, 0, nmemb * size);
+
+	return p;
+}
+
+/*
+ * Initialize the peer with "id" in "ifn->peers". "allowedips" must point to
+ * the "nallowedips" consecutive allowed ips of the peer.
+ *
+ * Return the peer.
+ */
+static struct peer *
+peernew(uint32_t id, const char *name, struct cidraddr *allowedips,
+    size_t nallowedips, const union sockaddr_inet *faddr)
+{
+	struct peer *peer;
+
+	peer = &ifn->peers[id];
+
 	peer->id = id;
 	peer->name = strdup(name);
 	peer->sock = -1;
@@ -2952,21 +4670,28 @@ peernew(uint32_t id, const char *name, size_t nallowedips,
 	peer->portsock4 = NULL;
 	peer->portsock6count = 0;
 	peer->portsock4count = 0;
-	peer->prefixlen = 0;
+	peer->sessv = &sessarena[id * 2];
+	peer->qpacketv = &qpacketarena[id * MAXQUEUEPACKETS];
+	peer->qpackethead = 0;
 	peer->qpackets = 0;
 	peer->qpacketsdatasz = 0;
-	SIMPLEQ_INIT(&peer->qpacketlist);
+	peer->fqnext = NULL;
+	peer->fqdeficit = 0;
+	peer->fqactive = 0;
+	peer->rknext = NULL;
+	peer->rkqueued = 0;
+	peer->stats = &statspage->peers[id];
+	peer->stats->owned = peerowned(peer);
+	snprintf(peer->stats->name, sizeof(peer->stats->name), "%s", name);
+	memset(peer->timers, 0, sizeof(peer->timers));
+	peer->allowedips = allowedips;
 	peer->allowedipssize = nallowedips;
+	peer->sesstent.id = -1;
+	peer->sessnext.id = -1;
+	peer->removed = 0;
 
 	memcpy(&peer->fsa, faddr, MIN(sizeof peer->fsa, sizeof *faddr));
 
-	peer->allowedips = reallocarray(NULL, peer->allowedipssize,
-	    sizeof *peer->allowedips);
-	if (peer->allowedips == NULL) {
-		logwarn("%s reallocarray peer->allowedips error", ifn->ifname);
-		exit(1);
-	}
-
 	sesstentclear(peer, 0);
 	sessnextclear(peer, 0);
 	peer->scurr = peer->sprev = NULL;
@@ -3037,12 +4762,19 @@ xaddportsock(struct peer *peer, in_port_t port, int isv6)
 		exit(1);
 	}
 
-	len = MAXRECVBUF;
+	len = ifn->rcvbuf;
 	if (setsockopt(ps->s, SOL_SOCKET, SO_RCVBUF, &len, sizeof len) == -1) {
 		logwarn("%s setsockopt rcvbuf error", ifn->ifname);
 		exit(1);
 	}
 
+	len = ifn->sndbuf;
+	if (len > 0 &&
+	    setsockopt(ps->s, SOL_SOCKET, SO_SNDBUF, &len, sizeof len) == -1) {
+		logwarn("%s setsockopt sndbuf error", ifn->ifname);
+		exit(1);
+	}
+
 	if (bind(ps->s, sa, sa->sa_len) == -1) {
 		logwarn("%s %s bind on port %u failed", ifn->ifname, __func__, ntohs(port));
 		exit(1);
@@ -3070,7 +4802,6 @@ xaddportsock(struct peer *peer, in_port_t port, int isv6)
 static void
 recvconfig(int masterport)
 {
-	char addrstr[MAXADDRSTR];
 	union inet_addr inet_addr;
 	static union {
 		struct sinit init;
@@ -3079,16 +4810,19 @@ recvconfig(int masterport)
 		struct scidraddr cidraddr;
 		struct seos eos;
 	} smsg;
-	struct cidraddr *ifaddr, *allowedip, *addr;
+	struct wire_bulk bulk;
+	struct cidraddr *ifaddr, *allowedip, *ifaddrv, *allowedipv;
 	struct sockaddr_in *sin;
 	struct sockaddr_in6 *sin6;
-	struct peer *peer, *peer2;
-	size_t m, msgsize, n, i;
+	struct peer *peer;
+	size_t m, msgsize, n, i, nallowedips;
 	unsigned char mtcode;
-	char addrp[INET6_ADDRSTRLEN];
+	char statsname[32];
+	int statsfd, bulkfd;
 
 	msgsize = sizeof(smsg);
-	if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
+	if (wire_recvmsgfd(masterport, &mtcode, &smsg, &msgsize, &bulkfd)
+	    == -1) {
 		logwarnx("ifn wire_recvmsg SINIT %d", masterport);
 		exit(1);
 	}
@@ -3103,6 +4837,21 @@ recvconfig(int masterport)
 	gid = smsg.init.gid;
 	eport = smsg.init.enclport;
 	pport = smsg.init.proxport;
+	statsfd = smsg.init.statsfd;
+
+	/* map the bulk configuration, the descriptor is not needed after */
+	if (bulkfd == -1) {
+		logwarnx("ifn no bulk configuration");
+		exit(1);
+	}
+	if (wire_bulkmap(&bulk, bulkfd, smsg.init.bulksize) == -1) {
+		logwarn("ifn map bulk configuration error");
+		exit(1);
+	}
+	if (close(bulkfd) == -1) {
+		logwarn("ifn close bulk configuration error");
+		exit(1);
+	}
 
 	msgsize = sizeof(smsg);
 	if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
@@ -3121,6 +4870,7 @@ recvconfig(int masterport)
 
 	ifn->id = smsg.ifn.ifnid;
 	ifn->peerssize = smsg.ifn.npeers;
+	nallowedips = smsg.ifn.nallowedips;
 	ifn->ifname = strdup(smsg.ifn.ifname);
 	if (strlen(smsg.ifn.ifdesc) > 0)
 		ifn->ifdesc = strdup(smsg.ifn.ifdesc);
@@ -3134,6 +4884,75 @@ recvconfig(int masterport)
 	    MIN(sizeof ifn->mac1key, sizeof smsg.ifn.mac1key));
 	memcpy(ifn->cookiekey, smsg.ifn.cookiekey,
 	    MIN(sizeof ifn->cookiekey, sizeof smsg.ifn.cookiekey));
+	ifn->rt6 = NULL;
+	ifn->rt4 = NULL;
+	ifn->tunbudget = smsg.ifn.tunbudget;
+	if (ifn->tunbudget == 0)
+		ifn->tunbudget = TUNBUDGET;
+	ifn->fqquantum = smsg.ifn.fqquantum;
+	if (ifn->fqquantum > MAXFQQUANTUM) {
+		logwarnx("%s fair queue quantum too large", ifn->ifname);
+		exit(1);
+	}
+	if (smsg.ifn.sndbuf > MAXSOCKBUF || smsg.ifn.rcvbuf > MAXSOCKBUF) {
+		logwarnx("%s socket buffer size too large", ifn->ifname);
+		exit(1);
+	}
+	ifn->sndbuf = smsg.ifn.sndbuf;
+	ifn->rcvbuf = smsg.ifn.rcvbuf;
+	if (ifn->rcvbuf == 0)
+		ifn->rcvbuf = MAXRECVBUF;
+	ifn->worker = smsg.ifn.worker;
+	ifn->workers = smsg.ifn.workers;
+	if (ifn->workers == 0)
+		ifn->workers = 1;
+	if (ifn->workers > MAXWORKERS || ifn->worker >= ifn->workers) {
+		logwarnx("%s invalid worker %zu of %zu", ifn->ifname,
+		    ifn->worker, ifn->workers);
+		exit(1);
+	}
+	memcpy(ifn->workerports, smsg.ifn.workerports,
+	    sizeof(ifn->workerports));
+
+	/* map the ring from the proxy, the descriptor is not needed after */
+	if (smsg.ifn.ringslots > 0) {
+		if (!isopenfd(smsg.ifn.ringfd)) {
+			logwarnx("%s ring %d not open", ifn->ifname,
+			    smsg.ifn.ringfd);
+			exit(1);
+		}
+		if (wire_ringmap(&pring, smsg.ifn.ringfd, smsg.ifn.ringslots,
+		    -1) == -1) {
+			logwarn("%s map ring error", ifn->ifname);
+			exit(1);
+		}
+		if (close(smsg.ifn.ringfd) == -1) {
+			logwarn("%s close ring error", ifn->ifname);
+			exit(1);
+		}
+	}
+
+	/* map the stats page, the descriptor is not needed after */
+	if (ifn->workers > 1)
+		snprintf(statsname, sizeof(statsname), "%s.%zu", ifn->ifname,
+		    ifn->worker);
+	else
+		snprintf(statsname, sizeof(statsname), "%s", ifn->ifname);
+
+	if (statsfd != -1 && !isopenfd(statsfd)) {
+		logwarnx("%s stats page %d not open", ifn->ifname, statsfd);
+		exit(1);
+	}
+	statspage = stats_map(statsfd, ifn->peerssize, STATSIFN, statsname);
+	if (statspage == NULL) {
+		logwarn("%s map stats page error", ifn->ifname);
+		exit(1);
+	}
+	if (statsfd != -1 && close(statsfd) == -1) {
+		logwarn("%s close stats page error", ifn->ifname);
+		exit(1);
+	}
+	stats = &statspage->u.ifn;
 
 	ifn->ifaddrs = calloc(ifn->ifaddrssize, sizeof *ifn->ifaddrs);
 	if (ifn->ifaddrs == NULL) {
@@ -3141,9 +4960,54 @@ recvconfig(int masterport)
 		exit(1);
 	}
 
-	ifn->peers = calloc(ifn->peerssize, sizeof *ifn->peers);
-	if (ifn->peers == NULL) {
-		logwarn("%s calloc ifn->peers", ifn->ifname);
+	/* allocate all addresses and allowed ips at once */
+	ifaddrv = calloc(ifn->ifaddrssize, sizeof *ifaddrv);
+	if (ifaddrv == NULL && ifn->ifaddrssize > 0) {
+		logwarn("%s calloc ifaddrs", ifn->ifname);
+		exit(1);
+	}
+
+	allowedipv = calloc(nallowedips, sizeof *allowedipv);
+	if (allowedipv == NULL && nallowedips > 0) {
+		logwarn("%s calloc allowedips", ifn->ifname);
+		exit(1);
+	}
+	allowedipsarena = allowedipv;
+
+	/*
+	 * Peers and the two session slots of each peer are in contiguous
+	 * arrays that start on a cache line.
+	 */
+	ifn->peers = xcallocline(ifn->peerssize, sizeof *ifn->peers);
+	sessarena = xcallocline(ifn->peerssize * 2, sizeof *sessarena);
+
+	/*
+	 * Keep the session id index at most half full with four session ids
+	 * per peer.
+	 */
+	for (sessidmapvsize = 8; sessidmapvsize < ifn->peerssize * 8;)
+		sessidmapvsize *= 2;
+
+	sessidmapv = calloc(sessidmapvsize, sizeof *sessidmapv);
+	if (sessidmapv == NULL) {
+		logwarn("%s calloc sessidmapv", ifn->ifname);
+		exit(1);
+	}
+
+	/*
+	 * Preallocate the packet queues of all peers at once so that queueing
+	 * packets while waiting for a handshake never allocates.
+	 */
+	if (ifn->peerssize > MAXPEERS) {
+		logwarnx("%s number of peers exceeds maximum %zu %d",
+		    ifn->ifname, ifn->peerssize, MAXPEERS);
+		exit(1);
+	}
+
+	qpacketarena = reallocarray(NULL, ifn->peerssize * MAXQUEUEPACKETS,
+	    sizeof *qpacketarena);
+	if (qpacketarena == NULL && ifn->peerssize > 0) {
+		logwarn("%s reallocarray qpacketarena", ifn->ifname);
 		exit(1);
 	}
 
@@ -3159,11 +5023,11 @@ recvconfig(int masterport)
 		exit(1);
 	}
 
-	/* first receive all interface addresses */
+	/* first take all interface addresses from the bulk configuration */
 	for (n = 0; n < ifn->ifaddrssize; n++) {
 		msgsize = sizeof(smsg);
-		if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
-			logwarnx("%s wire_recvmsg SCIDRADDR", ifn->ifname);
+		if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize) == -1) {
+			logwarnx("%s wire_bulkget SCIDRADDR", ifn->ifname);
 			exit(1);
 		}
 		if (mtcode != SCIDRADDR) {
@@ -3173,10 +5037,7 @@ recvconfig(int masterport)
 
 		assert(smsg.cidraddr.ifnid == ifn->id);
 
-		if ((ifaddr = malloc(sizeof(*ifaddr))) == NULL) {
-			logwarn("%s malloc ifaddr", ifn->ifname);
-			exit(1);
-		}
+		ifaddr = &ifaddrv[n];
 
 		ifaddr->prefixlen = smsg.cidraddr.prefixlen;
 		memcpy(&ifaddr->addr, &smsg.cidraddr.addr,
@@ -3213,11 +5074,11 @@ recvconfig(int masterport)
 		}
 	}
 
-	/* then receive all listen addresses, first v6, then v4 */
+	/* then all listen addresses, first v6, then v4 */
 	for (n = 0; n < ifn->laddr6count; n++) {
 		msgsize = sizeof(smsg);
-		if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
-			logwarnx("%s wire_recvmsg SCIDRADDR", ifn->ifname);
+		if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize) == -1) {
+			logwarnx("%s wire_bulkget SCIDRADDR", ifn->ifname);
 			exit(1);
 		}
 		if (mtcode != SCIDRADDR) {
@@ -3233,8 +5094,8 @@ recvconfig(int masterport)
 
 	for (n = 0; n < ifn->laddr4count; n++) {
 		msgsize = sizeof(smsg);
-		if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
-			logwarnx("%s wire_recvmsg SCIDRADDR", ifn->ifname);
+		if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize) == -1) {
+			logwarnx("%s wire_bulkget SCIDRADDR", ifn->ifname);
 			exit(1);
 		}
 		if (mtcode != SCIDRADDR) {
@@ -3284,11 +5145,11 @@ recvconfig(int masterport)
 		setsockaddr((struct sockaddr *)ifn->laddr4, &inet_addr, 0, 0);
 	}
 
-	/* then receive peers */
+	/* then the peers */
 	for (m = 0; m < ifn->peerssize; m++) {
 		msgsize = sizeof(smsg);
-		if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
-			logwarnx("%s wire_recvmsg SPEER", ifn->ifname);
+		if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize) == -1) {
+			logwarnx("%s wire_bulkget SPEER", ifn->ifname);
 			exit(1);
 		}
 		if (mtcode != SPEER) {
@@ -3298,23 +5159,26 @@ recvconfig(int masterport)
 
 		assert(smsg.peer.peerid == m);
 
-		if ((peer = peernew(m, smsg.peer.name, smsg.peer.nallowedips,
-		    &smsg.peer.fsa)) == NULL) {
-			logwarn("%s peernew %zu", ifn->ifname, m);
-			exit(1);
-		}
+		peer = peernew(m, smsg.peer.name, allowedipv,
+		    smsg.peer.nallowedips, &smsg.peer.fsa);
 
-		ifn->peers[m] = peer;
+		/* a spare slot gets its sockets so a reload can use it */
+		peer->removed = smsg.peer.unused;
 
 		for (n = 0; n < peer->allowedipssize; n++) {
-			if ((allowedip = malloc(sizeof(*allowedip))) == NULL) {
-				logwarn("%s malloc allowedip", ifn->ifname);
+			if (nallowedips == 0) {
+				logwarnx("%s more allowedips than announced",
+				    ifn->ifname);
 				exit(1);
 			}
+			allowedip = allowedipv++;
+			nallowedips--;
 
 			msgsize = sizeof(smsg);
-			if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
-				logwarnx("%s wire_recvmsg SCIDRADDR", ifn->ifname);
+			if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize)
+			    == -1) {
+				logwarnx("%s wire_bulkget SCIDRADDR",
+				    ifn->ifname);
 				exit(1);
 			}
 			if (mtcode != SCIDRADDR) {
@@ -3328,53 +5192,19 @@ recvconfig(int masterport)
 			memcpy(&allowedip->addr, &smsg.cidraddr.addr,
 			    MIN(sizeof allowedip->addr, sizeof smsg.cidraddr.addr));
 
-			peer->allowedips[n] = allowedip;
-
-			/* pre-calculate masks */
-			if (allowedip->addr.h.family == AF_INET6) {
-				sin6 = (struct sockaddr_in6 *)&allowedip->addr;
-				maskip6(&allowedip->v6addrmasked,
-				    &sin6->sin6_addr, allowedip->prefixlen, 1);
-
-				if (inet_ntop(AF_INET6, &sin6->sin6_addr, addrp,
-				    sizeof(addrp)) == NULL) {
-					logwarn("%s inet_ntop on v6 allowedip "
-					    "failed", ifn->ifname);
-					exit(1);
-				}
-			} else if (allowedip->addr.h.family == AF_INET) {
-				assert(allowedip->prefixlen <= 32);
-
-				allowedip->v4mask.s_addr =
-				    htonl(((1ULL << 32) - 1) <<
-				    (32 - allowedip->prefixlen));
-
-				sin = (struct sockaddr_in *)&allowedip->addr;
-				allowedip->v4addrmasked.s_addr =
-				    sin->sin_addr.s_addr &
-				    allowedip->v4mask.s_addr;
-
-				if (inet_ntop(AF_INET, &sin->sin_addr, addrp,
-				    sizeof(addrp)) == NULL) {
-					logwarn("%s inet_ntop on v4 allowedip "
-					    "failed", ifn->ifname);
-					exit(1);
-				}
-			} else {
-				logwarnx("%s %s allowedip unknown address "
-				    "family", ifn->ifname, peer->name);
+			if (routeadd(&ifn->rt6, &ifn->rt4, peer, allowedip)
+			    == -1)
 				exit(1);
-			}
-
-			if (verbose > 1)
-				loginfox("%s %s allowedip %s/%zu", ifn->ifname,
-				    peer->name, addrp, allowedip->prefixlen);
 		}
 
 		/*
-		 * Create one socket per listen port/family combination.
+		 * Create one socket per listen port/family combination, but
+		 * only for the peers that this worker serves.
 		 */
 
+		if (!peerowned(peer))
+			continue;
+
 		for (n = 0; n < ifn->laddr6count; n++) {
 			for (i = 0; i < peer->portsock6count; i++) {
 				if (ifn->laddr6[n].sin6_port ==
@@ -3402,35 +5232,13 @@ recvconfig(int masterport)
 		}
 	}
 
-	/*
-	 * Make sure there is no other peer with exactly
-	 * the same allowedip (at least the prefixlen
-	 * should differ).
-	 */
-	for (m = 0; m < ifn->peerssize; m++) {
-		peer = ifn->peers[m];
-		for (n = 0; n < peer->allowedipssize; n++) {
-			allowedip = peer->allowedips[n];
-			if (allowedip->addr.h.family == AF_INET6) {
-				if (peerbyroute6(&peer2, &addr,
-				    &allowedip->v6addrmasked) &&
-				    peer != peer2) {
-					if (inet_ntop(AF_INET6,
-					    &allowedip->v6addrmasked, addrstr,
-					    sizeof addrstr) == NULL) {
-						logwarn("%s %s inet_ntop error", ifn->ifname,
-						    __func__);
-						exit(1);
-					}
-
-					logwarnx("%s %s: %s/%zu\n",
-					    "multiple allowedips with the same "
-					    "address and prefixlen", ifn->ifname,
-					    addrstr, allowedip->prefixlen);
-					exit(1);
-				}
-			}
-		}
+	if (bulk.off != bulk.size) {
+		logwarnx("%s trailing bulk configuration", ifn->ifname);
+		exit(1);
+	}
+	if (wire_bulkunmap(&bulk, 1) == -1) {
+		logwarn("%s unmap bulk configuration", ifn->ifname);
+		exit(1);
 	}
 
 	/* expect end of startup signal */
@@ -3461,8 +5269,12 @@ ifn_init(int masterport)
 	size_t heapneeded, n, fdcount;
 
 	recvconfig(masterport);
+	mport = masterport;
 
-	setproctitle("%s", ifn->ifname);
+	if (ifn->workers > 1)
+		setproctitle("%s worker %zu", ifn->ifname, ifn->worker);
+	else
+		setproctitle("%s", ifn->ifname);
 
 	/*
 	 * Make sure we are not missing any communication channels and that
@@ -3487,9 +5299,27 @@ ifn_init(int masterport)
 
 	fdcount += 3;
 
+	if (ifn->worker == 0) {
+		for (n = 1; n < ifn->workers; n++) {
+			if (!isopenfd(ifn->workerports[n])) {
+				logwarnx("%s worker %zu port %d", ifn->ifname,
+				    n, ifn->workerports[n]);
+				exit(1);
+			}
+		}
+		fdcount += ifn->workers - 1;
+	} else {
+		if (!isopenfd(ifn->workerports[0])) {
+			logwarnx("%s worker 0 port %d", ifn->ifname,
+			    ifn->workerports[0]);
+			exit(1);
+		}
+		fdcount += 1;
+	}
+
 	for (n = 0; n < ifn->peerssize; n++) {
-		fdcount += ifn->peers[n]->portsock6count;
-		fdcount += ifn->peers[n]->portsock4count;
+		fdcount += ifn->peers[n].portsock6count;
+		fdcount += ifn->peers[n].portsock4count;
 	}
 
 	if ((size_t)getdtablecount() != fdcount) {
@@ -3502,16 +5332,25 @@ ifn_init(int masterport)
 	assert(EVP_AEAD_nonce_length(aead) == (sizeof nonce) - 4);
 	assert(EVP_AEAD_max_tag_len(aead) == TAGLEN);
 
-	if ((tund = opentunnel(ifn->ifname, ifn->ifdesc, ifn->ifaddrssize))
-	    == -1) {
-		logwarn("%s opentunnel", ifn->ifname);
-		exit(1);
-	}
+	/*
+	 * Only worker 0 opens the device, the other workers exchange packets
+	 * with worker 0 instead.
+	 */
+	if (ifn->worker > 0) {
+		tund = ifn->workerports[0];
+	} else {
+		if ((tund = opentunnel(ifn->ifname, ifn->ifdesc,
+		    ifn->ifaddrssize)) == -1) {
+			logwarn("%s opentunnel", ifn->ifname);
+			exit(1);
+		}
 
-	/* assign addresses */
-	for (n = 0; n < ifn->ifaddrssize; n++) {
-		if (assignaddr(ifn->ifname, ifn->ifaddrs[n]) == -1)
-			logwarn("%s assignaddr %zu error", ifn->ifname, n);
+		/* assign addresses */
+		for (n = 0; n < ifn->ifaddrssize; n++) {
+			if (assignaddr(ifn->ifname, ifn->ifaddrs[n]) == -1)
+				logwarn("%s assignaddr %zu error", ifn->ifname,
+				    n);
+		}
 	}
 
 	/*
@@ -3519,17 +5358,14 @@ ifn_init(int masterport)
 	 * peer allowed addresses. It doesn't have to be perfectly tight.
 	 */
 
-	if (ifn->peerssize > MAXPEERS) {
-		logwarn("%s number of peers exceeds maximum %zu %d", ifn->ifname,
-		    ifn->peerssize, MAXPEERS);
-		exit(1);
-	}
-
 	heapneeded = MINDATA;
+	/* the static batch rings count towards the data segment as well */
+	heapneeded += sizeof(rxring) + sizeof(txring);
 	heapneeded += ifn->peerssize * sizeof(struct session) * 2;
-	heapneeded += ifn->peerssize * MAXQUEUEPACKETSDATASZ;
+	heapneeded += ifn->peerssize * MAXQUEUEPACKETS * sizeof(struct qpacket);
 	heapneeded += ifn->peerssize * sizeof(struct peer);
 	heapneeded += ifn->peerssize * 8;
+	heapneeded += sessidmapvsize * sizeof(struct sessidmap);
 	heapneeded += ifn->ifaddrssize * sizeof(struct cidraddr);
 	heapneeded += ifn->ifaddrssize * 8;
 	heapneeded += ifn->laddr6count * sizeof *ifn->laddr6;
@@ -3538,16 +5374,24 @@ ifn_init(int masterport)
 	heapneeded += (ifn->peerssize + 10) * sizeof(struct kevent);
 
 	for (n = 0; n < ifn->peerssize; n++) {
-		heapneeded += ifn->peers[n]->portsock6count * sizeof(struct portsock);
-		heapneeded += ifn->peers[n]->portsock4count * sizeof(struct portsock);
+		heapneeded += ifn->peers[n].portsock6count * sizeof(struct portsock);
+		heapneeded += ifn->peers[n].portsock4count * sizeof(struct portsock);
+		/*
+		 * At most one route and one branch node per allowedip. Leave
+		 * room to build the routes of a reload with as many allowedips
+		 * while the current ones are still in use.
+		 */
+		heapneeded += ifn->peers[n].allowedipssize * 2 *
+		    (2 * sizeof(struct rtnode) + sizeof(struct cidraddr));
 	}
+	heapneeded += ifn->peerssize * sizeof(struct peerreload);
 
 	xensurelimit(RLIMIT_DATA, heapneeded);
 	xensurelimit(RLIMIT_FSIZE, MAXCORE);
 	xensurelimit(RLIMIT_CORE, MAXCORE);
 	xensurelimit(RLIMIT_MEMLOCK, 0);
-	/* kqueue will be opened later */
-	xensurelimit(RLIMIT_NOFILE, getdtablecount() + 1);
+	/* kqueue will be opened later, plus the bulk of a reload */
+	xensurelimit(RLIMIT_NOFILE, getdtablecount() + 2);
 	xensurelimit(RLIMIT_NPROC, 0);
 	xensurelimit(RLIMIT_STACK, MAXSTACK);
 
@@ -3587,7 +5431,8 @@ ifn_init(int masterport)
 		exit(1);
 	}
 
-	if (pledge("stdio inet", NULL) == -1) {
+	/* recvfd for the bulk of a reload */
+	if (pledge("stdio inet recvfd", NULL) == -1) {
 		logwarn("%s pledge", ifn->ifname);
 		exit(1);
 	}
@@ -20,11 +20,14 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <paths.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
 
+#include "stats.h"
 #include "util.h"
 #include "wireprot.h"
 
@@ -52,11 +55,17 @@ void master_printinfo(FILE *);
 /* these are used by the other modules as well */
 int background, verbose, doterm;
 
+static int doreload;
+
 /* global settings */
-static char *configfile;
+static char *configfile, *logfacilitystr, *progpath;
 static uid_t guid;
 static gid_t ggid;
 
+/* bulk with the peer slots of the running processes */
+static int peerslotsfd;
+static size_t peerslotssize;
+
 static struct cfgifn **ifnv;
 static size_t ifnvsize;
 
@@ -75,6 +84,9 @@ handlesig(int signo)
 	case SIGTERM:
 		doterm = 1;
 		break;
+	case SIGHUP:
+		doreload = 1;
+		break;
 	default:
 		logwarnx("master unexpected signal %d %s", signo,
 		    strsignal(signo));
@@ -113,6 +125,260 @@ void
 printusage(int d)
 {
 	dprintf(d, "usage: %s [-dnVv] [-f file]\n", getprogname());
+	dprintf(d, "       %s stats\n", getprogname());
+}
+
+/*
+ * Shared memory descriptors are close-on-exec, but are passed by number to the
+ * processes that are exec'd. Make "fd" survive execvpe(3).
+ *
+ * Exit on error.
+ */
+static void
+keeponexec(int fd)
+{
+	if (fcntl(fd, F_SETFD, 0) == -1) {
+		logwarn("master fcntl error %d", fd);
+		exit(1);
+	}
+}
+
+/*
+ * Write the length of "str" and then "str" itself to "d", without the
+ * terminating nul.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int
+writestr(int d, const char *str)
+{
+	size_t len;
+
+	len = strlen(str);
+
+	if (writen(d, &len, sizeof(len)) != 0)
+		return -1;
+	if (writen(d, str, len) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Read a string that is written by writestr from "d".
+ *
+ * Return a newly allocated string on success, NULL on failure.
+ */
+static char *
+readstr(int d)
+{
+	size_t len;
+	char *str;
+
+	if (read(d, &len, sizeof(len)) != sizeof(len))
+		return NULL;
+	if (len >= PATH_MAX)
+		return NULL;
+	if ((str = malloc(len + 1)) == NULL)
+		return NULL;
+	if (recv(d, str, len, MSG_WAITALL) != (ssize_t)len) {
+		free(str);
+		return NULL;
+	}
+	str[len] = '\0';
+
+	return str;
+}
+
+/*
+ * Find "name" in the PATH like execvp(3) does, so that a process without an
+ * environment can later exec the same program.
+ *
+ * Return a newly allocated absolute path on success, NULL on failure.
+ */
+static char *
+findprog(const char *name)
+{
+	const char *envpath;
+	char *dir, *path, *p, *prog;
+
+	if (strchr(name, '/') != NULL)
+		return realpath(name, NULL);
+
+	if ((envpath = getenv("PATH")) == NULL || *envpath == '\0')
+		envpath = _PATH_DEFPATH;
+
+	if ((path = strdup(envpath)) == NULL)
+		return NULL;
+
+	prog = NULL;
+	p = path;
+	while ((dir = strsep(&p, ":")) != NULL) {
+		if (*dir == '\0')
+			dir = ".";
+		if (asprintf(&prog, "%s/%s", dir, name) == -1) {
+			prog = NULL;
+			break;
+		}
+		if (access(prog, X_OK) == 0)
+			break;
+		free(prog);
+		prog = NULL;
+	}
+	free(path);
+
+	if (prog == NULL)
+		return NULL;
+
+	path = realpath(prog, NULL);
+	free(prog);
+
+	return path;
+}
+
+/*
+ * Exec a fresh process that parses the configuration file again and sends the
+ * changes to the running processes. The master itself can not read files, so
+ * the settings, the peer slots and the descriptors of the running processes
+ * are pumped over a stream to the new process, like the first master does to
+ * this one. "ifchan" has the channels with the "nifns" ifn processes.
+ *
+ * wire format:
+ * background
+ * verbose
+ * log facility
+ * configuration file
+ * peer slots descriptor
+ * size of the peer slots
+ * enclave descriptor
+ * proxy descriptor
+ * number of ifn descriptors
+ * each ifn descriptor
+ * ...
+ *
+ * Return the process id of the new process on success, -1 on failure.
+ */
+static pid_t
+startreload(chan *ifchan, size_t nifns)
+{
+	chan reload;
+	size_t n;
+	pid_t pid;
+	char *eargs[4], *eenv[1];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, reload) == -1) {
+		logwarn("master socketpair error reload");
+		return -1;
+	}
+
+	switch ((pid = fork())) {
+	case -1:
+		logwarn("master fork error reload");
+		close(reload[0]);
+		close(reload[1]);
+		return -1;
+	case 0:
+		close(reload[0]);
+
+		eargs[0] = (char *)getprogname();
+		eargs[1] = "-R";
+		if (asprintf(&eargs[2], "%d", reload[1]) < 1) {
+			logwarnx("master asprintf error reload");
+			exit(1);
+		}
+		eargs[3] = NULL;
+		eenv[0] = NULL;
+		execve(progpath, eargs, eenv);
+		logwarn("master exec error reload");
+		exit(1);
+	}
+
+	close(reload[1]);
+
+	/* on error the new process fails and the reload is reported failed */
+	if (writen(reload[0], &background, sizeof(int)) != 0 ||
+	    writen(reload[0], &verbose, sizeof(int)) != 0 ||
+	    writestr(reload[0], logfacilitystr) == -1 ||
+	    writestr(reload[0], configfile) == -1 ||
+	    writen(reload[0], &peerslotsfd, sizeof(int)) != 0 ||
+	    writen(reload[0], &peerslotssize, sizeof(peerslotssize)) != 0 ||
+	    writen(reload[0], &mastwithencl, sizeof(int)) != 0 ||
+	    writen(reload[0], &mastwithprox, sizeof(int)) != 0 ||
+	    writen(reload[0], &nifns, sizeof(nifns)) != 0) {
+		logwarn("master could not write to reload process");
+		close(reload[0]);
+		return pid;
+	}
+
+	for (n = 0; n < nifns; n++) {
+		if (writen(reload[0], &ifchan[n][0], sizeof(int)) != 0) {
+			logwarn("master could not pass ifn descriptor to "
+			    "reload process");
+			break;
+		}
+	}
+	close(reload[0]);
+
+	return pid;
+}
+
+/*
+ * Parse the configuration file again and send the changes to the running
+ * processes. Reads the settings and descriptors from stream "d", as written by
+ * startreload.
+ *
+ * Exit on error.
+ */
+static void
+reload(int d)
+{
+	struct cfgifn **nifnv;
+	char *nlogfacilitystr;
+	int *ifnports;
+	size_t n, nifns, nifnvsize;
+	uid_t uid;
+	gid_t gid;
+
+	if (read(d, &background, sizeof(int)) != sizeof(int))
+		err(1, "could not read background in reload");
+	if (read(d, &verbose, sizeof(int)) != sizeof(int))
+		err(1, "could not read verbose in reload");
+	if ((logfacilitystr = readstr(d)) == NULL)
+		errx(1, "could not read log facility in reload");
+	if ((configfile = readstr(d)) == NULL)
+		errx(1, "could not read configuration file in reload");
+	if (read(d, &peerslotsfd, sizeof(int)) != sizeof(int))
+		err(1, "could not read peer slots descriptor in reload");
+	if (read(d, &peerslotssize, sizeof(peerslotssize))
+	    != sizeof(peerslotssize))
+		err(1, "could not read size of the peer slots in reload");
+	if (read(d, &mastwithencl, sizeof(int)) != sizeof(int))
+		err(1, "could not read enclave descriptor in reload");
+	if (read(d, &mastwithprox, sizeof(int)) != sizeof(int))
+		err(1, "could not read proxy descriptor in reload");
+	if (read(d, &nifns, sizeof(nifns)) != sizeof(nifns))
+		err(1, "could not read number of ifn descriptors in reload");
+	if ((ifnports = calloc(nifns + 1, sizeof(*ifnports))) == NULL)
+		err(1, "calloc ifnports");
+	for (n = 0; n < nifns; n++) {
+		if (read(d, &ifnports[n], sizeof(int)) != sizeof(int))
+			err(1, "could not read ifn descriptor in reload");
+	}
+	close(d);
+
+	if (initlog(logfacilitystr) == -1)
+		errx(1, "could not init log in reload");
+
+	/* a different log facility requires a restart */
+	xparseconfigfile(configfile, &nifnv, &nifnvsize, &uid, &gid,
+	    &nlogfacilitystr);
+
+	processconfig();
+
+	sendreload(peerslotsfd, peerslotssize, mastwithencl, mastwithprox,
+	    ifnports, nifns);
+
+	exit(0);
 }
 
 /*
@@ -130,10 +396,11 @@ main(int argc, char **argv)
 	/* descriptors for all communication channels */
 	chan *ifchan, mastmast, tmpchan;
 	size_t n, m;
-	int configtest, foreground, stdopen, masterport, stat;
-	pid_t pid;
+	int configtest, foreground, stdopen, masterport, stat, nrings,
+	    enclstatsfd, proxstatsfd;
+	pid_t pid, reloadpid;
 	const char *errstr;
-	char c, *eargs[4], *eenv[1], *logfacilitystr, *oldprogname;
+	char c, *eargs[4], *eenv[1], *oldprogname, *path;
 
 	/* should endup in a configure script */
 	if (sizeof(struct msgwginit) != 148)
@@ -154,7 +421,7 @@ main(int argc, char **argv)
 
 	configtest = 0;
 	foreground = 0;
-	while ((c = getopt(argc, argv, "E:I:M:P:Vdf:hnqv")) != -1)
+	while ((c = getopt(argc, argv, "E:I:M:P:R:Vdf:hnqv")) != -1)
 		switch(c) {
 		case 'E':
 			masterport = strtonum(optarg, 0, INT_MAX, &errstr);
@@ -190,11 +457,30 @@ main(int argc, char **argv)
 				    "%s", errstr, optarg);
 			setproctitle("master");
 
-			if (chroot(EMPTYDIR) == -1 || chdir("/") == -1)
-				err(1, "chroot %s", EMPTYDIR);
-			if (pledge("stdio", NULL) == -1)
-				err(1, "%s: pledge", __func__);
-
+			if (read(mastmast[1], &background, sizeof(int))
+			    != sizeof(int))
+				err(1, "could not read background in new "
+				    "master");
+			if (read(mastmast[1], &verbose, sizeof(int))
+			    != sizeof(int))
+				err(1, "could not read verbose in new master");
+			if ((logfacilitystr = readstr(mastmast[1])) == NULL)
+				errx(1, "could not read log facility in new "
+				    "master");
+			if ((configfile = readstr(mastmast[1])) == NULL)
+				errx(1, "could not read configuration file in "
+				    "new master");
+			if ((progpath = readstr(mastmast[1])) == NULL)
+				errx(1, "could not read program path in new "
+				    "master");
+			if (read(mastmast[1], &peerslotsfd, sizeof(int))
+			    != sizeof(int))
+				err(1, "could not read peer slots descriptor in "
+				    "new master");
+			if (read(mastmast[1], &peerslotssize,
+			    sizeof(peerslotssize)) != sizeof(peerslotssize))
+				err(1, "could not read size of the peer slots "
+				    "in new master");
 			if (read(mastmast[1], &mastwithencl, sizeof(int))
 			    != sizeof(int))
 				err(1, "could not read enclave descriptor in "
@@ -218,7 +504,21 @@ main(int argc, char **argv)
 			close(mastmast[1]);
 
 			/*
-			 * Ignore SIGUSR1 and catch SIGINT and SIGTERM.
+			 * Only exec a fresh process that parses the
+			 * configuration again on SIGHUP. This process does not
+			 * hold any secrets and can not read any file.
+			 */
+			if (unveil(progpath, "x") == -1)
+				err(1, "%s: unveil %s", __func__, progpath);
+			if (pledge("stdio proc exec", NULL) == -1)
+				err(1, "%s: pledge", __func__);
+
+			if (initlog(logfacilitystr) == -1)
+				errx(1, "could not init log in new master");
+
+			/*
+			 * Ignore SIGUSR1 and SIGPIPE, a reload process may exit
+			 * early. Catch SIGHUP, SIGINT and SIGTERM.
 			 */
 
 			sa.sa_flags = 0;
@@ -228,8 +528,12 @@ main(int argc, char **argv)
 			sa.sa_handler = SIG_IGN;
 			if (sigaction(SIGUSR1, &sa, NULL) == -1)
 				err(1, "sigaction SIGUSR1");
+			if (sigaction(SIGPIPE, &sa, NULL) == -1)
+				err(1, "sigaction SIGPIPE");
 
 			sa.sa_handler = handlesig;
+			if (sigaction(SIGHUP, &sa, NULL) == -1)
+				err(1, "sigaction SIGHUP");
 			if (sigaction(SIGINT, &sa, NULL) == -1)
 				err(1, "sigaction SIGINT");
 			if (sigaction(SIGTERM, &sa, NULL) == -1)
@@ -245,20 +549,55 @@ main(int argc, char **argv)
 				signal_eos(smsg, ifchan[n][0]);
 
 			/*
-			 * Wait for first child to die or when a SIGINT or
-			 * SIGTERM is received.
+			 * Wait for the first child to die or when a SIGINT or
+			 * SIGTERM is received. Reload the configuration on
+			 * SIGHUP, a reload process may exit at any time.
 			 */
-			if ((pid = waitpid(WAIT_ANY, &stat, 0)) == -1) {
-				if (errno != EINTR)
-					err(1, "waitpid");
-
-				if (!doterm)
-					errx(1, "return from unexpected "
-					    "signal");
+			reloadpid = -1;
+			for (;;) {
+				if ((pid = waitpid(WAIT_ANY, &stat, 0)) == -1) {
+					if (errno != EINTR)
+						err(1, "waitpid");
+
+					if (doterm) {
+						warnx("master received "
+						    "termination signal, "
+						    "shutting down");
+						break;
+					}
+
+					if (!doreload)
+						errx(1, "return from unexpected"
+						    " signal");
+
+					doreload = 0;
+
+					if (reloadpid != -1) {
+						logwarnx("master reload already"
+						    " in progress");
+						continue;
+					}
+
+					reloadpid = startreload(ifchan,
+					    ifnvsize);
+					continue;
+				}
+
+				if (pid == reloadpid) {
+					reloadpid = -1;
+					if (WIFEXITED(stat) &&
+					    WEXITSTATUS(stat) == 0) {
+						if (verbose > 0)
+							lognoticex("master "
+							    "configuration "
+							    "reloaded");
+					} else {
+						logwarnx("master reload of %s "
+						    "failed", configfile);
+					}
+					continue;
+				}
 
-				warnx("master received termination signal, "
-				    "shutting down");
-			} else {
 				if (WIFEXITED(stat)) {
 					warnx("child %d normal exit %d", pid,
 					    WEXITSTATUS(stat));
@@ -269,6 +608,7 @@ main(int argc, char **argv)
 					    WCOREDUMP(stat) ? " (core)" : "");
 				} else
 					warnx("unknown termination status");
+				break;
 			}
 
 			/*
@@ -280,6 +620,24 @@ main(int argc, char **argv)
 				err(1, "killpg");
 
 			exit(0);
+		case 'R':
+			masterport = strtonum(optarg, 0, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "invalid reload descriptor: %s %s",
+				    errstr, optarg);
+			setproctitle("reload");
+
+			/*
+			 * rpath, dns and getpw to parse the configuration,
+			 * wpath and cpath for the bulk of each ifn and sendfd
+			 * to pass it.
+			 */
+			if (pledge("stdio rpath wpath cpath dns getpw sendfd",
+			    NULL) == -1)
+				err(1, "%s: pledge", __func__);
+
+			reload(masterport);
+			errx(1, "reload[%d]: unexpected return", getpid());
 		case 'd':
 			foreground = 1;
 			break;
@@ -309,12 +667,28 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	/* print the counters of a running instance */
+	if (argc == 1 && strcmp(argv[0], "stats") == 0) {
+		if (pledge("stdio rpath proc", NULL) == -1)
+			err(1, "%s: pledge", __func__);
+
+		if (stats_print(stdout) == -1)
+			errx(1, "no statistics found");
+
+		exit(0);
+	}
+
 	if (argc != 0) {
 		printusage(STDERR_FILENO);
 		exit(1);
 	}
 
-	if (pledge("stdio dns rpath proc exec getpw", NULL) == -1)
+	/*
+	 * wpath and cpath are needed for the shared memory rings and stats,
+	 * sendfd to pass the bulk configuration of each process.
+	 */
+	if (pledge("stdio dns rpath wpath cpath proc exec getpw sendfd", NULL)
+	    == -1)
 		err(1, "%s: pledge", __func__);
 
 	if (geteuid() != 0)
@@ -325,13 +699,20 @@ main(int argc, char **argv)
 	 *      private keys from memory.
 	 */
 
-	if (configfile) {
-		xparseconfigfile(configfile, &ifnv, &ifnvsize, &guid, &ggid,
-		    &logfacilitystr);
-	} else {
-		xparseconfigfile(DEFAULTCONFIG, &ifnv, &ifnvsize, &guid, &ggid,
-		    &logfacilitystr);
-	}
+	if (configfile == NULL)
+		configfile = DEFAULTCONFIG;
+
+	/* the configuration is parsed again from / on SIGHUP */
+	if ((path = realpath(configfile, NULL)) == NULL)
+		err(1, "%s", configfile);
+	configfile = path;
+
+	/* a reload execs the program again, without an environment */
+	if ((progpath = findprog(getprogname())) == NULL)
+		err(1, "could not find %s", getprogname());
+
+	xparseconfigfile(configfile, &ifnv, &ifnvsize, &guid, &ggid,
+	    &logfacilitystr);
 
 	if (configtest) {
 		fprintf(stdout, "configuration OK\n");
@@ -373,7 +754,33 @@ main(int argc, char **argv)
 
 	eenv[0] = NULL;
 
+	/*
+	 * Each process gets a stats page, the enclave is 0, the proxy 1 and
+	 * each ifn process follows. Remove the pages of a previous run first.
+	 */
+	stats_unlinkall();
+
+	nrings = 0;
 	for (n = 0; n < ifnvsize; n++) {
+		/*
+		 * Before forking the first worker of an interface, open the
+		 * channels between it and each additional worker.
+		 */
+
+		if (ifnv[n]->worker == 0) {
+			for (m = n + 1; m < n + ifnv[n]->workers; m++) {
+				if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tmpchan)
+				    == -1) {
+					logwarn("master socketpair error "
+					    "ifnworker %zu", m);
+					exit(1);
+				}
+
+				ifnv[m]->primwithifn = tmpchan[0];
+				ifnv[m]->ifnwithprim = tmpchan[1];
+			}
+		}
+
 		/*
 		 * Open an interface channel with master, enclave and proxy,
 		 * respectively.
@@ -403,6 +810,25 @@ main(int argc, char **argv)
 		ifnv[n]->proxwithifn = tmpchan[0];
 		ifnv[n]->ifnwithprox = tmpchan[1];
 
+		/* shared memory between the proxy and this ifn, if enabled */
+		if (ifnv[n]->ringslots > 0) {
+			ifnv[n]->ringfd = wire_ringcreate(ifnv[n]->ringslots);
+			if (ifnv[n]->ringfd == -1) {
+				logwarn("master ring error %s",
+				    ifnv[n]->ifname);
+				exit(1);
+			}
+			keeponexec(ifnv[n]->ringfd);
+			nrings++;
+		}
+
+		ifnv[n]->statsfd = stats_create(2 + n, ifnv[n]->peerssize);
+		if (ifnv[n]->statsfd == -1) {
+			logwarn("master stats error %s", ifnv[n]->ifname);
+			exit(1);
+		}
+		keeponexec(ifnv[n]->statsfd);
+
 		switch (fork()) {
 		case -1:
 			logwarn("master fork error %s", ifnv[n]->ifname);
@@ -416,9 +842,18 @@ main(int argc, char **argv)
 				close(ifnv[m]->mastwithifn);
 				close(ifnv[m]->enclwithifn);
 				close(ifnv[m]->proxwithifn);
+				if (m < n && ifnv[m]->ringfd != -1)
+					close(ifnv[m]->ringfd);
 			}
 
-			assert(getdtablecount() == stdopen + 3);
+			/* channels of the workers that are not forked yet */
+			for (m = n + 1; m < n - ifnv[n]->worker +
+			    ifnv[n]->workers; m++)
+				close(ifnv[m]->ifnwithprim);
+
+			assert(getdtablecount() == stdopen + 4 +
+			    (ifnv[n]->worker == 0 ? (int)ifnv[n]->workers - 1 :
+			    1) + (ifnv[n]->ringfd != -1));
 
 			eargs[0] = (char *)getprogname();
 			eargs[1] = "-I";
@@ -437,8 +872,17 @@ main(int argc, char **argv)
 		close(ifnv[n]->ifnwithmast);
 		close(ifnv[n]->ifnwithencl);
 		close(ifnv[n]->ifnwithprox);
+		close(ifnv[n]->statsfd);
+
+		if (ifnv[n]->worker == 0) {
+			for (m = n + 1; m < n + ifnv[n]->workers; m++)
+				close(ifnv[m]->primwithifn);
+		} else {
+			close(ifnv[n]->ifnwithprim);
+		}
 
-		assert(getdtablecount() == stdopen + (int)(n + 1) * 3);
+		assert(getdtablecount() == stdopen + (int)(n + 1) * 3 +
+		    (int)(ifnv[n]->workers - 1 - ifnv[n]->worker) + nrings);
 	}
 
 	/*
@@ -469,7 +913,13 @@ main(int argc, char **argv)
 	enclwithprox = tmpchan[0];
 	proxwithencl = tmpchan[1];
 
-	assert(getdtablecount() == stdopen + 6 + (int)ifnvsize * 3);
+	assert(getdtablecount() == stdopen + 6 + (int)ifnvsize * 3 + nrings);
+
+	if ((enclstatsfd = stats_create(0, 0)) == -1) {
+		logwarn("master stats error enclave");
+		exit(1);
+	}
+	keeponexec(enclstatsfd);
 
 	/* fork enclave */
 	switch (fork()) {
@@ -483,6 +933,8 @@ main(int argc, char **argv)
 		for (n = 0; n < ifnvsize; n++) {
 			close(ifnv[n]->mastwithifn);
 			close(ifnv[n]->proxwithifn);
+			if (ifnv[n]->ringfd != -1)
+				close(ifnv[n]->ringfd);
 		}
 
 		close(mastwithprox);
@@ -490,7 +942,7 @@ main(int argc, char **argv)
 		close(proxwithmast);
 		close(proxwithencl);
 
-		assert(getdtablecount() == stdopen + 2 + (int)ifnvsize);
+		assert(getdtablecount() == stdopen + 3 + (int)ifnvsize);
 
 		eargs[0] = (char *)getprogname();
 		eargs[1] = "-E";
@@ -507,11 +959,18 @@ main(int argc, char **argv)
 
 	close(enclwithmast);
 	close(enclwithprox);
+	close(enclstatsfd);
 
 	for (n = 0; n < ifnvsize; n++)
 		close(ifnv[n]->enclwithifn);
 
-	assert(getdtablecount() == stdopen + 4 + (int)ifnvsize * 2);
+	assert(getdtablecount() == stdopen + 4 + (int)ifnvsize * 2 + nrings);
+
+	if ((proxstatsfd = stats_create(1, 0)) == -1) {
+		logwarn("master stats error proxy");
+		exit(1);
+	}
+	keeponexec(proxstatsfd);
 
 	/* fork proxy  */
 	switch (fork()) {
@@ -528,7 +987,8 @@ main(int argc, char **argv)
 		close(mastwithencl);
 		close(mastwithprox);
 
-		assert(getdtablecount() == stdopen + 2 + (int)ifnvsize);
+		assert(getdtablecount() == stdopen + 3 + (int)ifnvsize +
+		    nrings);
 
 		eargs[0] = (char *)getprogname();
 		eargs[1] = "-P";
@@ -545,9 +1005,13 @@ main(int argc, char **argv)
 
 	close(proxwithmast);
 	close(proxwithencl);
+	close(proxstatsfd);
 
-	for (n = 0; n < ifnvsize; n++)
+	for (n = 0; n < ifnvsize; n++) {
 		close(ifnv[n]->proxwithifn);
+		if (ifnv[n]->ringfd != -1)
+			close(ifnv[n]->ringfd);
+	}
 
 	assert(getdtablecount() == stdopen + 2 + (int)ifnvsize);
 
@@ -561,12 +1025,16 @@ main(int argc, char **argv)
 	 *   3. send startup info to processes
 	 */
 
-	sendconfig_enclave(smsg, mastwithencl, enclwithprox);
-	sendconfig_proxy(smsg, mastwithprox, proxwithencl);
+	sendconfig_enclave(smsg, mastwithencl, enclwithprox, enclstatsfd);
+	sendconfig_proxy(smsg, mastwithprox, proxwithencl, proxstatsfd);
 
 	for (n = 0; n < ifnvsize; n++)
 		sendconfig_ifn(smsg, n);
 
+	/* peers keep their slot across reloads */
+	peerslotsfd = createpeerslots(&peerslotssize);
+	keeponexec(peerslotsfd);
+
 	/*
 	 *   4. reexec and idle
 	 */
@@ -575,6 +1043,13 @@ main(int argc, char **argv)
 	 * Pump config over a stream to our future-self
 	 *
 	 * wire format:
+	 * background
+	 * verbose
+	 * log facility
+	 * configuration file
+	 * program path
+	 * peer slots descriptor
+	 * size of the peer slots
 	 * enclave descriptor
 	 * proxy descriptor
 	 * number of ifn descriptors
@@ -585,6 +1060,34 @@ main(int argc, char **argv)
 		logwarn("master socketpair error mastermaster");
 		exit(1);
 	}
+	if (writen(mastmast[0], &background, sizeof(int)) != 0) {
+		logwarn("could not write background to new master");
+		exit(1);
+	}
+	if (writen(mastmast[0], &verbose, sizeof(int)) != 0) {
+		logwarn("could not write verbose to new master");
+		exit(1);
+	}
+	if (writestr(mastmast[0], logfacilitystr) == -1) {
+		logwarn("could not write log facility to new master");
+		exit(1);
+	}
+	if (writestr(mastmast[0], configfile) == -1) {
+		logwarn("could not write configuration file to new master");
+		exit(1);
+	}
+	if (writestr(mastmast[0], progpath) == -1) {
+		logwarn("could not write program path to new master");
+		exit(1);
+	}
+	if (writen(mastmast[0], &peerslotsfd, sizeof(int)) != 0) {
+		logwarn("could not write peer slots descriptor to new master");
+		exit(1);
+	}
+	if (writen(mastmast[0], &peerslotssize, sizeof(peerslotssize)) != 0) {
+		logwarn("could not write size of the peer slots to new master");
+		exit(1);
+	}
 	if (writen(mastmast[0], &mastwithencl, sizeof(int)) != 0) {
 		logwarn("could not write enclave descriptor to new master");
 		exit(1);
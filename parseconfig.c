@@ -45,6 +45,7 @@ static uid_t guid;
 static gid_t ggid;
 static const char *logfacilitystr = "daemon";
 static int logfacility;
+static size_t ghsrate, ghsburst, genclworkers;
 
 static const wskey nullkey;
 static const wskey basepoint = {9};
@@ -712,9 +713,9 @@ parseinterfaceconfigs(void)
 	struct sockaddr_in6 *laddrs6;
 	struct sockaddr_in *laddrs4;
 	struct stat st;
-	const char *key;
+	const char *key, *errstr;
 	char tundevpath[29];
-	size_t i, j, n;
+	size_t i, j, n, size;
 	int e, rc, tunnum;
 
 	e = 0;
@@ -911,6 +912,121 @@ parseinterfaceconfigs(void)
 				    == NULL)
 					err(1, "parseconfig strdup error "
 					    "ifdesc");
+			} else if (strcasecmp("tunbudget", key) == 0) {
+				if (subcfg->strvsize != 2) {
+					warnx("%s: %s must have a value",
+					    ifn->ifname, key);
+					e = 1;
+					continue;
+				}
+
+				ifn->tunbudget = strtonum(subcfg->strv[1], 1,
+				    MAXTUNBUDGET, &errstr);
+				if (errstr != NULL) {
+					warnx("%s: %s %s: %s", ifn->ifname, key,
+					    errstr, subcfg->strv[1]);
+					e = 1;
+					continue;
+				}
+			} else if (strcasecmp("fairqueue", key) == 0) {
+				if (subcfg->strvsize != 1 &&
+				    subcfg->strvsize != 2) {
+					warnx("%s: %s must contain an optional "
+					    "quantum", ifn->ifname, key);
+					e = 1;
+					continue;
+				}
+
+				ifn->fqquantum = FQQUANTUM;
+				if (subcfg->strvsize == 2) {
+					ifn->fqquantum = strtonum(
+					    subcfg->strv[1], MINFQQUANTUM,
+					    MAXFQQUANTUM, &errstr);
+					if (errstr != NULL) {
+						warnx("%s: %s %s: %s",
+						    ifn->ifname, key, errstr,
+						    subcfg->strv[1]);
+						e = 1;
+						continue;
+					}
+				}
+			} else if (strcasecmp("sndbuf", key) == 0 ||
+			    strcasecmp("rcvbuf", key) == 0) {
+				if (subcfg->strvsize != 2) {
+					warnx("%s: %s must have a value",
+					    ifn->ifname, key);
+					e = 1;
+					continue;
+				}
+
+				size = strtonum(subcfg->strv[1], MINSOCKBUF,
+				    MAXSOCKBUF, &errstr);
+				if (errstr != NULL) {
+					warnx("%s: %s %s: %s", ifn->ifname, key,
+					    errstr, subcfg->strv[1]);
+					e = 1;
+					continue;
+				}
+
+				if (strcasecmp("sndbuf", key) == 0)
+					ifn->sndbuf = size;
+				else
+					ifn->rcvbuf = size;
+			} else if (strcasecmp("proxyring", key) == 0) {
+				if (subcfg->strvsize != 2) {
+					warnx("%s: %s must have a value",
+					    ifn->ifname, key);
+					e = 1;
+					continue;
+				}
+
+				ifn->ringslots = strtonum(subcfg->strv[1], 1,
+				    MAXRINGSLOTS, &errstr);
+				if (errstr != NULL) {
+					warnx("%s: %s %s: %s", ifn->ifname, key,
+					    errstr, subcfg->strv[1]);
+					e = 1;
+					continue;
+				}
+				if (ifn->ringslots & (ifn->ringslots - 1)) {
+					warnx("%s: %s must be a power of two: "
+					    "%s", ifn->ifname, key,
+					    subcfg->strv[1]);
+					e = 1;
+					continue;
+				}
+			} else if (strcasecmp("workers", key) == 0) {
+				if (subcfg->strvsize != 2) {
+					warnx("%s: %s must have a value",
+					    ifn->ifname, key);
+					e = 1;
+					continue;
+				}
+
+				ifn->workers = strtonum(subcfg->strv[1], 1,
+				    MAXWORKERS, &errstr);
+				if (errstr != NULL) {
+					warnx("%s: %s %s: %s", ifn->ifname, key,
+					    errstr, subcfg->strv[1]);
+					e = 1;
+					continue;
+				}
+			} else if (strcasecmp("sparepeers", key) == 0) {
+				if (subcfg->strvsize != 2) {
+					warnx("%s: %s must have a value",
+					    ifn->ifname, key);
+					e = 1;
+					continue;
+				}
+
+				ifn->sparepeers = strtonum(subcfg->strv[1], 0,
+				    MAXPEERS, &errstr);
+				if (errstr != NULL) {
+					warnx("%s: %s %s: %s", ifn->ifname, key,
+					    errstr, subcfg->strv[1]);
+					e = 1;
+					continue;
+				}
 			} else if (strcasecmp("listen", key) == 0) {
 				if (subcfg->strvsize < 2) {
 					warnx("%s: %s must have at least one "
@@ -1172,6 +1288,21 @@ parseinterfaceconfigs(void)
 		if (ifn->peerssize == 0)
 			warnx("%s: has no peers configured", ifn->ifname);
 
+		/* reserve slots for peers that are added by a reload */
+		for (j = 0; j < ifn->sparepeers; j++) {
+			xaddone((void ***)&ifn->peers, &ifn->peerssize,
+			    (void **)&peer, sizeof(*peer));
+
+			snprintf(peer->name, sizeof(peer->name), "spare");
+			peer->unused = 1;
+		}
+
+		if (ifn->peerssize > MAXPEERS) {
+			warnx("%s: only %d peers and spare peers may be "
+			    "configured", ifn->ifname, MAXPEERS);
+			e = 1;
+		}
+
 		if (e)
 			continue;
 
@@ -1206,6 +1337,53 @@ parseinterfaceconfigs(void)
 	return 0;
 }
 
+/*
+ * Insert an entry for each additional worker of an interface directly after
+ * the interface itself. A worker is a copy of the interface that shares all
+ * settings and peers, but only serves the peers for which the peer id modulo
+ * the number of workers equals its index. Worker 0 owns the tunnel device.
+ *
+ * Exit on error.
+ */
+static void
+addworkers(void)
+{
+	struct cfgifn **nifnv, *ifn;
+	size_t k, m, n, nifnvsize;
+
+	nifnvsize = 0;
+	for (n = 0; n < ifnvsize; n++) {
+		if (ifnv[n]->workers == 0)
+			ifnv[n]->workers = 1;
+		nifnvsize += ifnv[n]->workers;
+	}
+
+	if ((nifnv = calloc(nifnvsize, sizeof(*nifnv))) == NULL)
+		err(1, "%s calloc", __func__);
+
+	for (n = 0, m = 0; n < ifnvsize; n++) {
+		for (k = 0; k < ifnv[n]->workers; k++) {
+			if (k == 0) {
+				ifn = ifnv[n];
+			} else {
+				if ((ifn = malloc(sizeof(*ifn))) == NULL)
+					err(1, "%s malloc", __func__);
+				*ifn = *ifnv[n];
+			}
+			ifn->worker = k;
+			ifn->ifnwithprim = -1;
+			ifn->primwithifn = -1;
+			ifn->ringfd = -1;
+			ifn->statsfd = -1;
+			nifnv[m++] = ifn;
+		}
+	}
+
+	free(ifnv);
+	ifnv = nifnv;
+	ifnvsize = nifnvsize;
+}
+
 /*
  * Parse the complete comfig and allocate new ifn structures in "ifnv".
  *
@@ -1219,7 +1397,7 @@ parseconfig(const struct scfge *root)
 {
 	struct scfge *subcfg;
 	struct cfgifn *ifn;
-	const char *key;
+	const char *key, *errstr;
 	size_t n;
 	int e, rc;
 
@@ -1337,6 +1515,46 @@ parseconfig(const struct scfge *root)
 			if ((gpskfile = strdup(subcfg->strv[1])) == NULL)
 				err(1, "parseconfig strdup error global "
 				    "pskfile");
+		} else if (strcasecmp("ratelimit", key) == 0) {
+			if (subcfg->strvsize != 2 && subcfg->strvsize != 3) {
+				warnx("%s: %s must contain a rate and an "
+				    "optional burst", "global", key);
+				e = 1;
+				continue;
+			}
+			ghsrate = strtonum(subcfg->strv[1], 1, MAXHSRATE,
+			    &errstr);
+			if (errstr != NULL) {
+				warnx("%s: %s rate %s: %s", "global", key,
+				    errstr, subcfg->strv[1]);
+				e = 1;
+				continue;
+			}
+			if (subcfg->strvsize == 3) {
+				ghsburst = strtonum(subcfg->strv[2], 1,
+				    MAXHSRATE, &errstr);
+				if (errstr != NULL) {
+					warnx("%s: %s burst %s: %s", "global",
+					    key, errstr, subcfg->strv[2]);
+					e = 1;
+					continue;
+				}
+			}
+		} else if (strcasecmp("enclaveworkers", key) == 0) {
+			if (subcfg->strvsize != 2) {
+				warnx("%s: %s must have a value", "global",
+				    key);
+				e = 1;
+				continue;
+			}
+			genclworkers = strtonum(subcfg->strv[1], 1,
+			    MAXENCLWORKERS, &errstr);
+			if (errstr != NULL) {
+				warnx("%s: %s %s: %s", "global", key, errstr,
+				    subcfg->strv[1]);
+				e = 1;
+				continue;
+			}
 		} else if (strcasecmp("interface", key) == 0) {
 			xaddone((void ***)&ifnv, &ifnvsize, (void **)&ifn,
 			    sizeof(*ifn));
@@ -1391,6 +1609,16 @@ parseconfig(const struct scfge *root)
 		}
 	}
 
+	if (ghsrate == 0)
+		ghsrate = HSRATE;
+
+	/* allow one second worth of messages at once by default */
+	if (ghsburst == 0)
+		ghsburst = ghsrate;
+
+	if (genclworkers == 0)
+		genclworkers = 1;
+
 	if (!guser)
 		guser = DFLUSER;
 
@@ -1426,6 +1654,8 @@ parseconfig(const struct scfge *root)
 	if (e != 0)
 		return -1;
 
+	addworkers();
+
 	return 0;
 }
 
@@ -1493,7 +1723,8 @@ xparseconfigfile(const char *filename, struct cfgifn ***rifnv,
 }
 
 /*
- * Load private keys of all interfaces, determine public key and mac1key.
+ * Load private keys of all interfaces, determine public key, mac1key and
+ * cookiekey.
  */
 void
 processconfig(void)
@@ -1505,18 +1736,51 @@ processconfig(void)
 		if (ws_calcmac1key(ifnv[n]->mac1key, ifnv[n]->pubkey) == -1)
 			errx(1, "ws_calcmac1key %zu", n);
 
+		if (ws_calccookiekey(ifnv[n]->cookiekey, ifnv[n]->pubkey) == -1)
+			errx(1, "ws_calccookiekey %zu", n);
+
 		if (ws_calcpubkeyhash(ifnv[n]->pubkeyhash, ifnv[n]->pubkey)
 		    == -1)
 			errx(1, "ws_calcpubkeyhash %zu", n);
 
 		for (m = 0; m < ifnv[n]->peerssize; m++) {
 			peer = ifnv[n]->peers[m];
+			if (peer->unused)
+				continue;
 			if (ws_calcmac1key(peer->mac1key, peer->pubkey) == -1)
 				errx(1, "ws_calcmac1key %zu %zu", n, m);
+			if (ws_calccookiekey(peer->cookiekey, peer->pubkey)
+			    == -1)
+				errx(1, "ws_calccookiekey %zu %zu", n, m);
 		}
 	}
 }
 
+/*
+ * Send "init" to "port" along with the descriptor of the filled "bulk"
+ * configuration in "bulkfd". The mapping and the descriptor are released.
+ *
+ * Exit on error.
+ */
+static void
+sendinit(int port, struct sinit *init, struct wire_bulk *bulk, int bulkfd)
+{
+	init->bulksize = bulk->size;
+
+	if (bulk->off != bulk->size)
+		logexitx(1, "%s bulk configuration not filled %zu/%zu",
+		    __func__, bulk->off, bulk->size);
+
+	if (wire_bulkunmap(bulk, 0) == -1)
+		logexit(1, "%s wire_bulkunmap", __func__);
+
+	if (wire_sendmsgfd(port, SINIT, init, sizeof(*init), bulkfd) == -1)
+		logexitx(1, "%s wire_sendmsgfd SINIT %d", __func__, port);
+
+	if (close(bulkfd) == -1)
+		logexit(1, "%s close bulk configuration", __func__);
+}
+
 /*
  * Send interface info to the proxy.
  *
@@ -1528,16 +1792,60 @@ processconfig(void)
  * The descriptors the proxy process must use to communicate with
  * each ifn process are in each ifn structure.
  *
- * SINIT
+ * SINIT, with the listen addresses as SCIDRADDR in the bulk configuration
  * SIFN
  *
  * Exit on error.
  */
 void
-sendconfig_proxy(union smsg smsg, int mast2prox, int proxwithencl)
+sendconfig_proxy(union smsg smsg, int mast2prox, int proxwithencl,
+    int statsfd)
 {
+	struct wire_bulk bulk;
 	struct cfgifn *ifn;
-	size_t m, n;
+	size_t m, n, size;
+	int bulkfd;
+
+	size = 0;
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker == 0)
+			size += (ifn->laddrs6count + ifn->laddrs4count) *
+			    wire_bulkrecsize(SCIDRADDR);
+	}
+
+	if ((bulkfd = wire_bulkcreate(&bulk, size)) == -1)
+		logexit(1, "%s wire_bulkcreate", __func__);
+
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker > 0)
+			continue;
+
+		for (m = 0; m < ifn->laddrs6count; m++) {
+			memset(&smsg.cidraddr, 0, sizeof smsg.cidraddr);
+			smsg.cidraddr.ifnid = n;
+			memcpy(&smsg.cidraddr.addr, &ifn->laddrs6[m],
+			    sizeof ifn->laddrs6[m]);
+
+			if (wire_bulkput(&bulk, SCIDRADDR, &smsg.cidraddr,
+			    sizeof smsg.cidraddr) == -1)
+				logexitx(1, "%s wire_bulkput SCIDRADDR",
+				    __func__);
+		}
+
+		for (m = 0; m < ifn->laddrs4count; m++) {
+			memset(&smsg.cidraddr, 0, sizeof smsg.cidraddr);
+			smsg.cidraddr.ifnid = n;
+			memcpy(&smsg.cidraddr.addr, &ifn->laddrs4[m],
+			    sizeof ifn->laddrs4[m]);
+
+			if (wire_bulkput(&bulk, SCIDRADDR, &smsg.cidraddr,
+			    sizeof smsg.cidraddr) == -1)
+				logexitx(1, "%s wire_bulkput SCIDRADDR",
+				    __func__);
+		}
+	}
 
 	memset(&smsg.init, 0, sizeof(smsg.init));
 
@@ -1547,9 +1855,9 @@ sendconfig_proxy(union smsg smsg, int mast2prox, int proxwithencl)
 	smsg.init.gid = ggid;
 	smsg.init.enclport = proxwithencl;
 	smsg.init.nifns = ifnvsize;
+	smsg.init.statsfd = statsfd;
 
-	if (wire_sendmsg(mast2prox, SINIT, &smsg.init, sizeof(smsg.init)) == -1)
-		logexitx(1, "%s wire_sendmsg SINIT", __func__);
+	sendinit(mast2prox, &smsg.init, &bulk, bulkfd);
 
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
@@ -1558,10 +1866,25 @@ sendconfig_proxy(union smsg smsg, int mast2prox, int proxwithencl)
 
 		smsg.ifn.ifnid = n;
 		smsg.ifn.ifnport = ifn->proxwithifn;
-		smsg.ifn.laddr6count = ifn->laddrs6count;
-		smsg.ifn.laddr4count = ifn->laddrs4count;
+		smsg.ifn.worker = ifn->worker;
+		smsg.ifn.workers = ifn->workers;
+		smsg.ifn.ringslots = ifn->ringslots;
+		smsg.ifn.ringfd = ifn->ringfd;
+		smsg.ifn.sndbuf = ifn->sndbuf;
+		smsg.ifn.rcvbuf = ifn->rcvbuf;
 		snprintf(smsg.ifn.ifname, sizeof(smsg.ifn.ifname), "%s",
 		    ifn->ifname);
+
+		/* additional workers only need their port to be known */
+		if (ifn->worker > 0) {
+			if (wire_sendmsg(mast2prox, SIFN, &smsg.ifn,
+			    sizeof(smsg.ifn)) == -1)
+				logexitx(1, "%s wire_sendmsg SIFN", __func__);
+			continue;
+		}
+
+		smsg.ifn.laddr6count = ifn->laddrs6count;
+		smsg.ifn.laddr4count = ifn->laddrs4count;
 		/* don't send interface description to proxy, no public keys in
 		 * the proxy process has small benefits because they're
 		 * semi-trusted in wireguard.
@@ -1575,31 +1898,6 @@ sendconfig_proxy(union smsg smsg, int mast2prox, int proxwithencl)
 		if (wire_sendmsg(mast2prox, SIFN, &smsg.ifn, sizeof(smsg.ifn))
 		    == -1)
 			logexitx(1, "%s wire_sendmsg SIFN", __func__);
-
-		/* send listen addresses */
-		for (m = 0; m < ifn->laddrs6count; m++) {
-			memset(&smsg.cidraddr, 0, sizeof smsg.cidraddr);
-			smsg.cidraddr.ifnid = n;
-			memcpy(&smsg.cidraddr.addr, &ifn->laddrs6[m],
-			    sizeof ifn->laddrs6[m]);
-
-			if (wire_sendmsg(mast2prox, SCIDRADDR, &smsg.cidraddr,
-			    sizeof smsg.cidraddr) == -1)
-				logexitx(1, "%s wire_sendmsg SCIDRADDR",
-				    __func__);
-		}
-
-		for (m = 0; m < ifn->laddrs4count; m++) {
-			memset(&smsg.cidraddr, 0, sizeof smsg.cidraddr);
-			smsg.cidraddr.ifnid = n;
-			memcpy(&smsg.cidraddr.addr, &ifn->laddrs4[m],
-			    sizeof ifn->laddrs4[m]);
-
-			if (wire_sendmsg(mast2prox, SCIDRADDR, &smsg.cidraddr,
-			    sizeof smsg.cidraddr) == -1)
-				logexitx(1, "%s wire_sendmsg SCIDRADDR",
-				    __func__);
-		}
 	}
 
 	/* wait with end of startup signal */
@@ -1613,18 +1911,59 @@ sendconfig_proxy(union smsg smsg, int mast2prox, int proxwithencl)
 /*
  * Send interface info to the enclave.
  *
- * SINIT
+ * SINIT, with the peers as SPEER in the bulk configuration
  * SIFN
- * SPEER
  *
  * Exit on error.
  */
 void
-sendconfig_enclave(union smsg smsg, int mast2encl, int enclwithprox)
+sendconfig_enclave(union smsg smsg, int mast2encl, int enclwithprox,
+    int statsfd)
 {
+	struct wire_bulk bulk;
 	struct cfgifn *ifn;
 	struct cfgpeer *peer;
-	size_t n, m;
+	size_t n, m, size;
+	int bulkfd;
+
+	size = 0;
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker == 0)
+			size += ifn->peerssize * wire_bulkrecsize(SPEER);
+	}
+
+	if ((bulkfd = wire_bulkcreate(&bulk, size)) == -1)
+		logexit(1, "%s wire_bulkcreate", __func__);
+
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker > 0)
+			continue;
+
+		for (m = 0; m < ifn->peerssize; m++) {
+			peer = ifn->peers[m];
+
+			memset(&smsg.peer, 0, sizeof(smsg.peer));
+
+			smsg.peer.ifnid = n;
+			smsg.peer.peerid = m;
+			smsg.peer.unused = peer->unused;
+
+			memcpy(smsg.peer.psk, peer->psk, sizeof(smsg.peer.psk));
+			memcpy(smsg.peer.peerkey, peer->pubkey,
+			    sizeof(smsg.peer.peerkey));
+			memcpy(smsg.peer.mac1key, peer->mac1key,
+			    sizeof(smsg.peer.mac1key));
+			memcpy(smsg.peer.cookiekey, peer->cookiekey,
+			    sizeof(smsg.peer.cookiekey));
+
+			if (wire_bulkput(&bulk, SPEER, &smsg.peer,
+			    sizeof(smsg.peer)) == -1)
+				logexitx(1, "%s wire_bulkput SPEER %zu",
+				    __func__, m);
+		}
+	}
 
 	memset(&smsg.init, 0, sizeof(smsg.init));
 
@@ -1634,9 +1973,12 @@ sendconfig_enclave(union smsg smsg, int mast2encl, int enclwithprox)
 	smsg.init.gid = ggid;
 	smsg.init.proxport = enclwithprox;
 	smsg.init.nifns = ifnvsize;
+	smsg.init.hsrate = ghsrate;
+	smsg.init.hsburst = ghsburst;
+	smsg.init.enclworkers = genclworkers;
+	smsg.init.statsfd = statsfd;
 
-	if (wire_sendmsg(mast2encl, SINIT, &smsg.init, sizeof(smsg.init)) == -1)
-		logexitx(1, "%s wire_sendmsg SINIT", __func__);
+	sendinit(mast2encl, &smsg.init, &bulk, bulkfd);
 
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
@@ -1645,8 +1987,19 @@ sendconfig_enclave(union smsg smsg, int mast2encl, int enclwithprox)
 
 		smsg.ifn.ifnid = n;
 		smsg.ifn.ifnport = ifn->enclwithifn;
+		smsg.ifn.worker = ifn->worker;
+		smsg.ifn.workers = ifn->workers;
 		snprintf(smsg.ifn.ifname, sizeof(smsg.ifn.ifname), "%s",
 		    ifn->ifname);
+
+		/* additional workers only need their port to be known */
+		if (ifn->worker > 0) {
+			if (wire_sendmsg(mast2encl, SIFN, &smsg.ifn,
+			    sizeof(smsg.ifn)) == -1)
+				logexitx(1, "%s wire_sendmsg SIFN", __func__);
+			continue;
+		}
+
 		if (ifn->ifdesc && strlen(ifn->ifdesc) > 0)
 			snprintf(smsg.ifn.ifdesc, sizeof(smsg.ifn.ifdesc), "%s",
 			    ifn->ifdesc);
@@ -1664,26 +2017,6 @@ sendconfig_enclave(union smsg smsg, int mast2encl, int enclwithprox)
 		if (wire_sendmsg(mast2encl, SIFN, &smsg.ifn, sizeof(smsg.ifn))
 		    == -1)
 			logexitx(1, "%s wire_sendmsg SIFN", __func__);
-
-		for (m = 0; m < ifn->peerssize; m++) {
-			peer = ifn->peers[m];
-
-			memset(&smsg.peer, 0, sizeof(smsg.peer));
-
-			smsg.peer.ifnid = n;
-			smsg.peer.peerid = m;
-
-			memcpy(smsg.peer.psk, peer->psk, sizeof(smsg.peer.psk));
-			memcpy(smsg.peer.peerkey, peer->pubkey,
-			    sizeof(smsg.peer.peerkey));
-			memcpy(smsg.peer.mac1key, peer->mac1key,
-			    sizeof(smsg.peer.mac1key));
-
-			if (wire_sendmsg(mast2encl, SPEER, &smsg.peer,
-			    sizeof(smsg.peer)) == -1)
-				logexitx(1, "%s wire_sendmsg SPEER %zu",
-				    __func__, m);
-		}
 	}
 
 	/* wait with end of startup signal */
@@ -1694,24 +2027,77 @@ sendconfig_enclave(union smsg smsg, int mast2encl, int enclwithprox)
 		logdebugx("config sent to enclave %d", mast2encl);
 }
 
+/*
+ * Put each peer of ifn "ifnid" in "bulk" as SPEER, followed by SCIDRADDR for
+ * each of its allowed ips. "smsg" is used as scratch space.
+ *
+ * Exit on error.
+ */
+static void
+putpeers(struct wire_bulk *bulk, union smsg *smsg, int ifnid)
+{
+	struct cfgcidraddr *allowedip;
+	struct cfgifn *ifn;
+	struct cfgpeer *peer;
+	size_t m, n;
+
+	ifn = ifnv[ifnid];
+
+	for (m = 0; m < ifn->peerssize; m++) {
+		peer = ifn->peers[m];
+
+		memset(&smsg->peer, 0, sizeof(smsg->peer));
+
+		smsg->peer.ifnid = ifnid;
+		smsg->peer.peerid = m;
+		snprintf(smsg->peer.name, sizeof(smsg->peer.name), "%s",
+		    peer->name);
+		smsg->peer.nallowedips = peer->allowedipssize;
+		smsg->peer.unused = peer->unused;
+		memcpy(&smsg->peer.fsa, &peer->fsa, sizeof(smsg->peer.fsa));
+
+		if (wire_bulkput(bulk, SPEER, &smsg->peer, sizeof(smsg->peer))
+		    == -1)
+			logexitx(1, "%s wire_bulkput SPEER %zu", __func__, m);
+
+		for (n = 0; n < peer->allowedipssize; n++) {
+			allowedip = peer->allowedips[n];
+
+			memset(&smsg->cidraddr, 0, sizeof(smsg->cidraddr));
+
+			smsg->cidraddr.ifnid = ifnid;
+			smsg->cidraddr.peerid = m;
+			smsg->cidraddr.prefixlen = allowedip->prefixlen;
+			memcpy(&smsg->cidraddr.addr, &allowedip->addr,
+			    sizeof(smsg->cidraddr.addr));
+
+			if (wire_bulkput(bulk, SCIDRADDR, &smsg->cidraddr,
+			    sizeof(smsg->cidraddr)) == -1)
+				logexitx(1, "%s wire_bulkput peer %zu allowedip"
+				    " %zu SCIDRADDR", __func__, m, n);
+		}
+	}
+}
+
 /*
  * Send interface info to an ifn process.
  *
- * SINIT
+ * SINIT, with the bulk configuration:
+ *   SCIDRADDR for each interface address
+ *   SCIDRADDR for each listen address
+ *   SPEER followed by SCIDRADDR for each allowed ip, for each peer
  * SIFN
- * SPEER
- * SCIDRADDR
  *
  * Exit on error.
  */
 void
 sendconfig_ifn(union smsg smsg, int ifnid)
 {
-	struct cfgcidraddr *allowedip;
+	struct wire_bulk bulk;
 	struct cfgcidraddr *ifaddr;
 	struct cfgifn *ifn;
-	struct cfgpeer *peer;
-	size_t m, n;
+	size_t m, n, size, nallowedips;
+	int bulkfd;
 
 	if (ifnid < 0)
 		logexitx(1, "%s", __func__);
@@ -1720,39 +2106,18 @@ sendconfig_ifn(union smsg smsg, int ifnid)
 
 	ifn = ifnv[ifnid];
 
-	memset(&smsg.init, 0, sizeof(smsg.init));
+	nallowedips = 0;
+	for (m = 0; m < ifn->peerssize; m++)
+		nallowedips += ifn->peers[m]->allowedipssize;
 
-	smsg.init.background = background;
-	smsg.init.verbose = verbose;
-	smsg.init.uid = ifn->uid;
-	smsg.init.gid = ifn->gid;
-	smsg.init.enclport = ifn->ifnwithencl;
-	smsg.init.proxport = ifn->ifnwithprox;
+	size = (ifn->ifaddrssize + ifn->laddrs6count + ifn->laddrs4count +
+	    nallowedips) * wire_bulkrecsize(SCIDRADDR) +
+	    ifn->peerssize * wire_bulkrecsize(SPEER);
 
-	if (wire_sendmsg(ifn->mastwithifn, SINIT, &smsg.init, sizeof(smsg.init))
-	    == -1)
-		logexitx(1, "%s wire_sendmsg SINIT %d", __func__,
-		    ifn->mastwithifn);
-
-	memset(&smsg.ifn, 0, sizeof(smsg.ifn));
-
-	smsg.ifn.ifnid = ifnid;
-	snprintf(smsg.ifn.ifname, sizeof(smsg.ifn.ifname), "%s", ifn->ifname);
-	if (ifn->ifdesc && strlen(ifn->ifdesc) > 0)
-		snprintf(smsg.ifn.ifdesc, sizeof(smsg.ifn.ifdesc), "%s",
-		    ifn->ifdesc);
-	memcpy(smsg.ifn.mac1key, ifn->mac1key, sizeof(smsg.ifn.mac1key));
-	memcpy(smsg.ifn.cookiekey, ifn->cookiekey, sizeof(smsg.ifn.cookiekey));
-	smsg.ifn.nifaddrs = ifn->ifaddrssize;
-	smsg.ifn.laddr6count = ifn->laddrs6count;
-	smsg.ifn.laddr4count = ifn->laddrs4count;
-	smsg.ifn.npeers = ifn->peerssize;
-
-	if (wire_sendmsg(ifn->mastwithifn, SIFN, &smsg.ifn, sizeof(smsg.ifn))
-	    == -1)
-		logexitx(1, "%s wire_sendmsg SIFN %s", __func__, ifn->ifname);
+	if ((bulkfd = wire_bulkcreate(&bulk, size)) == -1)
+		logexit(1, "%s wire_bulkcreate", __func__);
 
-	/* first send interface addresses */
+	/* first the interface addresses */
 	for (n = 0; n < ifn->ifaddrssize; n++) {
 		ifaddr = ifn->ifaddrs[n];
 
@@ -1763,9 +2128,9 @@ sendconfig_ifn(union smsg smsg, int ifnid)
 		memcpy(&smsg.cidraddr.addr, &ifaddr->addr,
 		    sizeof(smsg.cidraddr.addr));
 
-		if (wire_sendmsg(ifn->mastwithifn, SCIDRADDR, &smsg.cidraddr,
+		if (wire_bulkput(&bulk, SCIDRADDR, &smsg.cidraddr,
 		    sizeof(smsg.cidraddr)) == -1)
-			logexitx(1, "%s wire_sendmsg interface SCIDRADDR",
+			logexitx(1, "%s wire_bulkput interface SCIDRADDR",
 			    __func__);
 	}
 
@@ -1777,9 +2142,9 @@ sendconfig_ifn(union smsg smsg, int ifnid)
 		memcpy(&smsg.cidraddr.addr, &ifn->laddrs6[n],
 		    sizeof ifn->laddrs6[n]);
 
-		if (wire_sendmsg(ifn->mastwithifn, SCIDRADDR, &smsg.cidraddr,
+		if (wire_bulkput(&bulk, SCIDRADDR, &smsg.cidraddr,
 		    sizeof smsg.cidraddr) == -1)
-			logexitx(1, "%s wire_sendmsg local addr %d out of %zu",
+			logexitx(1, "%s wire_bulkput local addr %d out of %zu",
 			    __func__, n, ifn->laddrs6count);
 	}
 
@@ -1790,47 +2155,66 @@ sendconfig_ifn(union smsg smsg, int ifnid)
 		memcpy(&smsg.cidraddr.addr, &ifn->laddrs4[n],
 		    sizeof ifn->laddrs4[n]);
 
-		if (wire_sendmsg(ifn->mastwithifn, SCIDRADDR, &smsg.cidraddr,
+		if (wire_bulkput(&bulk, SCIDRADDR, &smsg.cidraddr,
 		    sizeof smsg.cidraddr) == -1)
-			logexitx(1, "%s wire_sendmsg local addr %d SCIDRADDR",
+			logexitx(1, "%s wire_bulkput local addr %d SCIDRADDR",
 			    __func__, n);
 	}
 
-	/* at last send the peers */
-	for (m = 0; m < ifn->peerssize; m++) {
-		peer = ifn->peers[m];
-
-		memset(&smsg.peer, 0, sizeof(smsg.peer));
+	/* at last the peers */
+	putpeers(&bulk, &smsg, ifnid);
 
-		smsg.peer.ifnid = ifnid;
-		smsg.peer.peerid = m;
-		snprintf(smsg.peer.name, sizeof(smsg.peer.name), "%s",
-		    peer->name);
-		smsg.peer.nallowedips = peer->allowedipssize;
-		memcpy(&smsg.peer.fsa, &peer->fsa, sizeof(smsg.peer.fsa));
+	memset(&smsg.init, 0, sizeof(smsg.init));
 
-		if (wire_sendmsg(ifn->mastwithifn, SPEER, &smsg.peer,
-		    sizeof(smsg.peer)) == -1)
-			logexitx(1, "%s wire_sendmsg SPEER %zu", __func__, m);
+	smsg.init.background = background;
+	smsg.init.verbose = verbose;
+	smsg.init.uid = ifn->uid;
+	smsg.init.gid = ifn->gid;
+	smsg.init.enclport = ifn->ifnwithencl;
+	smsg.init.proxport = ifn->ifnwithprox;
+	smsg.init.statsfd = ifn->statsfd;
 
-		for (n = 0; n < peer->allowedipssize; n++) {
-			allowedip = peer->allowedips[n];
+	sendinit(ifn->mastwithifn, &smsg.init, &bulk, bulkfd);
 
-			memset(&smsg.cidraddr, 0, sizeof(smsg.cidraddr));
+	memset(&smsg.ifn, 0, sizeof(smsg.ifn));
 
-			smsg.cidraddr.ifnid = ifnid;
-			smsg.cidraddr.peerid = m;
-			smsg.cidraddr.prefixlen = allowedip->prefixlen;
-			memcpy(&smsg.cidraddr.addr, &allowedip->addr,
-			    sizeof(smsg.cidraddr.addr));
+	smsg.ifn.ifnid = ifnid;
+	snprintf(smsg.ifn.ifname, sizeof(smsg.ifn.ifname), "%s", ifn->ifname);
+	if (ifn->ifdesc && strlen(ifn->ifdesc) > 0)
+		snprintf(smsg.ifn.ifdesc, sizeof(smsg.ifn.ifdesc), "%s",
+		    ifn->ifdesc);
+	memcpy(smsg.ifn.mac1key, ifn->mac1key, sizeof(smsg.ifn.mac1key));
+	memcpy(smsg.ifn.cookiekey, ifn->cookiekey, sizeof(smsg.ifn.cookiekey));
+	smsg.ifn.nifaddrs = ifn->ifaddrssize;
+	smsg.ifn.laddr6count = ifn->laddrs6count;
+	smsg.ifn.laddr4count = ifn->laddrs4count;
+	smsg.ifn.npeers = ifn->peerssize;
+	smsg.ifn.nallowedips = nallowedips;
+	smsg.ifn.tunbudget = ifn->tunbudget;
+	smsg.ifn.fqquantum = ifn->fqquantum;
+	smsg.ifn.sndbuf = ifn->sndbuf;
+	smsg.ifn.rcvbuf = ifn->rcvbuf;
+	smsg.ifn.worker = ifn->worker;
+	smsg.ifn.workers = ifn->workers;
+	smsg.ifn.ringslots = ifn->ringslots;
+	smsg.ifn.ringfd = ifn->ringfd;
 
-			if (wire_sendmsg(ifn->mastwithifn, SCIDRADDR,
-			    &smsg.cidraddr, sizeof(smsg.cidraddr)) == -1)
-				logexitx(1, "%s wire_sendmsg peer %d allowedip"
-				    " %d SCIDRADDR", __func__, m, n);
-		}
+	/*
+	 * Worker 0 gets the channels with all other workers, the other workers
+	 * only get their channel with worker 0.
+	 */
+	if (ifn->worker == 0) {
+		smsg.ifn.workerports[0] = -1;
+		for (n = 1; n < ifn->workers; n++)
+			smsg.ifn.workerports[n] = ifnv[ifnid + n]->primwithifn;
+	} else {
+		smsg.ifn.workerports[0] = ifn->ifnwithprim;
 	}
 
+	if (wire_sendmsg(ifn->mastwithifn, SIFN, &smsg.ifn, sizeof(smsg.ifn))
+	    == -1)
+		logexitx(1, "%s wire_sendmsg SIFN %s", __func__, ifn->ifname);
+
 	/* wait with end of startup signal */
 
 	explicit_bzero(&smsg, sizeof(smsg));
@@ -1840,6 +2224,414 @@ sendconfig_ifn(union smsg smsg, int ifnid)
 		    ifn->mastwithifn);
 }
 
+/*
+ * Hash a pre-shared key so that a change can be detected without keeping it.
+ */
+static void
+hashpsk(wshash h, const wskey psk)
+{
+	struct iovec iov[1];
+
+	iov[0].iov_base = (void *)psk;
+	iov[0].iov_len = KEYLEN;
+	ws_hash(h, iov, 1);
+}
+
+/*
+ * Compare the public keys of two pointers to peer slots.
+ */
+static int
+slotcmp(const void *a, const void *b)
+{
+	const struct speerslot *const *sa = a, *const *sb = b;
+
+	return memcmp((*sa)->pubkey, (*sb)->pubkey, KEYLEN);
+}
+
+/*
+ * Compare the public keys of two pointers to peers.
+ */
+static int
+peercmp(const void *a, const void *b)
+{
+	const struct cfgpeer *const *pa = a, *const *pb = b;
+
+	return memcmp((*pa)->pubkey, (*pb)->pubkey, KEYLEN);
+}
+
+/*
+ * Create a bulk with an SPEERSLOT for each peer slot of each interface, in
+ * order of interface id and peer id. Updates "size" with the size of the bulk.
+ *
+ * Return the descriptor of the bulk. Exit on error.
+ */
+int
+createpeerslots(size_t *size)
+{
+	struct speerslot slot;
+	struct wire_bulk bulk;
+	struct cfgifn *ifn;
+	struct cfgpeer *peer;
+	size_t n, m;
+	int bulkfd;
+
+	*size = 0;
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker == 0)
+			*size += ifn->peerssize * wire_bulkrecsize(SPEERSLOT);
+	}
+
+	if ((bulkfd = wire_bulkcreate(&bulk, *size)) == -1)
+		logexit(1, "%s wire_bulkcreate", __func__);
+
+	for (n = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker > 0)
+			continue;
+
+		for (m = 0; m < ifn->peerssize; m++) {
+			peer = ifn->peers[m];
+
+			memset(&slot, 0, sizeof(slot));
+
+			slot.ifnid = n;
+			slot.peerid = m;
+			slot.used = !peer->unused;
+			if (slot.used) {
+				memcpy(slot.pubkey, peer->pubkey, KEYLEN);
+				hashpsk(slot.pskhash, peer->psk);
+			}
+
+			if (wire_bulkput(&bulk, SPEERSLOT, &slot, sizeof(slot))
+			    == -1)
+				logexitx(1, "%s wire_bulkput SPEERSLOT %zu",
+				    __func__, m);
+		}
+	}
+
+	if (bulk.off != bulk.size)
+		logexitx(1, "%s bulk not filled %zu/%zu", __func__, bulk.off,
+		    bulk.size);
+
+	if (wire_bulkunmap(&bulk, 0) == -1)
+		logexit(1, "%s wire_bulkunmap", __func__);
+
+	return bulkfd;
+}
+
+/*
+ * Send the peers of ifn "ifnid" to the running ifn process on "port" so that it
+ * can update its peers, allowed ips and endpoints without a restart.
+ *
+ * MSGRELOAD, with the bulk:
+ *   SPEER followed by SCIDRADDR for each allowed ip, for each peer slot
+ *
+ * Exit on error.
+ */
+static void
+sendreload_ifn(int ifnid, int port)
+{
+	struct msgreload mrl;
+	struct wire_bulk bulk;
+	union smsg smsg;
+	struct cfgifn *ifn;
+	size_t m, nallowedips;
+	int bulkfd;
+
+	if (ifnid < 0)
+		logexitx(1, "%s", __func__);
+	if ((size_t)ifnid >= ifnvsize)
+		logexitx(1, "%s", __func__);
+
+	ifn = ifnv[ifnid];
+
+	nallowedips = 0;
+	for (m = 0; m < ifn->peerssize; m++)
+		nallowedips += ifn->peers[m]->allowedipssize;
+
+	if ((bulkfd = wire_bulkcreate(&bulk, nallowedips *
+	    wire_bulkrecsize(SCIDRADDR) + ifn->peerssize *
+	    wire_bulkrecsize(SPEER))) == -1)
+		logexit(1, "%s wire_bulkcreate", __func__);
+
+	putpeers(&bulk, &smsg, ifnid);
+
+	memset(&mrl, 0, sizeof(mrl));
+
+	snprintf(mrl.ifname, sizeof(mrl.ifname), "%s", ifn->ifname);
+	mrl.worker = ifn->worker;
+	mrl.workers = ifn->workers;
+	mrl.npeers = ifn->peerssize;
+	mrl.nallowedips = nallowedips;
+	mrl.bulksize = bulk.size;
+
+	if (bulk.off != bulk.size)
+		logexitx(1, "%s bulk not filled %zu/%zu", __func__, bulk.off,
+		    bulk.size);
+
+	if (wire_bulkunmap(&bulk, 0) == -1)
+		logexit(1, "%s wire_bulkunmap", __func__);
+
+	if (wire_sendmsgfd(port, MSGRELOAD, &mrl, sizeof(mrl), bulkfd) == -1)
+		logexitx(1, "%s wire_sendmsgfd MSGRELOAD %s", __func__,
+		    ifn->ifname);
+
+	if (close(bulkfd) == -1)
+		logexit(1, "%s close bulk", __func__);
+
+	if (verbose > 2)
+		logdebugx("reload sent to %s %d", ifn->ifname, port);
+}
+
+/*
+ * Give each configured peer of interface "ifnid" one of the "nslots" slots in
+ * "slotv" that the running processes have. A peer keeps the slot of its public
+ * key and a new peer takes the first slot that was unused before this reload,
+ * so that a freed slot is never reused by the same reload. The peers of the
+ * interface and its workers are replaced by one per slot, where each slot that
+ * is not taken gets a spare.
+ *
+ * Exit if a public key is configured more than once or if there are more peers
+ * than slots.
+ */
+static void
+assignslots(size_t ifnid, const struct speerslot *slotv, size_t nslots)
+{
+	static struct cfgpeer spare = { .name = "spare", .unused = 1 };
+	struct speerslot key, *keyp, **usedv, **found;
+	struct cfgpeer **confv, **peerv, *peer;
+	struct cfgifn *ifn;
+	size_t m, n, nconf, next, nused;
+
+	ifn = ifnv[ifnid];
+
+	if ((usedv = calloc(nslots + 1, sizeof(*usedv))) == NULL)
+		logexit(1, "%s calloc", __func__);
+	if ((peerv = calloc(nslots + 1, sizeof(*peerv))) == NULL)
+		logexit(1, "%s calloc", __func__);
+	if ((confv = calloc(ifn->peerssize + 1, sizeof(*confv))) == NULL)
+		logexit(1, "%s calloc", __func__);
+
+	nused = 0;
+	for (m = 0; m < nslots; m++)
+		if (slotv[m].used)
+			usedv[nused++] = (struct speerslot *)&slotv[m];
+
+	qsort(usedv, nused, sizeof(*usedv), slotcmp);
+
+	nconf = 0;
+	for (n = 0; n < ifn->peerssize; n++)
+		if (!ifn->peers[n]->unused)
+			confv[nconf++] = ifn->peers[n];
+
+	qsort(confv, nconf, sizeof(*confv), peercmp);
+
+	for (n = 1; n < nconf; n++)
+		if (peercmp(&confv[n - 1], &confv[n]) == 0)
+			logexitx(1, "%s: %s and %s have the same public key",
+			    ifn->ifname, confv[n - 1]->name, confv[n]->name);
+
+	/* first the peers that keep their slot, then the new peers */
+	next = 0;
+	for (n = 0; n < ifn->peerssize; n++) {
+		peer = ifn->peers[n];
+		if (peer->unused)
+			continue;
+
+		memcpy(key.pubkey, peer->pubkey, KEYLEN);
+		keyp = &key;
+		found = bsearch(&keyp, usedv, nused, sizeof(*usedv), slotcmp);
+		if (found != NULL)
+			peerv[(*found)->peerid] = peer;
+	}
+
+	for (n = 0; n < ifn->peerssize; n++) {
+		peer = ifn->peers[n];
+		if (peer->unused)
+			continue;
+
+		memcpy(key.pubkey, peer->pubkey, KEYLEN);
+		keyp = &key;
+		if (bsearch(&keyp, usedv, nused, sizeof(*usedv), slotcmp))
+			continue;
+
+		while (next < nslots && (slotv[next].used || peerv[next]))
+			next++;
+
+		if (next == nslots)
+			logexitx(1, "%s: no spare peer slot left for %s, "
+			    "restart required", ifn->ifname, peer->name);
+
+		peerv[next] = peer;
+	}
+
+	for (m = 0; m < nslots; m++)
+		if (peerv[m] == NULL)
+			peerv[m] = &spare;
+
+	for (n = ifnid; n < ifnid + ifn->workers; n++) {
+		ifnv[n]->peers = peerv;
+		ifnv[n]->peerssize = nslots;
+	}
+
+	explicit_bzero(&key, sizeof(key));
+	free(confv);
+	free(usedv);
+}
+
+/*
+ * Apply the configuration to the running processes. "slotsfd" is the bulk of
+ * "slotssize" bytes with the peer slots of the running processes as created
+ * by createpeerslots. "ifnports" has a port for each of the "nifns" running
+ * ifn processes.
+ *
+ * The enclave gets an SPEER for each slot that gets a new peer, loses its peer
+ * or has a new pre-shared key and the proxy gets one for each slot that gets a
+ * new peer, so that no state is left of the previous peer in a slot. Each ifn
+ * gets all peers of its interface. Each slot is updated as soon as its
+ * change is sent.
+ *
+ * Exit on error, without sending anything if the configuration does not fit.
+ */
+void
+sendreload(int slotsfd, size_t slotssize, int mast2encl, int mast2prox,
+    const int *ifnports, size_t nifns)
+{
+	struct wire_bulk slots;
+	union smsg smsg;
+	struct speerslot *slotv, *slot;
+	struct cfgifn *ifn;
+	struct cfgpeer *peer;
+	wshash pskhash;
+	size_t m, n, off, msgsize, nslots;
+	unsigned char mtcode;
+
+	if (nifns != ifnvsize)
+		logexitx(1, "the number of interfaces and workers changed from "
+		    "%zu to %zu, restart required", nifns, ifnvsize);
+
+	if (wire_bulkmap(&slots, slotsfd, slotssize) == -1)
+		logexit(1, "%s wire_bulkmap", __func__);
+
+	nslots = slotssize / wire_bulkrecsize(SPEERSLOT);
+	if ((slotv = calloc(nslots + 1, sizeof(*slotv))) == NULL)
+		logexit(1, "%s calloc", __func__);
+
+	for (m = 0; m < nslots; m++) {
+		msgsize = sizeof(slotv[m]);
+		if (wire_bulkget(&slots, &mtcode, &slotv[m], &msgsize) == -1 ||
+		    mtcode != SPEERSLOT)
+			logexitx(1, "%s SPEERSLOT %zu expected", __func__, m);
+	}
+
+	if (slots.off != slots.size)
+		logexitx(1, "%s bulk not read %zu/%zu", __func__, slots.off,
+		    slots.size);
+
+	/* the slots of an interface follow those of the previous interface */
+	for (n = 0, off = 0; n < ifnvsize; n++) {
+		if (ifnv[n]->worker > 0)
+			continue;
+
+		for (m = off; m < nslots && slotv[m].ifnid == n; m++)
+			if (slotv[m].peerid != m - off)
+				logexitx(1, "%s peer slot %zu out of order",
+				    __func__, m);
+
+		assignslots(n, &slotv[off], m - off);
+		off = m;
+	}
+
+	if (off != nslots)
+		logexitx(1, "the interfaces changed, restart required");
+
+	for (n = 0, off = 0; n < ifnvsize; n++) {
+		ifn = ifnv[n];
+		if (ifn->worker > 0)
+			continue;
+
+		for (m = 0; m < ifn->peerssize; m++, off++) {
+			peer = ifn->peers[m];
+			slot = &slotv[off];
+
+			if (peer->unused) {
+				if (!slot->used)
+					continue;
+			} else {
+				hashpsk(pskhash, peer->psk);
+				if (slot->used && memcmp(pskhash, slot->pskhash,
+				    sizeof(pskhash)) == 0)
+					continue;
+			}
+
+			memset(&smsg.peer, 0, sizeof(smsg.peer));
+
+			smsg.peer.ifnid = n;
+			smsg.peer.peerid = m;
+			smsg.peer.unused = peer->unused;
+
+			if (!peer->unused) {
+				memcpy(smsg.peer.psk, peer->psk,
+				    sizeof(smsg.peer.psk));
+				memcpy(smsg.peer.peerkey, peer->pubkey,
+				    sizeof(smsg.peer.peerkey));
+				memcpy(smsg.peer.mac1key, peer->mac1key,
+				    sizeof(smsg.peer.mac1key));
+				memcpy(smsg.peer.cookiekey, peer->cookiekey,
+				    sizeof(smsg.peer.cookiekey));
+			}
+
+			if (wire_sendmsg(mast2encl, SPEER, &smsg.peer,
+			    sizeof(smsg.peer)) == -1)
+				logexitx(1, "%s wire_sendmsg SPEER enclave %s "
+				    "%zu", __func__, ifn->ifname, m);
+
+			/* the proxy only needs to forget a previous peer */
+			if (!peer->unused && !slot->used) {
+				explicit_bzero(&smsg.peer, sizeof(smsg.peer));
+
+				smsg.peer.ifnid = n;
+				smsg.peer.peerid = m;
+
+				if (wire_sendmsg(mast2prox, SPEER, &smsg.peer,
+				    sizeof(smsg.peer)) == -1)
+					logexitx(1, "%s wire_sendmsg SPEER "
+					    "proxy %s %zu", __func__,
+					    ifn->ifname, m);
+			}
+
+			memset(slot, 0, sizeof(*slot));
+
+			slot->ifnid = n;
+			slot->peerid = m;
+			slot->used = !peer->unused;
+			if (slot->used) {
+				memcpy(slot->pubkey, peer->pubkey, KEYLEN);
+				memcpy(slot->pskhash, pskhash, sizeof(pskhash));
+			}
+
+			/* keep the slots in line with the enclave */
+			slots.off = off * wire_bulkrecsize(SPEERSLOT);
+			if (wire_bulkput(&slots, SPEERSLOT, slot, sizeof(*slot))
+			    == -1)
+				logexitx(1, "%s wire_bulkput SPEERSLOT %zu",
+				    __func__, off);
+		}
+	}
+
+	for (n = 0; n < ifnvsize; n++)
+		sendreload_ifn(n, ifnports[n]);
+
+	if (wire_bulkunmap(&slots, 0) == -1)
+		logexit(1, "%s wire_bulkunmap", __func__);
+
+	explicit_bzero(&smsg, sizeof(smsg));
+	explicit_bzero(pskhash, sizeof(pskhash));
+	explicit_bzero(slotv, (nslots + 1) * sizeof(*slotv));
+	free(slotv);
+}
+
 /*
  * Signal end of configuration.
  */
@@ -64,10 +64,12 @@ struct cfgpeer {
 	wskey psk;
 	wskey pubkey;
 	wskey mac1key;
+	wskey cookiekey;
 	struct sockaddr_storage fsa;	/* rename to endpoint */
 	struct cfgcidraddr **allowedips;
 	size_t allowedipssize;
 	char name[MAXPEERNAME + 1];
+	int unused;	/* spare slot for a peer that is added by a reload */
 };
 
 /*
@@ -107,6 +109,18 @@ struct cfgifn {
 	wskey cookiekey;
 	struct cfgpeer **peers;
 	size_t peerssize;
+	size_t sparepeers; /* unused peer slots at the end of "peers" */
+	size_t tunbudget; /* max packets read from the device per wakeup */
+	size_t fqquantum; /* bytes per peer per scheduler round, 0 if off */
+	size_t sndbuf;	/* send buffer of each UDP socket, 0 if not set */
+	size_t rcvbuf;	/* receive buffer of each UDP socket, 0 if not set */
+	size_t workers;	/* number of ifn processes that serve the interface */
+	size_t worker;	/* index of this process, worker 0 owns the device */
+	int ifnwithprim; /* channel of a worker with worker 0 */
+	int primwithifn; /* channel of worker 0 with this worker */
+	size_t ringslots; /* slots in the ring from the proxy, 0 if disabled */
+	int ringfd;	/* shared memory of the ring from the proxy */
+	int statsfd;	/* shared memory stats page of this process */
 	uid_t uid;
 	gid_t gid;
 };
@@ -141,9 +155,11 @@ void xparseconfigfile(const char *, struct cfgifn ***, size_t *, uid_t *, gid_t
  */
 void processconfig(void);
 
-void sendconfig_proxy(union smsg, int, int);
+void sendconfig_proxy(union smsg, int, int, int);
 void sendconfig_ifn(union smsg, int);
-void sendconfig_enclave(union smsg, int, int);
+void sendconfig_enclave(union smsg, int, int, int);
+int createpeerslots(size_t *);
+void sendreload(int, size_t, int, int, const int *, size_t);
 void signal_eos(union smsg, int);
 
 #endif /* PARSECONFIG_H */
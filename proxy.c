@@ -21,12 +21,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <signal.h>
+#include <siphash.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "stats.h"
 #include "util.h"
 #include "wireprot.h"
 #include "wiresep.h"
@@ -78,9 +81,19 @@ struct peer {
 	size_t recvsz;
 };
 
+/*
+ * An interface that is served by more than one worker is only stored once.
+ * The entries of the additional workers in ifnv point to the first worker.
+ */
 struct ifn {
 	uint32_t id;
 	int port;
+	size_t workers;
+	int workerports[MAXWORKERS];	/* port of each worker, port is first */
+	size_t ringslots;	/* 0 if data is only sent over the ports */
+	struct wire_ring workerrings[MAXWORKERS];
+	socklen_t sndbuf;	/* send buffer of listen sockets, 0 if default */
+	socklen_t rcvbuf;	/* receive buffer of listen sockets */
 	char *ifname;	/* null terminated name of the interface */
 	union sockaddr_inet **listenaddrs;
 	size_t listenaddrssize;
@@ -95,41 +108,89 @@ struct ifn {
 static uid_t uid;
 static gid_t gid;
 
-static int eport;
+static int eport, mport;
 
 static struct ifn **ifnv;
 static size_t ifnvsize;
 
 static uint8_t msg[MAXSCRATCH];
-static union sockaddr_inet peeraddr;
+
+/*
+ * Datagrams received on a server socket are read into "rxring" at once and are
+ * handled one after another.
+ */
+static struct dgram {
+	union sockaddr_inet src;
+	size_t len;
+	uint8_t data[MAXBATCHMSG];
+} rxring[RECVBATCH];
+
+#ifdef MSG_WAITFORONE /* recvmmsg(2) */
+static struct mmsghdr rxmsgv[RECVBATCH];
+static struct iovec rxiov[RECVBATCH];
+#endif
 /* mapping of server sockets to listenaddr or ifn */
 static struct sockmap **sockmapv;
 static size_t sockmapvsize;
 
-static size_t totalfwdifn, totalfwdifnsz, totalfwdenc, totalfwdencsz, totalrecv,
-    totalrecvsz, corrupted, invalidmac, invalidpeer;
+/* counters, in the shared memory stats page if there is one */
+static struct statspage *statspage;
+static struct proxystats *stats;
 
-static int logstats, doterm;
-
-static int
-sortsessmapv(const void *a, const void *b)
-{
-	const struct sessmap *x = *(const struct sessmap **)a;
-	const struct sessmap *y = *(const struct sessmap **)b;
+/*
+ * Secret used to calculate cookies for the source addresses of handshake
+ * messages while the enclave is under load. All times are in seconds of uptime.
+ */
+static wskey cookiesecret;
+static time_t now, cookiesecretts = -1, underloadts = -1;
 
-	if (x->sessid == y->sessid)
-		return 0;
+/*
+ * Recent sources of handshake and cookie messages, the IPv4 address or the /64
+ * prefix of the IPv6 address. Each source may send SRCRATE messages per second,
+ * checked before any crypto is done.
+ *
+ * While the enclave is under load a source is also ignored for REJECTTIME
+ * seconds after an invalid message, but only if the message had a valid mac2
+ * so that the source address is known to be real. Otherwise anyone could get
+ * the handshakes of a peer dropped by sending one message in its name.
+ *
+ * The table consists of buckets of SRCWAYS entries, selected by SipHash of the
+ * prefix. A new source gets an entry that is unused or stale. If all entries
+ * of the bucket are in use it gets none and is not limited here, the mac1 and
+ * cookie checks still apply. State of one source is never applied to another.
+ */
+struct srcent {
+	uint64_t prefix;
+	sa_family_t family;	/* 0 if the slot is unused */
+	size_t tokens;		/* messages left in the second "lastfill" */
+	time_t lastfill;
+	time_t rejectts;	/* last invalid message, -1 if none */
+};
 
-	if (x->sessid < y->sessid)
-		return -1;
+static struct srcent srctab[SRCTABSIZE];
+static SIPHASH_KEY srctabkey;
+static int srctabkeyset;
 
-	return 1;
-}
+static int logstats, doterm;
 
-static void
-sort(struct sessmap **sessmapv, size_t sessmapvsize)
+/*
+ * Return the index of the first entry in the sorted range "lo" up to "hi" of
+ * "sessmapv" with a session id greater than "sessid", or "hi" if there is none.
+ */
+static size_t
+sessmapvupper(struct sessmap **sessmapv, size_t lo, size_t hi, int64_t sessid)
 {
-	qsort(sessmapv, sessmapvsize, sizeof(*sessmapv), sortsessmapv);
+	size_t mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sessmapv[mid]->sessid > sessid)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
 }
 
 /*
@@ -180,29 +241,6 @@ handlesig(int signo)
 	}
 }
 
-/*
- * Find a socket mapping by socket descriptor. Return 1 if found and updates
- * "sockmap" to point to it. 0 if not found and updates "sockmap" to NULL.
- *
- * XXX log(n)
- */
-static int
-findsockmapbysock(struct sockmap **sockmap, int s)
-{
-	size_t n;
-
-	*sockmap = NULL;
-
-	for (n = 0; n < sockmapvsize; n++) {
-		if (s == sockmapv[n]->s) {
-			*sockmap = sockmapv[n];
-			return 1;
-		}
-	}
-
-	return 0;
-}
-
 /*
  * Find a peer by id and interface. Return 1 if found and updates "p" to point
  * to it. 0 if not found and updates "p" to NULL.
@@ -219,6 +257,25 @@ findpeerbyidandifn(struct peer **p, uint32_t peerid, const struct ifn *ifn)
 	return 1;
 }
 
+/*
+ * Return the port of the ifn worker that serves "peer".
+ */
+static int
+peerport(const struct ifn *ifn, const struct peer *peer)
+{
+	return ifn->workerports[peer->id % ifn->workers];
+}
+
+/*
+ * Return the interface id of the ifn worker that serves "peer". Each worker
+ * knows itself by its own index, which follows the index of the first worker.
+ */
+static uint32_t
+peerifnid(const struct ifn *ifn, const struct peer *peer)
+{
+	return ifn->id + peer->id % ifn->workers;
+}
+
 /*
  * Find a session by "sessid". Return 1 if found and updates "peer" to
  * point to it. 0 if not found and updates "peer" to NULL.
@@ -240,9 +297,10 @@ findpeerbysessidandifn(struct peer **peer, const struct ifn *ifn,
 }
 
 /*
- * Replace session id "oid" with "nid".
+ * Replace session id "oid" with "nid". The entry is moved to its new position
+ * by shifting the entries in between one place, which keeps the array sorted.
  *
- * O(log(n) + n * log(n))
+ * O(log(n)) comparisons and at most n pointer moves.
  *
  * Return 0 on success, -1 if "oid" does not exist.
  */
@@ -250,6 +308,8 @@ static int
 sessmapvreplace(const struct ifn *ifn, struct peer *peer, int64_t oid,
     int64_t nid)
 {
+	struct sessmap *sessmap;
+	size_t i;
 	int sessidx;
 
 	sessidx = sessmapvsearch(ifn->sessmapv, ifn->sessmapvsize, oid);
@@ -260,8 +320,9 @@ sessmapvreplace(const struct ifn *ifn, struct peer *peer, int64_t oid,
 		return -1;
 	}
 
-	ifn->sessmapv[sessidx]->sessid = nid;
-	ifn->sessmapv[sessidx]->peer = peer;
+	sessmap = ifn->sessmapv[sessidx];
+	sessmap->sessid = nid;
+	sessmap->peer = peer;
 
 	if (nid == oid) {
 		if (verbose > 0)
@@ -271,14 +332,118 @@ sessmapvreplace(const struct ifn *ifn, struct peer *peer, int64_t oid,
 		if (verbose > 1)
 			loginfox("proxy %s %08x replaced %08x", ifn->ifname,
 			    (uint32_t)nid, (uint32_t)oid);
-		sort(&ifn->sessmapv[sessidx], ifn->sessmapvsize - sessidx);
+		i = sessmapvupper(ifn->sessmapv, sessidx + 1,
+		    ifn->sessmapvsize, nid);
+		memmove(&ifn->sessmapv[sessidx], &ifn->sessmapv[sessidx + 1],
+		    (i - sessidx - 1) * sizeof(*ifn->sessmapv));
+		ifn->sessmapv[i - 1] = sessmap;
 	} else {
 		if (verbose > 1)
 			loginfox("proxy %s %08x replaced %08x", ifn->ifname,
 			    (uint32_t)nid, (uint32_t)oid);
-		sort(ifn->sessmapv, sessidx + 1);
+		i = sessmapvupper(ifn->sessmapv, 0, sessidx, nid);
+		memmove(&ifn->sessmapv[i + 1], &ifn->sessmapv[i],
+		    (sessidx - i) * sizeof(*ifn->sessmapv));
+		ifn->sessmapv[i] = sessmap;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive and handle a message from the enclave.
+ *
+ * OVERLOAD
+ *   the enclave is deferring handshakes, answer with cookie replies.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handleenclavemsg(void)
+{
+	size_t msgsize;
+	unsigned char mtcode;
+
+	msgsize = sizeof(msg);
+	if (wire_recvmsg(eport, &mtcode, msg, &msgsize) == -1) {
+		logwarnx("proxy wire_recvmsg enclave error");
+		return -1;
+	}
+
+	switch (mtcode) {
+	case MSGOVERLOAD:
+		if (verbose > 1)
+			loginfox("proxy enclave under load");
+		underloadts = now;
+		break;
+	default:
+		logwarnx("proxy unexpected message from enclave %d", mtcode);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive a peer slot that gets a new peer on a reload from the master and drop
+ * any session that is left of the previous peer in the slot.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handlemastermsg(void)
+{
+	struct speer *speer;
+	struct ifn *ifn;
+	struct peer *peer;
+	size_t msgsize, n;
+	unsigned char mtcode;
+	int64_t *sessidv[4];
+
+	msgsize = sizeof(msg);
+	if (wire_recvmsg(mport, &mtcode, msg, &msgsize) == -1) {
+		logwarnx("proxy wire_recvmsg master error");
+		return -1;
+	}
+
+	if (mtcode != SPEER || msgsize != sizeof(*speer)) {
+		logwarnx("proxy unexpected message from master %d", mtcode);
+		return -1;
+	}
+	speer = (struct speer *)msg;
+
+	if (speer->ifnid >= ifnvsize || ifnv[speer->ifnid]->id != speer->ifnid) {
+		logwarnx("proxy reload of unknown interface id %u",
+		    speer->ifnid);
+		return -1;
+	}
+	ifn = ifnv[speer->ifnid];
+
+	if (!findpeerbyidandifn(&peer, speer->peerid, ifn)) {
+		logwarnx("proxy %s reload of unknown peerid %u", ifn->ifname,
+		    speer->peerid);
+		return -1;
+	}
+
+	sessidv[0] = &peer->sesstent;
+	sessidv[1] = &peer->sessnext;
+	sessidv[2] = &peer->sesscurr;
+	sessidv[3] = &peer->sessprev;
+
+	for (n = 0; n < 4; n++) {
+		if (*sessidv[n] == -1)
+			continue;
+		if (sessmapvreplace(ifn, peer, *sessidv[n], -1) == -1)
+			logwarnx("proxy %s %llx could not remove session",
+			    ifn->ifname, *sessidv[n]);
+		*sessidv[n] = -1;
 	}
 
+	peer->sent = 0;
+	peer->sentsz = 0;
+	peer->recv = 0;
+	peer->recvsz = 0;
+
 	return 0;
 }
 
@@ -304,7 +469,7 @@ handleifnmsg(const struct sockmap *sockmap)
 	ifn = sockmap->ifn;
 
 	msgsize = sizeof(msg);
-	if (wire_recvpeeridmsg(ifn->port, &peerid, &mtcode, msg, &msgsize)
+	if (wire_recvpeeridmsg(sockmap->s, &peerid, &mtcode, msg, &msgsize)
 	    == -1) {
 		logwarnx("proxy %s wire_recvpeeridmsg error", ifn->ifname);
 		return -1;
@@ -407,71 +572,322 @@ handleifnmsg(const struct sockmap *sockmap)
 	return 0;
 }
 
+/*
+ * Return 1 if the enclave could not keep up with, or started deferring, the
+ * handshake messages that were forwarded to it during the last UNDERLOADTIME
+ * seconds, 0 otherwise.
+ */
+static int
+underload(void)
+{
+	return underloadts != -1 && now - underloadts < UNDERLOADTIME;
+}
+
+/*
+ * Return 1 if the limits of "se" no longer have any effect, so that the entry
+ * can be handed to a new source with a fresh allowance, 0 otherwise.
+ */
+static int
+srcstale(const struct srcent *se)
+{
+	return se->family == 0 || (se->lastfill != now &&
+	    (se->rejectts == -1 || now - se->rejectts >= REJECTTIME));
+}
+
+/*
+ * Find the entry of source address "src" in "srctab". If it is not in its
+ * bucket, take over a stale entry with a fresh allowance.
+ *
+ * Return the entry or NULL if the bucket has no stale entry.
+ */
+static struct srcent *
+srclookup(const union sockaddr_inet *src)
+{
+	struct srcent *bucket, *se, *victim;
+	uint64_t prefix;
+	size_t n;
+
+	if (!srctabkeyset) {
+		arc4random_buf(&srctabkey, sizeof(srctabkey));
+		srctabkeyset = 1;
+	}
+
+	prefix = 0;
+	if (src->h.family == AF_INET6)
+		memcpy(&prefix, &src->v6.sin6_addr, sizeof(prefix));
+	else if (src->h.family == AF_INET)
+		memcpy(&prefix, &src->v4.sin_addr, sizeof(src->v4.sin_addr));
+
+	bucket = &srctab[(SipHash24(&srctabkey, &prefix, sizeof(prefix)) &
+	    (SRCTABSIZE / SRCWAYS - 1)) * SRCWAYS];
+
+	victim = NULL;
+	for (n = 0; n < SRCWAYS; n++) {
+		se = &bucket[n];
+		if (se->family == src->h.family && se->prefix == prefix)
+			return se;
+
+		if (victim == NULL && srcstale(se))
+			victim = se;
+	}
+
+	if (victim == NULL)
+		return NULL;
+
+	victim->tokens = SRCRATE;
+	victim->lastfill = now;
+	victim->rejectts = -1;
+	victim->prefix = prefix;
+	victim->family = src->h.family;
+
+	return victim;
+}
+
+/*
+ * Decide whether a message from source "se" may be handled. A source without an
+ * entry is not limited. A source that has no tokens left in the current second
+ * is dropped and, while the enclave is under load, one that sent an invalid
+ * message less than REJECTTIME seconds ago as well.
+ *
+ * Return 1 if the message may be handled, 0 otherwise.
+ */
+static int
+srcadmit(struct srcent *se)
+{
+	if (se == NULL)
+		return 1;
+
+	if (underload() && se->rejectts != -1 &&
+	    now - se->rejectts < REJECTTIME) {
+		stats->rejected++;
+		return 0;
+	}
+
+	if (se->lastfill != now) {
+		se->tokens = SRCRATE;
+		se->lastfill = now;
+	}
+
+	if (se->tokens == 0) {
+		stats->ratelimited++;
+		return 0;
+	}
+
+	se->tokens--;
+	return 1;
+}
+
+/*
+ * Calculate the cookie for the source address "src" of a handshake message.
+ * The cookie secret is rotated every COOKIEMAXAGE seconds.
+ *
+ * Mac(Rm, Am)
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int
+makecookie(uint8_t *cookie, const union sockaddr_inet *src)
+{
+	uint8_t am[sizeof(struct in6_addr) + sizeof(in_port_t)];
+	size_t amsize;
+
+	if (cookiesecretts == -1 || now - cookiesecretts >= COOKIEMAXAGE) {
+		arc4random_buf(cookiesecret, sizeof(cookiesecret));
+		cookiesecretts = now;
+	}
+
+	if (src->h.family == AF_INET6) {
+		amsize = sizeof(src->v6.sin6_addr);
+		memcpy(am, &src->v6.sin6_addr, amsize);
+	} else if (src->h.family == AF_INET) {
+		amsize = sizeof(src->v4.sin_addr);
+		memcpy(am, &src->v4.sin_addr, amsize);
+	} else {
+		return -1;
+	}
+
+	memcpy(&am[amsize], &src->h.port, sizeof(src->h.port));
+	amsize += sizeof(src->h.port);
+
+	return ws_mac(cookie, COOKIELEN, am, amsize, cookiesecret);
+}
+
+/*
+ * Send a cookie reply to the source of the handshake message in "dgram" with
+ * sender "sender" and "mac1".
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+sendcookie(const struct sockmap *sockmap, const struct dgram *dgram,
+    uint32_t sender, const uint8_t *mac1, const uint8_t *cookie)
+{
+	struct msgwgcook mwc;
+	size_t n;
+
+	mwc.type = htole32(3);
+	mwc.receiver = sender;
+	arc4random_buf(mwc.nonce, sizeof(mwc.nonce));
+
+	n = sizeof(mwc.cookie);
+	if (ws_xaead(mwc.cookie, &n, cookie, COOKIELEN,
+	    sockmap->ifn->cookiekey, mwc.nonce, mac1, 16, 0) == -1)
+		return -1;
+
+	if (sendto(sockmap->s, &mwc, sizeof(mwc), 0,
+	    (const struct sockaddr *)&dgram->src, dgram->src.h.len) == -1)
+		return -1;
+
+	stats->cookiereplies++;
+
+	return 0;
+}
+
+/*
+ * Remember that source "se" sent the invalid handshake message in "dgram", but
+ * only while the enclave is under load and only if "mac2" at "mac2offset" is
+ * valid for the source address, so that a spoofed message is never held
+ * against the real source.
+ */
+static void
+srcreject(struct srcent *se, const struct dgram *dgram, const uint8_t *mac2,
+    size_t mac2offset)
+{
+	uint8_t cookie[COOKIELEN];
+
+	if (se == NULL || !underload())
+		return;
+
+	if (makecookie(cookie, &dgram->src) == -1)
+		return;
+
+	if (ws_validmac2(mac2, 16, dgram->data, mac2offset, cookie))
+		se->rejectts = now;
+}
+
+/*
+ * Decide whether a handshake message in "dgram" may be forwarded to the
+ * enclave. While the enclave is under load only messages with a valid mac2
+ * pass, all others are answered with a cookie reply.
+ *
+ * Return 1 if the message may be forwarded, 0 otherwise.
+ */
+static int
+admithandshake(const struct sockmap *sockmap, const struct dgram *dgram,
+    uint32_t sender, const uint8_t *mac1, const uint8_t *mac2,
+    size_t mac2offset)
+{
+	uint8_t cookie[COOKIELEN];
+
+	if (!underload())
+		return 1;
+
+	if (makecookie(cookie, &dgram->src) == -1)
+		return 0;
+
+	if (ws_validmac2(mac2, 16, dgram->data, mac2offset, cookie))
+		return 1;
+
+	if (sendcookie(sockmap, dgram, sender, mac1, cookie) == -1)
+		logwarn("proxy %s could not send cookie reply",
+		    sockmap->ifn->ifname);
+
+	return 0;
+}
+
+/*
+ * Forward a handshake message in "dgram" to the enclave. If the enclave can not
+ * keep up, drop the message and consider the enclave under load.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+forwardhandshake(const struct sockmap *sockmap, const struct dgram *dgram)
+{
+	struct ifn *ifn;
+
+	ifn = sockmap->ifn;
+
+	if (wire_proxysendmsg(eport, ifn->id, sockmap->listenaddr,
+	    &dgram->src, dgram->data[0], dgram->data, dgram->len) == -1) {
+		if (errno == EAGAIN || errno == ENOBUFS) {
+			if (verbose > 0 && !underload())
+				lognoticex("proxy %s enclave is under load, "
+				    "requiring cookies", ifn->ifname);
+			underloadts = now;
+			return -1;
+		}
+
+		logwarn("proxy %s error when trying to forward handshake "
+		    "message to enclave", ifn->ifname);
+		return -1;
+	}
+
+	stats->fwdencl++;
+	stats->fwdenclsz += dgram->len;
+
+	return 0;
+}
+
 /*
  * Receive and handle a message from the Internet.
  *
  * MSGWGINIT
- *   If mac1 OK, forward to enclave
+ *   If mac1 OK and not under load or mac2 OK, forward to enclave
  * MSGWGRESP
- *   If mac1 OK and session exists, forward to enclave
+ *   If mac1 OK, session exists and not under load or mac2 OK, forward to
+ *   enclave
  * MSGWGCOOKIE
- *   If mac1 OK and session exists, forward to enclave
+ *   If session exists, forward to interface process
  * MSGWGDATA
- *   If mac1 OK and session exists, forward to interface process
+ *   If session exists, forward to interface process
  *
- * TODO handle EWOULDBLOCK / create cookies
+ * Under load, handshake messages without a valid mac2 are answered with a
+ * cookie reply instead.
  *
  * Return 0 on success, -1 on error.
  */
 static int
-handlesockmsg(const struct sockmap *sockmap)
+handlesockmsg(const struct sockmap *sockmap, struct dgram *dgram)
 {
 	char verbosepeeraddr[MAXADDRSTR];
 	struct msgwginit *mwi;
 	struct msgwgresp *mwr;
+	struct msgwgcook *mwc;
 	struct msgwgdatahdr *mwdhdr;
 	struct ifn *ifn;
 	struct peer *peer;
-	ssize_t rc;
+	struct srcent *se;
 	size_t msgsize;
 	unsigned char mtcode;
-	socklen_t peeraddrsize;
 
 	ifn = sockmap->ifn;
 
-	peeraddrsize = sizeof(peeraddr);
-	rc = recvfrom(sockmap->s, msg, sizeof(msg), 0,
-	    (struct sockaddr *)&peeraddr, &peeraddrsize);
-	if (rc == -1) {
-		if (verbose > -1)
-			logwarn("proxy %s recvfrom error", ifn->ifname);
-		return -1;
-	}
-	if (rc < 1) {
+	if (dgram->len < 1) {
 		if (verbose > -1)
-			logwarnx("proxy %s recvfrom zero read error",
+			logwarnx("proxy %s empty or oversized datagram",
 			    ifn->ifname);
 		return -1;
 	}
-	msgsize = rc;
+	msgsize = dgram->len;
 
-	totalrecv++;
-	totalrecvsz += msgsize;
+	stats->recv++;
+	stats->recvsz += msgsize;
 
 	if (verbose > 0) {
 		addrtostr(verbosepeeraddr, sizeof verbosepeeraddr,
-		    (struct sockaddr *)&peeraddr, 0);
+		    (struct sockaddr *)&dgram->src, 0);
 	} else {
 		verbosepeeraddr[0] = '\0';
 	}
 
-	mtcode = msg[0];
+	mtcode = dgram->data[0];
 	if (mtcode >= MTNCODES) {
 		if (verbose > 0)
 			lognoticex("proxy %s received message from %s with "
 			    "unexpected message code %d", ifn->ifname,
 			    verbosepeeraddr, mtcode);
-		corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
@@ -483,7 +899,7 @@ handlesockmsg(const struct sockmap *sockmap)
 				    " least %zu bytes instead of %zu",
 				    ifn->ifname, verbosepeeraddr,
 				    msgtypes[1].size, msgsize);
-			corrupted++;
+			stats->corrupted++;
 			return -1;
 		}
 	} else if (msgsize != msgtypes[mtcode].size) {
@@ -492,7 +908,7 @@ handlesockmsg(const struct sockmap *sockmap)
 			    "invalid message size, expected %zu bytes instead "
 			    "of %zu", ifn->ifname, verbosepeeraddr,
 			    msgtypes[1].size, msgsize);
-		corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
@@ -516,39 +932,57 @@ handlesockmsg(const struct sockmap *sockmap)
 		}
 	}
 
+	/* drop handshake and cookie messages from abusive sources early */
+	if (mtcode == MSGWGINIT || mtcode == MSGWGRESP ||
+	    mtcode == MSGWGCOOKIE) {
+		se = srclookup(&dgram->src);
+		if (!srcadmit(se)) {
+			if (verbose > 1)
+				loginfox("proxy %s dropped message from %s "
+				    "over the source limit", ifn->ifname,
+				    verbosepeeraddr);
+			return -1;
+		}
+	} else {
+		se = NULL;
+	}
+
 	switch (mtcode) {
 	case MSGWGINIT:
-		mwi = (struct msgwginit *)msg;
+		mwi = (struct msgwginit *)dgram->data;
 		if (!ws_validmac(mwi->mac1, sizeof(mwi->mac1), mwi,
 		    MAC1OFFSETINIT, ifn->mac1key)) {
 			if (verbose > 0)
 				lognoticex("proxy %s received init message from"
 				    " %s with invalid mac1", ifn->ifname,
 				    verbosepeeraddr);
-			invalidmac++;
+			stats->invalidmac++;
+			srcreject(se, dgram, mwi->mac2, MAC2OFFSETINIT);
 			return -1;
 		}
 
-		if (wire_proxysendmsg(eport, ifn->id, sockmap->listenaddr,
-		    &peeraddr, mtcode, msg, msgsize) == -1) {
-			logwarn("proxy %s error when trying to forward init "
-			    "message from %s to enclave", ifn->ifname,
-			    verbosepeeraddr);
+		if (!admithandshake(sockmap, dgram, mwi->sender, mwi->mac1,
+		    mwi->mac2, MAC2OFFSETINIT)) {
+			if (verbose > 1)
+				loginfox("proxy %s init message from %s "
+				    "without valid mac2 under load",
+				    ifn->ifname, verbosepeeraddr);
 			return -1;
 		}
 
-		totalfwdenc++;
-		totalfwdencsz += msgsize;
+		if (forwardhandshake(sockmap, dgram) == -1)
+			return -1;
 		break;
 	case MSGWGRESP:
-		mwr = (struct msgwgresp *)msg;
+		mwr = (struct msgwgresp *)dgram->data;
 		if (!findpeerbysessidandifn(&peer, ifn,
 		    le32toh(mwr->receiver))) {
 			if (verbose > 0)
 				lognoticex("proxy %s received response message "
 				    "from peer with unknown receiver %x",
 				    ifn->ifname, le32toh(mwr->receiver));
-			invalidpeer++;
+			stats->invalidpeer++;
+			srcreject(se, dgram, mwr->mac2, MAC2OFFSETRESP);
 			return -1;
 		}
 		if (!ws_validmac(mwr->mac1, sizeof(mwr->mac1), mwr,
@@ -557,41 +991,71 @@ handlesockmsg(const struct sockmap *sockmap)
 				lognoticex("proxy %s received response message "
 				    "from %s with invalid mac1", ifn->ifname,
 				    verbosepeeraddr);
-			invalidmac++;
+			stats->invalidmac++;
+			srcreject(se, dgram, mwr->mac2, MAC2OFFSETRESP);
 			return -1;
 		}
 
-		if (wire_proxysendmsg(eport, ifn->id, sockmap->listenaddr,
-		    &peeraddr, mtcode, msg, msgsize) == -1) {
-			logwarn("proxy %s error when trying to forward response"
-			    " message from %s to enclave", ifn->ifname,
-			    verbosepeeraddr);
+		if (!admithandshake(sockmap, dgram, mwr->sender, mwr->mac1,
+		    mwr->mac2, MAC2OFFSETRESP)) {
+			if (verbose > 1)
+				loginfox("proxy %s response message from %s "
+				    "without valid mac2 under load",
+				    ifn->ifname, verbosepeeraddr);
 			return -1;
 		}
 
-		totalfwdenc++;
-		totalfwdencsz += msgsize;
+		if (forwardhandshake(sockmap, dgram) == -1)
+			return -1;
 		break;
 	case MSGWGCOOKIE:
-		/* TODO */
+		mwc = (struct msgwgcook *)dgram->data;
+		if (!findpeerbysessidandifn(&peer, ifn,
+		    le32toh(mwc->receiver))) {
+			if (verbose > 0)
+				lognoticex("proxy %s received cookie message "
+				    "from peer with unknown receiver %x",
+				    ifn->ifname, le32toh(mwc->receiver));
+			stats->invalidpeer++;
+			return -1;
+		}
+
+		if (wire_proxysendmsg(peerport(ifn, peer), peerifnid(ifn, peer),
+		    sockmap->listenaddr, &dgram->src, mtcode, dgram->data,
+		    msgsize) == -1) {
+			logwarn("proxy %s error when trying to forward cookie "
+			    "message from %s to ifn", ifn->ifname,
+			    verbosepeeraddr);
+			return -1;
+		}
+
+		stats->fwdifn++;
+		stats->fwdifnsz += msgsize;
 		break;
 	case MSGWGDATA:
-		mwdhdr = (struct msgwgdatahdr *)msg;
+		mwdhdr = (struct msgwgdatahdr *)dgram->data;
 		if (!findpeerbysessidandifn(&peer, ifn,
 		    le32toh(mwdhdr->receiver))) {
 			if (verbose > 0)
 				lognoticex("proxy %s received data from peer "
 				    "with unknown receiver %x", ifn->ifname,
 				    le32toh(mwdhdr->receiver));
-			invalidpeer++;
+			stats->invalidpeer++;
 			return -1;
 		}
 
 		peer->recv++;
 		peer->recvsz += msgsize;
 
-		if (wire_proxysendmsg(ifn->port, ifn->id, sockmap->listenaddr,
-		    &peeraddr, mtcode, msg, msgsize) == -1) {
+		/* prefer the ring, fall back to the port if it's full */
+		if (ifn->ringslots > 0 && wire_ringput(&ifn->workerrings[
+		    peer->id % ifn->workers], peerifnid(ifn, peer),
+		    sockmap->listenaddr, &dgram->src, mtcode, dgram->data,
+		    msgsize) == 0) {
+			stats->fwdring++;
+		} else if (wire_proxysendmsg(peerport(ifn, peer),
+		    peerifnid(ifn, peer), sockmap->listenaddr, &dgram->src,
+		    mtcode, dgram->data, msgsize) == -1) {
 			logwarn("proxy %s error when trying to forward data "
 			    "message from %s to ifn", ifn->ifname,
 			    verbosepeeraddr);
@@ -600,30 +1064,117 @@ handlesockmsg(const struct sockmap *sockmap)
 
 		peer->sent++;
 		peer->sentsz += msgsize;
-		totalfwdifn++;
-		totalfwdifnsz += msgsize;
+		stats->fwdifn++;
+		stats->fwdifnsz += msgsize;
 		break;
 	default:
 		if (verbose > 1)
 			loginfox("proxy %s received unsupported message type "
 			    "%d from %s", ifn->ifname, mtcode, verbosepeeraddr);
-		corrupted++;
+		stats->corrupted++;
 		return -1;
 	}
 
 	return 0;
 }
 
+/*
+ * Read up to RECVBATCH datagrams from server socket "s" into "rxring" without
+ * blocking. Datagrams that do not fit in a ring slot are discarded by the
+ * kernel and have their length set to 0.
+ *
+ * Return the number of datagrams read, or -1 on error with errno set.
+ */
+static int
+recvbatch(int s)
+{
+#ifdef MSG_WAITFORONE
+	int i, n;
+
+	for (i = 0; i < RECVBATCH; i++) {
+		rxiov[i].iov_base = rxring[i].data;
+		rxiov[i].iov_len = sizeof(rxring[i].data);
+		memset(&rxmsgv[i].msg_hdr, 0, sizeof(rxmsgv[i].msg_hdr));
+		rxmsgv[i].msg_hdr.msg_name = &rxring[i].src;
+		rxmsgv[i].msg_hdr.msg_namelen = sizeof(rxring[i].src);
+		rxmsgv[i].msg_hdr.msg_iov = &rxiov[i];
+		rxmsgv[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(s, rxmsgv, RECVBATCH, MSG_DONTWAIT, NULL);
+	if (n == -1)
+		return errno == EAGAIN ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		if (rxmsgv[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			rxring[i].len = 0;
+		} else {
+			rxring[i].len = rxmsgv[i].msg_len;
+		}
+	}
+#else
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t rc;
+	int n;
+
+	for (n = 0; n < RECVBATCH; n++) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = rxring[n].data;
+		iov.iov_len = sizeof(rxring[n].data);
+		mh.msg_name = &rxring[n].src;
+		mh.msg_namelen = sizeof(rxring[n].src);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+
+		rc = recvmsg(s, &mh, MSG_DONTWAIT);
+		if (rc == -1) {
+			if (n == 0 && errno != EAGAIN)
+				return -1;
+			break;
+		}
+
+		if (mh.msg_flags & MSG_TRUNC) {
+			rxring[n].len = 0;
+		} else {
+			rxring[n].len = rc;
+		}
+	}
+#endif
+
+	return n;
+}
+
+/*
+ * Receive and handle all pending datagrams on a server socket, up to
+ * RECVBATCH at a time.
+ */
+static void
+handlesockmsgs(const struct sockmap *sockmap)
+{
+	int i, n;
+
+	n = recvbatch(sockmap->s);
+	if (n == -1) {
+		if (verbose > -1)
+			logwarn("proxy %s recvmsg error", sockmap->ifn->ifname);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		handlesockmsg(sockmap, &rxring[i]);
+}
+
 /*
  * Listen for messages on the server sockets or from the ifn processes.
  *
  * Won't return on success.
- *
- * TODO: MSGWGCOOKIE	-> usock
  */
 void
 proxy_serv(void)
 {
+	static const struct timespec logwait = { 1, 0 };
+	const struct timespec *timeout;
 	struct sockmap *sockmap;
 	struct kevent *ev;
 	size_t evsize, n;
@@ -638,23 +1189,33 @@ proxy_serv(void)
 		exit(1);
 	}
 
-	evsize = sockmapvsize;
+	evsize = sockmapvsize + 2;
 	if ((ev = calloc(evsize, sizeof(*ev))) == NULL) {
 		logwarn("proxy calloc evsize error");
 		exit(1);
 	}
 
+	/* register each socket with its mapping */
 	for (n = 0; n < sockmapvsize; n++)
-		EV_SET(&ev[n], sockmapv[n]->s, EVFILT_READ, EV_ADD, 0, 0, NULL);
+		EV_SET(&ev[n], sockmapv[n]->s, EVFILT_READ, EV_ADD, 0, 0,
+		    sockmapv[n]);
+
+	/* the enclave and the master have no mapping */
+	EV_SET(&ev[sockmapvsize], eport, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	EV_SET(&ev[sockmapvsize + 1], mport, EVFILT_READ, EV_ADD, 0, 0, NULL);
 
 	if ((nev = kevent(kq, ev, evsize, NULL, 0, NULL)) == -1) {
 		logwarn("proxy kevent error");
 		exit(1);
 	}
 
+	logdefer(1);
+
 	for (;;) {
 		if (logstats) {
+			logdefer(0);
 			proxy_loginfo();
+			logdefer(1);
 			logstats = 0;
 		}
 
@@ -665,7 +1226,10 @@ proxy_serv(void)
 			exit(1);
 		}
 
-		if ((nev = kevent(kq, NULL, 0, ev, evsize, NULL)) == -1) {
+		/* wake up in time to report suppressed log messages */
+		timeout = logflush() ? &logwait : NULL;
+
+		if ((nev = kevent(kq, NULL, 0, ev, evsize, timeout)) == -1) {
 			if (errno == EINTR) {
 				continue;
 			} else {
@@ -674,17 +1238,39 @@ proxy_serv(void)
 			}
 		}
 
+		now = getuptime();
+
 		if (verbose > 2)
 			logdebugx("proxy %d events", nev);
 
 		for (i = 0; i < nev; i++) {
-			if (!findsockmapbysock(&sockmap, ev[i].ident)) {
-				if (verbose > -1)
-					logwarnx("proxy socket event not found:"
-					    " %lu", ev[i].ident);
+			if ((int)ev[i].ident == mport) {
+				if (ev[i].flags & EV_EOF) {
+					logwarnx("proxy master went away");
+					exit(1);
+				}
+				if (handlemastermsg() == -1)
+					logwarnx("proxy reload error");
 				continue;
 			}
 
+			if (ev[i].udata == NULL) {
+				if (ev[i].flags & EV_EOF) {
+					if (verbose > -1)
+						logwarnx("proxy enclave eof");
+					if (close(eport) == -1) {
+						logwarn("proxy close enclave "
+						    "socket error");
+						exit(1);
+					}
+					continue;
+				}
+				handleenclavemsg();
+				continue;
+			}
+
+			sockmap = ev[i].udata;
+
 			if (sockmap->listenaddr) {
 				if (ev[i].flags & EV_EOF) {
 					if (verbose > -1)
@@ -699,7 +1285,7 @@ proxy_serv(void)
 					}
 					break;
 				}
-				handlesockmsg(sockmap);
+				handlesockmsgs(sockmap);
 				break;
 			} else {
 				if (ev[i].flags & EV_EOF) {
@@ -722,6 +1308,32 @@ proxy_serv(void)
 	}
 }
 
+/*
+ * Map the shared memory ring with "worker" of "ifn" from descriptor "fd"
+ * and close the descriptor.
+ *
+ * Exit on error.
+ */
+static void
+mapring(struct ifn *ifn, size_t worker, int fd)
+{
+	if (!isopenfd(fd)) {
+		logwarnx("proxy %s ring %d not open", ifn->ifname, fd);
+		exit(1);
+	}
+
+	if (wire_ringmap(&ifn->workerrings[worker], fd, ifn->ringslots,
+	    ifn->workerports[worker]) == -1) {
+		logwarn("proxy %s map ring error", ifn->ifname);
+		exit(1);
+	}
+
+	if (close(fd) == -1) {
+		logwarn("proxy %s close ring error", ifn->ifname);
+		exit(1);
+	}
+}
+
 /*
  * Receive configuration from the master.
  *
@@ -741,15 +1353,18 @@ recvconfig(int masterport)
 		struct scidraddr cidraddr;
 		struct seos eos;
 	} smsg;
+	struct wire_bulk bulk;
 	size_t n, m, msgsize;
 	unsigned char mtcode;
 	struct ifn *ifn;
-	union sockaddr_inet *listenaddr;
-	struct peer *peer;
-	struct sessmap *sessmap;
+	union sockaddr_inet *listenaddrv;
+	struct peer *peerv;
+	struct sessmap *sessmapv;
+	int bulkfd;
 
 	msgsize = sizeof(smsg);
-	if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
+	if (wire_recvmsgfd(masterport, &mtcode, &smsg, &msgsize, &bulkfd)
+	    == -1) {
 		logwarnx("proxy receive SINIT error %d", masterport);
 		exit(1);
 	}
@@ -765,6 +1380,36 @@ recvconfig(int masterport)
 	eport = smsg.init.enclport;
 	ifnvsize = smsg.init.nifns;
 
+	/* map the stats page, the descriptor is not needed after */
+	if (smsg.init.statsfd != -1 && !isopenfd(smsg.init.statsfd)) {
+		logwarnx("proxy stats page %d not open", smsg.init.statsfd);
+		exit(1);
+	}
+	statspage = stats_map(smsg.init.statsfd, 0, STATSPROXY, "proxy");
+	if (statspage == NULL) {
+		logwarn("proxy map stats page error");
+		exit(1);
+	}
+	if (smsg.init.statsfd != -1 && close(smsg.init.statsfd) == -1) {
+		logwarn("proxy close stats page error");
+		exit(1);
+	}
+	stats = &statspage->u.proxy;
+
+	/* map the bulk configuration, the descriptor is not needed after */
+	if (bulkfd == -1) {
+		logwarnx("proxy no bulk configuration");
+		exit(1);
+	}
+	if (wire_bulkmap(&bulk, bulkfd, smsg.init.bulksize) == -1) {
+		logwarn("proxy map bulk configuration error");
+		exit(1);
+	}
+	if (close(bulkfd) == -1) {
+		logwarn("proxy close bulk configuration error");
+		exit(1);
+	}
+
 	if ((ifnv = calloc(ifnvsize, sizeof(*ifnv))) == NULL) {
 		logwarn("proxy calloc ifnv error");
 		exit(1);
@@ -781,16 +1426,49 @@ recvconfig(int masterport)
 			exit(1);
 		}
 
+		assert(smsg.ifn.ifnid == n);
+
+		/* additional workers follow their first worker */
+		if (smsg.ifn.worker > 0) {
+			if (smsg.ifn.worker > n ||
+			    smsg.ifn.worker >= ifnv[n - smsg.ifn.worker]->workers) {
+				logwarnx("proxy invalid worker %zu",
+				    smsg.ifn.worker);
+				exit(1);
+			}
+			ifn = ifnv[n - smsg.ifn.worker];
+			ifn->workerports[smsg.ifn.worker] = smsg.ifn.ifnport;
+			if (ifn->ringslots > 0)
+				mapring(ifn, smsg.ifn.worker, smsg.ifn.ringfd);
+			ifnv[n] = ifn;
+			continue;
+		}
+
 		if ((ifn = malloc(sizeof(**ifnv))) == NULL) {
 			logwarn("proxy malloc ifnv[%zu] error", n);
 			exit(1);
 		}
 
-		assert(smsg.ifn.ifnid == n);
-
 		ifn->id = smsg.ifn.ifnid;
 		ifn->ifname = strdup(smsg.ifn.ifname);
 		ifn->port = smsg.ifn.ifnport;
+		ifn->workers = smsg.ifn.workers;
+		if (ifn->workers == 0 || ifn->workers > MAXWORKERS)
+			ifn->workers = 1;
+		ifn->workerports[0] = ifn->port;
+		ifn->ringslots = smsg.ifn.ringslots;
+		if (ifn->ringslots > 0)
+			mapring(ifn, 0, smsg.ifn.ringfd);
+		if (smsg.ifn.sndbuf > MAXSOCKBUF ||
+		    smsg.ifn.rcvbuf > MAXSOCKBUF) {
+			logwarnx("proxy %s socket buffer size too large",
+			    ifn->ifname);
+			exit(1);
+		}
+		ifn->sndbuf = smsg.ifn.sndbuf;
+		ifn->rcvbuf = smsg.ifn.rcvbuf;
+		if (ifn->rcvbuf == 0)
+			ifn->rcvbuf = MAXRECVBUF;
 		ifn->listenaddrssize = smsg.ifn.laddr6count +
 		    smsg.ifn.laddr4count;
 		memcpy(ifn->mac1key, smsg.ifn.mac1key,
@@ -799,30 +1477,31 @@ recvconfig(int masterport)
 		    MIN(sizeof ifn->cookiekey, sizeof smsg.ifn.cookiekey));
 
 		ifn->peerssize = smsg.ifn.npeers;
+		if (MAXPEERS / 4 < ifn->peerssize) {
+			logwarnx("proxy only %d peers are supported",
+			    MAXPEERS);
+			exit(1);
+		}
+
+		/* allocate all peers, session ids and addresses at once */
 		if ((ifn->peers = calloc(ifn->peerssize, sizeof(*ifn->peers)))
 		    == NULL) {
 			logwarn("proxy calloc ifnv->peers error");
 			exit(1);
 		}
-
-		for (m = 0; m < ifn->peerssize; m++) {
-			peer = malloc(sizeof(*ifn->peers[m]));
-			if (peer == NULL) {
-				logwarn("proxy malloc peer error");
-				exit(1);
-			}
-			peer->id = m;
-			peer->sesstent = -1;
-			peer->sessnext = -1;
-			peer->sesscurr = -1;
-			peer->sessprev = -1;
-			ifn->peers[m] = peer;
+		if ((peerv = calloc(ifn->peerssize, sizeof(*peerv))) == NULL &&
+		    ifn->peerssize > 0) {
+			logwarn("proxy calloc peers error");
+			exit(1);
 		}
 
-		if (MAXPEERS / 4 < ifn->peerssize) {
-			logwarnx("proxy only %d peers are supported",
-			    MAXPEERS);
-			exit(1);
+		for (m = 0; m < ifn->peerssize; m++) {
+			peerv[m].id = m;
+			peerv[m].sesstent = -1;
+			peerv[m].sessnext = -1;
+			peerv[m].sesscurr = -1;
+			peerv[m].sessprev = -1;
+			ifn->peers[m] = &peerv[m];
 		}
 
 		ifn->sessmapvsize = ifn->peerssize * 4;
@@ -831,30 +1510,36 @@ recvconfig(int masterport)
 			logwarn("proxy calloc ifn->sessmapv error");
 			exit(1);
 		}
+		if ((sessmapv = calloc(ifn->sessmapvsize, sizeof(*sessmapv)))
+		    == NULL && ifn->sessmapvsize > 0) {
+			logwarn("proxy calloc sessmaps error");
+			exit(1);
+		}
 
 		for (m = 0; m < ifn->sessmapvsize; m++) {
-			sessmap = malloc(sizeof(*ifn->sessmapv[m]));
-			if (sessmap == NULL) {
-				logwarn("proxy malloc sessmap error");
-				exit(1);
-			}
-			sessmap->sessid = -1;
-			sessmap->peer = NULL;
-			ifn->sessmapv[m] = sessmap;
+			sessmapv[m].sessid = -1;
+			sessmapv[m].peer = NULL;
+			ifn->sessmapv[m] = &sessmapv[m];
 		}
 
-		/* receive all server addresses */
+		/* take all server addresses from the bulk configuration */
 		if ((ifn->listenaddrs = calloc(ifn->listenaddrssize,
 		    sizeof(*ifn->listenaddrs))) == NULL) {
 			logwarn("proxy calloc ifn->listenaddrs error");
 			exit(1);
 		}
+		if ((listenaddrv = calloc(ifn->listenaddrssize,
+		    sizeof(*listenaddrv))) == NULL &&
+		    ifn->listenaddrssize > 0) {
+			logwarn("proxy calloc listenaddrs error");
+			exit(1);
+		}
 
 		for (m = 0; m < ifn->listenaddrssize; m++) {
 			msgsize = sizeof(smsg);
-			if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize)
+			if (wire_bulkget(&bulk, &mtcode, &smsg, &msgsize)
 			    == -1) {
-				logwarnx("proxy receive SCIDRADDR error");
+				logwarnx("proxy bulk SCIDRADDR error");
 				exit(1);
 			}
 			if (mtcode != SCIDRADDR) {
@@ -872,20 +1557,24 @@ recvconfig(int masterport)
 				continue;
 			}
 
-			if ((listenaddr = malloc(sizeof(*listenaddr))) == NULL) {
-				logwarn("proxy malloc listenaddr error");
-				exit(1);
-			}
-
-			memcpy(listenaddr, &smsg.cidraddr.addr,
-			    MIN(sizeof *listenaddr, sizeof smsg.cidraddr.addr));
+			memcpy(&listenaddrv[m], &smsg.cidraddr.addr,
+			    MIN(sizeof *listenaddrv, sizeof smsg.cidraddr.addr));
 
-			ifn->listenaddrs[m] = listenaddr;
+			ifn->listenaddrs[m] = &listenaddrv[m];
 		}
 
 		ifnv[n] = ifn;
 	}
 
+	if (bulk.off != bulk.size) {
+		logwarnx("proxy trailing bulk configuration");
+		exit(1);
+	}
+	if (wire_bulkunmap(&bulk, 1) == -1) {
+		logwarn("proxy unmap bulk configuration error");
+		exit(1);
+	}
+
 	/* expect end of startup signal */
 	msgsize = sizeof(smsg);
 	if (wire_recvmsg(masterport, &mtcode, &smsg, &msgsize) == -1) {
@@ -915,12 +1604,13 @@ proxy_init(int masterport)
 	struct sigaction sa;
 	size_t heapneeded, i, m, n, nrlistenaddrs, nrpeers, nrsessmaps;
 	const int on = 1;
-	int stdopen, s;
+	int stdopen, s, port;
 	socklen_t len;
 	uint32_t ifnid;
 	struct ifn *ifn;
 
 	recvconfig(masterport);
+	mport = masterport;
 
 	/*
 	 * Make sure we are not missing any communication channels and that
@@ -941,9 +1631,10 @@ proxy_init(int masterport)
 
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
-		if (!isopenfd(ifn->port)) {
+		port = ifn->workerports[n - ifn->id];
+		if (!isopenfd(port)) {
 			logwarnx("proxy %s port %d not open", ifn->ifname,
-			    ifn->port);
+			    port);
 			exit(1);
 		}
 	}
@@ -954,6 +1645,12 @@ proxy_init(int masterport)
 		exit(1);
 	}
 
+	/* detect a busy enclave instead of blocking on it */
+	if (fcntl(eport, F_SETFL, O_NONBLOCK) == -1) {
+		logwarn("proxy fcntl enclave port error");
+		exit(1);
+	}
+
 	/*
 	 * Initialize IPC and UDP sockets in one sorted array so that we can
 	 * easily monitor events. Start server sockets but don't process input
@@ -964,9 +1661,15 @@ proxy_init(int masterport)
 	i = 0;
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
+		port = ifn->workerports[n - ifn->id];
 
-		/* one IPC socket plus one for all listen addressses */
-		sockmapvsize += 1 + ifn->listenaddrssize;
+		/*
+		 * One IPC socket per worker plus one for all listen addressses
+		 * of the interface.
+		 */
+		sockmapvsize += 1;
+		if (ifn->id == n)
+			sockmapvsize += ifn->listenaddrssize;
 
 		sockmapv = reallocarray(sockmapv, sockmapvsize,
 		    sizeof(*sockmapv));
@@ -981,7 +1684,7 @@ proxy_init(int masterport)
 			exit(1);
 		}
 
-		sockmapv[i]->s = ifn->port;
+		sockmapv[i]->s = port;
 		sockmapv[i]->ifn = ifn;
 		sockmapv[i]->listenaddr = NULL;
 
@@ -989,20 +1692,24 @@ proxy_init(int masterport)
 		 * Before creating server sockets, wait for each ifn process to
 		 * send the signal that it has created its sockets.
 		 */
-		if (read(ifn->port, &ifnid, sizeof ifnid) == -1) {
+		if (read(port, &ifnid, sizeof ifnid) == -1) {
 			logwarn("proxy %s read error port %d",
-			    ifn->ifname, ifn->port);
+			    ifn->ifname, port);
 			exit(1);
 		}
 
-		if (ifnid != ifn->id) {
+		if (ifnid != n) {
 			logwarnx("proxy %s received ifn id %u, expected "
-			    "%u", ifn->ifname, ifnid, ifn->id);
+			    "%zu", ifn->ifname, ifnid, n);
 			exit(1);
 		}
 
 		i++;
 
+		/* the additional workers share the listen sockets */
+		if (ifn->id != n)
+			continue;
+
 		for (m = 0; m < ifn->listenaddrssize; m++) {
 			listenaddr = ifn->listenaddrs[m];
 			s = socket(listenaddr->h.family, SOCK_DGRAM, 0);
@@ -1019,7 +1726,7 @@ proxy_init(int masterport)
 				exit(1);
 			}
 
-			len = MAXRECVBUF;
+			len = ifn->rcvbuf;
 			if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &len,
 			    sizeof len) == -1) {
 				logwarn("proxy %s setsockopt rcvbuf error",
@@ -1027,6 +1734,14 @@ proxy_init(int masterport)
 				exit(1);
 			}
 
+			len = ifn->sndbuf;
+			if (len > 0 && setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+			    &len, sizeof len) == -1) {
+				logwarn("proxy %s setsockopt sndbuf error",
+				    ifn->ifname);
+				exit(1);
+			}
+
 			if (bind(s, (struct sockaddr *)listenaddr,
 			    listenaddr->h.len) == -1) {
 				addrtostr(addrstr, sizeof(addrstr),
@@ -1068,6 +1783,8 @@ proxy_init(int masterport)
 	nrsessmaps = 0;
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
+		if (ifn->id != n)
+			continue;
 		nrlistenaddrs += ifn->listenaddrssize;
 		nrpeers += ifn->peerssize;
 		nrsessmaps += ifn->sessmapvsize;
@@ -1080,11 +1797,14 @@ proxy_init(int masterport)
 	}
 
 	heapneeded = MINDATA;
+	/* the static receive ring and source table are data as well */
+	heapneeded += sizeof(rxring);
+	heapneeded += sizeof(srctab);
 	heapneeded += nrpeers * sizeof(struct peer);
 	heapneeded += ifnvsize * sizeof(struct ifn);
 	heapneeded += nrlistenaddrs * sizeof(union sockaddr_inet);
 	heapneeded += nrsessmaps * sizeof(struct sessmap);
-	heapneeded += sockmapvsize * sizeof(struct kevent);
+	heapneeded += (sockmapvsize + 2) * sizeof(struct kevent);
 	heapneeded += sockmapvsize * sizeof(struct sockmap);
 
 	xensurelimit(RLIMIT_DATA, heapneeded);
@@ -1132,7 +1852,8 @@ proxy_init(int masterport)
 		exit(1);
 	}
 
-	if (pledge("stdio", NULL) == -1) {
+	/* inet is needed to send cookie replies on unconnected sockets */
+	if (pledge("stdio inet", NULL) == -1) {
 		logwarn("proxy pledge error");
 		exit(1);
 	}
@@ -1147,6 +1868,8 @@ proxy_loginfo(void)
 
 	for (n = 0; n < ifnvsize; n++) {
 		ifn = ifnv[n];
+		if (ifn->id != n)
+			continue;
 		logwarnx("proxy ifn %zu, id %d, port %d, sessmapvsize %zu", n,
 		    ifn->id, ifn->port, ifn->sessmapvsize);
 
@@ -1166,9 +1889,14 @@ proxy_loginfo(void)
 			    (uint32_t)ifn->sessmapv[m]->sessid);
 	}
 
-	logwarnx("proxy total recv %zu %zu bytes", totalrecv, totalrecvsz);
-	logwarnx("proxy fwd ifn %zu %zu bytes", totalfwdifn, totalfwdifnsz);
-	logwarnx("proxy fwd enc %zu %zu bytes", totalfwdenc, totalfwdencsz);
+	logwarnx("proxy total recv %zu %zu bytes", stats->recv, stats->recvsz);
+	logwarnx("proxy fwd ifn %zu %zu bytes, %zu via ring", stats->fwdifn,
+	    stats->fwdifnsz, stats->fwdring);
+	logwarnx("proxy fwd enc %zu %zu bytes", stats->fwdencl,
+	    stats->fwdenclsz);
+	logwarnx("proxy cookie replies %zu", stats->cookiereplies);
 	logwarnx("proxy corrupted/invalid mac/invalid peer %zu/%zu/%zu",
-	    corrupted, invalidmac, invalidpeer);
+	    stats->corrupted, stats->invalidmac, stats->invalidpeer);
+	logwarnx("proxy rate limited/rejected sources %zu/%zu",
+	    stats->ratelimited, stats->rejected);
 }
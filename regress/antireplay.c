@@ -1,6 +1,9 @@
 #include <assert.h>
 #include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "../antireplay.h"
 
@@ -16,10 +19,10 @@ testwithupdatejump(void)
 
 	/* everything bigger than 0 is new */
 	assert(antireplay_isnew(&ar, seq));
-	assert(antireplay_isnew(&ar, seq - 1000));
+	assert(antireplay_isnew(&ar, seq - MAXTOTALITEMS - 1));
 	antireplay_update(&ar, seq);
 	assert(!antireplay_isnew(&ar, seq));
-	assert(!antireplay_isnew(&ar, seq - 1000));
+	assert(!antireplay_isnew(&ar, seq - MAXTOTALITEMS - 1));
 
 	/* Check next, update and recheck */
 	assert(antireplay_isnew(&ar, seq + 1));
@@ -69,12 +72,136 @@ testnoupdate(void)
 		assert(antireplay_isnew(&ar, n));
 }
 
+/*
+ * Deliver blocks of the window size in a random order. Every number must be
+ * accepted exactly once.
+ */
+void
+testreorder(void)
+{
+	struct antireplay ar;
+	uint64_t *v, base, tmp;
+	size_t i, j, n;
+
+	memset(&ar, 0, sizeof(ar));
+
+	n = MAXTOTALITEMS;
+	if ((v = calloc(n, sizeof(*v))) == NULL)
+		err(1, "calloc");
+
+	for (base = 1; base < 100 * n; base += n) {
+		for (i = 0; i < n; i++)
+			v[i] = base + i;
+
+		for (i = n - 1; i > 0; i--) {
+			j = arc4random_uniform(i + 1);
+			tmp = v[i];
+			v[i] = v[j];
+			v[j] = tmp;
+		}
+
+		for (i = 0; i < n; i++) {
+			assert(antireplay_isnew(&ar, v[i]));
+			assert(antireplay_update(&ar, v[i]) == 0);
+			assert(!antireplay_isnew(&ar, v[i]));
+			assert(antireplay_update(&ar, v[i]) == -1);
+		}
+	}
+
+	for (base = 1; base < 100 * n; base++)
+		assert(!antireplay_isnew(&ar, base));
+
+	free(v);
+}
+
+/*
+ * Jump over more than the complete window and make sure nothing of the old
+ * window is left.
+ */
+void
+testbigjump(void)
+{
+	struct antireplay ar;
+	uint64_t seq;
+
+	memset(&ar, 0, sizeof(ar));
+
+	for (seq = 1; seq < TOTALBITS; seq++)
+		assert(antireplay_update(&ar, seq) == 0);
+
+	seq = 10 * TOTALBITS + 7;
+	assert(antireplay_update(&ar, seq) == 0);
+
+	for (seq = seq - MAXTOTALITEMS; seq < 10 * TOTALBITS + 7; seq++)
+		assert(antireplay_isnew(&ar, seq));
+
+	assert(!antireplay_isnew(&ar, 10 * TOTALBITS + 7 - MAXTOTALITEMS - 1));
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+		err(1, "clock_gettime");
+
+	return (end.tv_sec - start->tv_sec) +
+	    (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Measure the number of checks and updates per second for in order delivery
+ * and for delivery that is reordered by up to "depth" packets.
+ */
+void
+bench(const char *name, uint64_t depth)
+{
+	struct antireplay ar;
+	struct timespec start;
+	uint64_t seq, n, accepted;
+	double secs;
+
+	memset(&ar, 0, sizeof(ar));
+
+	n = 50000000;
+	accepted = 0;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		err(1, "clock_gettime");
+
+	for (seq = depth + 1; seq < n + depth + 1; seq++) {
+		/* swap each pair of numbers "depth" apart */
+		if (depth > 0 && (seq / depth) % 2 == 0)
+			accepted += antireplay_update(&ar, seq - depth) == 0;
+		else if (depth > 0)
+			accepted += antireplay_update(&ar, seq + depth) == 0;
+		else
+			accepted += antireplay_update(&ar, seq) == 0;
+	}
+
+	secs = elapsed(&start);
+
+	printf("%s: %.1f Mpps, %.2f%% accepted\n", name, n / secs / 1e6,
+	    100.0 * accepted / n);
+}
+
 int
-main(void)
+main(int argc, char *argv[])
 {
 	testnoupdate();
 	testwithupdateseq();
 	testwithupdatejump();
+	testreorder();
+	testbigjump();
+
+	/* only run the benchmarks on request */
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		bench("in order", 0);
+		bench("reordered by 64", 64);
+		bench("reordered by 1024", 1024);
+		bench("reordered by window", MAXTOTALITEMS / 2);
+	}
 
 	return 0;
 }
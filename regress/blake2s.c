@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Verify each BLAKE2s compression function that is supported on this CPU with
+ * known answers and against the reference implementation.
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../blake2.h"
+#include "../blake2s-simd.h"
+
+#define MAXMSG 1024
+
+struct kat {
+	size_t msglen;	/* message is 0, 1, 2, ... */
+	int keyed;	/* key is 0, 1, 2, ... 31 */
+	const char *hash;
+};
+
+static const struct kat katv[] = {
+	{ 0, 0,
+	    "69217a3079908094e11121d042354a7c1f55b6482ca1a51e1b250dfd1ed0eef9" },
+	{ 0, 1,
+	    "48a8997da407876b3d79c0d92325ad3b89cbb754d86ab71aee047ad345fd2c49" },
+	{ 1, 1,
+	    "40d15fee7c328830166ac3f918650f807e7e01e177258cdc0a39b11f598066f1" },
+	{ 63, 1,
+	    "c65382513f07460da39833cb666c5ed82e61b9e998f4b0c4287cee56c3cc9bcd" },
+	{ 64, 1,
+	    "8975b0577fd35566d750b362b0897a26c399136df07bababbde6203ff2954ed4" },
+	{ 65, 1,
+	    "21fe0ceb0052be7fb0f004187cacd7de67fa6eb0938d927677f2398c132317a8" },
+	{ 255, 1,
+	    "3fb735061abc519dfe979e54c1ee5bfad0a9d858b3315bad34bde999efd724dd" },
+};
+
+static uint8_t key[BLAKE2S_KEYBYTES];
+static uint8_t seqmsg[MAXMSG];
+
+static void
+hexhash(char *out, const uint8_t hash[BLAKE2S_OUTBYTES])
+{
+	size_t n;
+
+	for (n = 0; n < BLAKE2S_OUTBYTES; n++)
+		snprintf(&out[n * 2], 3, "%02x", hash[n]);
+}
+
+/*
+ * Check the current implementation against the known answers, both in one go
+ * and with every possible update size.
+ */
+void
+testkat(void)
+{
+	blake2s_state S;
+	uint8_t hash[BLAKE2S_OUTBYTES];
+	char hex[BLAKE2S_OUTBYTES * 2 + 1];
+	size_t n, step, off;
+
+	for (n = 0; n < sizeof(katv) / sizeof(katv[0]); n++) {
+		assert(blake2s(hash, sizeof(hash), seqmsg, katv[n].msglen,
+		    katv[n].keyed ? key : NULL,
+		    katv[n].keyed ? sizeof(key) : 0) == 0);
+		hexhash(hex, hash);
+		assert(strcmp(hex, katv[n].hash) == 0);
+
+		for (step = 1; step <= BLAKE2S_BLOCKBYTES; step++) {
+			if (katv[n].keyed)
+				assert(blake2s_init_key(&S, sizeof(hash), key,
+				    sizeof(key)) == 0);
+			else
+				assert(blake2s_init(&S, sizeof(hash)) == 0);
+
+			for (off = 0; off < katv[n].msglen; off += step)
+				assert(blake2s_update(&S, &seqmsg[off],
+				    MIN(step, katv[n].msglen - off)) == 0);
+
+			assert(blake2s_final(&S, hash, sizeof(hash)) == 0);
+			hexhash(hex, hash);
+			assert(strcmp(hex, katv[n].hash) == 0);
+		}
+	}
+}
+
+/*
+ * Compare the current implementation with the reference for random messages of
+ * every length up to MAXMSG, each with a random key and output length.
+ */
+void
+testoracle(const struct blake2s_impl *impl)
+{
+	uint8_t msg[MAXMSG], rkey[BLAKE2S_KEYBYTES];
+	uint8_t exp[BLAKE2S_OUTBYTES], got[BLAKE2S_OUTBYTES];
+	size_t n, outlen, keylen;
+
+	for (n = 0; n <= MAXMSG; n++) {
+		arc4random_buf(msg, n);
+		arc4random_buf(rkey, sizeof(rkey));
+		outlen = 1 + arc4random_uniform(BLAKE2S_OUTBYTES);
+		keylen = arc4random_uniform(BLAKE2S_KEYBYTES + 1);
+
+		assert(blake2s_useimpl(&blake2s_implv[0]) == 0);
+		assert(blake2s(exp, outlen, msg, n, keylen ? rkey : NULL,
+		    keylen) == 0);
+
+		assert(blake2s_useimpl(impl) == 0);
+		assert(blake2s(got, outlen, msg, n, keylen ? rkey : NULL,
+		    keylen) == 0);
+
+		assert(memcmp(exp, got, outlen) == 0);
+	}
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+		err(1, "clock_gettime");
+
+	return (end.tv_sec - start->tv_sec) +
+	    (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Measure the number of keyed hashes of "msglen" bytes per second, like a
+ * mac1 over an init message.
+ */
+void
+bench(const struct blake2s_impl *impl, size_t msglen)
+{
+	struct timespec start;
+	uint8_t hash[BLAKE2S_OUTBYTES];
+	size_t n, iterations;
+	double secs;
+
+	assert(blake2s_useimpl(impl) == 0);
+
+	iterations = 2000000;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		err(1, "clock_gettime");
+
+	for (n = 0; n < iterations; n++) {
+		blake2s(hash, 16, seqmsg, msglen, key, sizeof(key));
+		seqmsg[0] = hash[0];
+	}
+
+	secs = elapsed(&start);
+
+	printf("%s %zu bytes: %.2f Mhashes/s\n", impl->name, msglen,
+	    iterations / secs / 1e6);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct blake2s_impl *impl;
+	size_t n;
+
+	for (n = 0; n < sizeof(key); n++)
+		key[n] = n;
+	for (n = 0; n < sizeof(seqmsg); n++)
+		seqmsg[n] = n;
+
+	for (n = 0; n < blake2s_implvsize; n++) {
+		impl = &blake2s_implv[n];
+		if (!blake2s_implsupported(impl)) {
+			printf("%s not supported\n", impl->name);
+			continue;
+		}
+
+		assert(blake2s_useimpl(impl) == 0);
+		testkat();
+		testoracle(impl);
+		printf("%s ok\n", impl->name);
+	}
+
+	/* the fastest supported implementation is selected by default */
+	assert(blake2s_useimpl(NULL) == 0);
+	printf("default %s\n", blake2s_currentimpl()->name);
+
+	/* only run the benchmarks on request */
+	if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+		for (n = 0; n < blake2s_implvsize; n++) {
+			impl = &blake2s_implv[n];
+			if (!blake2s_implsupported(impl))
+				continue;
+			bench(impl, 116);
+			bench(impl, 1024);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define FIELD(s, f) { #f, offsetof(struct s, f) }
+
+struct statsfield {
+	const char *name;
+	size_t offset;
+};
+
+static const struct statsfield ifnfields[] = {
+	FIELD(ifnstats, devin), FIELD(ifnstats, devinerr),
+	FIELD(ifnstats, devout), FIELD(ifnstats, devouterr),
+	FIELD(ifnstats, devinsz), FIELD(ifnstats, devoutsz),
+	FIELD(ifnstats, queuein), FIELD(ifnstats, queueinerr),
+	FIELD(ifnstats, queueout), FIELD(ifnstats, queueouterr),
+	FIELD(ifnstats, queueinsz), FIELD(ifnstats, queueoutsz),
+	FIELD(ifnstats, sockin), FIELD(ifnstats, sockinerr),
+	FIELD(ifnstats, sockout), FIELD(ifnstats, sockouterr),
+	FIELD(ifnstats, sockinsz), FIELD(ifnstats, sockoutsz),
+	FIELD(ifnstats, initin), FIELD(ifnstats, initinerr),
+	FIELD(ifnstats, initout), FIELD(ifnstats, initouterr),
+	FIELD(ifnstats, respin), FIELD(ifnstats, respinerr),
+	FIELD(ifnstats, respout), FIELD(ifnstats, respouterr),
+	FIELD(ifnstats, proxin), FIELD(ifnstats, proxinerr),
+	FIELD(ifnstats, proxout), FIELD(ifnstats, proxouterr),
+	FIELD(ifnstats, enclin), FIELD(ifnstats, enclinerr),
+	FIELD(ifnstats, enclout), FIELD(ifnstats, enclouterr),
+	FIELD(ifnstats, corrupted), FIELD(ifnstats, invalidmac),
+	FIELD(ifnstats, invalidpeer),
+};
+
+static const struct statsfield proxyfields[] = {
+	FIELD(proxystats, recv), FIELD(proxystats, recvsz),
+	FIELD(proxystats, fwdifn), FIELD(proxystats, fwdifnsz),
+	FIELD(proxystats, fwdring),
+	FIELD(proxystats, fwdencl), FIELD(proxystats, fwdenclsz),
+	FIELD(proxystats, cookiereplies), FIELD(proxystats, corrupted),
+	FIELD(proxystats, invalidmac), FIELD(proxystats, invalidpeer),
+	FIELD(proxystats, ratelimited), FIELD(proxystats, rejected),
+};
+
+static const struct statsfield enclavefields[] = {
+	FIELD(enclavestats, initin), FIELD(enclavestats, initinerr),
+	FIELD(enclavestats, respin), FIELD(enclavestats, respinerr),
+	FIELD(enclavestats, cookiein), FIELD(enclavestats, cookieinerr),
+	FIELD(enclavestats, initout), FIELD(enclavestats, initouterr),
+	FIELD(enclavestats, deferred),
+	FIELD(enclavestats, ephpooled), FIELD(enclavestats, ephinline),
+	FIELD(enclavestats, forwarded),
+};
+
+static const char *histnames[HISTSTAGES] = {
+	"kevent", "tunread", "tunwrite", "route", "encrypt", "decrypt",
+	"sockread", "sockwrite", "handshake", "wginit", "wgresp",
+};
+
+static const struct statsfield peerfields[] = {
+	FIELD(peerstats, rx), FIELD(peerstats, rxsz),
+	FIELD(peerstats, tx), FIELD(peerstats, txsz),
+	FIELD(peerstats, queued), FIELD(peerstats, queuedrops),
+	FIELD(peerstats, replayed), FIELD(peerstats, unauthenticated),
+	FIELD(peerstats, hsinit), FIELD(peerstats, hsresp),
+	FIELD(peerstats, hsdone), FIELD(peerstats, hslatency),
+	FIELD(peerstats, hslatencysum),
+};
+
+/*
+ * Return the size of a stats page with room for "npeers" peers.
+ */
+size_t
+stats_size(size_t npeers)
+{
+	return sizeof(struct statspage) + npeers * sizeof(struct peerstats);
+}
+
+static int
+statspath(char *path, size_t pathsize, size_t n)
+{
+	int rc;
+
+	rc = snprintf(path, pathsize, "%s%zu", STATSNAME, n);
+	if (rc < 0 || (size_t)rc >= pathsize)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Remove the stats pages of a previous run.
+ */
+void
+stats_unlinkall(void)
+{
+	char path[32];
+	size_t n;
+
+	for (n = 0; statspath(path, sizeof(path), n) == 0; n++)
+		if (shm_unlink(path) == -1)
+			break;
+}
+
+/*
+ * Create stats page "n" with room for "npeers" peers.
+ *
+ * Return a read/write descriptor on success, -1 on failure.
+ */
+int
+stats_create(size_t n, size_t npeers)
+{
+	char path[32];
+	int fd;
+
+	if (statspath(path, sizeof(path), n) == -1)
+		return -1;
+
+	if ((fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1)
+		return -1;
+
+	if (ftruncate(fd, stats_size(npeers)) == -1) {
+		close(fd);
+		shm_unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Map the stats page in "fd" that has room for "npeers" peers and initialize
+ * it for the calling process. If "fd" is -1 a private page is allocated so
+ * that counters can always be updated.
+ *
+ * Return the page on success, NULL on failure.
+ */
+struct statspage *
+stats_map(int fd, size_t npeers, enum statstype type, const char *name)
+{
+	struct statspage *page;
+	struct stat st;
+
+	if (fd == -1) {
+		if ((page = calloc(1, stats_size(npeers))) == NULL)
+			return NULL;
+	} else {
+		if (fstat(fd, &st) == -1)
+			return NULL;
+
+		if (st.st_size < 0 || (size_t)st.st_size != stats_size(npeers)) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		page = mmap(NULL, stats_size(npeers), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+		if (page == MAP_FAILED)
+			return NULL;
+
+		memset(page, 0, stats_size(npeers));
+	}
+
+	page->version = STATSVERSION;
+	page->pid = getpid();
+	page->type = type;
+	snprintf(page->name, sizeof(page->name), "%s", name);
+	page->npeers = npeers;
+	page->magic = STATSMAGIC;
+
+	return page;
+}
+
+static void
+printfields(FILE *fp, const char *prefix, const void *base,
+    const struct statsfield *fields, size_t nfields)
+{
+	size_t n;
+
+	for (n = 0; n < nfields; n++)
+		fprintf(fp, "%s.%s %zu\n", prefix, fields[n].name,
+		    *(const size_t *)((const uint8_t *)base +
+		    fields[n].offset));
+}
+
+/*
+ * Print each histogram that has measurements as "process.hist.stage.count",
+ * "process.hist.stage.sum" and a line "process.hist.stage.geN" for each bucket
+ * with values of at least N nanoseconds that is not empty.
+ */
+static void
+printhists(FILE *fp, const struct statspage *page)
+{
+	const struct histogram *h;
+	size_t n, m;
+
+	for (n = 0; n < HISTSTAGES; n++) {
+		h = &page->hist[n];
+		if (h->count == 0)
+			continue;
+
+		fprintf(fp, "%s.hist.%s.count %zu\n", page->name, histnames[n],
+		    h->count);
+		fprintf(fp, "%s.hist.%s.sum %zu\n", page->name, histnames[n],
+		    h->sum);
+		for (m = 0; m < HISTBUCKETS; m++) {
+			if (h->bucket[m] == 0)
+				continue;
+			fprintf(fp, "%s.hist.%s.ge%llu %zu\n", page->name,
+			    histnames[n], m == 0 ? 0ULL : 1ULL << m,
+			    h->bucket[m]);
+		}
+	}
+}
+
+/*
+ * Print the counters of all running processes to "fp", one counter per line
+ * as "process.counter value" or "process.peerN.counter value".
+ *
+ * Return 0 on success, -1 if no stats could be found.
+ */
+int
+stats_print(FILE *fp)
+{
+	const struct statspage *page;
+	const struct peerstats *ps;
+	struct stat st;
+	char path[32], prefix[64];
+	size_t n, m, found;
+	int fd;
+
+	found = 0;
+	for (n = 0; statspath(path, sizeof(path), n) == 0; n++) {
+		if ((fd = shm_open(path, O_RDONLY, 0)) == -1)
+			break;
+
+		if (fstat(fd, &st) == -1 ||
+		    (size_t)st.st_size < sizeof(struct statspage)) {
+			close(fd);
+			continue;
+		}
+
+		page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (page == MAP_FAILED)
+			continue;
+
+		/* skip pages that are not initialized or of a dead process */
+		if (page->magic != STATSMAGIC ||
+		    page->version != STATSVERSION ||
+		    stats_size(page->npeers) > (size_t)st.st_size ||
+		    (kill(page->pid, 0) == -1 && errno == ESRCH)) {
+			munmap((void *)page, st.st_size);
+			continue;
+		}
+
+		found++;
+
+		switch (page->type) {
+		case STATSENCLAVE:
+			printfields(fp, page->name, &page->u.enclave,
+			    enclavefields,
+			    sizeof(enclavefields) / sizeof(enclavefields[0]));
+			break;
+		case STATSPROXY:
+			printfields(fp, page->name, &page->u.proxy,
+			    proxyfields,
+			    sizeof(proxyfields) / sizeof(proxyfields[0]));
+			break;
+		case STATSIFN:
+			printfields(fp, page->name, &page->u.ifn, ifnfields,
+			    sizeof(ifnfields) / sizeof(ifnfields[0]));
+			break;
+		}
+
+		printhists(fp, page);
+
+		for (m = 0; m < page->npeers; m++) {
+			ps = &page->peers[m];
+			if (!ps->owned)
+				continue;
+
+			snprintf(prefix, sizeof(prefix), "%s.peer%zu",
+			    page->name, m);
+			fprintf(fp, "%s.name %.*s\n", prefix,
+			    (int)sizeof(ps->name), ps->name);
+			printfields(fp, prefix, ps, peerfields,
+			    sizeof(peerfields) / sizeof(peerfields[0]));
+		}
+
+		munmap((void *)page, st.st_size);
+	}
+
+	if (found == 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Return the time of the monotonic clock in nanoseconds.
+ */
+uint64_t
+stats_nsec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Account a measurement of "ns" nanoseconds in histogram "h".
+ */
+void
+stats_histadd(struct histogram *h, uint64_t ns)
+{
+	size_t n;
+
+	h->count++;
+	h->sum += ns;
+
+	for (n = 0; ns > 1 && n < HISTBUCKETS - 1; n++)
+		ns >>= 1;
+
+	h->bucket[n]++;
+}
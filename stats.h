@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Each process keeps its counters in a page of shared memory that is created
+ * by the master. The page of process "n" is named STATSNAME "n", the enclave
+ * is 0, the proxy 1 and each ifn process follows. Additional enclave workers
+ * create their own page after those of the ifn processes. Counters are only
+ * written by the owning process and can be read at any time by "wiresep stats".
+ */
+#define STATSNAME "/wiresep.stats."
+#define STATSMAGIC 0x77737374
+#define STATSVERSION 5
+
+enum statstype { STATSENCLAVE, STATSPROXY, STATSIFN };
+
+/*
+ * Time spent in the stages of the hot paths is only measured if compiled with
+ * -DSTATSTIMING. Each stage has a histogram with log2 buckets of nanoseconds.
+ */
+#define HISTBUCKETS 32
+
+enum histstage {
+	HISTKEVENT,	/* ifn waiting in kevent(2) */
+	HISTTUNREAD,
+	HISTTUNWRITE,
+	HISTROUTE,	/* allowed ips lookup */
+	HISTENCRYPT,
+	HISTDECRYPT,
+	HISTSOCKREAD,
+	HISTSOCKWRITE,
+	HISTHANDSHAKE,	/* ifn from REQWGINIT to SESSKEYS */
+	HISTWGINIT,	/* enclave handling an init message */
+	HISTWGRESP,	/* enclave handling a response message */
+	HISTSTAGES
+};
+
+struct histogram {
+	size_t count;
+	size_t sum;
+	size_t bucket[HISTBUCKETS];	/* bucket n holds [2^n, 2^(n + 1)) */
+	uint64_t start;	/* start of the running measurement, internal */
+};
+
+#ifdef STATSTIMING
+#define HISTSTART(page, stage) ((page)->hist[stage].start = stats_nsec())
+#define HISTSTOP(page, stage) stats_histadd(&(page)->hist[stage], \
+    stats_nsec() - (page)->hist[stage].start)
+#define HISTADD(page, stage, ns) stats_histadd(&(page)->hist[stage], (ns))
+#else
+#define HISTSTART(page, stage)
+#define HISTSTOP(page, stage)
+#define HISTADD(page, stage, ns)
+#endif
+
+struct ifnstats {
+	size_t devin; size_t devinerr; size_t devout; size_t devouterr;
+	    size_t devinsz; size_t devoutsz;
+	size_t queuein; size_t queueinerr; size_t queueout; size_t queueouterr;
+	    size_t queueinsz; size_t queueoutsz;
+	size_t sockin; size_t sockinerr; size_t sockout; size_t sockouterr;
+	    size_t sockinsz; size_t sockoutsz;
+	size_t initin; size_t initinerr; size_t initout; size_t initouterr;
+	size_t respin; size_t respinerr; size_t respout; size_t respouterr;
+	size_t proxin; size_t proxinerr; size_t proxout; size_t proxouterr;
+	size_t enclin; size_t enclinerr; size_t enclout; size_t enclouterr;
+	size_t corrupted;
+	size_t invalidmac;
+	size_t invalidpeer;
+};
+
+struct proxystats {
+	size_t recv; size_t recvsz;
+	size_t fwdifn; size_t fwdifnsz; size_t fwdring;
+	size_t fwdencl; size_t fwdenclsz;
+	size_t cookiereplies;
+	size_t corrupted;
+	size_t invalidmac;
+	size_t invalidpeer;
+	size_t ratelimited;	/* over the handshake rate of the source */
+	size_t rejected;	/* from a source that recently failed */
+};
+
+struct enclavestats {
+	size_t initin; size_t initinerr;
+	size_t respin; size_t respinerr;
+	size_t cookiein; size_t cookieinerr;
+	size_t initout; size_t initouterr;
+	size_t deferred;	/* reads postponed by the rate limiter */
+	size_t ephpooled;	/* ephemeral keys taken from the pool */
+	size_t ephinline;	/* ephemeral keys generated on demand */
+	size_t forwarded;	/* messages passed on to another worker */
+};
+
+/* only filled in by the ifn process that serves the peer */
+struct peerstats {
+	int owned;
+	char name[9];
+	size_t rx; size_t rxsz;
+	size_t tx; size_t txsz;
+	size_t queued;	/* packets waiting for a session right now */
+	size_t queuedrops;
+	size_t replayed;
+	size_t unauthenticated;
+	size_t hsinit;	/* handshake initiations sent */
+	size_t hsresp;	/* handshake responses sent */
+	size_t hsdone;	/* sessions established */
+	size_t hslatency;	/* microseconds of the last initiated handshake */
+	size_t hslatencysum;	/* microseconds of all initiated handshakes */
+	uint64_t hsstart;	/* start of the pending initiation, internal */
+};
+
+struct statspage {
+	uint32_t magic;
+	uint32_t version;
+	pid_t pid;
+	enum statstype type;
+	char name[32];
+	union {
+		struct ifnstats ifn;
+		struct proxystats proxy;
+		struct enclavestats enclave;
+	} u;
+	struct histogram hist[HISTSTAGES];
+	size_t npeers;
+	struct peerstats peers[];
+};
+
+size_t stats_size(size_t npeers);
+void stats_unlinkall(void);
+int stats_create(size_t n, size_t npeers);
+struct statspage *stats_map(int fd, size_t npeers, enum statstype type,
+    const char *name);
+int stats_print(FILE *fp);
+uint64_t stats_nsec(void);
+void stats_histadd(struct histogram *h, uint64_t ns);
+
+#endif /* STATS_H */
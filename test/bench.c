@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../base64.h"
+#include "../wiresep.h"
+
+#include "bench.h"
+
+/*
+ * Write "npeers" peer sections without an endpoint to "d". Each peer has a
+ * random public key and allowedips net.x.y.z/32, unique for at most 2^24 - 1
+ * peers.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+bench_writepeers(int d, size_t npeers, uint8_t net)
+{
+	char pubkey[64];
+	wskey key;
+	size_t n;
+
+	if (npeers >= 1 << 24) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (n = 1; n <= npeers; n++) {
+		arc4random_buf(key, sizeof(key));
+		if (base64_ntop(key, sizeof(key), pubkey, sizeof(pubkey)) == -1)
+			return -1;
+
+		if (dprintf(d, "\t\tpeer {\n\t\t\tpubkey %s\n\t\t\tallowedips "
+		    "%u.%zu.%zu.%zu/32\n\t\t}\n", pubkey, net, n >> 16 & 0xff,
+		    n >> 8 & 0xff, n & 0xff) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create an anonymous stats page with room for "npeers" peers that can be
+ * passed to a process under test.
+ *
+ * Return a read/write descriptor on success, -1 on failure.
+ */
+int
+bench_statscreate(size_t npeers)
+{
+	char path[] = "/wiresep.XXXXXXXXXX";
+	int fd;
+
+	if ((fd = shm_mkstemp(path)) == -1)
+		return -1;
+
+	if (shm_unlink(path) == -1 || ftruncate(fd, stats_size(npeers)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Map a page created by bench_statscreate read-only so that the counters of
+ * the process under test can be followed.
+ *
+ * Return the page on success, NULL on failure.
+ */
+const struct statspage *
+bench_statsmap(int fd, size_t npeers)
+{
+	const struct statspage *page;
+
+	page = mmap(NULL, stats_size(npeers), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED)
+		return NULL;
+
+	return page;
+}
+
+/*
+ * Raise the soft limit on open files to the hard limit, each peer needs at
+ * least one socket in the ifn process.
+ */
+void
+bench_raisenofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+/*
+ * Print "count" items with a total size of "bytes" that are handled in "nsec"
+ * nanoseconds as "name.count", "name.bytes", "name.nsec", "name.pps" and
+ * "name.gbps". The bandwidth is only printed if "bytes" is not 0.
+ */
+void
+bench_print(const char *name, size_t count, size_t bytes, uint64_t nsec)
+{
+	double secs;
+
+	secs = nsec / 1000000000.0;
+
+	printf("%s.count %zu\n", name, count);
+	if (bytes > 0)
+		printf("%s.bytes %zu\n", name, bytes);
+	printf("%s.nsec %llu\n", name, (unsigned long long)nsec);
+	printf("%s.pps %.0f\n", name, secs > 0 ? count / secs : 0);
+	if (bytes > 0)
+		printf("%s.gbps %.3f\n", name,
+		    secs > 0 ? bytes * 8 / secs / 1000000000.0 : 0);
+
+	fflush(stdout);
+}
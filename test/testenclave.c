@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2020 Tim Kuijsten
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose
+ * with or without fee is hereby granted, provided that the above copyright
+ * notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Test complete handshakes between two interfaces through the enclave.
+ *
+ * Fork an ENCLAVE that knows a tun1 and a tun2 interface that are each others
+ * peer and let this process play the role of the master, the proxy and both
+ * ifn processes. Each handshake consists of:
+ *   MSGREQWGINIT from tun1
+ *   MSGWGINIT to tun1, passed on to the enclave as a message for tun2
+ *   MSGCONNREQ, MSGSESSKEYS and MSGWGRESP to tun2, the response is passed on
+ *       to the enclave as a message for tun1
+ *   MSGCONNREQ and MSGSESSKEYS to tun1
+ *
+ * The number of handshakes per second is printed on stdout. With more than one
+ * enclave worker the messages of tun2 are passed on by the front.
+ */
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../parseconfig.h"
+
+#include "bench.h"
+
+/* inside job */
+#include "../enclave.c"
+
+#define DEFAULTHANDSHAKES 10000
+
+typedef int chan[2];
+
+/* these are used by the other modules as well */
+int background, verbose;
+
+/* global settings */
+static uid_t guid;
+static gid_t ggid;
+
+static struct cfgifn **cfgifnv;
+static size_t cfgifnvsize;
+
+/*
+ * Configure two interfaces that are each others peer and do not limit the
+ * handshake rate. Extra peers for tun2, the responder that has to find the peer
+ * by its public key, are written between config2 and config3.
+ *
+ * tun1 pubkey ErOyQKEbYQx/nFSiCFY+lDCe/3LfJ/v8UiHFpnvpo3Q=
+ * tun2 pubkey 0PbkDqdhbg3N4JUA0cV+CxAWATiCQx7nZA+vjeG7s00=
+ */
+static const char config1[] = "user 1109\n\
+	ratelimit 1000000\n\
+	interface tun1 {\n\
+		ifaddr 172.16.1.17/16\n\
+		listen [::1]:1234\n\
+\n\
+		privkey f5tK/SyL1G599SrSLPlul0Z4DFgqMglUrebRH7hSAZs=\n\
+		psk     l8Oj31HlFvmxUOJw7zIvu/MJ66QDZfg/8+u3M4EHzbY=\n\
+\n\
+		peer b {\n\
+			pubkey  0PbkDqdhbg3N4JUA0cV+CxAWATiCQx7nZA+vjeG7s00=\n\
+			allowedips 172.16.2.17/16\n\
+		}\n";
+
+static const char config2[] = "\
+	}\n\
+	interface tun2 {\n\
+		ifaddr 172.16.2.17/16\n\
+		listen [::1]:2345\n\
+\n\
+		privkey X6EO9HiLHP+j7Gj9C9+P1eOoUjGjPZFSljJE4QLSFag=\n\
+		psk     l8Oj31HlFvmxUOJw7zIvu/MJ66QDZfg/8+u3M4EHzbY=\n\
+\n\
+		peer a {\n\
+			pubkey ErOyQKEbYQx/nFSiCFY+lDCe/3LfJ/v8UiHFpnvpo3Q=\n\
+			allowedips 172.16.1.17/16\n\
+		}\n";
+
+static const char config3[] = "\
+	}\n";
+
+static union smsg smsg;
+
+static void
+printusage(FILE *fp)
+{
+	fprintf(fp, "usage: %s [-v] [-p peers] [-w workers] [handshakes]\n",
+	    getprogname());
+}
+
+/*
+ * Receive a message for peer 0 of an interface from the enclave in "msg" and
+ * make sure it is of type "mtcode".
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+expectmsg(int port, unsigned char mtcode, size_t *msgsize)
+{
+	uint32_t peerid;
+	unsigned char mt;
+
+	*msgsize = sizeof(msg);
+	if (wire_recvpeeridmsg(port, &peerid, &mt, msg, msgsize) == -1) {
+		logwarn("expected message %d", mtcode);
+		return -1;
+	}
+
+	if (mt != mtcode || peerid != 0) {
+		logwarnx("expected message %d for peer 0, got %d for peer %u",
+		    mtcode, mt, peerid);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Run one handshake initiated by tun1 with tun2 through the enclave.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int
+handshake(int tun1port, int tun2port, int proxport,
+    const union sockaddr_inet *addr1, const union sockaddr_inet *addr2)
+{
+	struct msgreqwginit mri;
+	size_t msgsize;
+
+	if (makemsgreqwginit(&mri) == -1)
+		return -1;
+
+	if (wire_sendpeeridmsg(tun1port, 0, MSGREQWGINIT, &mri, sizeof(mri))
+	    == -1)
+		return -1;
+
+	if (expectmsg(tun1port, MSGWGINIT, &msgsize) == -1)
+		return -1;
+
+	if (wire_proxysendmsg(proxport, 1, addr2, addr1, MSGWGINIT, msg,
+	    msgsize) == -1)
+		return -1;
+
+	if (expectmsg(tun2port, MSGCONNREQ, &msgsize) == -1)
+		return -1;
+	if (expectmsg(tun2port, MSGSESSKEYS, &msgsize) == -1)
+		return -1;
+	if (expectmsg(tun2port, MSGWGRESP, &msgsize) == -1)
+		return -1;
+
+	if (wire_proxysendmsg(proxport, 0, addr1, addr2, MSGWGRESP, msg,
+	    msgsize) == -1)
+		return -1;
+
+	if (expectmsg(tun1port, MSGCONNREQ, &msgsize) == -1)
+		return -1;
+	if (expectmsg(tun1port, MSGSESSKEYS, &msgsize) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Set "sa" to [::1]:"port".
+ */
+static void
+loopback(union sockaddr_inet *sa, in_port_t port)
+{
+	memset(sa, 0, sizeof(*sa));
+	sa->v6.sin6_len = sizeof(sa->v6);
+	sa->v6.sin6_family = AF_INET6;
+	sa->v6.sin6_port = htons(port);
+	sa->v6.sin6_addr = in6addr_loopback;
+}
+
+/*
+ * Derived from enclave_init but without resource limits and privilege
+ * dropping, since no privileges are needed to begin with.
+ */
+static void
+testenclave_init(int masterport)
+{
+	struct sigaction sa;
+
+	recvconfig(masterport);
+	forkworkers(masterport);
+
+	/* print statistics on SIGUSR1 and do a graceful exit on SIGTERM */
+	sa.sa_handler = handlesig;
+	sa.sa_flags = SA_RESTART;
+	if (sigemptyset(&sa.sa_mask) == -1)
+		logexit(1, "sigemptyset");
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		logexit(1, "sigaction SIGUSR1");
+	if (sigaction(SIGTERM, &sa, NULL) == -1)
+		logexit(1, "sigaction SIGTERM");
+}
+
+/*
+ * Test the handshake rate of the enclave.
+ *
+ * Bootstrap the application:
+ *   0. parse configuration
+ *   1. setup communication ports and fork the ENCLAVE
+ *   2. send config to the ENCLAVE
+ *   3. run the handshakes one after the other
+ */
+int
+main(int argc, char **argv)
+{
+	union sockaddr_inet addr1, addr2;
+	struct timeval tv;
+	chan tmpchan;
+	uint64_t start;
+	size_t n, m, peers, nworkers, handshakes, failed;
+	int ipc[2], stat, mastwithencl, enclwithmast, enclwithprox;
+	int proxwithencl, stdopen;
+	pid_t enclave, configpid;
+	const char *errstr;
+	char c, *logfacilitystr;
+
+	peers = 1;
+	nworkers = 1;
+	while ((c = getopt(argc, argv, "hp:vw:")) != -1)
+		switch(c) {
+		case 'h':
+			printusage(stdout);
+			exit(0);
+		case 'p':
+			peers = strtonum(optarg, 1, MAXPEERS, &errstr);
+			if (errstr != NULL)
+				logexitx(1, "peers must be a number between 1 "
+				    "and %d: %s", MAXPEERS, optarg);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'w':
+			nworkers = strtonum(optarg, 1, MAXENCLWORKERS, &errstr);
+			if (errstr != NULL)
+				logexitx(1, "workers must be a number between "
+				    "1 and %d: %s", MAXENCLWORKERS, optarg);
+			break;
+		case '?':
+			printusage(stderr);
+			exit(1);
+		}
+
+	argc -= optind;
+	argv += optind;
+
+	handshakes = DEFAULTHANDSHAKES;
+	if (argc > 0) {
+		handshakes = strtonum(*argv, 1, INT_MAX, &errstr);
+		if (errstr != NULL)
+			logexitx(1, "handshakes must be a number between 1 and "
+			    "%d: %s", INT_MAX, *argv);
+
+		argc--;
+		argv++;
+	}
+
+	if (argc != 0) {
+		printusage(stderr);
+		exit(1);
+	}
+
+	setprogname("master");
+	setproctitle(NULL);
+
+	if (pipe(ipc) == -1)
+		logexit(1, "pipe");
+
+	/* pump the config to the parser */
+	if ((configpid = fork()) == 0) {
+		close(ipc[0]);
+
+		if (dprintf(ipc[1], "enclaveworkers %zu\n", nworkers) < 0)
+			logexit(1, "write config error");
+		if (write(ipc[1], config1, sizeof(config1) - 1)
+		    != sizeof(config1) - 1)
+			logexit(1, "write config error");
+		if (write(ipc[1], config2, sizeof(config2) - 1)
+		    != sizeof(config2) - 1)
+			logexit(1, "write config error");
+		if (bench_writepeers(ipc[1], peers - 1, 11) == -1)
+			logexit(1, "write peers error");
+		if (write(ipc[1], config3, sizeof(config3) - 1)
+		    != sizeof(config3) - 1)
+			logexit(1, "write config error");
+		close(ipc[1]);
+		exit(0);
+	}
+
+	/* read the config */
+	close(ipc[1]);
+	if (parseconfigfd(ipc[0], &cfgifnv, &cfgifnvsize, &guid, &ggid,
+	    &logfacilitystr) == -1)
+		logexitx(1, "parseconfigfd");
+	close(ipc[0]);
+	processconfig();
+
+	if (waitpid(configpid, &stat, 0) == -1)
+		logexit(1, "waitpid configpid");
+
+	/*
+	 * Make sure we are not missing any communication channels and that
+	 * there is no descriptor leak.
+	 */
+
+	stdopen = isopenfd(STDIN_FILENO) + isopenfd(STDOUT_FILENO) +
+	    isopenfd(STDERR_FILENO);
+
+	assert(getdtablecount() == stdopen);
+
+	/*
+	 *   1. setup communication ports and fork the ENCLAVE
+	 *
+	 * One channel per interface + a channel with the master and with the
+	 * proxy (which we all fulfill in this test setup).
+	 */
+
+	/* wait at most a second for each message from the enclave */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+
+	for (n = 0; n < cfgifnvsize; n++) {
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tmpchan) == -1)
+			logexit(1, "socketpair %zu", n);
+
+		cfgifnv[n]->enclwithifn = tmpchan[0];
+		cfgifnv[n]->ifnwithencl = tmpchan[1];
+
+		if (setsockopt(cfgifnv[n]->ifnwithencl, SOL_SOCKET,
+		    SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+			logexit(1, "setsockopt");
+	}
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tmpchan) == -1)
+		logexit(1, "socketpair");
+
+	enclwithmast = tmpchan[0];
+	mastwithencl = tmpchan[1];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tmpchan) == -1)
+		logexit(1, "socketpair");
+
+	enclwithprox = tmpchan[0];
+	proxwithencl = tmpchan[1];
+
+	switch (enclave = fork()) {
+	case -1:
+		logexit(1, "fork enclave");
+	case 0:
+		setprogname("enclave");
+		setproctitle(NULL);
+
+		/* gprof */
+		if (chdir("/tmp") == -1)
+			logexit(1, "chdir");
+
+		for (m = 0; m < cfgifnvsize; m++)
+			close(cfgifnv[m]->ifnwithencl);
+
+		close(mastwithencl);
+		close(proxwithencl);
+
+		if ((size_t)getdtablecount() != stdopen + 2 + cfgifnvsize)
+			logexitx(1, "descriptor mismatch: %d",
+			    getdtablecount());
+
+		testenclave_init(enclwithmast);
+		enclave_serv();
+		logexitx(1, "enclave_serv returned");
+	}
+
+	for (n = 0; n < cfgifnvsize; n++)
+		close(cfgifnv[n]->enclwithifn);
+
+	close(enclwithmast);
+	close(enclwithprox);
+
+	/*
+	 *   2. send config to the ENCLAVE
+	 */
+
+	sendconfig_enclave(smsg, mastwithencl, enclwithprox, -1);
+	signal_eos(smsg, mastwithencl);
+
+	/*
+	 *   3. run the handshakes one after the other
+	 */
+
+	loopback(&addr1, 1234);
+	loopback(&addr2, 2345);
+
+	failed = 0;
+	start = stats_nsec();
+	for (n = 0; n < handshakes; n++)
+		if (handshake(cfgifnv[0]->ifnwithencl, cfgifnv[1]->ifnwithencl,
+		    proxwithencl, &addr1, &addr2) == -1)
+			failed++;
+
+	printf("testenclave.peers %zu\n", peers);
+	printf("testenclave.workers %zu\n", nworkers);
+	printf("testenclave.failed %zu\n", failed);
+	bench_print("testenclave.handshake", handshakes - failed, 0,
+	    stats_nsec() - start);
+
+	if (kill(enclave, SIGTERM) == -1)
+		logexit(1, "kill enclave");
+
+	exit(0);
+}
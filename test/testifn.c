@@ -24,6 +24,13 @@
  *   CATCHER that catches any packets coming out of tun2
  *
  * let this process play the role of a pseudo master, enclave and proxy process.
+ *
+ * With -b the rate at which tun1 moves packets from its tunnel to its socket
+ * and tun2 moves packets from its socket to its tunnel is printed on stdout.
+ * With -f tun1 sends its packets through the egress scheduler. With -w tun1 is
+ * served by two workers and the catcher hands the second worker a data message
+ * from tun2 like the proxy does, the test fails if it does not reach the
+ * tunnel of tun1.
  */
 
 #include <sys/socket.h>
@@ -48,6 +55,8 @@
 
 #include "../parseconfig.h"
 
+#include "bench.h"
+
 /* inside job */
 #include "../ifn.c"
 
@@ -99,15 +108,21 @@ static size_t recvencl, recvprox, recvtun, recvtunsz;
 
 static int logstats, doterm;
 
+/* fixed packet size and total number of peers of tun1 in a benchmark */
+static size_t benchsize, benchpeers = 1;
+static int bench, fairqueue, workers;
+
 /* msg scratchpad is defined in ifn.c */
 
 /*
- * Configure one interface with 8 peers.
+ * Configure two interfaces that are each others peer. Extra peers for tun1 are
+ * written between configpeerb and config2. With -w one peer is written between
+ * config1 and configpeerb, so that peer b is served by the second worker.
  *
  * tun1 pubkey ErOyQKEbYQx/nFSiCFY+lDCe/3LfJ/v8UiHFpnvpo3Q=
  * tun2 pubkey 0PbkDqdhbg3N4JUA0cV+CxAWATiCQx7nZA+vjeG7s00=
  */
-static const char config[] = "user 1109\n\
+static const char config1[] = "user 1109\n\
 	interface tun1 {\n\
 		ifaddr 172.16.1.17/16\n\
 		listen [::1]:1234\n\
@@ -117,12 +132,16 @@ static const char config[] = "user 1109\n\
 \n\
 		# override global uid\n\
 		user 1200\n\
-\n\
+\n";
+
+static const char configpeerb[] = "\
 		peer b {\n\
 			pubkey  0PbkDqdhbg3N4JUA0cV+CxAWATiCQx7nZA+vjeG7s00=\n\
 			allowedips 172.16.2.17/16\n\
 			endpoint [::1]:2345\n\
-		}\n\
+		}\n";
+
+static const char config2[] = "\
 	}\n\
 	interface tun2 {\n\
 		ifaddr 172.16.2.17/16\n\
@@ -161,7 +180,8 @@ xclose(int *d)
 static void
 printusage(int d)
 {
-	dprintf(d, "usage: %s [-qv] [packets]\n", "testifn");
+	dprintf(d, "usage: %s [-bfqvw] [-p peers] [-s size] [packets]\n",
+	    "testifn");
 }
 
 static void
@@ -334,7 +354,8 @@ testsrcdst(int pitcherwithmast, size_t nrpackets,
     int tund)
 {
 	struct timespec to;
-	uint8_t buf[TUNHDRSIZ + MAXIPHDR + MAXPAYLOADSIZE], *iphdr, *randomness;
+	uint8_t buf[TUNHDRSIZ + MAX(MAXIPHDR + MAXPAYLOADSIZE, WSTUNMTU)];
+	uint8_t *iphdr, *randomness;
 	size_t i, sent, lenoff, len;
 	char c;
 
@@ -382,12 +403,14 @@ testsrcdst(int pitcherwithmast, size_t nrpackets,
 		 * Ensure at least 20 bytes are sent so that we're comptible
 		 * with ipv4 style headers that include the header in it's size.
 		 */
-		if (randomness[i] % MAXPAYLOADSIZE < 20) {
+		if (benchsize > 0) {
+			len = benchsize;
+		} else if (randomness[i] % MAXPAYLOADSIZE < 20) {
 			len = randomness[i] % MAXPAYLOADSIZE + 20;
 		} else {
 			len = randomness[i] % MAXPAYLOADSIZE;
 		}
-		iphdr[lenoff] = htobe16(len);
+		*(uint16_t *)&iphdr[lenoff] = htobe16(len);
 
 		if (write(tund, buf, TUNHDRSIZ + len) == -1) {
 			if (errno == ENOBUFS) {
@@ -596,9 +619,69 @@ handleifnmsg(const struct testifn *testifn)
 	return 0;
 }
 
+/*
+ * Act as the proxy and hand "testifn" a data message from its peer that
+ * contains an ip header only. Use "ifnid" as the interface id, like the proxy
+ * does for the worker that serves the peer.
+ *
+ * Exit on error.
+ */
+static void
+sendproxydata(const struct testifn *testifn, uint32_t ifnid)
+{
+	EVP_AEAD_CTX ctx;
+	union sockaddr_inet lsa, fsa;
+	struct msgwgdatahdr *mwdhdr;
+	uint8_t buf[MINPACKETSIZE], in[32], iv[12], *iphdr;
+	size_t outsize;
+
+	iphdr = createtunnelpacket(buf, sizeof(buf),
+	    &testifn->peertestifn->cfgifn->ifaddrs[0]->addr,
+	    &testifn->cfgifn->ifaddrs[0]->addr, 0);
+
+	/* both interfaces have an ipv4 address, pad to a multiple of 16 */
+	memset(in, 0, sizeof(in));
+	memcpy(in, iphdr, sizeof(struct ip));
+
+	mwdhdr = (struct msgwgdatahdr *)msg;
+	mwdhdr->type = htole32(4);
+	mwdhdr->receiver = htole32(testifn->sessid);
+
+	/* stay clear of the counters of keepalives sent by the peer */
+	mwdhdr->counter = htole64(1 << 16);
+
+	memset(iv, 0, sizeof(iv));
+	memcpy(&iv[4], &mwdhdr->counter, sizeof(mwdhdr->counter));
+
+	if (EVP_AEAD_CTX_init(&ctx, EVP_aead_chacha20_poly1305(),
+	    testifn->recvkey, KEYLEN, TAGLEN, NULL) == 0)
+		logexitx(1, "EVP_AEAD_CTX_init");
+
+	outsize = sizeof(msg) - sizeof(*mwdhdr);
+	if (EVP_AEAD_CTX_seal(&ctx, &msg[sizeof(*mwdhdr)], &outsize, outsize,
+	    iv, sizeof(iv), in, sizeof(in), NULL, 0) == 0)
+		logexitx(1, "EVP_AEAD_CTX_seal");
+
+	EVP_AEAD_CTX_cleanup(&ctx);
+
+	memset(&lsa, 0, sizeof(lsa));
+	memcpy(&lsa.v6, &testifn->cfgifn->laddrs6[0], sizeof(lsa.v6));
+	memset(&fsa, 0, sizeof(fsa));
+	memcpy(&fsa.v6, &testifn->peertestifn->cfgifn->laddrs6[0],
+	    sizeof(fsa.v6));
+
+	if (wire_proxysendmsg(testifn->cfgifn->proxwithifn, ifnid, &lsa, &fsa,
+	    MSGWGDATA, msg, sizeof(*mwdhdr) + outsize) == -1)
+		logexitx(1, "wire_proxysendmsg");
+}
+
 /*
  * Catcher acts as ENCLAVE and PROXY for all IFN processes and watches tunnel
  * descriptors.
+ *
+ * With -w, as soon as tun2 received data from the second worker of tun1, that
+ * worker has a session and gets a data message via the proxy channel. tun2 has
+ * the last index.
  */
 static void
 runcatcher(int catcherwithmast, struct testifn *testifnv, size_t testifnvsize)
@@ -606,7 +689,7 @@ runcatcher(int catcherwithmast, struct testifn *testifnv, size_t testifnvsize)
 	struct sigaction sa;
 	struct kevent *kev;
 	size_t n, kevlen;
-	int r2, queue;
+	int r2, queue, proxysent;
 	char c;
 
 	/* print stats on SIGUSR1 */
@@ -648,6 +731,7 @@ runcatcher(int catcherwithmast, struct testifn *testifnv, size_t testifnvsize)
 	 * Simply read all messages on all tunnel descriptors, and communication
 	 * with proxy and enclave.
 	 */
+	proxysent = 0;
 	for (;;) {
 		if (logstats) {
 			logwarnx("packets received enclave %zu, proxy %zu, tun "
@@ -656,8 +740,14 @@ runcatcher(int catcherwithmast, struct testifn *testifnv, size_t testifnvsize)
 			logstats = 0;
 		}
 
-		if (doterm)
+		if (doterm) {
+			if (workers && testifnv[0].recvtun == 0) {
+				logwarnx("data via the proxy did not reach the "
+				    "tunnel through the second worker of tun1");
+				exit(1);
+			}
 			exit(0);
+		}
 
 		if ((r2 = kevent(queue, NULL, 0, kev, kevlen, NULL)) == -1) {
 			if (errno == EINTR) {
@@ -679,6 +769,17 @@ runcatcher(int catcherwithmast, struct testifn *testifnv, size_t testifnvsize)
 
 					testifnv[n].recvtun++;
 					recvtun++;
+
+					/*
+					 * The first worker of tun1 has
+					 * interface id 0, peer b of tun1 is
+					 * served by worker 1.
+					 */
+					if (workers && !proxysent &&
+					    n == testifnvsize - 1) {
+						sendproxydata(&testifnv[1], 1);
+						proxysent = 1;
+					}
 				} else if ((int)kev[r2].ident ==
 				    testifnv[n].cfgifn->enclwithifn) {
 					if (handleifnmsg(&testifnv[n]) == -1)
@@ -701,6 +802,67 @@ runcatcher(int catcherwithmast, struct testifn *testifnv, size_t testifnvsize)
 	}
 }
 
+/*
+ * Follow the counters of tun1 and tun2 until the pitcher is done and none of
+ * the counters changed for a second. Then print the rate at which tun1 sent
+ * packets from its tunnel to its socket since the start and the rate at which
+ * tun2 wrote packets from its socket to its tunnel since its first packet.
+ */
+static void
+benchifn(pid_t pitcher, const struct statspage *tun1,
+    const struct statspage *tun2)
+{
+	struct timespec to;
+	uint64_t now, start, first, last1, last2;
+	size_t out, in;
+	pid_t pid;
+	int stat, done;
+
+	/* poll each millisecond */
+	to.tv_sec = 0;
+	to.tv_nsec = 1000000;
+
+	start = stats_nsec();
+	first = last1 = last2 = start;
+	out = in = 0;
+	done = 0;
+
+	for (;;) {
+		if (nanosleep(&to, NULL) == -1)
+			logexit(1, "nanosleep");
+
+		now = stats_nsec();
+
+		if (tun1->u.ifn.sockout != out) {
+			out = tun1->u.ifn.sockout;
+			last1 = now;
+		}
+
+		if (tun2->u.ifn.devout != in) {
+			if (in == 0)
+				first = now;
+			in = tun2->u.ifn.devout;
+			last2 = now;
+		}
+
+		if (!done) {
+			if ((pid = waitpid(pitcher, &stat, WNOHANG)) == -1)
+				logexit(1, "waitpid");
+			if (pid == pitcher)
+				done = 1;
+		} else if (now - MAX(last1, last2) > 1000000000) {
+			break;
+		}
+	}
+
+	printf("testifn.peers %zu\n", benchpeers);
+	printf("testifn.size %zu\n", benchsize);
+	bench_print("testifn.tun2sock", out, tun1->u.ifn.devinsz,
+	    last1 - start);
+	bench_print("testifn.sock2tun", in, tun2->u.ifn.devoutsz,
+	    last2 - first);
+}
+
 /*
  * Derived from ifn.c ifn_init but without privilege dropping etc, since no
  * privileges are needed to begin with. Most importantly, no call to opentunnel.
@@ -713,12 +875,20 @@ testifn_init(int masterport, int tunneld)
 	struct sigaction sa;
 
 	recvconfig(masterport);
+	mport = masterport;
 
 	aead = EVP_aead_chacha20_poly1305();
-	assert(EVP_AEAD_nonce_length(aead) == sizeof(nonce));
+	assert(EVP_AEAD_nonce_length(aead) == (sizeof nonce) - 4);
 	assert(EVP_AEAD_max_tag_len(aead) == TAGLEN);
 
-	tund = tunneld;
+	/* like ifn_init, additional workers use the channel with worker 0 */
+	if (ifn->worker > 0) {
+		if (close(tunneld) == -1)
+			logexit(1, "close");
+		tund = ifn->workerports[0];
+	} else {
+		tund = tunneld;
+	}
 
 	/*
 	 * Print statistics on SIGUSR1 and do a graceful exit on SIGTERM.
@@ -747,26 +917,48 @@ testifn_init(int masterport, int tunneld)
 int
 main(int argc, char **argv)
 {
+	const struct statspage **benchpagev;
 	struct testifn *testifnv;
 	chan tmpchan;
-	size_t j, m, n, testifnvsize;
+	size_t j, m, n, last, testifnvsize;
 	socklen_t len;
 	int ipc[2], stat, packets, stdopen;
 	pid_t pid, pitcher, catcher, configpid;
 	const char *errstr;
 	char c, *logfacilitystr;
 
-	while ((c = getopt(argc, argv, "hqv")) != -1) {
+	while ((c = getopt(argc, argv, "bfhp:qs:vw")) != -1) {
 		switch(c) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'f':
+			fairqueue = 1;
+			break;
 		case 'h':
 			printusage(STDOUT_FILENO);
 			exit(0);
+		case 'p':
+			benchpeers = strtonum(optarg, 1, MAXPEERS, &errstr);
+			if (errstr != NULL)
+				logexitx(1, "peers must be a number between 1 "
+				    "and %d: %s", MAXPEERS, optarg);
+			break;
 		case 'q':
 			verbose--;
 			break;
+		case 's':
+			benchsize = strtonum(optarg, 20, WSTUNMTU, &errstr);
+			if (errstr != NULL)
+				logexitx(1, "size must be a number between 20 "
+				    "and %d: %s", WSTUNMTU, optarg);
+			break;
 		case 'v':
 			verbose++;
 			break;
+		case 'w':
+			workers = 1;
+			break;
 		case '?':
 			printusage(STDERR_FILENO);
 			exit(1);
@@ -807,8 +999,21 @@ main(int argc, char **argv)
 	if ((configpid = fork()) == 0) {
 		xclose(&ipc[0]);
 
-		if (write(ipc[1], config, sizeof(config) - 1)
-		    != sizeof(config) - 1)
+		if (write(ipc[1], config1, sizeof(config1) - 1)
+		    != sizeof(config1) - 1)
+			logexit(1, "write config error");
+		if (fairqueue && dprintf(ipc[1], "fairqueue\n") < 0)
+			logexit(1, "write config error");
+		if (workers && (dprintf(ipc[1], "workers 2\n") < 0 ||
+		    bench_writepeers(ipc[1], 1, 11) == -1))
+			logexit(1, "write config error");
+		if (write(ipc[1], configpeerb, sizeof(configpeerb) - 1)
+		    != sizeof(configpeerb) - 1)
+			logexit(1, "write config error");
+		if (bench_writepeers(ipc[1], benchpeers - 1, 10) == -1)
+			logexit(1, "write peers error");
+		if (write(ipc[1], config2, sizeof(config2) - 1)
+		    != sizeof(config2) - 1)
 			logexit(1, "write config error");
 		xclose(&ipc[1]);
 		exit(0);
@@ -816,7 +1021,9 @@ main(int argc, char **argv)
 
 	/* read the config */
 	xclose(&ipc[1]);
-	xparseconfigfd(ipc[0], &cfgifnv, &cfgifnvsize, &guid, &ggid, &logfacilitystr);
+	if (parseconfigfd(ipc[0], &cfgifnv, &cfgifnvsize, &guid, &ggid,
+	    &logfacilitystr) == -1)
+		logexitx(1, "parseconfigfd");
 	xclose(&ipc[0]);
 	processconfig();
 
@@ -844,7 +1051,30 @@ main(int argc, char **argv)
 		logexitx(1, "calloc");
 	testifnvsize = cfgifnvsize;
 
+	if ((benchpagev = calloc(cfgifnvsize, sizeof(*benchpagev))) == NULL)
+		logexitx(1, "calloc");
+
+	if (benchpeers > 1)
+		bench_raisenofile();
+
 	for (n = 0; n < cfgifnvsize; n++) {
+		/*
+		 * Before forking the first worker of an interface, open the
+		 * channels between it and each additional worker, like master.
+		 */
+
+		if (cfgifnv[n]->worker == 0) {
+			for (m = n + 1; m < n + cfgifnv[n]->workers; m++) {
+				if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tmpchan)
+				    == -1)
+					logexit(1, "socketpair ifnworker %zu",
+					    m);
+
+				cfgifnv[m]->primwithifn = tmpchan[0];
+				cfgifnv[m]->ifnwithprim = tmpchan[1];
+			}
+		}
+
 		/*
 		 * Open interface channels with master and catcher (that acts as
 		 * enclave and ifn).
@@ -886,6 +1116,14 @@ main(int argc, char **argv)
 		    &len, sizeof(len)) == -1)
 			logexit(1, "setsockopt");
 
+		/* share the counters of the ifn process with us */
+		if (bench) {
+			cfgifnv[n]->statsfd =
+			    bench_statscreate(cfgifnv[n]->peerssize);
+			if (cfgifnv[n]->statsfd == -1)
+				logexit(1, "bench_statscreate %zu", n);
+		}
+
 		switch (testifnv[n].pid = fork()) {
 		case -1:
 			logexit(1, "fork %s", cfgifnv[n]->ifname);
@@ -908,14 +1146,27 @@ main(int argc, char **argv)
 				xclose(&cfgifnv[m]->proxwithifn);
 			}
 
-			assert(getdtablecount() == stdopen + 4);
+			/* channels of the workers that are not forked yet */
+			for (m = n + 1; m < n - cfgifnv[n]->worker +
+			    cfgifnv[n]->workers; m++)
+				xclose(&cfgifnv[m]->ifnwithprim);
+
+			assert(getdtablecount() == stdopen + 4 + bench +
+			    (cfgifnv[n]->worker == 0 ?
+			    (int)cfgifnv[n]->workers - 1 : 1));
 
 			testifn_init(cfgifnv[n]->ifnwithmast,
 			    testifnv[n].ifnwithtund);
 
-			/* expect a v4 and a v6 socket per peer */
+			/*
+			 * Expect a v4 and a v6 socket per peer served by this
+			 * worker, worker 0 keeps the channels with the others.
+			 */
 			if ((size_t)getdtablecount() != stdopen + 4 +
-			    cfgifnv[n]->peerssize * 2)
+			    (cfgifnv[n]->worker == 0 ?
+			    cfgifnv[n]->workers - 1 : 0) +
+			    (cfgifnv[n]->peerssize + cfgifnv[n]->workers - 1 -
+			    cfgifnv[n]->worker) / cfgifnv[n]->workers * 2)
 				logexitx(1, "descriptor mismatch: %d",
 				    getdtablecount());
 
@@ -940,22 +1191,44 @@ main(int argc, char **argv)
 		if (close(testifnv[n].cfgifn->ifnwithprox) == -1)
 			logexit(1, "close");
 
-		assert(getdtablecount() == stdopen + (int)(n + 1) * 4);
-	}
+		if (cfgifnv[n]->worker == 0) {
+			for (m = n + 1; m < n + cfgifnv[n]->workers; m++)
+				xclose(&cfgifnv[m]->primwithifn);
+		} else {
+			xclose(&cfgifnv[n]->ifnwithprim);
+		}
 
-	/* setup symmetric keys between first and second interface */
-	memset(&testifnv[0].sendkey, 5, sizeof(wskey));
-	memset(&testifnv[0].recvkey, 7, sizeof(wskey));
-	memset(&testifnv[1].sendkey, 7, sizeof(wskey));
-	memset(&testifnv[1].recvkey, 5, sizeof(wskey));
+		if (bench) {
+			benchpagev[n] = bench_statsmap(cfgifnv[n]->statsfd,
+			    cfgifnv[n]->peerssize);
+			if (benchpagev[n] == NULL)
+				logexit(1, "bench_statsmap %zu", n);
+			if (close(cfgifnv[n]->statsfd) == -1)
+				logexit(1, "close");
+		}
 
-	testifnv[0].sessid = 11;
-	testifnv[0].peersessid = 13;
-	testifnv[1].sessid = 13;
-	testifnv[1].peersessid = 11;
+		assert(getdtablecount() == stdopen + (int)(n + 1) * 4 +
+		    (int)(cfgifnv[n]->workers - 1 - cfgifnv[n]->worker));
+	}
 
-	testifnv[0].peertestifn = &testifnv[1];
-	testifnv[1].peertestifn = &testifnv[0];
+	/*
+	 * Setup symmetric keys between the first and second interface, each
+	 * worker of tun1 uses the same keys. tun2 has the last index.
+	 */
+	last = testifnvsize - 1;
+	for (n = 0; n < last; n++) {
+		memset(&testifnv[n].sendkey, 5, sizeof(wskey));
+		memset(&testifnv[n].recvkey, 7, sizeof(wskey));
+		testifnv[n].sessid = 11;
+		testifnv[n].peersessid = 13;
+		testifnv[n].peertestifn = &testifnv[last];
+	}
+
+	memset(&testifnv[last].sendkey, 7, sizeof(wskey));
+	memset(&testifnv[last].recvkey, 5, sizeof(wskey));
+	testifnv[last].sessid = 13;
+	testifnv[last].peersessid = 11;
+	testifnv[last].peertestifn = &testifnv[0];
 
 	if (pipe(ipc) == -1)
 		logexit(1, "pipe");
@@ -995,7 +1268,7 @@ main(int argc, char **argv)
 		setproctitle(NULL);
 
 		j = testsrcdst(ipc[1], packets, &cfgifnv[0]->ifaddrs[0]->addr,
-		    &cfgifnv[1]->ifaddrs[0]->addr, testifnv[0].mastwithtund);
+		    &cfgifnv[last]->ifaddrs[0]->addr, testifnv[0].mastwithtund);
 		logwarnx("testsrcdst, written %zu packets", j);
 		exit(0);
 	}
@@ -1025,8 +1298,13 @@ main(int argc, char **argv)
 
 	/* Wait until the pitcher is done and then kill the catcher */
 
-	if ((pid = waitpid(WAIT_ANY, &stat, 0)) == -1)
+	if (bench) {
+		benchifn(pitcher, benchpagev[0], benchpagev[last]);
+		pid = pitcher;
+		stat = 0;
+	} else if ((pid = waitpid(WAIT_ANY, &stat, 0)) == -1) {
 		logexit(1, "waitpid");
+	}
 
 	if (WIFEXITED(stat)) {
 		if (WEXITSTATUS(stat) != 0) {
@@ -1058,5 +1336,13 @@ main(int argc, char **argv)
 	if (kill(catcher, SIGTERM) == -1)
 		logexit(1, "kill catcher");
 
+	/* the catcher checks if the second worker received data via the proxy */
+	if (workers) {
+		if (waitpid(catcher, &stat, 0) == -1)
+			logexit(1, "waitpid catcher");
+		if (!WIFEXITED(stat) || WEXITSTATUS(stat) != 0)
+			logexitx(1, "worker test failed");
+	}
+
 	exit(0);
 }
@@ -34,6 +34,8 @@
 
 #include "../parseconfig.h"
 
+#include "bench.h"
+
 /* inside job */
 #include "../proxy.c"
 
@@ -67,7 +69,7 @@ static size_t cfgifnvsize;
 
 static size_t recvencl, recvifn, recvifnsz;
 
-static int logstats, doterm;
+static int logstats, doterm, bench;
 
 /*
  * Configure one interface with several peers.
@@ -170,7 +172,7 @@ static union smsg smsg;
 static void
 printusage(FILE *fp)
 {
-	fprintf(fp, "usage: %s [-v] [packets]\n", getprogname());
+	fprintf(fp, "usage: %s [-bv] [packets]\n", getprogname());
 }
 
 /*
@@ -234,12 +236,12 @@ testsetup(const struct cfgifn *ifn)
 		memcpy(&testsockmapv[i].si, &ifn->laddrs6[i],
 		    sizeof ifn->laddrs6[i]);
 
-		testsockmapv[i].s = socket(testsockmapv[i].si.family, SOCK_DGRAM, 0);
+		testsockmapv[i].s = socket(testsockmapv[i].si.h.family, SOCK_DGRAM, 0);
 		if (testsockmapv[i].s == -1)
 			logexit(1, "socket");
 
 		if (connect(testsockmapv[i].s, (struct sockaddr *)&testsockmapv[i].si,
-		    testsockmapv[i].si.len) == -1)
+		    testsockmapv[i].si.h.len) == -1)
 			logexit(1, "connect");
 	}
 }
@@ -265,8 +267,8 @@ testinvalidpackets(size_t nrpackets, int sock)
 
 	sent = 0;
 	for (i = 0; i < (nrpackets * RANDPERPACK); i += RANDPERPACK) {
-		mwdh.counter = htole64(&randomness[i]);
-		mwdh.receiver = htole32(&randomness[i + 1]);
+		mwdh.counter = htole64(*(uint64_t *)&randomness[i]);
+		mwdh.receiver = htole32(*(uint32_t *)&randomness[i + 1]);
 
 		r = write(sock, &mwdh, sizeof(mwdh));
 		if (r == -1) {
@@ -415,6 +417,179 @@ runcatcher(int ipc[2], int ifnwithprox, int enclwithprox)
 	}
 }
 
+/*
+ * Follow the counters of the proxy until all pitchers are done and none of the
+ * counters changed for a second. Then print the rate at which packets were
+ * received, forwarded to the ifn and rejected because of an invalid session id.
+ */
+static void
+benchproxy(size_t pitchers, const struct statspage *page)
+{
+	const struct proxystats *ps;
+	struct timespec to;
+	uint64_t now, start, last;
+	size_t recv;
+	pid_t pid;
+	int stat;
+
+	/* poll each millisecond */
+	to.tv_sec = 0;
+	to.tv_nsec = 1000000;
+
+	ps = &page->u.proxy;
+	start = last = stats_nsec();
+	recv = 0;
+
+	for (;;) {
+		if (nanosleep(&to, NULL) == -1)
+			logexit(1, "nanosleep");
+
+		now = stats_nsec();
+
+		if (ps->recv != recv) {
+			recv = ps->recv;
+			last = now;
+		}
+
+		while (pitchers > 0) {
+			if ((pid = waitpid(WAIT_ANY, &stat, WNOHANG)) == -1)
+				logexit(1, "waitpid");
+			if (pid == 0)
+				break;
+			pitchers--;
+		}
+
+		if (pitchers == 0 && now - last > 1000000000)
+			break;
+	}
+
+	bench_print("testproxy.recv", recv, ps->recvsz, last - start);
+	bench_print("testproxy.fwdifn", ps->fwdifn, ps->fwdifnsz,
+	    last - start);
+	bench_print("testproxy.invalidpeer", ps->invalidpeer, 0, last - start);
+}
+
+/*
+ * Make "src" the IPv4 source address "addr", in host byte order.
+ */
+static void
+testsrcaddr(union sockaddr_inet *src, uint32_t addr)
+{
+	memset(src, 0, sizeof(*src));
+	src->v4.sin_len = sizeof(src->v4);
+	src->v4.sin_family = AF_INET;
+	src->v4.sin_port = htons(51820);
+	src->v4.sin_addr.s_addr = htonl(addr);
+}
+
+/*
+ * Return the bucket of IPv4 source address "src" in the source table.
+ */
+static size_t
+testsrcbucket(const union sockaddr_inet *src)
+{
+	uint64_t prefix;
+
+	prefix = 0;
+	memcpy(&prefix, &src->v4.sin_addr, sizeof(src->v4.sin_addr));
+
+	return SipHash24(&srctabkey, &prefix, sizeof(prefix)) &
+	    (SRCTABSIZE / SRCWAYS - 1);
+}
+
+/*
+ * Check the source table of the proxy. A source that collides with a bucket
+ * full of rejected sources must not inherit their state and an invalid message
+ * with a spoofed source must never get the real source rejected.
+ *
+ * Exit on failure.
+ */
+static void
+testsrctab(void)
+{
+	struct proxystats ps;
+	struct dgram dgram;
+	struct msgwginit *mwi;
+	struct srcent *se;
+	union sockaddr_inet victim;
+	uint8_t cookie[COOKIELEN];
+	size_t bucket, n;
+	uint32_t addr;
+
+	memset(&ps, 0, sizeof(ps));
+	stats = &ps;
+	now = 1000;
+	underloadts = now;
+
+	/* the first lookup sets the key */
+	testsrcaddr(&victim, 0x0a000001);
+	srclookup(&victim);
+	memset(srctab, 0, sizeof(srctab));
+	bucket = testsrcbucket(&victim);
+
+	/* fill the bucket of the victim with rejected sources */
+	for (n = 0, addr = 0x0b000000; n < SRCWAYS; addr++) {
+		testsrcaddr(&dgram.src, addr);
+		if (testsrcbucket(&dgram.src) != bucket)
+			continue;
+		if ((se = srclookup(&dgram.src)) == NULL)
+			logexitx(1, "testsrctab no entry for source %zu", n);
+		se->rejectts = now;
+		n++;
+	}
+
+	se = srclookup(&victim);
+	if (se != NULL && se->rejectts != -1)
+		logexitx(1, "testsrctab colliding source inherited a reject");
+	if (!srcadmit(se))
+		logexitx(1, "testsrctab colliding source dropped");
+
+	/* an invalid init in the name of the victim, without a valid mac2 */
+	memset(srctab, 0, sizeof(srctab));
+	if ((se = srclookup(&victim)) == NULL)
+		logexitx(1, "testsrctab no entry for the victim");
+
+	memset(&dgram, 0, sizeof(dgram));
+	dgram.src = victim;
+	dgram.len = sizeof(*mwi);
+	mwi = (struct msgwginit *)dgram.data;
+	mwi->type = htole32(1);
+	arc4random_buf(mwi->mac2, sizeof(mwi->mac2));
+
+	srcreject(se, &dgram, mwi->mac2, MAC2OFFSETINIT);
+	if (se->rejectts != -1 || !srcadmit(se))
+		logexitx(1, "testsrctab spoofed source rejected");
+
+	/* the reject cache is not used if the enclave is not under load */
+	underloadts = -1;
+	se->rejectts = now;
+	if (!srcadmit(se))
+		logexitx(1, "testsrctab reject used while not under load");
+
+	/* a source that proved its address is rejected under load */
+	underloadts = now;
+	se->rejectts = -1;
+	if (makecookie(cookie, &victim) == -1)
+		logexitx(1, "testsrctab makecookie");
+	if (ws_mac2(mwi->mac2, sizeof(mwi->mac2), mwi, MAC2OFFSETINIT, cookie)
+	    == -1)
+		logexitx(1, "testsrctab ws_mac2");
+
+	srcreject(se, &dgram, mwi->mac2, MAC2OFFSETINIT);
+	if (srcadmit(se))
+		logexitx(1, "testsrctab proven source not rejected");
+
+	/* leave the proxy as it was */
+	memset(srctab, 0, sizeof(srctab));
+	underloadts = -1;
+	cookiesecretts = -1;
+	now = 0;
+	stats = NULL;
+
+	if (verbose > 0)
+		logwarnx("testsrctab ok");
+}
+
 /*
  * Mostly a copy of proxy_init from proxy.c.
  */
@@ -460,7 +635,7 @@ testproxy_init(int masterport)
 
 		for (m = 0; m < ifnv[n]->listenaddrssize; m++) {
 			listenaddr = ifnv[n]->listenaddrs[m];
-			s = socket(listenaddr->family, SOCK_DGRAM, 0);
+			s = socket(listenaddr->h.family, SOCK_DGRAM, 0);
 			if (s == -1)
 				logexit(1, "%s socket listenaddr", __func__);
 
@@ -474,7 +649,7 @@ testproxy_init(int masterport)
 				logexit(1, "setsockopt rcvbuf error");
 
 			if (bind(s, (struct sockaddr *)listenaddr,
-			    listenaddr->len) == -1) {
+			    listenaddr->h.len) == -1) {
 				addrtostr(addrstr, sizeof(addrstr),
 				    (struct sockaddr *)listenaddr, 0);
 				logexit(1, "%s bind failed: %s", __func__,
@@ -527,15 +702,20 @@ main(int argc, char **argv)
 {
 	/* descriptors for all communication channels */
 	chan tmpchan;
+	const struct statspage *benchpage;
 	int mastwithprox, proxwithmast, enclwithprox, proxwithencl, stdopen;
+	int statsfd;
 	size_t i, j, n, pitchers;
 	int ipc[2], stat, proxysock, packets;
 	pid_t pid, proxy, catcher, configpid;
 	const char *errstr;
 	char c, *logfacilitystr;
 
-	while ((c = getopt(argc, argv, "hv")) != -1)
+	while ((c = getopt(argc, argv, "bhv")) != -1)
 		switch(c) {
+		case 'b':
+			bench = 1;
+			break;
 		case 'h':
 			printusage(stdout);
 			exit(0);
@@ -587,13 +767,17 @@ main(int argc, char **argv)
 
 	/* read the config */
 	close(ipc[1]);
-	xparseconfigfd(ipc[0], &cfgifnv, &cfgifnvsize, &guid, &ggid, &logfacilitystr);
+	if (parseconfigfd(ipc[0], &cfgifnv, &cfgifnvsize, &guid, &ggid,
+	    &logfacilitystr) == -1)
+		logexitx(1, "parseconfigfd");
 	close(ipc[0]);
 	processconfig();
 
 	if (waitpid(configpid, &stat, 0) == -1)
 		logexit(1, "waitpid configpid");
 
+	testsrctab();
+
 	/*
 	 * Make sure we are not missing any communication channels and that
 	 * there is no descriptor leak.
@@ -631,6 +815,11 @@ main(int argc, char **argv)
 	proxwithencl = tmpchan[0];
 	enclwithprox = tmpchan[1];
 
+	/* share the counters of the proxy with us */
+	statsfd = -1;
+	if (bench && (statsfd = bench_statscreate(0)) == -1)
+		logexit(1, "bench_statscreate");
+
 	/* create a pipe for bi-directional signalling */
 	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ipc) == -1)
 		logexit(1, "socketpair ipc", n);
@@ -655,7 +844,8 @@ main(int argc, char **argv)
 
 		close(ipc[0]);
 
-		if ((size_t)getdtablecount() != stdopen + 3 + cfgifnvsize)
+		if ((size_t)getdtablecount() != stdopen + 3 + bench +
+		    cfgifnvsize)
 			logexitx(1, "descriptor mismatch: %d", getdtablecount());
 
 		testproxy_init(proxwithmast);
@@ -675,6 +865,12 @@ main(int argc, char **argv)
 	close(proxwithmast);
 	close(proxwithencl);
 
+	benchpage = NULL;
+	if (bench) {
+		if ((benchpage = bench_statsmap(statsfd, 0)) == NULL)
+			logexit(1, "bench_statsmap");
+	}
+
 	/* fork catcher */
 	switch (catcher = fork()) {
 	case -1:
@@ -684,6 +880,8 @@ main(int argc, char **argv)
 		setproctitle(NULL);
 
 		close(mastwithprox);
+		if (bench)
+			close(statsfd);
 
 		/* only one ifn */
 		runcatcher(ipc, cfgifnv[0]->ifnwithprox, enclwithprox);
@@ -696,9 +894,12 @@ main(int argc, char **argv)
 	 *   3. send startup info
 	 */
 
-	sendconfig_proxy(smsg, mastwithprox, proxwithencl);
+	sendconfig_proxy(smsg, mastwithprox, proxwithencl, statsfd);
 	signal_eos(smsg, mastwithprox);
 
+	if (bench)
+		close(statsfd);
+
 	/*
 	 *   4. run the tests to PROXY by firing test packets at it from different
 	 *      processes
@@ -780,6 +981,11 @@ main(int argc, char **argv)
 
 	/* Simply wait until all pitchers are done and then kill the catcher */
 
+	if (bench) {
+		benchproxy(pitchers, benchpage);
+		pitchers = 0;
+	}
+
 	i = 0;
 	while (i < pitchers) {
 		if ((pid = waitpid(WAIT_ANY, &stat, 0)) == -1)
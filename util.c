@@ -34,6 +34,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "util.h"
@@ -754,27 +755,290 @@ initlog(const char *facility)
 	return 0;
 }
 
-void
-logexit(int code, const char *msg, ...)
+/*
+ * Messages are written directly unless deferred by logdefer. Deferred messages
+ * are formatted into a fixed buffer that is written out by logflush when the
+ * process is idle, and each call site, keyed by its format string, may log at
+ * most LOGBURST messages per second. Any excess is counted but not formatted,
+ * and reported as a single line once the second is over. This keeps the volume
+ * of a message that is triggered by network input independent of the rate at
+ * which it arrives.
+ *
+ * Call sites are found by probing from the slot of their format string, a slot
+ * is only handed to another call site once its second is over. If all slots
+ * are taken in the current second, the message counts towards the call site
+ * in its first slot.
+ */
+
+#define LOGLINE 256
+#define LOGBUFSIZE 32
+#define LOGSITES 64
+#define LOGBURST 20
+
+struct logline {
+	int prio;
+	char msg[LOGLINE];
+};
+
+struct logsite {
+	const char *fmt;
+	time_t window;
+	size_t count;
+	size_t suppressed;
+	int prio;
+};
+
+static struct logline logbuf[LOGBUFSIZE];
+static struct logsite logsites[LOGSITES];
+static size_t logbufcount, logpending;
+static int deferred;
+
+/*
+ * Like getuptime but without exiting on error, so it is safe to use while
+ * exiting.
+ */
+static time_t
+lognow(void)
 {
-	va_list ap;
+	struct timespec tp;
 
-	va_start(ap, msg);
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1)
+		return 0;
+
+	return tp.tv_sec;
+}
+
+static void
+logwrite(int prio, const char *line)
+{
 	if (background) {
-		vsyslog(LOG_ERR, msg, ap);
-		syslog(LOG_ERR, "%m");
-		exit(code);
+		syslog(prio, "%s", line);
 	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		if (msg) {
-			vfprintf(stderr, msg, ap);
-			fprintf(stderr, ": %s\n", strerror(errno));
+		fprintf(stderr, "%s[%d]: %s\n", getprogname(), getpid(), line);
+	}
+}
+
+/*
+ * Write out all buffered messages.
+ */
+static void
+logdrain(void)
+{
+	size_t n;
+
+	for (n = 0; n < logbufcount; n++)
+		logwrite(logbuf[n].prio, logbuf[n].msg);
+
+	logbufcount = 0;
+}
+
+static struct logline *
+lognewline(int prio)
+{
+	struct logline *line;
+
+	if (logbufcount == LOGBUFSIZE)
+		logdrain();
+
+	line = &logbuf[logbufcount++];
+	line->prio = prio;
+	line->msg[0] = '\0';
+
+	return line;
+}
+
+/*
+ * Report the messages of "site" that were suppressed, if any.
+ */
+static void
+logsuppressed(struct logsite *site)
+{
+	struct logline *line;
+
+	if (site->suppressed == 0)
+		return;
+
+	line = lognewline(site->prio);
+	snprintf(line->msg, sizeof(line->msg),
+	    "%zu similar messages suppressed: %s", site->suppressed, site->fmt);
+
+	site->suppressed = 0;
+	logpending--;
+}
+
+/*
+ * Return 1 if a message with format "fmt" may be logged, 0 if it exceeds the
+ * burst of its call site and is suppressed.
+ */
+static int
+logallowed(int prio, const char *fmt)
+{
+	struct logsite *site, *avail;
+	time_t now;
+	size_t home, n;
+
+	now = lognow();
+	home = ((uintptr_t)fmt >> 3) % LOGSITES;
+
+	avail = NULL;
+	for (n = 0; n < LOGSITES; n++) {
+		site = &logsites[(home + n) % LOGSITES];
+		if (site->fmt == fmt)
+			break;
+		if (avail == NULL && (site->fmt == NULL ||
+		    site->window != now))
+			avail = site;
+		if (site->fmt == NULL)
+			break;
+	}
+
+	if (site->fmt != fmt) {
+		if (avail == NULL) {
+			site = &logsites[home];
 		} else {
-			fprintf(stderr, "%s\n", strerror(errno));
+			site = avail;
+			logsuppressed(site);
+			site->fmt = fmt;
+			site->prio = prio;
+			site->window = now;
+			site->count = 0;
 		}
-		exit(code);
+	} else if (site->window != now) {
+		logsuppressed(site);
+		site->prio = prio;
+		site->window = now;
+		site->count = 0;
+	}
+
+	if (site->count >= LOGBURST) {
+		if (site->suppressed++ == 0)
+			logpending++;
+		return 0;
+	}
+
+	site->count++;
+	return 1;
+}
+
+/*
+ * Write out all deferred messages and report any suppressed messages of call
+ * sites of which the second is over.
+ *
+ * Return 1 if there are still suppressed messages to report later, 0
+ * otherwise. The caller should call logflush again within a second if it
+ * returns 1.
+ */
+int
+logflush(void)
+{
+	time_t now;
+	size_t n;
+	int saved_errno = errno;
+
+	if (logpending > 0) {
+		now = lognow();
+		for (n = 0; n < LOGSITES && logpending > 0; n++)
+			if (logsites[n].window != now)
+				logsuppressed(&logsites[n]);
 	}
+
+	logdrain();
+
+	errno = saved_errno;
+
+	return logpending > 0;
+}
+
+static void
+logatexit(void)
+{
+	logflush();
+}
+
+/*
+ * Start deferring and rate limiting messages if "on" is 1, or write out any
+ * deferred messages and go back to direct logging if "on" is 0.
+ */
+void
+logdefer(int on)
+{
+	static int registered;
+
+	if (on && !registered) {
+		if (atexit(logatexit) != 0)
+			logexit(1, "%s atexit", __func__);
+		registered = 1;
+	}
+
+	if (!on)
+		logflush();
+
+	deferred = on;
+}
+
+/*
+ * Log "msg" with priority "prio". Append a description of the current errno if
+ * "witherr" is set.
+ */
+static void
+logv(int prio, int witherr, const char *msg, va_list ap)
+{
+	struct logline *line;
+	size_t len;
+	int saved_errno = errno;
+
+	if (!deferred) {
+		if (background) {
+			vsyslog(prio, msg, ap);
+			if (witherr)
+				syslog(prio, "%m");
+		} else {
+			fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
+			if (!witherr) {
+				vfprintf(stderr, msg, ap);
+				fprintf(stderr, "\n");
+			} else if (msg) {
+				vfprintf(stderr, msg, ap);
+				fprintf(stderr, ": %s\n", strerror(errno));
+			} else {
+				fprintf(stderr, "%s\n", strerror(errno));
+			}
+		}
+		errno = saved_errno;
+		return;
+	}
+
+	if (msg && !logallowed(prio, msg)) {
+		errno = saved_errno;
+		return;
+	}
+
+	line = lognewline(prio);
+
+	if (msg)
+		vsnprintf(line->msg, sizeof(line->msg), msg, ap);
+
+	if (witherr) {
+		len = strlen(line->msg);
+		snprintf(&line->msg[len], sizeof(line->msg) - len, "%s%s",
+		    msg ? ": " : "", strerror(saved_errno));
+	}
+
+	errno = saved_errno;
+}
+
+void
+logexit(int code, const char *msg, ...)
+{
+	va_list ap;
+
+	logdefer(0);
+
+	va_start(ap, msg);
+	logv(LOG_ERR, 1, msg, ap);
 	va_end(ap);
+
+	exit(code);
 }
 
 void
@@ -782,17 +1046,13 @@ logexitx(int code, const char *msg, ...)
 {
 	va_list ap;
 
+	logdefer(0);
+
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_ERR, msg, ap);
-		exit(code);
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		vfprintf(stderr, msg, ap);
-		fprintf(stderr, "\n");
-		exit(code);
-	}
+	logv(LOG_ERR, 0, msg, ap);
 	va_end(ap);
+
+	exit(code);
 }
 
 /*
@@ -810,196 +1070,104 @@ void
 logwarn(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < -1)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_WARNING, msg, ap);
-		syslog(LOG_WARNING, "%m");
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		if (msg) {
-			vfprintf(stderr, msg, ap);
-			fprintf(stderr, ": %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "%s\n", strerror(errno));
-		}
-	}
+	logv(LOG_WARNING, 1, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 logwarnx(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < -1)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_WARNING, msg, ap);
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		vfprintf(stderr, msg, ap);
-		fprintf(stderr, "\n");
-	}
+	logv(LOG_WARNING, 0, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 lognotice(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < 0)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_NOTICE, msg, ap);
-		syslog(LOG_NOTICE, "%m");
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		if (msg) {
-			vfprintf(stderr, msg, ap);
-			fprintf(stderr, ": %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "%s\n", strerror(errno));
-		}
-	}
+	logv(LOG_NOTICE, 1, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 lognoticex(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < 0)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_NOTICE, msg, ap);
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		vfprintf(stderr, msg, ap);
-		fprintf(stderr, "\n");
-	}
+	logv(LOG_NOTICE, 0, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 loginfo(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < 1)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_INFO, msg, ap);
-		syslog(LOG_INFO, "%m");
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		if (msg) {
-			vfprintf(stderr, msg, ap);
-			fprintf(stderr, ": %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "%s\n", strerror(errno));
-		}
-	}
+	logv(LOG_INFO, 1, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 loginfox(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < 1)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_INFO, msg, ap);
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		vfprintf(stderr, msg, ap);
-		fprintf(stderr, "\n");
-	}
+	logv(LOG_INFO, 0, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 logdebug(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < 2)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_DEBUG, msg, ap);
-		syslog(LOG_DEBUG, "%m");
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		if (msg) {
-			vfprintf(stderr, msg, ap);
-			fprintf(stderr, ": %s\n", strerror(errno));
-		} else {
-			fprintf(stderr, "%s\n", strerror(errno));
-		}
-	}
+	logv(LOG_DEBUG, 1, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 void
 logdebugx(const char *msg, ...)
 {
 	va_list ap;
-	int saved_errno = errno;
 
 	if (verbose < 2)
 		return;
 
 	va_start(ap, msg);
-	if (background) {
-		vsyslog(LOG_DEBUG, msg, ap);
-	} else {
-		fprintf(stderr, "%s[%d]: ", getprogname(), getpid());
-		vfprintf(stderr, msg, ap);
-		fprintf(stderr, "\n");
-	}
+	logv(LOG_DEBUG, 0, msg, ap);
 	va_end(ap);
-
-	errno = saved_errno;
 }
 
 /*
@@ -1030,3 +1198,19 @@ isfdsafe(int fd, mode_t allowedpermissions)
 
 	return 1;
 }
+
+/*
+ * Return the number of seconds elapsed on the monotonic clock.
+ *
+ * Exit on error.
+ */
+time_t
+getuptime(void)
+{
+	struct timespec tp;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tp) == -1)
+		logexit(1, "clock_gettime");
+
+	return tp.tv_sec;
+}
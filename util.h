@@ -23,6 +23,7 @@
 #include <netinet/in.h>
 
 #include <stdio.h>
+#include <time.h>
 
 #define EMPTYDIR "/var/empty"
 /* ethernet address in hex notation with terminating nul */
@@ -49,6 +50,8 @@ int resolvegroup(gid_t *, const char *);
 int facilitystrtoint(int *, const char *);
 int daemonize(void);
 int initlog(const char *);
+void logdefer(int);
+int logflush(void);
 void logexit(int code, const char *, ...);
 void logexitx(int code, const char *, ...);
 void logwarn(const char *, ...);
@@ -60,5 +63,6 @@ void loginfox(const char *, ...);
 void logdebug(const char *, ...);
 void logdebugx(const char *, ...);
 int isfdsafe(int, mode_t);
+time_t getuptime(void);
 
 #endif /* UTIL_H */
@@ -14,6 +14,9 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
@@ -45,6 +48,10 @@ struct msgtype msgtypes[MTNCODES] = {
 	{ sizeof(struct speer),	0 },
 	{ sizeof(struct scidraddr),	0 },
 	{ sizeof(struct seos),	0 },
+	{ sizeof(struct msgoverload),	0 },
+	{ sizeof(struct msgdoorbell),	0 },
+	{ sizeof(struct msgreload),	0 },
+	{ sizeof(struct speerslot),	0 },
 };
 
 void
@@ -90,11 +97,37 @@ printmsgwgresp(FILE *fp, const struct msgwgresp *mwr)
 int
 wire_recvmsg(int port, unsigned char *mtcode, void *msg, size_t *msgsize)
 {
+	return wire_recvmsgfd(port, mtcode, msg, msgsize, NULL);
+}
+
+/*
+ * Read a message from a port that may come with a descriptor. "fd" is set to
+ * the received descriptor or -1 if there is none. If "fd" is NULL any
+ * descriptor that comes along is closed.
+ *
+ * "mtcode", "msg" and "msgsize" are all value/result parameters.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int
+wire_recvmsgfd(int port, unsigned char *mtcode, void *msg, size_t *msgsize,
+    int *fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
 	struct iovec iov[3];
 	struct msgtype *mt;
 	ssize_t r;
 	size_t iovlen;
 	char overread;
+	int rfd;
+
+	if (fd != NULL)
+		*fd = -1;
 
 	if (*msgsize >= MAXMSGSIZEP1)
 		return -1;
@@ -110,8 +143,14 @@ wire_recvmsg(int port, unsigned char *mtcode, void *msg, size_t *msgsize)
 	iov[iovlen].iov_len = 1;
 	iovlen++;
 
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = iovlen;
+	mh.msg_control = &cmsgbuf.buf;
+	mh.msg_controllen = sizeof(cmsgbuf.buf);
+
 again:
-	r = readv(port, iov, iovlen);
+	r = recvmsg(port, &mh, 0);
 	if (r <= 0) {
 		if (r == -1 && errno == EINTR)
 			goto again;
@@ -120,36 +159,58 @@ again:
 	}
 
 	/*
-	 * XXX make sure readv(2) on AF_UNIX SOCK_DGRAM never returns partially
-	 * read datagrams.
+	 * XXX make sure recvmsg(2) on AF_UNIX SOCK_DGRAM never returns
+	 * partially read datagrams.
 	 */
 
+	rfd = -1;
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(&rfd, CMSG_DATA(cmsg), sizeof(rfd));
+	}
+
+	if (fd != NULL) {
+		*fd = rfd;
+	} else if (rfd != -1) {
+		close(rfd);
+	}
+
 	if ((size_t)r < sizeof(*mtcode))
-		return -1;
+		goto err;
 
 	*msgsize = r - sizeof(*mtcode);
 
 	if (*mtcode >= MTNCODES)
-		return -1;
+		goto err;
 
 	mt = &msgtypes[*mtcode];
 	if (mt->varsize) {
 		/* size is a minimum on variable sized messages */
 		if (*msgsize < mt->size)
-			return -1;
+			goto err;
 
 		/* check overread */
 		while (iovlen--)
 			r -= iov[iovlen].iov_len;
 		if (r >= 0)
-			return -1;
+			goto err;
 	} else {
 		if (*msgsize != mt->size)
-			return -1;
+			goto err;
 		/* implicit overread check */
 	}
 
 	return 0;
+
+err:
+	if (fd != NULL && *fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+	return -1;
 }
 
 /*
@@ -160,6 +221,24 @@ again:
 int
 wire_sendmsg(int port, unsigned char mtcode, const void *msg, size_t msgsize)
 {
+	return wire_sendmsgfd(port, mtcode, msg, msgsize, -1);
+}
+
+/*
+ * Send a message to a port along with descriptor "fd", unless "fd" is -1.
+ *
+ * Return 0 on success, -1 on error.
+ */
+int
+wire_sendmsgfd(int port, unsigned char mtcode, const void *msg, size_t msgsize,
+    int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
 	struct iovec iov[2];
 	struct msgtype *mt;
 	ssize_t r;
@@ -189,8 +268,24 @@ wire_sendmsg(int port, unsigned char mtcode, const void *msg, size_t msgsize)
 	iov[iovlen].iov_len = msgsize;
 	iovlen++;
 
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = iovlen;
+
+	if (fd != -1) {
+		memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+		mh.msg_control = &cmsgbuf.buf;
+		mh.msg_controllen = sizeof(cmsgbuf.buf);
+
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	}
+
 again:
-	r = writev(port, iov, iovlen);
+	r = sendmsg(port, &mh, 0);
 	if (r <= 0) {
 		if (r == -1 && errno == EINTR)
 			goto again;
@@ -448,6 +543,398 @@ again:
 	return 0;
 }
 
+/*
+ * Return 0 if "msgsize" is a valid size for a message of type "mtcode", -1
+ * otherwise.
+ */
+static int
+validsize(unsigned char mtcode, size_t msgsize)
+{
+	struct msgtype *mt;
+
+	if (mtcode >= MTNCODES)
+		return -1;
+
+	mt = &msgtypes[mtcode];
+
+	if (mt->varsize) {
+		/* size is a minimum on variable sized messages */
+		if (msgsize < mt->size)
+			return -1;
+	} else
+		if (msgsize != mt->size)
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Return the number of bytes of shared memory needed for a ring with "nslots"
+ * slots.
+ */
+size_t
+wire_ringsize(size_t nslots)
+{
+	return sizeof(struct wire_ringshm) +
+	    nslots * sizeof(struct wire_ringslot);
+}
+
+/*
+ * Create an anonymous shared memory object for a ring with "nslots" slots.
+ * "nslots" must be a power of two. The descriptor can be inherited and mapped
+ * by both the producer and the consumer with wire_ringmap.
+ *
+ * Return the descriptor on success, -1 on failure.
+ */
+int
+wire_ringcreate(size_t nslots)
+{
+	struct wire_ringshm *shm;
+	char path[] = "/wiresep.XXXXXXXXXX";
+	int fd;
+
+	if (nslots == 0 || nslots > MAXRINGSLOTS || (nslots & (nslots - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((fd = shm_mkstemp(path)) == -1)
+		return -1;
+
+	if (shm_unlink(path) == -1)
+		goto err;
+
+	if (ftruncate(fd, wire_ringsize(nslots)) == -1)
+		goto err;
+
+	shm = mmap(NULL, wire_ringsize(nslots), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto err;
+
+	/* the consumer starts out waiting for the doorbell */
+	shm->waiting = 1;
+
+	if (munmap(shm, wire_ringsize(nslots)) == -1)
+		goto err;
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Map the ring in "fd" with "nslots" slots into "ring". "port" is the
+ * descriptor the producer uses to ring the doorbell. The descriptor can be
+ * closed after mapping.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+wire_ringmap(struct wire_ring *ring, int fd, size_t nslots, int port)
+{
+	struct stat st;
+
+	if (nslots == 0 || nslots > MAXRINGSLOTS || (nslots & (nslots - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+
+	if (st.st_size < 0 || (size_t)st.st_size != wire_ringsize(nslots)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ring->shm = mmap(NULL, wire_ringsize(nslots), PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fd, 0);
+	if (ring->shm == MAP_FAILED)
+		return -1;
+
+	ring->nslots = nslots;
+	ring->port = port;
+
+	return 0;
+}
+
+/*
+ * Put a proxy message in "ring" and ring the doorbell if the consumer is
+ * waiting for it. Only the proxy calls this.
+ *
+ * Return 0 on success, -1 if the ring is full or the message does not fit in a
+ * slot, in which case the caller should send it over the socket.
+ */
+int
+wire_ringput(struct wire_ring *ring, uint32_t ifnid,
+    const union sockaddr_inet *lsa, const union sockaddr_inet *fsa,
+    unsigned char mtcode, const void *msg, size_t msgsize)
+{
+	struct wire_ringslot *slot;
+	struct msgdoorbell mdb;
+	uint32_t head, tail;
+
+	if (validsize(mtcode, msgsize) == -1)
+		return -1;
+
+	if (msgsize > sizeof(slot->msg))
+		return -1;
+
+	head = ring->shm->head;
+	tail = __atomic_load_n(&ring->shm->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= ring->nslots)
+		return -1;
+
+	slot = &ring->shm->slots[head & (ring->nslots - 1)];
+	slot->ifnid = ifnid;
+	memcpy(&slot->lsa, lsa, sizeof(slot->lsa));
+	memcpy(&slot->fsa, fsa, sizeof(slot->fsa));
+	slot->mtcode = mtcode;
+	slot->msgsize = msgsize;
+	memcpy(slot->msg, msg, msgsize);
+
+	__atomic_store_n(&ring->shm->head, head + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in wire_ringget so that no wakeup is lost */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&ring->shm->waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&ring->shm->waiting, 0, __ATOMIC_RELAXED);
+
+		memset(&mdb, 0, sizeof(mdb));
+		if (wire_proxysendmsg(ring->port, ifnid, lsa, fsa, MSGDOORBELL,
+		    &mdb, sizeof(mdb)) == -1) {
+			/* try again with the next message */
+			__atomic_store_n(&ring->shm->waiting, 1,
+			    __ATOMIC_RELAXED);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Take the oldest proxy message from "ring". "msgsize" must be set to the
+ * size of "msg" and is updated to the size of the message. If the ring is
+ * empty, the producer is asked to ring the doorbell on the next message. Only
+ * an ifn process calls this.
+ *
+ * The message is copied out of shared memory before it is validated so that
+ * the proxy can not change it afterwards.
+ *
+ * Return 1 if a message is taken, 0 if the ring is empty, -1 if the message
+ * in the next slot is invalid and skipped or if the ring is corrupt.
+ */
+int
+wire_ringget(struct wire_ring *ring, uint32_t *ifnid,
+    union sockaddr_inet *lsa, union sockaddr_inet *fsa, unsigned char *mtcode,
+    void *msg, size_t *msgsize)
+{
+	struct wire_ringslot *slot;
+	uint32_t head, tail;
+	size_t size;
+
+	tail = ring->shm->tail;
+	head = __atomic_load_n(&ring->shm->head, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+		__atomic_store_n(&ring->shm->waiting, 1, __ATOMIC_RELAXED);
+
+		/* pairs with the fence in wire_ringput */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		head = __atomic_load_n(&ring->shm->head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			return 0;
+
+		__atomic_store_n(&ring->shm->waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	if (head - tail > ring->nslots)
+		return -1;
+
+	slot = &ring->shm->slots[tail & (ring->nslots - 1)];
+	size = slot->msgsize;
+	if (size > sizeof(slot->msg) || size > *msgsize) {
+		__atomic_store_n(&ring->shm->tail, tail + 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+
+	*ifnid = slot->ifnid;
+	memcpy(lsa, &slot->lsa, sizeof(*lsa));
+	memcpy(fsa, &slot->fsa, sizeof(*fsa));
+	*mtcode = slot->mtcode;
+	memcpy(msg, slot->msg, size);
+	*msgsize = size;
+
+	__atomic_store_n(&ring->shm->tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (validsize(*mtcode, *msgsize) == -1)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Return the number of bytes a message of type "mtcode" takes in a bulk
+ * configuration. Only fixed size messages can be part of one.
+ */
+size_t
+wire_bulkrecsize(unsigned char mtcode)
+{
+	assert(mtcode < MTNCODES && !msgtypes[mtcode].varsize);
+
+	return sizeof(mtcode) + msgtypes[mtcode].size;
+}
+
+/*
+ * Create an anonymous shared memory object of "size" bytes for a bulk
+ * configuration and map it into "bulk" so that it can be filled with
+ * wire_bulkput. The descriptor can be sent to the process that reads it.
+ *
+ * Return the descriptor on success, -1 on failure.
+ */
+int
+wire_bulkcreate(struct wire_bulk *bulk, size_t size)
+{
+	char path[] = "/wiresep.XXXXXXXXXX";
+	int fd;
+
+	if ((fd = shm_mkstemp(path)) == -1)
+		return -1;
+
+	if (shm_unlink(path) == -1)
+		goto err;
+
+	if (ftruncate(fd, size) == -1)
+		goto err;
+
+	if (wire_bulkmap(bulk, fd, size) == -1)
+		goto err;
+
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Map the bulk configuration of "size" bytes in "fd" into "bulk". The
+ * descriptor can be closed after mapping.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+wire_bulkmap(struct wire_bulk *bulk, int fd, size_t size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+
+	if (st.st_size < 0 || (size_t)st.st_size != size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bulk->mem = NULL;
+	bulk->size = size;
+	bulk->off = 0;
+
+	if (size == 0)
+		return 0;
+
+	bulk->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (bulk->mem == MAP_FAILED) {
+		bulk->mem = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Unmap "bulk". If "wipe" is set the records are cleared first, which must
+ * only be done by the reader.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+wire_bulkunmap(struct wire_bulk *bulk, int wipe)
+{
+	if (bulk->mem == NULL)
+		return 0;
+
+	if (wipe)
+		explicit_bzero(bulk->mem, bulk->size);
+
+	if (munmap(bulk->mem, bulk->size) == -1)
+		return -1;
+
+	bulk->mem = NULL;
+	bulk->size = 0;
+	bulk->off = 0;
+
+	return 0;
+}
+
+/*
+ * Append a message to "bulk".
+ *
+ * Return 0 on success, -1 if the message is invalid or does not fit.
+ */
+int
+wire_bulkput(struct wire_bulk *bulk, unsigned char mtcode, const void *msg,
+    size_t msgsize)
+{
+	if (validsize(mtcode, msgsize) == -1 || msgtypes[mtcode].varsize)
+		return -1;
+
+	if (bulk->size - bulk->off < sizeof(mtcode) + msgsize)
+		return -1;
+
+	bulk->mem[bulk->off] = mtcode;
+	memcpy(&bulk->mem[bulk->off + sizeof(mtcode)], msg, msgsize);
+	bulk->off += sizeof(mtcode) + msgsize;
+
+	return 0;
+}
+
+/*
+ * Take the next message from "bulk", much like wire_recvmsg.
+ *
+ * "mtcode", "msg" and "msgsize" are all value/result parameters.
+ *
+ * Return 0 on success, -1 if there is no next message or if it is invalid.
+ */
+int
+wire_bulkget(struct wire_bulk *bulk, unsigned char *mtcode, void *msg,
+    size_t *msgsize)
+{
+	size_t size;
+
+	if (bulk->size - bulk->off < sizeof(*mtcode))
+		return -1;
+
+	*mtcode = bulk->mem[bulk->off];
+	if (*mtcode >= MTNCODES || msgtypes[*mtcode].varsize)
+		return -1;
+
+	size = msgtypes[*mtcode].size;
+	if (size > *msgsize ||
+	    bulk->size - bulk->off - sizeof(*mtcode) < size)
+		return -1;
+
+	memcpy(msg, &bulk->mem[bulk->off + sizeof(*mtcode)], size);
+	*msgsize = size;
+	bulk->off += sizeof(*mtcode) + size;
+
+	return 0;
+}
+
 /*
  * Make a 5-CONNREQ message, updates "mcr".
  *
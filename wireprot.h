@@ -100,6 +100,79 @@ struct msgreqwginit {
 	char i;
 };
 
+/* 15-OVERLOAD */
+struct msgoverload {
+	char i;
+};
+
+/* 16-DOORBELL */
+struct msgdoorbell {
+	char i;
+};
+
+/*
+ * 17-RELOAD
+ *
+ * Sent by the master to each ifn process along with a bulk that has every peer
+ * slot of the interface as SPEER records in order of peer id, each followed by
+ * its allowed ips as SCIDRADDR.
+ */
+struct msgreload {
+	char ifname[8];
+	size_t worker;
+	size_t workers;
+	size_t npeers;
+	size_t nallowedips;	/* of all peers together */
+	size_t bulksize;	/* size of the bulk with the peers */
+};
+
+/*
+ * Single producer, single consumer ring in shared memory that carries proxy
+ * messages from the proxy to an ifn process without going through the kernel.
+ * The socketpair between both processes is only used for a MSGDOORBELL once
+ * the consumer has found the ring empty.
+ */
+struct wire_ringslot {
+	uint32_t ifnid;
+	union sockaddr_inet lsa;
+	union sockaddr_inet fsa;
+	unsigned char mtcode;
+	size_t msgsize;
+	uint8_t msg[MAXBATCHMSG];
+};
+
+struct wire_ringshm {
+	uint32_t head;	/* only written by the producer */
+	char pad1[CACHELINESIZE - sizeof(uint32_t)];
+	uint32_t tail;	/* only written by the consumer */
+	int waiting;	/* set by the consumer, cleared by the producer */
+	char pad2[CACHELINESIZE - sizeof(uint32_t) - sizeof(int)];
+	struct wire_ringslot slots[];
+};
+
+/*
+ * Process local view of a ring. Never trust anything but the slots in shared
+ * memory.
+ */
+struct wire_ring {
+	struct wire_ringshm *shm;
+	uint32_t nslots;	/* power of two */
+	int port;	/* doorbell, only used by the producer */
+};
+
+/*
+ * Bulk configuration. The peers and addresses of a process are not sent one
+ * message at a time but are packed into one unlinked shared memory object that
+ * is sent along with SINIT or MSGRELOAD. Each record is a message code followed
+ * by the fixed size message, in the order in which the process reads them. The
+ * peer slots of the master are kept in a bulk as well.
+ */
+struct wire_bulk {
+	uint8_t *mem;
+	size_t size;
+	size_t off;	/* next record */
+};
+
 /*
  * Startup Messages.
  */
@@ -113,6 +186,11 @@ struct sinit {
 	int enclport;
 	int proxport;
 	uint32_t nifns;
+	size_t hsrate;	/* handshake messages per second per enclave source */
+	size_t hsburst;
+	size_t enclworkers;	/* enclave processes that share handshakes */
+	int statsfd;	/* shared memory stats page, -1 if none */
+	size_t bulksize;	/* size of the bulk configuration */
 };
 
 /* SIFN */
@@ -128,11 +206,26 @@ struct sifn {
 	wskey cookiekey;
 	size_t nifaddrs;
 	size_t npeers;
+	size_t nallowedips;	/* of all peers together */
 	size_t laddr6count;
 	size_t laddr4count;
+	size_t tunbudget;
+	size_t fqquantum;	/* 0 if there is no egress scheduler */
+	size_t sndbuf;	/* socket buffer sizes, 0 for the default */
+	size_t rcvbuf;
+	size_t worker;
+	size_t workers;
+	int workerports[MAXWORKERS];
+	size_t ringslots;	/* 0 if there is no ring with the proxy */
+	int ringfd;
 };
 
-/* SPEER */
+/*
+ * SPEER
+ *
+ * Also sent by a reload to the enclave and the proxy for each peer slot that
+ * changes, the proxy only gets the ids.
+ */
 struct speer {
 	uint32_t ifnid;
 	uint32_t peerid;
@@ -141,7 +234,9 @@ struct speer {
 	wskey psk;
 	wskey peerkey; /* XXX s/pubkey/ */
 	wskey mac1key;
+	wskey cookiekey;
 	size_t nallowedips;
+	int unused;	/* spare slot or removed by a reload, no keys */
 };
 
 /* SCIDRADDR */
@@ -157,6 +252,22 @@ struct seos {
 	char i;
 };
 
+/*
+ * SPEERSLOT
+ *
+ * The peer that uses a slot of an interface. Only the master holds these, in a
+ * bulk that is never sent but passed on to each process that reloads the
+ * configuration so that peers keep their id for as long as their public key is
+ * configured.
+ */
+struct speerslot {
+	uint32_t ifnid;
+	uint32_t peerid;
+	wskey pubkey;
+	wshash pskhash;	/* Hash(psk), the key itself is not kept */
+	int used;
+};
+
 #define MSGNONE	0
 #define MSGWGINIT	1
 #define MSGWGRESP	2
@@ -172,8 +283,12 @@ struct seos {
 #define SPEER	12
 #define SCIDRADDR	13
 #define SEOS 14
+#define MSGOVERLOAD	15
+#define MSGDOORBELL	16
+#define MSGRELOAD	17
+#define SPEERSLOT	18
 
-#define MTNCODES 15
+#define MTNCODES 19
 
 struct msgtype {
 	size_t size;
@@ -190,6 +305,10 @@ void printmsgwgresp(FILE *, const struct msgwgresp *);
 
 int wire_recvmsg(int port, unsigned char *mtcode, void *msg, size_t *msgsize);
 int wire_sendmsg(int port, unsigned char mtcode, const void *msg, size_t msgsize);
+int wire_recvmsgfd(int port, unsigned char *mtcode, void *msg, size_t *msgsize,
+    int *fd);
+int wire_sendmsgfd(int port, unsigned char mtcode, const void *msg,
+    size_t msgsize, int fd);
 int wire_proxysendmsg(int port, uint32_t ifnid,
     const union sockaddr_inet *lsa, const union sockaddr_inet *fsa,
     unsigned char mtcode, const void *msg, size_t msgsize);
@@ -198,6 +317,25 @@ int wire_recvpeeridmsg(int port, uint32_t *peerid, unsigned char *mtcode,
 int wire_recvproxymsg(int port, uint32_t *ifnid, union sockaddr_inet *fsa,
     union sockaddr_inet *lsa, unsigned char *mtcode, void *msg, size_t *msgsize);
 
+size_t wire_ringsize(size_t nslots);
+int wire_ringcreate(size_t nslots);
+int wire_ringmap(struct wire_ring *ring, int fd, size_t nslots, int port);
+int wire_ringput(struct wire_ring *ring, uint32_t ifnid,
+    const union sockaddr_inet *lsa, const union sockaddr_inet *fsa,
+    unsigned char mtcode, const void *msg, size_t msgsize);
+int wire_ringget(struct wire_ring *ring, uint32_t *ifnid,
+    union sockaddr_inet *lsa, union sockaddr_inet *fsa, unsigned char *mtcode,
+    void *msg, size_t *msgsize);
+
+size_t wire_bulkrecsize(unsigned char mtcode);
+int wire_bulkcreate(struct wire_bulk *bulk, size_t size);
+int wire_bulkmap(struct wire_bulk *bulk, int fd, size_t size);
+int wire_bulkunmap(struct wire_bulk *bulk, int wipe);
+int wire_bulkput(struct wire_bulk *bulk, unsigned char mtcode, const void *msg,
+    size_t msgsize);
+int wire_bulkget(struct wire_bulk *bulk, unsigned char *mtcode, void *msg,
+    size_t *msgsize);
+
 /* Send a message with a peerid. Return 0 on success, -1 */
 int wire_sendpeeridmsg(int port, uint32_t peerid, unsigned char mtcode,
     const void *msg, size_t msgsize);
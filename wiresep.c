@@ -14,6 +14,7 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <openssl/evp.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -62,6 +63,86 @@ ws_validmac(const uint8_t *mac, size_t macsize, const void *data,
 	return 1;
 }
 
+/*
+ * Calculate mac2 using a cookie of COOKIELEN bytes as the key. Return 16 bytes
+ * of output.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+int
+ws_mac2(void *out, size_t outlen, const void *in, size_t inlen,
+    const uint8_t *cookie)
+{
+	if (outlen != 16)
+		return -1;
+
+	if (blake2s(out, outlen, in, inlen, cookie, COOKIELEN) == -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Verify that "mac" is the correct mac2 for "data" using "cookie".
+ *
+ * Return 1 on success, 0 otherwise.
+ */
+int
+ws_validmac2(const uint8_t *mac, size_t macsize, const void *data,
+    size_t datasize, const uint8_t *cookie)
+{
+	static uint8_t tmpmac[16];
+
+	if (macsize != sizeof(tmpmac))
+		return 0;
+
+	if (ws_mac2(tmpmac, sizeof(tmpmac), data, datasize, cookie) == -1)
+		return 0;
+
+	if (timingsafe_bcmp(tmpmac, mac, macsize) != 0)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * Seal or open a cookie with XChaCha20Poly1305 using a nonce of
+ * COOKIENONCELEN bytes and additional data "ad".
+ *
+ * Return 0 on success, -1 on failure. "outlen" is a value/result parameter.
+ */
+int
+ws_xaead(uint8_t *out, size_t *outlen, const uint8_t *in, size_t inlen,
+    const wskey key, const uint8_t *nonce, const uint8_t *ad, size_t adlen,
+    int open)
+{
+	const EVP_AEAD *aead = EVP_aead_xchacha20_poly1305();
+	EVP_AEAD_CTX ctx;
+	int rc;
+
+	if (EVP_AEAD_nonce_length(aead) != COOKIENONCELEN)
+		return -1;
+
+	if (EVP_AEAD_CTX_init(&ctx, aead, key, KEYLEN,
+	    EVP_AEAD_DEFAULT_TAG_LENGTH, NULL) == 0)
+		return -1;
+
+	if (open) {
+		rc = EVP_AEAD_CTX_open(&ctx, out, outlen, *outlen, nonce,
+		    COOKIENONCELEN, in, inlen, ad, adlen);
+	} else {
+		rc = EVP_AEAD_CTX_seal(&ctx, out, outlen, *outlen, nonce,
+		    COOKIENONCELEN, in, inlen, ad, adlen);
+	}
+
+	EVP_AEAD_CTX_cleanup(&ctx);
+
+	if (rc == 0)
+		return -1;
+
+	return 0;
+}
+
 /*
  * Return 32 bytes of output.
  *
@@ -120,6 +201,26 @@ ws_calcmac1key(wskey mac1key, const wskey pubkey)
 	return 0;
 }
 
+/*
+ * Calculate the cookie key.
+ *
+ * Hash(Label-Cookie || Spubm)
+ */
+int
+ws_calccookiekey(wskey cookiekey, const wskey pubkey)
+{
+	struct iovec iov[2];
+
+	iov[0].iov_base = LABELCOOKIE;
+	iov[0].iov_len = strlen(LABELCOOKIE);
+	iov[1].iov_base = (void *)pubkey;
+	iov[1].iov_len = KEYLEN;
+
+	ws_hash(cookiekey, iov, 2);
+
+	return 0;
+}
+
 /*
  * Calculate the hash of a public key.
  *
@@ -26,7 +26,22 @@
 #define MAXSCRATCH 71680 /* 70 KB */
 #define MAXUDP6DATA (65575 - 40 - 8) /* max udp v6 (non-jumbo) payload */
 #define MAXRECVBUF (MAXUDP6DATA * 2)
+#define MINSOCKBUF 1024 /* min of a configured socket buffer size */
+#define MAXSOCKBUF (1 << 21) /* max of a configured socket buffer size */
 #define MAXPEERS 10000
+#define RECVBATCH 32 /* max datagrams received per socket event */
+#define MAXBATCHMSG 9216 /* max size of a batched datagram, fits jumbo frames */
+#define TUNBUDGET 64 /* default max packets read from a tunnel per event */
+#define MAXTUNBUDGET 4096
+#define FQQUANTUM 4096 /* default bytes per peer per egress scheduler round */
+#define MINFQQUANTUM 64
+#define MAXFQQUANTUM 65536
+#define MAXWORKERS 16 /* max ifn processes per interface */
+#define MAXENCLWORKERS 16 /* max enclave processes */
+#define HSRATE 1000 /* default handshake messages per second per source */
+#define MAXHSRATE 1000000
+#define MAXRINGSLOTS 4096 /* max slots of a shared memory ring */
+#define CACHELINESIZE 64
 
 /* hash("Noise_IKpsk2_25519_ChaChaPoly_BLAKE2s") */
 #define CONSHASH "60e26daef327efc02ec335e2a025d2d016eb4206f87277f52d38d1988b78cd36"
@@ -39,6 +54,18 @@
 
 #define MAC1OFFSETINIT (1 + 3 + 4 + 32 + 48 + 28)
 #define MAC1OFFSETRESP (1 + 3 + 4 + 4 + 32 + 16)
+#define MAC2OFFSETINIT (MAC1OFFSETINIT + 16)
+#define MAC2OFFSETRESP (MAC1OFFSETRESP + 16)
+
+#define COOKIELEN 16
+#define COOKIENONCELEN 24
+#define COOKIEMAXAGE 120 /* lifetime of a cookie secret in seconds */
+#define COOKIELATENCY 5 /* stop using a received cookie this early */
+#define UNDERLOADTIME 1 /* seconds to stay under load after the enclave lags */
+#define SRCRATE 100 /* handshake messages per second per source address */
+#define SRCTABSIZE 4096 /* number of source addresses tracked, power of two */
+#define SRCWAYS 4 /* sources per bucket of the source table, power of two */
+#define REJECTTIME 1 /* seconds to ignore a source after an invalid message */
 
 typedef uint8_t wskey[KEYLEN];
 typedef uint8_t wshash[HASHLEN];
@@ -50,11 +77,17 @@ struct keypair {
 
 int ws_mac(void *, size_t, const void *, size_t, const wskey);
 int ws_validmac(const uint8_t *, size_t, const void *, size_t, const wskey);
+int ws_mac2(void *, size_t, const void *, size_t, const uint8_t *);
+int ws_validmac2(const uint8_t *, size_t, const void *, size_t,
+    const uint8_t *);
+int ws_xaead(uint8_t *, size_t *, const uint8_t *, size_t, const wskey,
+    const uint8_t *, const uint8_t *, size_t, int);
 int ws_aead(uint8_t *, size_t *, const uint8_t *, size_t, const wskey,
     uint64_t, const uint8_t *, size_t, int);
 void ws_hash(wshash, const struct iovec *, size_t);
 void wspk(FILE *, const char *, wskey);
 int ws_calcmac1key(wskey, const wskey);
+int ws_calccookiekey(wskey, const wskey);
 int ws_calcpubkeyhash(wshash, const wskey);
 
 #endif /* WIRESEP_H */